@@ -17,9 +17,11 @@
 #include <linux/blk_types.h>
 #include <linux/bvec.h>
 #include <asm/io.h>
+#include <asm/pgtable.h>
 
 #include "mem.h"
 #include "ramdevice.h"
+#include "trace.h"
 
 /**
  * 
@@ -42,6 +44,20 @@ uint64_t g_highmem_phys_addr = 0x100000000; /* beginning of the reserved phy mem
 module_param(nvm_capacity_mb, int, 0);
 MODULE_PARM_DESC(nvm_capacity_mb, "Size of each NVM disk in MB");
 
+/**
+ * Log the requests to /dev/nvm_trace (see trace.h)
+ */
+static int nvm_trace = 0;
+module_param(nvm_trace, int, 0);
+MODULE_PARM_DESC(nvm_trace, "Log the requests to /dev/nvm_trace (0 or 1)");
+
+/**
+ * Refuse to load unless the NVM space is mapped with 2MB/1GB pages
+ */
+static int nvm_hugemap = 0;
+module_param(nvm_hugemap, int, 0);
+MODULE_PARM_DESC(nvm_hugemap, "Fail to load unless the NVM space is mapped with 2MB/1GB pages (0 or 1)");
+
 /**
  * The list and mutex of NVM devices
  */
@@ -68,8 +84,65 @@ static const struct block_device_operations nvmdev_fops = {
  *    2. nvm_highmem_map() : make mapping for highmem physical address by ioremap()
  */
 
+/**
+ * Count the pages of each size the NVM space is mapped with, and return
+ * the smallest size (0 if a page is not mapped)
+ *
+ * ioremap uses 2MB/1GB pages for the parts of the space aligned to them,
+ * unless the kernel lacks CONFIG_HAVE_ARCH_HUGE_VMAP or is booted with
+ * "nohugeiomap". Nothing changes the attributes of the mapping later, so
+ * the large pages are never split.
+ */
+static unsigned long nvm_highmem_map_granularity(void)
+{
+	unsigned long va = (unsigned long)g_highmem_virt_addr;
+	unsigned long end = va + g_highmem_size;
+	unsigned long num_4k = 0, num_2m = 0, num_1g = 0;
+
+	while (va < end)
+	{
+		unsigned int level;
+		unsigned long size;
+		pte_t *ptep = lookup_address(va, &level);
+
+		if (!ptep)
+			return 0;
+		if (level == PG_LEVEL_4K)
+		{
+			size = PAGE_SIZE;
+			num_4k++;
+		}
+		else if (level == PG_LEVEL_2M)
+		{
+			size = PMD_SIZE;
+			num_2m++;
+		}
+		else if (level == PG_LEVEL_1G)
+		{
+			size = PUD_SIZE;
+			num_1g++;
+		}
+		else
+			return 0;
+		va = (va & ~(size - 1)) + size;
+	}
+
+	printk(KERN_INFO "NVMSIM: high memory space mapped with %lu 1GB pages, %lu 2MB pages and %lu 4KB pages\n",
+		   num_1g, num_2m, num_4k);
+	if (num_4k)
+		return PAGE_SIZE;
+	return num_2m ? PMD_SIZE : PUD_SIZE;
+}
+
 void *nvm_highmem_map(void)
 {
+	unsigned long map_size;
+
+	// the large pages need a 2MB aligned space
+	if (!IS_ALIGNED(g_highmem_phys_addr, PMD_SIZE) || !IS_ALIGNED(g_highmem_size, PMD_SIZE))
+		printk(KERN_WARNING "NVMSIM: high memory space (offset: %llu, size=%llu) is not 2MB aligned\n",
+			   (unsigned long long)g_highmem_phys_addr, (unsigned long long)g_highmem_size);
+
 	// https://patchwork.kernel.org/patch/3092221/
 	if ((g_highmem_virt_addr = ioremap_cache(g_highmem_phys_addr, g_highmem_size)))
 	{
@@ -77,6 +150,23 @@ void *nvm_highmem_map(void)
 		g_highmem_curr_addr = g_highmem_virt_addr;
 		printk(KERN_INFO "NVMSIM: high memory space remapped (offset: %llu MB, size=%lu MB)\n",
 			   BYTES_TO_MB(g_highmem_phys_addr), BYTES_TO_MB(g_highmem_size));
+
+		map_size = nvm_highmem_map_granularity();
+		if (!map_size)
+		{
+			printk(KERN_ERR "NVMSIM: cannot walk the high memory mapping\n");
+			iounmap(g_highmem_virt_addr);
+			g_highmem_virt_addr = NULL;
+			return NULL;
+		}
+		if (nvm_hugemap && map_size <= PAGE_SIZE)
+		{
+			printk(KERN_ERR "NVMSIM: high memory space is not mapped with 2MB/1GB pages (nvm_hugemap=1)\n");
+			iounmap(g_highmem_virt_addr);
+			g_highmem_virt_addr = NULL;
+			return NULL;
+		}
+		printk(KERN_INFO "NVMSIM: high memory mapping granularity is %lu KB\n", map_size >> 10);
 		return g_highmem_virt_addr;
 	}
 	else
@@ -248,6 +338,13 @@ static void nvm_make_request(struct request_queue *q, struct bio *bio)
 
 	// bi_iter.bi_size is the number ofremained bi_vec
 	sector = bio->bi_iter.bi_sector;
+
+	// Log the request before it is served
+	nvm_trace_request(nvm_dev->nvmdev_number, sector, bio->bi_iter.bi_size,
+					  (op_is_write(bio_op(bio)) ? NVM_TRACE_WRITE : 0) |
+						  ((bio->bi_opf & REQ_PREFLUSH) ? NVM_TRACE_FLUSH : 0) |
+						  ((bio->bi_opf & REQ_FUA) ? NVM_TRACE_FUA : 0));
+
 	capacity = get_capacity(bio->bi_disk);
 	if (sector + (bio->bi_iter.bi_size >> SECTOR_SHIFT) > capacity)
 		goto out;
@@ -389,6 +486,13 @@ static int __init nvm_init(void)
 		list_add_tail(&device->nvmdev_list, &nvm_list_head);
 	}
 
+	// Start the request trace before the partition scan
+	if (nvm_trace && nvm_trace_init() < 0)
+	{
+		printk(KERN_INFO "NVMSIM: cannot start the request trace\n");
+		goto out_free;
+	}
+
 	// Register block devices's gendisk
 	list_for_each_entry(device, &nvm_list_head, nvmdev_list)
 	{
@@ -431,6 +535,7 @@ static void __exit nvm_exit(void)
 	{
 		nvm_del_one(nvmsim);
 	}
+	nvm_trace_exit();
 
 	blk_unregister_region(MKDEV(NVM_MAJOR, 0), range);
 	unregister_blkdev(NVM_MAJOR, NVM_DEVICES_NAME);
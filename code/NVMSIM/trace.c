@@ -0,0 +1,185 @@
+/***
+ *  trace.c
+ * NVM Simulator: request trace
+ *
+ * Per-CPU rings of request records in one vmalloc_user() buffer, exported
+ * by the misc device /dev/nvm_trace (mmap for the rings, ioctl to start,
+ * stop and reset). Enabled by the module parameter nvm_trace=1.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/version.h>
+
+#include "trace.h"
+
+int nvm_trace_on = 0;
+
+static void *nvm_trace_buf = NULL;
+static unsigned nvm_trace_nr_rings = 0;
+static unsigned long nvm_trace_ring_bytes = 0;
+static DEFINE_MUTEX(nvm_trace_mutex);
+
+/**
+ * Wait for the loggers: they run with the interrupts off, which only
+ * synchronize_sched() waits for before 4.20
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+#define NVM_TRACE_SYNC() synchronize_rcu()
+#else
+#define NVM_TRACE_SYNC() synchronize_sched()
+#endif
+
+#define NVM_TRACE_RING(CPU) ((struct nvm_trace_ring *)((char *)nvm_trace_buf + (CPU)*nvm_trace_ring_bytes))
+
+/**
+ * Append a record to the ring of this CPU
+ */
+void __nvm_trace_request(unsigned dev, sector_t sector, unsigned bytes, unsigned flags)
+{
+	struct nvm_trace_ring *ring;
+	struct nvm_trace_rec *rec;
+	unsigned long irqflags;
+	__u64 head;
+	int cpu;
+
+	local_irq_save(irqflags);
+
+	// a stop may have come since the caller checked; the stop waits for the
+	// irq-off sections (NVM_TRACE_SYNC()), so no record is written past it
+	if (!READ_ONCE(nvm_trace_on))
+	{
+		local_irq_restore(irqflags);
+		return;
+	}
+	cpu = smp_processor_id();
+	ring = NVM_TRACE_RING(cpu);
+	head = ring->head;
+	rec = &ring->rec[head & (NVM_TRACE_RING_RECS - 1)];
+
+	rec->ts = ktime_get_ns();
+	rec->sector = sector;
+	rec->bytes = bytes;
+	rec->flags = flags;
+	rec->dev = dev;
+	rec->cpu = cpu;
+
+	// a live reader sees the record before the new head
+	smp_wmb();
+	ring->head = head + 1;
+	local_irq_restore(irqflags);
+}
+
+static long nvm_trace_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct nvm_trace_info info;
+	long ret = 0;
+	unsigned i;
+
+	mutex_lock(&nvm_trace_mutex);
+	switch (cmd)
+	{
+	case NVM_TRACE_IOC_INFO:
+		memset(&info, 0, sizeof(info));
+		info.version = NVM_TRACE_VERSION;
+		info.nr_rings = nvm_trace_nr_rings;
+		info.ring_recs = NVM_TRACE_RING_RECS;
+		info.rec_size = sizeof(struct nvm_trace_rec);
+		info.ring_bytes = nvm_trace_ring_bytes;
+		info.enabled = nvm_trace_on;
+		if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+			ret = -EFAULT;
+		break;
+	case NVM_TRACE_IOC_START:
+		nvm_trace_on = 1;
+		break;
+	case NVM_TRACE_IOC_STOP:
+		nvm_trace_on = 0;
+		// the records being written are done after a grace period
+		NVM_TRACE_SYNC();
+		break;
+	case NVM_TRACE_IOC_RESET:
+		if (nvm_trace_on)
+		{
+			ret = -EBUSY;
+			break;
+		}
+		for (i = 0; i < nvm_trace_nr_rings; i++)
+			NVM_TRACE_RING(i)->head = 0;
+		break;
+	default:
+		ret = -ENOTTY;
+	}
+	mutex_unlock(&nvm_trace_mutex);
+	return ret;
+}
+
+static int nvm_trace_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	// the rings are read-only for the users
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, nvm_trace_buf, vma->vm_pgoff);
+}
+
+static const struct file_operations nvm_trace_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = nvm_trace_ioctl,
+	.compat_ioctl = nvm_trace_ioctl,
+	.mmap = nvm_trace_mmap,
+};
+
+static struct miscdevice nvm_trace_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = NVM_TRACE_DEV_NAME,
+	.fops = &nvm_trace_fops,
+};
+
+/**
+ * Allocate the rings and register /dev/nvm_trace, logging starts at once
+ */
+int nvm_trace_init(void)
+{
+	int ret;
+
+	nvm_trace_nr_rings = nr_cpu_ids;
+	nvm_trace_ring_bytes = PAGE_ALIGN(sizeof(struct nvm_trace_ring) +
+									  NVM_TRACE_RING_RECS * sizeof(struct nvm_trace_rec));
+	nvm_trace_buf = vmalloc_user(nvm_trace_nr_rings * nvm_trace_ring_bytes);
+	if (!nvm_trace_buf)
+		return -ENOMEM;
+
+	ret = misc_register(&nvm_trace_dev);
+	if (ret < 0)
+	{
+		vfree(nvm_trace_buf);
+		nvm_trace_buf = NULL;
+		return ret;
+	}
+
+	nvm_trace_on = 1;
+	printk(KERN_INFO "NVMSIM: request trace on /dev/%s (%u rings)\n", NVM_TRACE_DEV_NAME, nvm_trace_nr_rings);
+	return 0;
+}
+
+void nvm_trace_exit(void)
+{
+	if (!nvm_trace_buf)
+		return;
+
+	nvm_trace_on = 0;
+	NVM_TRACE_SYNC();
+	misc_deregister(&nvm_trace_dev);
+	vfree(nvm_trace_buf);
+	nvm_trace_buf = NULL;
+}
@@ -0,0 +1,86 @@
+/***
+ *  trace.h
+ * NVM Simulator: request trace
+ *
+ * The layout of the records, the rings and the ioctls is the same as the
+ * PMBD request trace (nvm-ref/pmbd/pmbd_trace.h), so pmbd_replay captures
+ * and replays NVMSIM workloads as well:
+ *
+ *      pmbd_replay -t /dev/nvm_trace dump nvm.trace
+ *      pmbd_replay replay /dev/nvm0 nvm.trace
+ */
+
+#ifndef __NVMSIM_TRACE_H
+#define __NVMSIM_TRACE_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/compiler.h>
+
+#define NVM_TRACE_VERSION 1
+#define NVM_TRACE_DEV_NAME "nvm_trace"
+#define NVM_TRACE_RING_RECS (1 << 15) /* records per CPU ring (power of 2, 1MB) */
+
+/**
+ * Request flags
+ */
+#define NVM_TRACE_WRITE (1 << 0)
+#define NVM_TRACE_FLUSH (1 << 1)
+#define NVM_TRACE_FUA (1 << 2)
+
+/**
+ * One request, logged when it enters nvm_make_request()
+ */
+struct nvm_trace_rec
+{
+	__u64 ts;	  // entry time (ns, CLOCK_MONOTONIC)
+	__u64 sector; // the first sector
+	__u32 bytes;  // request size (0 for a pure flush)
+	__u16 flags;  // NVM_TRACE_WRITE/FLUSH/FUA
+	__u16 dev;	  // device number
+	__u32 cpu;	  // the submitting CPU
+	__u32 reserved;
+};
+
+/**
+ * The ring of a CPU, exported read-only by mmap() of /dev/nvm_trace
+ */
+struct nvm_trace_ring
+{
+	__u64 head;	// records ever written (next at head % ring_recs)
+	__u64 pad[7]; // keep the records cacheline aligned
+	struct nvm_trace_rec rec[];
+};
+
+struct nvm_trace_info
+{
+	__u32 version;
+	__u32 nr_rings;
+	__u32 ring_recs;
+	__u32 rec_size;
+	__u64 ring_bytes; // the distance between rings in the mmap
+	__u32 enabled;
+	__u32 reserved;
+};
+
+#define NVM_TRACE_IOC_MAGIC 'P'
+#define NVM_TRACE_IOC_INFO _IOR(NVM_TRACE_IOC_MAGIC, 1, struct nvm_trace_info)
+#define NVM_TRACE_IOC_START _IO(NVM_TRACE_IOC_MAGIC, 2)
+#define NVM_TRACE_IOC_STOP _IO(NVM_TRACE_IOC_MAGIC, 3)
+#define NVM_TRACE_IOC_RESET _IO(NVM_TRACE_IOC_MAGIC, 4)
+
+extern int nvm_trace_on;
+int nvm_trace_init(void);
+void nvm_trace_exit(void);
+void __nvm_trace_request(unsigned dev, sector_t sector, unsigned bytes, unsigned flags);
+
+/**
+ * Log a request, a single load when the trace is off
+ */
+static inline void nvm_trace_request(unsigned dev, sector_t sector, unsigned bytes, unsigned flags)
+{
+	if (unlikely(READ_ONCE(nvm_trace_on)))
+		__nvm_trace_request(dev, sector, bytes, flags);
+}
+
+#endif
@@ -28,18 +28,32 @@
 #ifndef PMBD_H
 #define PMBD_H
 
+#include "pmbd_core.h"
+
 #define PMBD_MAJOR 			261		/* FIXME: temporarily use this */
 #define PMBD_NAME			"pmbd"		/* pmbd module name */
 #define PMBD_MAX_NUM_DEVICES 		26		/* max num of devices */
-#define PMBD_MAX_NUM_CPUS		32		/* max num of cpus*/
 
 /*
- * type definitions  
+ * type definitions (PMBD_CHECKSUM_T, BBN_T and PBN_T are in pmbd_core.h)
  */ 
-typedef uint32_t			PMBD_CHECKSUM_T;/* we use CRC32 to calculate checksum */
-typedef sector_t			BBN_T;		/* BBN_T */
-typedef sector_t			PBN_T;		/* BBN_T */
 
+/*
+ * the header of the checksum area in PM (see pmbd_checksum_space_format)
+ * NOTE: the area is one header page followed by one PMBD_CHECKSUM_T entry
+ * per checksum unit. An entry is written with a single 8-byte store, so it is
+ * never torn; 0 means no checksum has been written for the unit yet. An entry
+ * with PMBD_CHECKSUM_PENDING holds the checksum of the unit before a write
+ * that has not been committed yet (see pmbd_checksum_begin_write).
+ */
+typedef struct pmbd_checksum_header {
+	uint64_t			magic;		/* PMBD_CHECKSUM_MAGIC */
+	uint32_t			version;	/* PMBD_CHECKSUM_VERSION */
+	uint32_t			csalg;		/* the checksum algorithm (PMBD_CSALG_*) */
+	uint32_t			unit_size;	/* checksum unit size (bytes) */
+	uint32_t			reserved;
+	uint64_t			num_units;	/* num of entries */
+} PMBD_CHECKSUM_HEADER_T;
 
 /*
  * PMBD device buffer control structure 
@@ -50,7 +64,7 @@ typedef sector_t			PBN_T;		/* BBN_T */
  * each of which contains the metadata information of each block in the buffer
 
     buffer space management variables
- * num_dirty - total number of dirty blocks in buffer
+ * num_dirty - total number of dirty (or reserved) blocks in buffer
  *  pos_dirty - point to the end of the sequence of dirty blocks 
  *  pos_clean - point to the end of the sequence of clean blocks
  * 
@@ -61,18 +75,19 @@ typedef sector_t			PBN_T;		/* BBN_T */
  *       ----------------------------
  *       |  clean  |*DIRTY*| clean  |
  *       ----------------------------
- *  buffer_lock - protects reads/writes to the aforesaid three
+ *  The dirty region is a multi-producer/single-consumer ring. Allocators
+ *  reserve blocks with atomic operations on num_dirty and pos_clean (the
+ *  latter is a monotonically increasing ticket, taken modulo num_blocks),
+ *  and only the flusher (holding flush_lock) moves pos_dirty.
  */
 typedef struct pmbd_bbi {				/* pmbd buffer block info (BBI) */
 	PBN_T				pbn;		/* physical block number in PM (converted from sector) */
+	BBN_T				hnext;		/* next BBN in the same PBN hash bucket */
 	unsigned			dirty;		/* dirty (1) or clean (0)*/
+	uint64_t			line_mask;	/* dirty lines in the block (one bit per 1/64 block) */
+	uint64_t			valid_mask;	/* lines holding valid data (others are only in PM) */
 } PMBD_BBI_T;
 
-typedef struct pmbd_bsort_entry {			/* pmbd buffer block info for sorting */
-	BBN_T				bbn;		/* buffer block number (in buffer)*/
-	PBN_T				pbn;		/* physical block number (in PMBD)*/
-} PMBD_BSORT_ENTRY_T;
-
 typedef struct pmbd_buffer {
 	unsigned			buffer_id;
 	struct pmbd_device* 		pmbd;		/* the linked pmbd device */
@@ -81,10 +96,13 @@ typedef struct pmbd_buffer {
 	void* 				buffer_space;	/* buffer space base vaddr address */
 	PMBD_BBI_T*			bbi_space;	/* array of buffer block info (BBI)*/
 
-	BBN_T				num_dirty;	/* num of dirty blocks */
-	BBN_T				pos_dirty;	/* the first dirty block */
-	BBN_T				pos_clean;	/* the first clean block */
-	spinlock_t			buffer_lock;	/* lock to protect metadata updates */
+	BBN_T*				hash_heads;	/* PBN->BBN hash buckets (chained by bbi->hnext) */
+	unsigned long*			hash_locks;	/* one lock bit per hash bucket */
+	unsigned			hash_bits;	/* log2 of the num of hash buckets */
+
+	atomic_t			num_dirty;	/* num of dirty blocks */
+	BBN_T				pos_dirty;	/* the first dirty block (flusher only) */
+	atomic64_t			pos_clean;	/* the first clean block (ticket) */
 	unsigned int			batch_size;	/* the batch size for flushing buffer pages */
 
 	struct task_struct*		syncer;		/* the syncer daemon */
@@ -96,50 +114,207 @@ typedef struct pmbd_buffer {
 /*
  * PM physical block information (each corresponding to a PM block)
  *
- * (1) if the physical block is buffered, bbn contains a valid buffer block
- * number (BBN) between 0 - (buffer->num_blocks-1), otherwise, it contains an
- * invalid value (buffer->num_blocks + 1)
- * (2) any access to the block (read/write/sync) must have this lock first to
- * prevent multiple concurrent accesses to the same PM block
+ * (1) any access to the block (read/write/sync) must hold the block lock
+ * first to prevent multiple concurrent accesses to the same PM block. The
+ * block locks are bit spinlocks packed in pmbd->pbi_locks, and a block uses
+ * the bit (pbn & pbi_lock_mask). The table is sized by the buffers
+ * (PMBD_BLOCK_LOCKS_PER_BBN bits per buffer block) rather than by the device,
+ * so blocks far apart may share a bit. To stay deadlock free with shared
+ * bits, a thread holds either one bit (readers/writers of the buffer) or a
+ * set of bits taken in ascending bit order (the flusher and the FUA/bypass
+ * writes, see pmbd_block_lock_range()), and never waits for a bit or the
+ * flush_lock while holding one.
+ * (2) whether the block is buffered, and where, is no longer recorded per
+ * block. Each buffer keeps a hash of the PBNs it holds (see hash_heads in
+ * PMBD_BUFFER_T), sized by the buffer rather than by the device. A chain in the
+ * hash is protected by its bucket lock bit; the link of a given PBN can only
+ * be changed by the holder of that block's lock.
  */
-typedef struct pmbd_pbi{
-	BBN_T				bbn;
-	spinlock_t			lock;	
-} PMBD_PBI_T;
+#define PMBD_BUFFER_BBN_NONE			((BBN_T) -1)	/* end of hash chain / not buffered */
 
-typedef struct pmbd_stat{
-	/* stat_lock does not protect cycles_*[] counters */
-	spinlock_t			stat_lock;		/* protection lock */
+/*
+ * PM range lock (used by the unbuffered read/write path)
+ *
+ * Rather than grabbing one spinlock per PM block, a request locks the whole
+ * range of blocks [start, end] it touches in one step. Held ranges are kept in
+ * a red-black tree ordered by their first block. Since held ranges never
+ * overlap, the only held range that may conflict with a new range [s, e] is the
+ * one with the largest start not beyond e, which is found in O(log n). 
+ *
+ * A range is acquired either as a whole or not at all, so no ordering between
+ * ranges is needed to stay deadlock free. The node is owned by the caller
+ * (normally on its stack), so locking never allocates memory. The holders may
+ * sleep (slowdowns, blk-mq blocking contexts), so a conflicting request sleeps
+ * on the wait queue until a range is released, rather than spinning.
+ */
+typedef struct pmbd_range_lock_node {
+	struct rb_node			node;
+	PBN_T				start;	/* first locked block */
+	PBN_T				end;	/* last locked block */
+} PMBD_RANGE_LOCK_NODE_T;
+
+typedef struct pmbd_range_lock {
+	spinlock_t			lock;	/* protects the tree */
+	struct rb_root			root;	/* held ranges */
+	unsigned			waiters;/* num of requests waiting for a range (under lock) */
+	wait_queue_head_t		wait;	/* the waiting requests */
+} PMBD_RANGE_LOCK_T;
 
-	unsigned			last_access_jiffies;	/* the timestamp of the most recent access */
-	uint64_t			num_sectors_read;	/* total num of sectors being read */
-	uint64_t			num_sectors_write;	/* total num of sectors being written */
-	uint64_t			num_requests_read;	/* total num of requests for read */
-	uint64_t			num_requests_write;	/* total num of request for write */
+/*
+ * the sequential write streams tracked on each CPU (buffer admission)
+ */
+#define PMBD_ADMIT_STREAMS		(4)
+
+typedef struct pmbd_admit_streams {
+	PMBD_STREAM_T			slot[PMBD_ADMIT_STREAMS];
+} ____cacheline_aligned_in_smp PMBD_ADMIT_STREAMS_T;
+
+/*
+ * an unbuffered request being processed as one batch (see pmbd_batch_start())
+ */
+typedef struct pmbd_batch {
+	PMBD_RANGE_LOCK_NODE_T		rn;	/* the range lock held */
+	struct pmbd_emul_ctx*		ctx;	/* the emulation context charged */
+	sector_t			sector;	/* the first sector */
+	size_t				bytes;	/* total size of the request */
+	void*				pos;	/* the PM address of the next segment */
+	int				rw;	/* READ or WRITE */
+	unsigned			do_fua;	/* FUA write */
+	unsigned			do_nts;	/* non-temporal stores (a write bypassing the buffer) */
+	uint64_t			start;	/* emulation start time */
+	size_t				cks_read;/* PM read to checksum partial units (see emul_cks_read()) */
+	int				err;	/* the first error (e.g. a write verification mismatch) */
+} PMBD_BATCH_T;
+
+/*
+ * per-CPU log of the PM ranges written since the last write barrier
+ *
+ * In WB mode without nts and clflush, the written data stays in the CPU cache
+ * until the write barrier, which then writes back only the logged ranges (see
+ * pmbd_dirty_log_flush()). Each log has two sets of extents: the local writers
+ * append to the current one, and the barrier switches the sets and flushes
+ * the other one, so writers are not stopped while the barrier flushes. A set
+ * holds wbinvd<#> MBs of page-sized extents, so that it only overflows when
+ * wbinvd would be used anyway, or with small scattered writes.
+ */
+#define PMBD_DIRTY_LOG_MIN_EXTENTS	128	/* min extents per set */
+
+typedef struct pmbd_extent {
+	void*				addr;	/* the first byte */
+	size_t				bytes;	/* the size */
+} PMBD_EXTENT_T;
+
+typedef struct pmbd_dirty_set {
+	unsigned			num;		/* the num of extents */
+	unsigned			overflow;	/* the set was full, some writes are not logged */
+	uint64_t			bytes;		/* total bytes written */
+	PMBD_EXTENT_T*			extent;		/* the extents (pmbd->dirty_log_extents) */
+} PMBD_DIRTY_SET_T;
+
+typedef struct pmbd_dirty_log {
+	spinlock_t			lock;	/* protects cur and the current set */
+	unsigned			cur;	/* the set being appended to */
+	PMBD_DIRTY_SET_T		set[2];
+	struct work_struct		work;	/* flushes the detached set on this CPU */
+	struct pmbd_device*		pmbd;
+} ____cacheline_aligned_in_smp PMBD_DIRTY_LOG_T;
+
+/*
+ * PM emulation context
+ *
+ * Bandwidth emulation keeps the state of the current batch of requests (see
+ * pmbd_emul_transfer_time()). Rather than one batch per device serialized by
+ * a device-wide lock, each hardware context (one per CPU) owns a batch and a
+ * share of the emulated bandwidth. The shares are periodically reconciled
+ * according to the recent demand of each context, so that the total
+ * bandwidth stays close to the configured rdbw/wrbw.
+ */
+typedef struct pmbd_emul_ctx {
+	spinlock_t			batch_lock;		/* lock protecting batch_* fields */
+	uint64_t			batch_start_cycle[2]; 	/* start time of the batch (cycles)*/
+	uint64_t			batch_end_cycle[2];	/* end time of the batch (cycles) */
+	uint64_t			batch_sectors[2];	/* the total num of sectors in the batch */ 
+	uint64_t			bw_share[2];		/* the share of the bandwidth (MB/sec) */
+	atomic64_t			demand[2];		/* sectors accessed since the last reconciliation */
+	uint64_t			defer_until[2];		/* the emulated transfers are done until (defer mode, cycles) */
+} ____cacheline_aligned_in_smp PMBD_EMUL_CTX_T;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+/*
+ * the per-request data of blk-mq (pdu): in defer mode, the request is
+ * completed by the timer at its emulated finish time
+ */
+typedef struct pmbd_mq_cmd {
+	struct hrtimer			timer;		/* completes the request */
+	blk_status_t			status;		/* the status to complete with */
+} PMBD_MQ_CMD_T;
+#endif
+
+/*
+ * latency histograms (one per phase and direction, timestat only)
+ * Bucket i counts the latencies in [2^i, 2^(i+1)) cycles.
+ */
+#define PMBD_HIST_BARRIER		0	/* write barrier */
+#define PMBD_HIST_PREPARE		1	/* request preparation (incl. emulation start) */
+#define PMBD_HIST_WORK			2	/* data transfer */
+#define PMBD_HIST_ENDIO			3	/* request completion */
+#define PMBD_HIST_MEMCPY		4	/* memcpy from/to PM */
+#define PMBD_HIST_CLFLUSH		5	/* clflush of a range */
+#define PMBD_HIST_NUM_PHASES		6
+#define PMBD_HIST_NUM_BUCKETS		40
+
+/* per-CPU statistics (each CPU updates its own cache lines only) */
+typedef struct pmbd_stat_cpu{
+	uint64_t			num_sectors[2];		/* total num of sectors being read/written */
+	uint64_t			num_requests[2];	/* total num of requests for read/write */
 	uint64_t			num_write_barrier;	/* total num of write barriers received */
-	uint64_t			num_write_fua;		/* total num of write barriers received */
-	
+	uint64_t			num_write_fua;		/* total num of FUA writes received */
+	uint64_t			num_verify_errors;	/* total num of write verification mismatches */
+	uint64_t			num_checksum_errors;	/* total num of checksum mismatches on read */
+	uint64_t			num_checksum_lazy;	/* total num of checksum units read without verifying (verified before) */
+	uint64_t			num_checksum_pending;	/* total num of checksum units read with a write cut short by a crash (not verified) */
+	uint64_t			num_admit_small;	/* total num of writes admitted into the buffer for being small */
+	uint64_t			num_admit_freq;		/* total num of writes admitted into the buffer for being rewritten */
+	uint64_t			num_bypass_seq;		/* total num of writes bypassing the buffer for being sequential */
+	uint64_t			num_bypass_cold;	/* total num of writes bypassing the buffer for being cold */
+	uint64_t			num_buffer_wr_hits;	/* total num of blocks written into the buffer already buffered */
+	uint64_t			num_buffer_wr_misses;	/* total num of blocks written into the buffer newly allocated */
+
 	/* cycles counters (enabled/disabled by timestat)*/
-	uint64_t			cycles_total[2][PMBD_MAX_NUM_CPUS];	/* total cycles for read in make_request*/
-	uint64_t			cycles_prepare[2][PMBD_MAX_NUM_CPUS];	/* total cycles for prepare in make_request*/
-	uint64_t			cycles_wb[2][PMBD_MAX_NUM_CPUS];	/* total cycles for write barrier in make_request*/
-	uint64_t			cycles_work[2][PMBD_MAX_NUM_CPUS];	/* total cycles for work in make_request*/
-	uint64_t			cycles_endio[2][PMBD_MAX_NUM_CPUS];	/* total cycles for endio in make_request*/
-	uint64_t			cycles_finish[2][PMBD_MAX_NUM_CPUS];	/* total cycles for finish-up in make_request*/
-
-	uint64_t			cycles_pmap[2][PMBD_MAX_NUM_CPUS];	/* total cycles for private mapping*/
-	uint64_t			cycles_punmap[2][PMBD_MAX_NUM_CPUS];	/* total cycles for private unmapping */
-	uint64_t			cycles_memcpy[2][PMBD_MAX_NUM_CPUS];	/* total cycles for memcpy */
-	uint64_t			cycles_clflush[2][PMBD_MAX_NUM_CPUS];	/* total cycles for clflush_range */
-	uint64_t			cycles_clflushall[2][PMBD_MAX_NUM_CPUS];/* total cycles for clflush_all */
-	uint64_t			cycles_wrverify[2][PMBD_MAX_NUM_CPUS];	/* total cycles for doing write verification */
-	uint64_t			cycles_checksum[2][PMBD_MAX_NUM_CPUS];	/* total cycles for doing checksum */
-	uint64_t			cycles_pause[2][PMBD_MAX_NUM_CPUS];	/* total cycles for pause */
-	uint64_t			cycles_slowdown[2][PMBD_MAX_NUM_CPUS];	/* total cycles for slowdown*/
-	uint64_t			cycles_setpages_ro[2][PMBD_MAX_NUM_CPUS]; /*total cycles for set pages to ro*/
-	uint64_t			cycles_setpages_rw[2][PMBD_MAX_NUM_CPUS]; /*total cycles for set pages to rw*/
+	uint64_t			cycles_total[2];	/* total cycles for read in make_request*/
+	uint64_t			cycles_prepare[2];	/* total cycles for prepare in make_request*/
+	uint64_t			cycles_wb[2];		/* total cycles for write barrier in make_request*/
+	uint64_t			cycles_work[2];		/* total cycles for work in make_request*/
+	uint64_t			cycles_endio[2];	/* total cycles for endio in make_request*/
+	uint64_t			cycles_finish[2];	/* total cycles for finish-up in make_request*/
+
+	uint64_t			cycles_pmap[2];		/* total cycles for private mapping*/
+	uint64_t			cycles_punmap[2];	/* total cycles for private unmapping */
+	uint64_t			cycles_memcpy[2];	/* total cycles for memcpy */
+	uint64_t			cycles_clflush[2];	/* total cycles for clflush_range */
+	uint64_t			cycles_clflushall[2];	/* total cycles for clflush_all */
+	uint64_t			cycles_wrverify[2];	/* total cycles for doing write verification */
+	uint64_t			cycles_checksum[2];	/* total cycles for doing checksum */
+	uint64_t			cycles_pause[2];	/* total cycles for pause */
+	uint64_t			cycles_slowdown[2];	/* total cycles for slowdown*/
+	uint64_t			cycles_setpages_ro[2];	/* total cycles for set pages to ro*/
+	uint64_t			cycles_setpages_rw[2];	/* total cycles for set pages to rw*/
+
+	/* latency histograms (enabled/disabled by timestat) */
+	uint64_t			hist[PMBD_HIST_NUM_PHASES][2][PMBD_HIST_NUM_BUCKETS];
+} ____cacheline_aligned_in_smp PMBD_STAT_CPU_T;
+
+typedef struct pmbd_stat{
+	unsigned			last_access_jiffies;	/* the timestamp of the most recent access */
+	PMBD_STAT_CPU_T __percpu*	cpu;			/* per-CPU counters (summed up by readers) */
 } PMBD_STAT_T;
 
+/* update the counters of the current CPU (preemption safe) */
+#define PMBD_STAT_ADD(PMBD, FIELD, V)	this_cpu_add((PMBD)->pmbd_stat->cpu->FIELD, (V))
+#define PMBD_STAT_INC(PMBD, FIELD)	this_cpu_inc((PMBD)->pmbd_stat->cpu->FIELD)
+#define PMBD_HIST_BUCKET(CYCLES)	((CYCLES) ? MIN_OF(fls64((CYCLES)) - 1, PMBD_HIST_NUM_BUCKETS - 1) : 0)
+#define PMBD_STAT_HIST(PMBD, PHASE, RW, CYCLES)	PMBD_STAT_INC((PMBD), hist[(PHASE)][(RW)][PMBD_HIST_BUCKET((CYCLES))])
+
 /*
  * pmbd_device structure (each corresponding to a pmbd instance)
  */
@@ -163,23 +338,30 @@ typedef struct pmbd_device {
 	unsigned 			pmbd_type;	/* vmalloc() or high_mem */
 	unsigned 			rammode;	/* RAM mode (no write protection) or not */
 	unsigned			bufmode;	/* use buffer or not */
-	unsigned			wpmode;		/* write protection mode: PTE change (0) or CR0/WP bit switch (1)*/
+	unsigned			wpmode;		/* write protection mode: PTE change (0), CR0/WP bit switch (1), or write window (2) */
 
 	/* buffer management */
 	PMBD_BUFFER_T**			buffers;	/* buffer control structure */
 	unsigned 			num_buffers;	/* number of buffers */
 	unsigned			buffer_stride;	/* the number of contiguous blocks mapped to the same buffer */
 
+	/* buffer admission */
+	PMBD_SKETCH_T			admit_sketch;	/* block write frequencies */
+	PMBD_ADMIT_STREAMS_T __percpu*	admit_streams;	/* per-CPU sequential write streams */
+
 
 
 	/* physical block info (metadata) */	
-	PMBD_PBI_T*			pbi_space;	/* physical block info space (each) */
+	unsigned long*			pbi_locks;	/* physical block lock bits (hashed by pbn) */
+	PBN_T				pbi_lock_mask;	/* the num of lock bits - 1 (a power of 2) */
 	unsigned			pb_size;	/* the unit size of each block (4096 in default) */
+	PMBD_RANGE_LOCK_T		range_lock;	/* range lock for unbuffered accesses */
 
 	/* checksum */
-	PMBD_CHECKSUM_T*		checksum_space;		/* checksum array */
+	void*				checksum_area;		/* checksum area in PM (header page + entries) */
+	PMBD_CHECKSUM_T*		checksum_space;		/* checksum entries (in checksum_area) */
+	unsigned long*			checksum_verified;	/* unit verified since loading (one bit each) */
 	unsigned 			checksum_unit_size;	/* checksum unit size (bytes) */
-	void*				checksum_iomem_buf;	/* one unit buffer for ioremapped PM */
 
 	/* emulating PM with injected latency */
 	unsigned			simmode;	/* simulating whole device (0) or PM only (1)*/
@@ -192,16 +374,33 @@ typedef struct pmbd_device {
 	uint64_t			rdpause;	/* read pause (cycles per 4KB page) */
 	uint64_t			wrpause;	/* write pause (cycles per 4KB page) */
 
-	spinlock_t			batch_lock;		/* lock protecting batch_* fields */
-	uint64_t			batch_start_cycle[2]; 	/* start time of the batch (cycles)*/
-	uint64_t			batch_end_cycle[2];	/* end time of the batch (cycles) */
-	uint64_t			batch_sectors[2];	/* the total num of sectors in the batch */ 
+	PMBD_EMUL_CTX_T*		emul_ctx;		/* emulation contexts (one per CPU) */
+	unsigned			num_emul_ctx;		/* the number of emulation contexts */
+	spinlock_t			emul_reconcile_lock;	/* only one thread reconciles the shares */
+	uint64_t			emul_reconcile_cycle;	/* the last reconciliation (cycles) */
+
+	unsigned			banks;		/* num of banks (0 - flat timing model) */
+	uint64_t			rowhit;		/* row buffer hit latency (ns) */
+	unsigned			wqsize;		/* write queue entries */
+	PMBD_BANK_MODEL_T		bank_model;	/* the banked timing model */
+	spinlock_t			bank_lock;	/* serializes the accesses to the model */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	struct blk_mq_tag_set		tag_set;	/* blk-mq tag set */
+#endif
 
 	PMBD_STAT_T*			pmbd_stat;	/* statistics data */
 	struct proc_dir_entry* 		proc_devstat;	/* the proc output */
+	struct dentry*			debugfs_dir;	/* the debugfs directory (latency histograms) */
+	struct mutex			config_lock;	/* serializes the config changes (sysfs) and the buffer readers */
+	unsigned			sysfs_added;	/* the sysfs attributes are created (before 4.20) */
 
-	spinlock_t			wr_barrier_lock;/* for write barrier and other control */
-	atomic_t			num_flying_wr;	/* the counter of writes on the fly */
+	struct mutex			wr_barrier_lock;/* serializes write barriers */
+	unsigned long			wr_epoch;	/* write epoch (flipped by each write barrier) */
+	wait_queue_head_t		wr_drain_wait;	/* the write barrier waits here for the old epoch to drain */
+	long __percpu*			num_flying_wr[2];/* per-CPU counters of writes on the fly (per epoch parity) */
+	PMBD_DIRTY_LOG_T __percpu*	dirty_log;	/* per-CPU ranges written since the last barrier (NULL - wbinvd) */
+	unsigned			dirty_log_extents;/* extents per set of a dirty log */
 
 	spinlock_t			tmp_lock;
 	uint64_t			tmp_data;
@@ -225,19 +424,29 @@ typedef struct pmbd_device {
 #define MAX_OF(A, B)			(((A) > (B))? (A) : (B))
 #define MIN_OF(A, B)			(((A) < (B))? (A) : (B))
 
+#ifndef SECTOR_SHIFT
 #define SECTOR_SHIFT			9
+#endif
+#ifndef PAGE_SHIFT
 #define PAGE_SHIFT			12
+#endif
+#ifndef SECTOR_SIZE
 #define SECTOR_SIZE			(1UL << SECTOR_SHIFT)
+#endif
 //#define PAGE_SIZE			(1UL << PAGE_SHIFT)
 #define SECTOR_MASK			(~(SECTOR_SIZE-1))
+#ifndef PAGE_MASK
 #define PAGE_MASK			(~(PAGE_SIZE-1))
+#endif
 #define PMBD_SECTOR_SIZE			SECTOR_SIZE
 #define PMBD_PAGE_SIZE			PAGE_SIZE
 #define KB_SHIFT			10
 #define MB_SHIFT			20
 #define GB_SHIFT			30
+#define KB_TO_BYTES(N)			((N) << KB_SHIFT)
 #define MB_TO_BYTES(N)			((N) << MB_SHIFT)
 #define GB_TO_BYTES(N)			((N) << GB_SHIFT)
+#define BYTES_TO_KB(N)			((N) >> KB_SHIFT)
 #define BYTES_TO_MB(N)			((N) >> MB_SHIFT)
 #define BYTES_TO_GB(N)			((N) >> GB_SHIFT)
 #define MB_TO_SECTORS(N)		((N) << (MB_SHIFT - SECTOR_SHIFT))
@@ -254,6 +463,107 @@ typedef struct pmbd_device {
 #define IS_DIGIT(C) 			(isdigit(C) && (C) != '\0')
 #define IS_ALPHA(C)			(isalpha(C) && (C) != '\0')
 
+/*
+ * kernel compatibility (2.6.34, 3.2.1, and 4.13+ up to 6.x)
+ */
+#ifndef READ_ONCE
+#define READ_ONCE(X)			ACCESS_ONCE((X))
+#define WRITE_ONCE(X, V)		(ACCESS_ONCE((X)) = (V))
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,11,0)
+#define PMBD_KMAP(PAGE)			kmap_local_page((PAGE))
+#define PMBD_KUNMAP(ADDR)		kunmap_local((ADDR))
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0)
+#define PMBD_KMAP(PAGE)			kmap_atomic((PAGE))
+#define PMBD_KUNMAP(ADDR)		kunmap_atomic((ADDR))
+#else
+#define PMBD_KMAP(PAGE)			kmap_atomic((PAGE), KM_USER0)
+#define PMBD_KUNMAP(ADDR)		kunmap_atomic((ADDR), KM_USER0)
+#endif
+
+#define PMBD_CPU_HAS_SSE41()		boot_cpu_has(X86_FEATURE_XMM4_1)
+#define PMBD_CPU_HAS_SSE42()		boot_cpu_has(X86_FEATURE_XMM4_2)
+#ifdef X86_FEATURE_AVX2
+#define PMBD_CPU_HAS_AVX2()		boot_cpu_has(X86_FEATURE_AVX2)
+#else
+#define PMBD_CPU_HAS_AVX2()		0
+#endif
+#define PMBD_CPU_HAS_CLFLUSH()		boot_cpu_has(X86_FEATURE_CLFLUSH)
+
+/* clwb() and clflushopt() are available since 4.1 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+#define PMBD_CPU_HAS_CLWB()		boot_cpu_has(X86_FEATURE_CLWB)
+#define PMBD_CPU_HAS_CLFLUSHOPT()	boot_cpu_has(X86_FEATURE_CLFLUSHOPT)
+#else
+#define PMBD_CPU_HAS_CLWB()		0
+#define PMBD_CPU_HAS_CLFLUSHOPT()	0
+#endif
+
+/* page cache modes (the _PAGE_CACHE_* bits became an enum in 4.2) */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+#define PMBD_PAGE_CACHE_WB		_PAGE_CACHE_MODE_WB
+#define PMBD_PAGE_CACHE_WC		_PAGE_CACHE_MODE_WC
+#define PMBD_PAGE_CACHE_UC		_PAGE_CACHE_MODE_UC
+#define PMBD_PAGE_CACHE_UC_MINUS	_PAGE_CACHE_MODE_UC_MINUS
+#define PMBD_CACHE_PROT(FLAG)		cachemode2protval((enum page_cache_mode)(FLAG))
+#else
+#define PMBD_PAGE_CACHE_WB		_PAGE_CACHE_WB
+#define PMBD_PAGE_CACHE_WC		_PAGE_CACHE_WC
+#define PMBD_PAGE_CACHE_UC		_PAGE_CACHE_UC
+#define PMBD_PAGE_CACHE_UC_MINUS	_PAGE_CACHE_UC_MINUS
+#define PMBD_CACHE_PROT(FLAG)		(FLAG)
+#endif
+
+/* 
+ * set_memory_ro/rw() are not exported and CR0.WP is pinned since 5.3, so
+ * write protection changes the PTEs directly (see pmbd_set_pages_ro/rw())
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,3,0)
+#define PMBD_PTE_PROTECT		1
+#else
+#define PMBD_PTE_PROTECT		0
+#endif
+
+/* blk_mq_freeze_queue() returns the memalloc flags to restore since 6.14 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,14,0)
+#define PMBD_FREEZE_QUEUE(Q, F)		((F) = blk_mq_freeze_queue((Q)))
+#define PMBD_UNFREEZE_QUEUE(Q, F)	blk_mq_unfreeze_queue((Q), (F))
+#else
+#define PMBD_FREEZE_QUEUE(Q, F)		{blk_mq_freeze_queue((Q)); (F) = 0;}
+#define PMBD_UNFREEZE_QUEUE(Q, F)	blk_mq_unfreeze_queue((Q))
+#endif
+
+/* 
+ * the queue limits are passed to blk_mq_alloc_disk() since 6.9, and the
+ * flush/FUA capability is a limits feature since 6.11 (blk_queue_write_cache()
+ * and blk_queue_max_hw_sectors() are gone)
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,9,0)
+#define PMBD_MQ_QUEUE_LIMITS		1
+#else
+#define PMBD_MQ_QUEUE_LIMITS		0
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,11,0)
+#define PMBD_MQ_QUEUE_FEATURES		1
+#else
+#define PMBD_MQ_QUEUE_FEATURES		0
+#endif
+
+/* BLK_MQ_F_SHOULD_MERGE is gone since 6.14 (the queues always merge) */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,14,0)
+#define PMBD_MQ_FLAGS			BLK_MQ_F_BLOCKING
+#else
+#define PMBD_MQ_FLAGS			(BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING)
+#endif
+
+/* hrtimer_init() was replaced by hrtimer_setup() in 6.13 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+#define PMBD_HRTIMER_INIT(TIMER, FN)	hrtimer_setup((TIMER), (FN), CLOCK_MONOTONIC, HRTIMER_MODE_REL)
+#else
+#define PMBD_HRTIMER_INIT(TIMER, FN)	{hrtimer_init((TIMER), CLOCK_MONOTONIC, HRTIMER_MODE_REL); (TIMER)->function = (FN);}
+#endif
+
 #define DISABLE_SAVE_IRQ(FLAGS)		{local_irq_save((FLAGS)); local_irq_disable();}
 #define ENABLE_RESTORE_IRQ(FLAGS)	{local_irq_restore((FLAGS)); local_irq_enable();}
 #define CUR_CPU_ID()			smp_processor_id()
@@ -265,25 +575,41 @@ typedef struct pmbd_device {
 #define PMBD_CONFIG_VMALLOC  		0 /* vmalloc() based PMBD (default) */
 #define PMBD_CONFIG_HIGHMEM  		1 /* ioremap() based PMBD */
 
+/* PMBD_CSALG_* (checksum engines) are in pmbd_core.h */
+
+/* cache line flush instructions (the best one is selected at load time) */
+#define PMBD_FLUSH_CLFLUSH		0	/* clflush (serialized, mfence) */
+#define PMBD_FLUSH_CLFLUSHOPT		1	/* clflushopt (weakly ordered, sfence) */
+#define PMBD_FLUSH_CLWB			2	/* clwb (the line stays cached, sfence) */
+
 
 /* global config */
 #define PMBD_IS_MERGEABLE()		(g_pmbd_mergeable == TRUE)
 #define PMBD_USE_VMALLOC()		(g_pmbd_type == PMBD_CONFIG_VMALLOC)
 #define PMBD_USE_HIGHMEM()		(g_pmbd_type == PMBD_CONFIG_HIGHMEM)
 #define PMBD_USE_CLFLUSH()		(g_pmbd_cpu_cache_clflush == TRUE)
-#define PMBD_CPU_CACHE_FLAG()		((g_pmbd_cpu_cache_flag == _PAGE_CACHE_WB)? "WB" : \
-					((g_pmbd_cpu_cache_flag == _PAGE_CACHE_WC)? "WC" : \
-					((g_pmbd_cpu_cache_flag == _PAGE_CACHE_UC)? "UC" : \
-					((g_pmbd_cpu_cache_flag == _PAGE_CACHE_UC_MINUS)? "UC-Minus" : "UNKNOWN"))))
+#define PMBD_CPU_CACHE_FLAG()		((g_pmbd_cpu_cache_flag == PMBD_PAGE_CACHE_WB)? "WB" : \
+					((g_pmbd_cpu_cache_flag == PMBD_PAGE_CACHE_WC)? "WC" : \
+					((g_pmbd_cpu_cache_flag == PMBD_PAGE_CACHE_UC)? "UC" : \
+					((g_pmbd_cpu_cache_flag == PMBD_PAGE_CACHE_UC_MINUS)? "UC-Minus" : "UNKNOWN"))))
 
-#define PMBD_CPU_CACHE_USE_WB()		(g_pmbd_cpu_cache_flag == _PAGE_CACHE_WB)	/* write back */
-#define PMBD_CPU_CACHE_USE_WC()		(g_pmbd_cpu_cache_flag == _PAGE_CACHE_WC)	/* write combining */
-#define PMBD_CPU_CACHE_USE_UC()		(g_pmbd_cpu_cache_flag == _PAGE_CACHE_UC)	/* uncachable */
-#define PMBD_CPU_CACHE_USE_UM()		(g_pmbd_cpu_cache_flag == _PAGE_CACHE_UC_MINUS)	/* uncachable minus */
+#define PMBD_CPU_CACHE_USE_WB()		(g_pmbd_cpu_cache_flag == PMBD_PAGE_CACHE_WB)	/* write back */
+#define PMBD_CPU_CACHE_USE_WC()		(g_pmbd_cpu_cache_flag == PMBD_PAGE_CACHE_WC)	/* write combining */
+#define PMBD_CPU_CACHE_USE_UC()		(g_pmbd_cpu_cache_flag == PMBD_PAGE_CACHE_UC)	/* uncachable */
+#define PMBD_CPU_CACHE_USE_UM()		(g_pmbd_cpu_cache_flag == PMBD_PAGE_CACHE_UC_MINUS)	/* uncachable minus */
 
 #define PMBD_USE_WRITE_PROTECTION()	(g_pmbd_wr_protect == TRUE)
 #define PMBD_USE_WRITE_VERIFICATION()	(g_pmbd_wr_verify == TRUE)
+#define PMBD_VERIFY_ENGINE_NAME()	((g_pmbd_verify_engine == PMBD_VERIFY_AVX2)? "AVX2" : \
+					((g_pmbd_verify_engine == PMBD_VERIFY_SSE41)? "SSE4.1" : "MEMCMP"))
 #define PMBD_USE_CHECKSUM()		(g_pmbd_checksum == TRUE)
+#define PMBD_USE_CSALG(ALG)		(g_pmbd_csalg == (ALG))
+#define PMBD_USE_CSLAZY()		(g_pmbd_cslazy == TRUE)
+#define PMBD_CSALG_NAME()		((g_pmbd_csalg == PMBD_CSALG_CRC32)? "CRC32" : \
+					((g_pmbd_csalg == PMBD_CSALG_CRC32C)? "CRC32C" : \
+					((g_pmbd_csalg == PMBD_CSALG_XXH64)? "XXH64" : "UNKNOWN")))
+#define PMBD_FLUSH_INSN_NAME()		((g_pmbd_flush_insn == PMBD_FLUSH_CLWB)? "CLWB" : \
+					((g_pmbd_flush_insn == PMBD_FLUSH_CLFLUSHOPT)? "CLFLUSHOPT" : "CLFLUSH"))
 #define PMBD_USE_LOCK()			(g_pmbd_lock == TRUE)
 #define PMBD_USE_SUBPAGE_UPDATE()	(g_pmbd_subpage_update == TRUE)
 
@@ -293,9 +619,14 @@ typedef struct pmbd_device {
 #define PMBD_USE_WB()			(g_pmbd_wb == TRUE)
 #define PMBD_USE_FUA()			(g_pmbd_fua == TRUE)
 #define PMBD_USE_TIMESTAT()		(g_pmbd_timestat == TRUE)
+#define PMBD_USE_DEFER()		(g_pmbd_defer == TRUE)
+#define PMBD_USE_TRACE()		(g_pmbd_trace == TRUE)
+#define PMBD_USE_ADMIT()		(g_pmbd_admit == TRUE)
+#define PMBD_USE_DIRTY_LOG()		(PMBD_USE_WB() && PMBD_CPU_CACHE_USE_WB() && !PMBD_USE_NTS() && \
+					!PMBD_USE_CLFLUSH() && !PMBD_USE_PMAP() && g_pmbd_wbinvd_threshold > 0)
 
-#define TIMESTAMP(TS)			rdtscll((TS))
-#define TIMESTAT_POINT(TS)		{(TS) = 0; if (PMBD_USE_TIMESTAT()) rdtscll((TS));}
+#define TIMESTAMP(TS)			((TS) = get_cycles())
+#define TIMESTAT_POINT(TS)		{(TS) = 0; if (PMBD_USE_TIMESTAT()) TIMESTAMP((TS));}
 
 /* instanced based config */
 #define PMBD_DEV_USE_VMALLOC(PMBD)	((PMBD)->pmbd_type == PMBD_CONFIG_VMALLOC)
@@ -303,10 +634,15 @@ typedef struct pmbd_device {
 #define PMBD_DEV_USE_BUFFER(PMBD)		((PMBD)->bufmode)
 #define PMBD_DEV_USE_WPMODE_PTE(PMBD)	((PMBD)->wpmode == 0)
 #define PMBD_DEV_USE_WPMODE_CR0(PMBD)	((PMBD)->wpmode == 1)
+#define PMBD_DEV_USE_WPMODE_WIN(PMBD)	((PMBD)->wpmode == 2)
+#define PMBD_DEV_USE_WRITE_WINDOW(PMBD)	(PMBD_USE_WRITE_PROTECTION() && !PMBD_USE_PMAP() && PMBD_DEV_USE_WPMODE_WIN(PMBD))
+#define PMBD_DEV_USE_ADMIT(PMBD)	(PMBD_DEV_USE_BUFFER(PMBD) && (PMBD)->admit_streams != NULL)
 
-#define PMBD_DEV_USE_EMULATION(PMBD)	((PMBD)->rdlat || (PMBD)->wrlat || (PMBD)->rdbw || (PMBD)->wrbw)
+#define PMBD_DEV_USE_EMULATION(PMBD)	((PMBD)->rdlat || (PMBD)->wrlat || (PMBD)->rdbw || (PMBD)->wrbw || (PMBD)->banks)
+#define PMBD_DEV_USE_BANKS(PMBD)	((PMBD)->banks > 0)
 #define PMBD_DEV_SIM_PMBD(PMBD)		(PMBD_DEV_USE_EMULATION((PMBD)) && (PMBD)->simmode == 1)
 #define PMBD_DEV_SIM_DEV(PMBD)		(PMBD_DEV_USE_EMULATION((PMBD)) && (PMBD)->simmode == 0)
+#define PMBD_DEV_USE_DEFER(PMBD)	(PMBD_USE_DEFER() && PMBD_DEV_SIM_DEV((PMBD)))
 #define PMBD_DEV_USE_SLOWDOWN(PMBD)	((PMBD)->rdsx > 1 || (PMBD)->wrsx > 1)
 
 /* support functions */
@@ -334,41 +670,58 @@ typedef struct pmbd_device {
 #define CALLER_DESTROYER			(2)
 
 #define PMBD_BLOCK_VADDR(PMBD, PBN)		((PMBD)->mem_space + ((PMBD)->pb_size * (PBN)))
-#define PMBD_BLOCK_PBI(PMBD, PBN)			((PMBD)->pbi_space + (PBN))
 #define PMBD_TOTAL_PB_NUM(PMBD) 			(PMBD_MEM_TOTAL_BYTES(PMBD) / (PMBD)->pb_size)
-#define PMBD_BLOCK_IS_BUFFERED(PMBD, PBN)		(PMBD_BLOCK_PBI((PMBD),(PBN))->bbn < PBN_TO_PMBD_BUFFER((PMBD), (PBN))->num_blocks)
-#define PMBD_SET_BLOCK_BUFFERED(PMBD, PBN, BBN)	(PMBD_BLOCK_PBI((PMBD),(PBN))->bbn = (BBN))
-#define PMBD_SET_BLOCK_UNBUFFERED(PMBD, PBN)	(PMBD_BLOCK_PBI((PMBD),(PBN))->bbn = PMBD_TOTAL_PB_NUM((PMBD)) + 3)
-//#define PMBD_SET_BLOCK_UNBUFFERED(PMBD, PBN)	(PMBD_BLOCK_PBI((PMBD),(PBN))->bbn = PBN_TO_PMBD_BUFFER((PMBD), (PBN))->num_blocks + 1)
+#define PMBD_BLOCK_LOCKS_PER_BBN		(4)	/* lock bits per buffer block */
+#define PMBD_BLOCK_LOCK_NUM(PMBD)		((PMBD)->pbi_lock_mask + 1)
+#define PMBD_BLOCK_LOCK_BIT(PMBD, PBN)		((PBN) & (PMBD)->pbi_lock_mask)
+#define PMBD_BLOCK_LOCK_WORD(PMBD, BIT)		((PMBD)->pbi_locks + ((BIT) / BITS_PER_LONG))
+#define PMBD_BLOCK_LOCK(PMBD, PBN)		bit_spin_lock(PMBD_BLOCK_LOCK_BIT((PMBD), (PBN)) % BITS_PER_LONG, \
+							PMBD_BLOCK_LOCK_WORD((PMBD), PMBD_BLOCK_LOCK_BIT((PMBD), (PBN))))
+#define PMBD_BLOCK_UNLOCK(PMBD, PBN)		bit_spin_unlock(PMBD_BLOCK_LOCK_BIT((PMBD), (PBN)) % BITS_PER_LONG, \
+							PMBD_BLOCK_LOCK_WORD((PMBD), PMBD_BLOCK_LOCK_BIT((PMBD), (PBN))))
 
 #define PMBD_BUFFER_MIN_BUFSIZE			(4) 	/* buffer size (in MBs) */
+#define PMBD_BUFFER_MAX_NUM			(nr_cpu_ids * 4)	/* max num of buffers of a device */
 #define PMBD_BUFFER_BLOCK(BUF, BBN)		((BUF)->buffer_space + (BUF)->pmbd->pb_size*(BBN))
 #define PMBD_BUFFER_BBI(BUF, BBN)		((BUF)->bbi_space + (BBN))
 #define PMBD_BUFFER_BBI_INDEX(BUF, ADDR)		((ADDR)-(BUF)->bbi_space)
+#define PMBD_BUFFER_HASH_NUM(BUF)		(1UL << (BUF)->hash_bits)
+#define PMBD_BUFFER_HASH(BUF, PBN)		hash_long((unsigned long)(PBN), (BUF)->hash_bits)
+#define PMBD_BUFFER_HASH_LOCK(BUF, H)		bit_spin_lock((H) % BITS_PER_LONG, (BUF)->hash_locks + ((H) / BITS_PER_LONG))
+#define PMBD_BUFFER_HASH_UNLOCK(BUF, H)		bit_spin_unlock((H) % BITS_PER_LONG, (BUF)->hash_locks + ((H) / BITS_PER_LONG))
 #define PMBD_BUFFER_SET_BBI_CLEAN(BUF, BBN)	((PMBD_BUFFER_BBI((BUF), (BBN)))->dirty = FALSE)
 #define PMBD_BUFFER_SET_BBI_DIRTY(BUF, BBN)	((PMBD_BUFFER_BBI((BUF), (BBN)))->dirty = TRUE)
 #define PMBD_BUFFER_BBI_IS_CLEAN(BUF, BBN)	((PMBD_BUFFER_BBI((BUF), (BBN)))->dirty == FALSE)
 #define PMBD_BUFFER_BBI_IS_DIRTY(BUF, BBN)	((PMBD_BUFFER_BBI((BUF), (BBN)))->dirty == TRUE)
+#define PMBD_BUFFER_BLOCK_LINES			PMBD_LINE_MASK_BITS	/* num of dirty-tracking lines per buffer block */
+#define PMBD_BUFFER_LINE_SIZE(PMBD)		((PMBD)->pb_size / PMBD_BUFFER_BLOCK_LINES)
 #define PMBD_BUFFER_SET_BBI_BUFFERED(BUF,BBN,PBN)((PMBD_BUFFER_BBI((BUF), (BBN)))->pbn = (PBN))
 #define PMBD_BUFFER_SET_BBI_UNBUFFERED(BUF, BBN)	((PMBD_BUFFER_BBI((BUF), (BBN)))->pbn = PMBD_TOTAL_PB_NUM((BUF)->pmbd) + 2)
 
 #define PMBD_BUFFER_FLUSH_HW			(0.7)	/* high watermark */
 #define PMBD_BUFFER_FLUSH_LW			(0.1)	/* low watermark */
-#define PMBD_BUFFER_IS_FULL(BUF)			((BUF)->num_dirty >= (BUF)->num_blocks)
-#define PMBD_BUFFER_IS_EMPTY(BUF)		((BUF)->num_dirty == 0)
-#define PMBD_BUFFER_ABOVE_HW(BUF)		((BUF)->num_dirty >= (((BUF)->num_blocks * PMBD_BUFFER_FLUSH_HW)))
-#define PMBD_BUFFER_BELOW_HW(BUF)		((BUF)->num_dirty < (((BUF)->num_blocks * PMBD_BUFFER_FLUSH_HW)))
-#define PMBD_BUFFER_ABOVE_LW(BUF)		((BUF)->num_dirty >= (((BUF)->num_blocks * PMBD_BUFFER_FLUSH_LW)))
-#define PMBD_BUFFER_BELOW_LW(BUF)		((BUF)->num_dirty < (((BUF)->num_blocks * PMBD_BUFFER_FLUSH_LW)))
+#define PMBD_BUFFER_NUM_DIRTY(BUF)		((BBN_T) atomic_read(&(BUF)->num_dirty))
+#define PMBD_BUFFER_IS_FULL(BUF)			(PMBD_BUFFER_NUM_DIRTY(BUF) >= (BUF)->num_blocks)
+#define PMBD_BUFFER_IS_EMPTY(BUF)		(PMBD_BUFFER_NUM_DIRTY(BUF) == 0)
+#define PMBD_BUFFER_ABOVE_HW(BUF)		(PMBD_BUFFER_NUM_DIRTY(BUF) >= (((BUF)->num_blocks * PMBD_BUFFER_FLUSH_HW)))
+#define PMBD_BUFFER_BELOW_HW(BUF)		(PMBD_BUFFER_NUM_DIRTY(BUF) < (((BUF)->num_blocks * PMBD_BUFFER_FLUSH_HW)))
+#define PMBD_BUFFER_ABOVE_LW(BUF)		(PMBD_BUFFER_NUM_DIRTY(BUF) >= (((BUF)->num_blocks * PMBD_BUFFER_FLUSH_LW)))
+#define PMBD_BUFFER_BELOW_LW(BUF)		(PMBD_BUFFER_NUM_DIRTY(BUF) < (((BUF)->num_blocks * PMBD_BUFFER_FLUSH_LW)))
 #define PMBD_BUFFER_BATCH_SIZE_DEFAULT		(1024)	/* the batch size for each flush */
 
+#define PMBD_ADMIT_SEQ_DEFAULT			(512)	/* a stream of so many KBs bypasses the buffer */
+#define PMBD_ADMIT_SMALL_DEFAULT		(16)	/* writes up to so many KBs are always admitted */
+#define PMBD_ADMIT_FREQ				(2)	/* blocks written so many times recently are admitted */
+#define PMBD_ADMIT_SKETCH_WORDS(BLOCKS)		roundup_pow_of_two(MAX_OF((BLOCKS) / 4, 64))	/* 4 counters per buffer block */
+#define PMBD_ADMIT_SKETCH_SAMPLE(BLOCKS)	((BLOCKS) * 10)	/* the aging period (block writes) */
+
 #define PMBD_BUFFER_NEXT_POS(BUF, POS)		(((POS)==((BUF)->num_blocks - 1))? 0 : ((POS)+1))
 #define PMBD_BUFFER_PRIO_POS(BUF, POS)		(((POS)== 0)? ((BUF)->num_blocks - 1) : ((POS)-1))
 #define PMBD_BUFFER_NEXT_N_POS(BUF,POS,N)	(((POS)+(N))%((BUF)->num_blocks))
 #define PMBD_BUFFER_PRIO_N_POS(BUF,POS,N)	((BUF)->num_blocks - (((N)+(BUF)->num_blocks-(POS))%(BUF)->num_blocks))
 
 /* high memory */
-#define PMBD_HIGHMEM_AVAILABLE_SPACE 		(g_highmem_virt_addr + g_highmem_size - g_highmem_curr_addr)
+#define PMBD_HIGHMEM_AVAILABLE_SPACE 		(g_highmem_top_addr - g_highmem_curr_addr)
 
 /* emulation */
 #define MAX_SYNC_SLOWDOWN			(10000000)	/* use async_slowdown, if larger than 10ms */
@@ -381,6 +734,18 @@ typedef struct pmbd_device {
 #define PMBD_BATCH_MIN_SECTORS   		(256)		/* maximum data amount requested in a batch */
 #define PMBD_BATCH_MAX_INTERVAL 		(1000000)	/* maximum interval between two requests in a batch*/
 #define PMBD_BATCH_MAX_DURATION  		(10000000)	/* maximum duration of a batch (ns)*/
+#define PMBD_EMUL_RECONCILE_INTERVAL		(10000000)	/* interval of reconciling the bandwidth shares (ns) */
+
+/* banked timing model */
+#define PMBD_BANK_ROW_SHIFT			(10)	/* 1KB rows interleaved over the banks */
+#define PMBD_BANK_ROWHIT_DEFAULT		(20)	/* row buffer hit latency (ns) */
+#define PMBD_BANK_WQSIZE_DEFAULT		(32)	/* write queue entries */
+/* the emulation context of this CPU, for the accesses not tied to a hardware
+ * context (the bio front end, the buffer and its syncer); a blk-mq request
+ * charges the context of its hctx (see pmbd_mq_init_hctx()) */
+#define PMBD_EMUL_CTX(PMBD)			(&(PMBD)->emul_ctx[raw_smp_processor_id() % (PMBD)->num_emul_ctx])
+#define PMBD_MQ_QUEUE_DEPTH			(128)		/* blk-mq queue depth per hardware context */
+#define PMBD_MAX_HW_SECTORS			(1024)		/* max sectors of a request */
 
 /* write protection*/
 #define VADDR_TO_PAGE(ADDR)			((ADDR) >> PAGE_SHIFT)
@@ -390,15 +755,22 @@ typedef struct pmbd_device {
 #define VADDR_TO_CHECKSUM_IDX(PMBD, ADDR)	(((ADDR) - (PMBD)->mem_space) / (PMBD)->checksum_unit_size)
 #define CHECKSUM_IDX_TO_VADDR(PMBD, IDX) 	((PMBD)->mem_space + (IDX) * (PMBD)->checksum_unit_size)
 #define CHECKSUM_IDX_TO_CKADDR(PMBD, IDX)	((PMBD)->checksum_space + (IDX))
+#define PMBD_CHECKSUM_MAGIC			(0x31534b4344424d50ULL)	/* "PMBDCKS1" */
+#define PMBD_CHECKSUM_VERSION			(2)
+#define PMBD_CHECKSUM_VALID			(1ULL << 63)	/* set in every written entry */
+#define PMBD_CHECKSUM_PENDING			(1ULL << 62)	/* the unit is being written */
+#define PMBD_CHECKSUM_ENTRY(CK)			(((CK) & ~(PMBD_CHECKSUM_VALID | PMBD_CHECKSUM_PENDING)) | PMBD_CHECKSUM_VALID)
+
+/* the data of a write is durable once its fence is done, so the entries can
+ * be ordered around it (otherwise, it is durable only at the write barrier) */
+#define PMBD_CHECKSUM_ORDERED(DO_FUA)		(!PMBD_CPU_CACHE_USE_WB() || PMBD_USE_CLFLUSH() || PMBD_USE_NTS() || (DO_FUA))
+#define PMBD_CHECKSUM_SPACE_BYTES(PMBD)		(PAGE_SIZE + PAGE_ALIGN(PMBD_CHECKSUM_TOTAL_NUM(PMBD) * sizeof(PMBD_CHECKSUM_T)))
 
 /* idle period timer */
 #define PMBD_BUFFER_FLUSH_IDLE_TIMEOUT		(2000)		/* 1 millisecond */
-#define PMBD_DEV_UPDATE_ACCESS_TIME(PMBD)		{spin_lock(&(PMBD)->pmbd_stat->stat_lock); \
-						(PMBD)->pmbd_stat->last_access_jiffies = jiffies; \
-						spin_unlock(&(PMBD)->pmbd_stat->stat_lock);}
-#define PMBD_DEV_GET_ACCESS_TIME(PMBD, T)		{spin_lock(&(PMBD)->pmbd_stat->stat_lock); \
-						(T) = (PMBD)->pmbd_stat->last_access_jiffies; \
-						spin_unlock(&(PMBD)->pmbd_stat->stat_lock);}
+#define PMBD_DEV_UPDATE_ACCESS_TIME(PMBD)		{if ((PMBD)->pmbd_stat->last_access_jiffies != (unsigned) jiffies) \
+							WRITE_ONCE((PMBD)->pmbd_stat->last_access_jiffies, jiffies);}
+#define PMBD_DEV_GET_ACCESS_TIME(PMBD, T)		{(T) = READ_ONCE((PMBD)->pmbd_stat->last_access_jiffies);}
 #define PMBD_DEV_IS_IDLE(PMBD, IDLE)		((IDLE) > PMBD_BUFFER_FLUSH_IDLE_TIMEOUT)
 
 /* Help info */
@@ -415,6 +787,7 @@ GENERAL OPTIONS: \n\
 \t hmo<#> \t high memory starting offset (GB) \n\
 \t hms<#> \t high memory size (GBs) \n\
 \t pmap<Y|N> \t use private mapping (Y) or not (N default) - (note: must enable HM and wrprotN) \n\
+\t hugemap<Y|N> \t fail to load unless HM is mapped with 2MB/1GB pages (Y), or only report the page sizes (N default) \n\
 \t nts<Y|N> \t use non-temporal store (MOVNTQ) and sfence to do memcpy (Y), or regular memcpy (N default)\n\
 \t wb<Y|N> \t use write barrier (Y) or not (N default)\n\
 \t fua<Y|N> \t use WRITE_FUA (Y default) or not (N) (only effective for Linux 3.2.1)\n\
@@ -430,17 +803,29 @@ SIMULATION: \n\
 \t wrsx<#,#..> \t set the relative slowdown (x) for write \n\
 \t rdpause<#,.> \t set a pause (cycles per 4KB) for each read\n\
 \t wrpause<#,.> \t set a pause (cycles per 4KB) for each write\n\
+\t banks<#,#..> \t use the banked timing model with # banks (0 default - flat model), rdlat/wrlat are the row miss latencies \n\
+\t rowhit<#,#..> \t set the row buffer hit latency (ns) of the banked model (20 default) \n\
+\t wqsize<#,#..> \t set the write queue entries of the banked model (32 default, 0 - writes wait for the banks) \n\
+\t defer<Y|N> \t complete requests from a timer at the emulated finish time instead of busy waiting (N default, simmode0 and blk-mq only) \n\
 \t adj<#> \t set an adjustment to the system overhead (nanoseconds) \n\
 \n\
 WRITE PROTECTION: \n\
 \t wrprot<Y|N> \t use write protection for PM pages? (Y or N)\n\
-\t wpmode<#,#,..>  write protection mode: use the PTE change (0 default) or switch CR0/WP bit (1) \n\
-\t clflush<Y|N> \t use clflush to flush CPU cache for each write to PM space? (Y or N) \n\
+\t wpmode<#,#,..>  write protection mode: use the PTE change (0 default), switch CR0/WP bit (1), or a per-CPU private write window (2, also used instead of 0 if HM is mapped with 2MB/1GB pages) \n\
+\t clflush<Y|N> \t use clflush to flush CPU cache for each write to PM space? (Y or N) (clwb or clflushopt if supported, see pmbdcfg) \n\
+\t wbinvd<#> \t without nts and clflush, write back only the ranges written since the last write barrier, or the entire CPU cache (wbinvd) if more than # MBs were written (16 default, 0 - always wbinvd) \n\
 \t wrverify<Y|N> \t use write verification for PM pages? (Y or N) \n\
+\t vfysample<#> \t verify 1 of every # pages written (1 default - all pages) \n\
+\t vfyrand<Y|N> \t pick the verified pages at random (Y) or every #th page (N default) \n\
 \t checksum<Y|N> \t use checksum to protect PM pages? (Y or N)\n\
+\t csalg<CRC32|CRC32C|XXH64> checksum algorithm (CRC32 default, CRC32C needs SSE4.2)\n\
+\t cslazy<Y|N> \t verify the checksum of a page only on its first read since loading? (Y or N)\n\
 \t bufsize<#,#,..> the buffer size (MBs) (0 - no buffer, at least 4MB)\n\
-\t bufnum<#> \t the number of buffers for a PMBD device (16 buffers, at least 1 if using buffer, 0 -no buffer) \n\
+\t bufnum<#> \t the number of buffers for a PMBD device (16 buffers, at least 1 if using buffer, 0 -no buffer, at most 4 per CPU) \n\
 \t bufstride<#> \t the number of contiguous blocks(4KB) mapped into one buffer (bucket size for round-robin mapping) (1024 in default)\n\
+\t admit<Y|N> \t admit only small or rewritten writes into the buffer, others go directly to PM with non-temporal stores (N default) \n\
+\t admitseq<#> \t with admitY, a sequential stream of # KBs bypasses the buffer (512 default) \n\
+\t admitsmall<#> \t with admitY, writes up to # KBs are always admitted (16 default) \n\
 \t batch<#,#> \t the batch size (num of pages) for flushing PMBD device buffer (1 means no batching) \n\
 \n\
 MISC: \n\
@@ -449,22 +834,30 @@ MISC: \n\
 \t cache<WB|WC|UC> use which CPU cache policy? Write back (WB), Write Combined (WB), or Uncachable (UC)\n\
 \t subupdate<Y|N>  only update the changed cachelines of a page? (Y or N) (check PMBD_CACHELINE_SIZE) \n\
 \t timestat<Y|N>   enable the detailed timing statistics (/proc/pmbd/pmbdstat)? (Y or N) (This will cause significant performance slowdown) \n\
+\t trace<Y|N> \t log each request into per-CPU rings exported by /dev/pmbd_trace (N default, see pmbd_replay) \n\
 \n\
 NOTE: \n\
 \t (1) Option rdlat/wrlat only specifies the minimum access times. Real access times can be higher.\n\
 \t (2) If rdsx/wrsx is specified, the rdlat/wrlat/rdbw/wrbw would be ignored. \n\
 \t (3) Option simmode1 applies the simulated specification to the PM space, rather than the whole device, which may have buffer.\n\
+\t (4) With the banked model, requests to idle banks overlap and writes are acknowledged once queued. Bandwidth (rdbw/wrbw) is still emulated separately.\n\
 \n\
 WARNING: \n\
-\t (1) When using simmode1 to simulate slow-speed PM space, soft lockup warning may appear. Use \"nosoftlockup\" boot option to disable it.\n\
+\t (1) When using simmode1 to simulate slow-speed PM space, soft lockup warning may appear. Use \"nosoftlockup\" boot option to disable it, or simmode0 with deferY.\n\
 \t (2) Enabling timestat may cause performance degradation.\n\
-\t (3) FUA is supported in Linux 3.2.1, but if buffer is used (for PT-based protection), enabling FUA lowers performance due to double writes.\n\
+\t (3) FUA is supported in Linux 3.2.1. If buffer is used (for PT-based protection), FUA writes bypass the buffer and go directly to PM.\n\
 \t (4) No support for changing CPU cache related PTE attributes for VM-based PMBD in Linux 3.2.1 (RCU stalls).\n\
 \n\
 PROC ENTRIES: \n\
 \t /proc/pmbd/pmbdcfg     config info about the PMBD devices\n\
 \t /proc/pmbd/pmbdstat    statistics of the PMBD devices (if timestat is enabled)\n\
 \n\
+SYSFS ENTRIES: \n\
+\t /sys/block/<dev>/pmbd/  per-device settings (the options above set them at load)\n\
+\t     rdlat wrlat rdbw wrbw rdsx wrsx rdpause wrpause simmode rowhit \t emulation (read-write)\n\
+\t     bufsize bufnum bufstride batch \t buffer (read-write, bufsize/bufnum/bufstride rebuild the buffers)\n\
+\t     banks wqsize cache wpmode \t read-only\n\
+\n\
 EXAMPLE: \n\
 \t Assuming a 16GB PM space with physical memory addresses from 8GB to 24GB:\n\
 \t (1) Basic (Ramdisk): \n\
@@ -482,9 +875,17 @@ EXAMPLE: \n\
 static inline void pmbd_set_pages_ro(PMBD_DEVICE_T* pmbd, void* addr, uint64_t bytes, unsigned on_access);
 static inline void pmbd_set_pages_rw(PMBD_DEVICE_T* pmbd, void* addr, uint64_t bytes, unsigned on_access);
 static inline void pmbd_clflush_range(PMBD_DEVICE_T* pmbd, void* dst, size_t bytes);
+static inline void pmbd_dirty_log_add(PMBD_DEVICE_T* pmbd, void* addr, size_t bytes);
+static void pmbd_dirty_log_free(PMBD_DEVICE_T* pmbd);
+static void pmbd_dirty_log_work(struct work_struct* work);
+static inline void pmbd_flush_fence(void);
+static inline unsigned long pmbd_va_to_pfn(PMBD_DEVICE_T* pmbd, void* va);
 static inline int pmbd_verify_wr_pages(PMBD_DEVICE_T* pmbd, void* dst, void* src, size_t bytes);
-static int pmbd_checksum_on_write(PMBD_DEVICE_T* pmbd, void* vaddr, size_t bytes);
-static int pmbd_checksum_on_read(PMBD_DEVICE_T* pmbd, void* vaddr, size_t bytes);
+static int pmbd_checksum_on_write(PMBD_DEVICE_T* pmbd, void* vaddr, size_t bytes, unsigned do_fua);
+static void pmbd_checksum_begin_write(PMBD_DEVICE_T* pmbd, void* vaddr, size_t bytes, unsigned do_fua);
+static inline int pmbd_checksum_on_copy(PMBD_DEVICE_T* pmbd, void* pmbd_va, void* map_va, void* ram_va, size_t bytes, unsigned rw, PMBD_CHECKSUM_T* checksum, size_t* cks_read);
+static void pmbd_checksum_commit(PMBD_DEVICE_T* pmbd, unsigned long first, PMBD_CHECKSUM_T* cks, uint64_t mask, unsigned num, unsigned rw, unsigned do_fua);
+static void pmbd_checksum_on_flush(PMBD_DEVICE_T* pmbd, PMBD_BBI_T* bbi, void* pmbd_va, void* buf_va);
 
 static inline int put_ulong(unsigned long arg, unsigned long val)
 {
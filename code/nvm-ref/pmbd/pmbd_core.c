@@ -0,0 +1,722 @@
+/*
+ * Intel Persistent Memory Block Driver
+ * Copyright (c) <2011-2013>, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Intel Persistent Memory Block Driver (v0.9)
+ *
+ * pmbd_core.c
+ *
+ * The core library of PMBD (see pmbd_core.h). Everything here works on plain
+ * memory and numbers only, so that the same code runs in the kernel module
+ * and in the userspace tests. Do not add anything that needs the device, the
+ * block layer or a kernel lock.
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/atomic.h>
+#endif
+#include "pmbd_core.h"
+
+#define CORE_SECTOR_SIZE	(512)
+#define CORE_MB_SHIFT		(20)
+
+/*
+ **************************************************************************
+ * Checksum engines
+ **************************************************************************
+ */
+
+/*
+ * CRC32C with the SSE4.2 crc32 instruction
+ */
+
+static uint32_t pmbd_crc32c_shift[4][256];	/* shift a crc over PMBD_CRC32C_LANE zero bytes */
+
+static inline uint32_t crc32c_u64(uint32_t crc, uint64_t v)
+{
+	uint64_t c = crc;
+	__asm__ __volatile__ ("crc32q %1, %0" : "+r" (c) : "rm" (v));
+	return (uint32_t) c;
+}
+
+static inline uint32_t crc32c_u8(uint32_t crc, uint8_t v)
+{
+	__asm__ __volatile__ ("crc32b %1, %0" : "+r" (crc) : "rm" (v));
+	return crc;
+}
+
+static inline uint32_t crc32c_serial(uint32_t crc, const unsigned char* p, size_t len)
+{
+	while (len >= sizeof(uint64_t)){
+		crc = crc32c_u64(crc, *(const uint64_t*) p);
+		p += sizeof(uint64_t);
+		len -= sizeof(uint64_t);
+	}
+	while (len--)
+		crc = crc32c_u8(crc, *p++);
+	return crc;
+}
+
+/*
+ * the crc32 state transformation over a run of zeros is linear, so shifting
+ * a state is the xor of the shifted value of each of its four bytes
+ */
+static inline uint32_t crc32c_shift(uint32_t crc)
+{
+	return pmbd_crc32c_shift[0][crc & 0xff] ^
+		pmbd_crc32c_shift[1][(crc >> 8) & 0xff] ^
+		pmbd_crc32c_shift[2][(crc >> 16) & 0xff] ^
+		pmbd_crc32c_shift[3][crc >> 24];
+}
+
+/* build the lane shift table (must be called before pmbd_crc32c()) */
+void pmbd_crc32c_init(void)
+{
+	int i, j, k;
+	for (k = 0; k < 4; k ++){
+		for (i = 0; i < 256; i ++){
+			uint32_t crc = ((uint32_t) i) << (k * 8);
+			for (j = 0; j < PMBD_CRC32C_LANE; j += sizeof(uint64_t))
+				crc = crc32c_u64(crc, 0);
+			pmbd_crc32c_shift[k][i] = crc;
+		}
+	}
+	return;
+}
+
+uint32_t pmbd_crc32c(const void* data, size_t len)
+{
+	const unsigned char* p = data;
+	uint32_t crc0 = ~0U;
+
+	/* three-way interleaved for page-sized units */
+	if (len >= 3 * PMBD_CRC32C_LANE){
+		uint32_t crc1 = 0;
+		uint32_t crc2 = 0;
+		const uint64_t* p0 = (const uint64_t*) p;
+		const uint64_t* p1 = (const uint64_t*) (p + PMBD_CRC32C_LANE);
+		const uint64_t* p2 = (const uint64_t*) (p + 2 * PMBD_CRC32C_LANE);
+		size_t i;
+
+		for (i = 0; i < PMBD_CRC32C_LANE / sizeof(uint64_t); i ++){
+			crc0 = crc32c_u64(crc0, p0[i]);
+			crc1 = crc32c_u64(crc1, p1[i]);
+			crc2 = crc32c_u64(crc2, p2[i]);
+		}
+
+		/* merge the three streams */
+		crc0 = crc32c_shift(crc0) ^ crc1;
+		crc0 = crc32c_shift(crc0) ^ crc2;
+
+		p += 3 * PMBD_CRC32C_LANE;
+		len -= 3 * PMBD_CRC32C_LANE;
+	}
+
+	return ~crc32c_serial(crc0, p, len);
+}
+
+
+/*
+ * xxhash64 (derived from the xxHash reference implementation, BSD 2-Clause)
+ */
+
+#define XXH64_PRIME1	11400714785074694791ULL
+#define XXH64_PRIME2	14029467366897019727ULL
+#define XXH64_PRIME3	1609587929392839161ULL
+#define XXH64_PRIME4	9650029242287828579ULL
+#define XXH64_PRIME5	2870177450012600261ULL
+#define XXH64_ROTL(X,R)	(((X) << (R)) | ((X) >> (64 - (R))))
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH64_PRIME2;
+	acc = XXH64_ROTL(acc, 31);
+	return acc * XXH64_PRIME1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+uint64_t pmbd_xxh64(const void* data, size_t len, uint64_t seed)
+{
+	const unsigned char* p = data;
+	const unsigned char* const end = p + len;
+	uint64_t h64;
+
+	if (len >= 32){
+		const unsigned char* const limit = end - 32;
+		uint64_t v1 = seed + XXH64_PRIME1 + XXH64_PRIME2;
+		uint64_t v2 = seed + XXH64_PRIME2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH64_PRIME1;
+
+		do {
+			v1 = xxh64_round(v1, *(const uint64_t*) p); p += 8;
+			v2 = xxh64_round(v2, *(const uint64_t*) p); p += 8;
+			v3 = xxh64_round(v3, *(const uint64_t*) p); p += 8;
+			v4 = xxh64_round(v4, *(const uint64_t*) p); p += 8;
+		} while (p <= limit);
+
+		h64 = XXH64_ROTL(v1, 1) + XXH64_ROTL(v2, 7) + XXH64_ROTL(v3, 12) + XXH64_ROTL(v4, 18);
+		h64 = xxh64_merge_round(h64, v1);
+		h64 = xxh64_merge_round(h64, v2);
+		h64 = xxh64_merge_round(h64, v3);
+		h64 = xxh64_merge_round(h64, v4);
+	} else {
+		h64 = seed + XXH64_PRIME5;
+	}
+
+	h64 += (uint64_t) len;
+
+	while (p + 8 <= end){
+		h64 ^= xxh64_round(0, *(const uint64_t*) p);
+		h64 = XXH64_ROTL(h64, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+		p += 8;
+	}
+	if (p + 4 <= end){
+		h64 ^= (uint64_t)(*(const uint32_t*) p) * XXH64_PRIME1;
+		h64 = XXH64_ROTL(h64, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+		p += 4;
+	}
+	while (p < end){
+		h64 ^= (*p) * XXH64_PRIME5;
+		h64 = XXH64_ROTL(h64, 11) * XXH64_PRIME1;
+		p ++;
+	}
+
+	h64 ^= h64 >> 33;
+	h64 *= XXH64_PRIME2;
+	h64 ^= h64 >> 29;
+	h64 *= XXH64_PRIME3;
+	h64 ^= h64 >> 32;
+
+	return h64;
+}
+
+/*
+ * compute the checksum of a buffer with the given engine
+ * @alg: PMBD_CSALG_*
+ * @data: the buffer
+ * @len: the size of the buffer (in bytes)
+ */
+PMBD_CHECKSUM_T pmbd_checksum_calc(unsigned alg, const void* data, size_t len)
+{
+	if (alg == PMBD_CSALG_CRC32C)
+		return pmbd_crc32c(data, len);
+	else if (alg == PMBD_CSALG_XXH64)
+		return pmbd_xxh64(data, len, 0);
+	else
+		return crc32_le(0, data, len);
+}
+
+
+/*
+ **************************************************************************
+ * Write verification
+ **************************************************************************
+ */
+
+/*
+ * The compare engines stream both buffers with non-temporal loads
+ * (movntdqa), so verifying a large write does not evict the working set
+ * from the CPU cache (on write-back memory the hint is best effort), and
+ * stop at the first step that differs. The SIMD engines need both buffers
+ * aligned to their load size; anything else, and the tail, is left to
+ * memcmp(). In the kernel, the caller must hold kernel_fpu_begin().
+ */
+static inline int mem_equal_sse41_64(const void* a, const void* b)
+{
+	unsigned mask;
+	__asm__ __volatile__ (
+	"movntdqa (%1), %%xmm0\n"
+	"movntdqa 16(%1), %%xmm1\n"
+	"movntdqa 32(%1), %%xmm2\n"
+	"movntdqa 48(%1), %%xmm3\n"
+	"movntdqa (%2), %%xmm4\n"
+	"movntdqa 16(%2), %%xmm5\n"
+	"movntdqa 32(%2), %%xmm6\n"
+	"movntdqa 48(%2), %%xmm7\n"
+	"pcmpeqb %%xmm4, %%xmm0\n"
+	"pcmpeqb %%xmm5, %%xmm1\n"
+	"pcmpeqb %%xmm6, %%xmm2\n"
+	"pcmpeqb %%xmm7, %%xmm3\n"
+	"pand %%xmm1, %%xmm0\n"
+	"pand %%xmm3, %%xmm2\n"
+	"pand %%xmm2, %%xmm0\n"
+	"pmovmskb %%xmm0, %0\n"
+	: "=r" (mask)
+	: "r" (a), "r" (b)
+	: PMBD_SIMD_CLOBBERS);
+	return mask == 0xffff;
+}
+
+static inline int mem_equal_avx2_128(const void* a, const void* b)
+{
+	unsigned mask;
+	__asm__ __volatile__ (
+	"vmovntdqa (%1), %%ymm0\n"
+	"vmovntdqa 32(%1), %%ymm1\n"
+	"vmovntdqa 64(%1), %%ymm2\n"
+	"vmovntdqa 96(%1), %%ymm3\n"
+	"vmovntdqa (%2), %%ymm4\n"
+	"vmovntdqa 32(%2), %%ymm5\n"
+	"vmovntdqa 64(%2), %%ymm6\n"
+	"vmovntdqa 96(%2), %%ymm7\n"
+	"vpcmpeqb %%ymm4, %%ymm0, %%ymm0\n"
+	"vpcmpeqb %%ymm5, %%ymm1, %%ymm1\n"
+	"vpcmpeqb %%ymm6, %%ymm2, %%ymm2\n"
+	"vpcmpeqb %%ymm7, %%ymm3, %%ymm3\n"
+	"vpand %%ymm1, %%ymm0, %%ymm0\n"
+	"vpand %%ymm3, %%ymm2, %%ymm2\n"
+	"vpand %%ymm2, %%ymm0, %%ymm0\n"
+	"vpmovmskb %%ymm0, %0\n"
+	: "=r" (mask)
+	: "r" (a), "r" (b)
+	: PMBD_SIMD_CLOBBERS);
+	return mask == 0xffffffff;
+}
+
+/*
+ * compare two buffers with the given engine
+ * return 1 if they are equal, 0 otherwise
+ */
+int pmbd_mem_equal(unsigned engine, const void* a, const void* b, size_t len)
+{
+	const unsigned char* p = a;
+	const unsigned char* q = b;
+	int equal = 1;
+
+	if (engine == PMBD_VERIFY_AVX2 && !(((unsigned long) p | (unsigned long) q) & 31)) {
+		for (; len >= 128 && equal; p += 128, q += 128, len -= 128)
+			equal = mem_equal_avx2_128(p, q);
+		__asm__ __volatile__ ("vzeroupper" ::: "memory");
+	} else if (engine == PMBD_VERIFY_SSE41 && !(((unsigned long) p | (unsigned long) q) & 15)) {
+		for (; len >= 64 && equal; p += 64, q += 64, len -= 64)
+			equal = mem_equal_sse41_64(p, q);
+	}
+
+	return equal && !memcmp(p, q, len);
+}
+
+/*
+ * decide if the next page is verified
+ * @state: the sampling state of the caller (one per CPU, starts at 0)
+ * @n: verify 1 of every n pages (0 or 1 - all pages)
+ * @rnd: pick the pages at random (1 in n chance), rather than every n-th
+ * return 1 if the page is verified
+ */
+int pmbd_sample_page(uint64_t* state, unsigned n, unsigned rnd)
+{
+	uint64_t x;
+
+	if (n <= 1)
+		return 1;
+
+	if (!rnd) {
+		if (++ *state < n)
+			return 0;
+		*state = 0;
+		return 1;
+	}
+
+	/* xorshift64*, the high half is the best mixed */
+	x = *state ? *state : 0x9e3779b97f4a7c15ULL;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return ((uint32_t) ((x * 0x2545f4914f6cdd1dULL) >> 32)) % n == 0;
+}
+
+/*
+ **************************************************************************
+ * Buffer block line masks
+ **************************************************************************
+ */
+
+/*
+ * get the line mask of a write to a buffer block
+ * @line_size:	the size of a line (1/64 of the block)
+ * @off:	in-block offset of the write (in bytes)
+ * @size:	size of the write (in bytes)
+ *
+ * A write covers every line it touches.
+ */
+uint64_t pmbd_line_mask(size_t line_size, size_t off, size_t size)
+{
+	unsigned first = off / line_size;
+	unsigned last = (off + size - 1) / line_size;
+	unsigned num = last - first + 1;
+
+	if (num >= PMBD_LINE_MASK_BITS)
+		return ~0ULL;
+	return ((1ULL << num) - 1) << first;
+}
+
+/*
+ * get the mask of the lines a write covers completely (the lines it
+ * overwrites, see pmbd_line_mask() for the lines it touches)
+ */
+uint64_t pmbd_line_mask_full(size_t line_size, size_t off, size_t size)
+{
+	size_t first = (off + line_size - 1) / line_size;
+	size_t end = (off + size) / line_size;
+
+	if (end <= first)
+		return 0;
+	return pmbd_line_mask(line_size, first * line_size, (end - first) * line_size);
+}
+
+/*
+ * find the next run of set bits in a line mask
+ * @mask:	the line mask
+ * @first:	where to start searching (in), the first line of the run (out)
+ * @last:	the last line of the run (out)
+ *
+ * return 1 if a run is found
+ */
+int pmbd_next_run(uint64_t mask, unsigned* first, unsigned* last)
+{
+	unsigned i = *first;
+
+	while (i < PMBD_LINE_MASK_BITS && !(mask & (1ULL << i)))
+		i ++;
+	if (i >= PMBD_LINE_MASK_BITS)
+		return 0;
+
+	*first = i;
+	while (i + 1 < PMBD_LINE_MASK_BITS && (mask & (1ULL << (i + 1))))
+		i ++;
+	*last = i;
+	return 1;
+}
+
+
+/*
+ **************************************************************************
+ * Buffer flush planning
+ **************************************************************************
+ */
+
+/* support functions to sort the bbi entries */
+int pmbd_bsort_compare(const void* m, const void* n)
+{
+	const PMBD_BSORT_ENTRY_T* a = (const PMBD_BSORT_ENTRY_T*) m;
+	const PMBD_BSORT_ENTRY_T* b = (const PMBD_BSORT_ENTRY_T*) n;
+	if (a->pbn < b->pbn)
+		return -1;
+	else if (a->pbn == b->pbn)
+		return 0;
+	else
+		return 1;
+
+}
+
+void pmbd_bsort_swap(void* m, void* n, int size)
+{
+	PMBD_BSORT_ENTRY_T* a = (PMBD_BSORT_ENTRY_T*) m;
+	PMBD_BSORT_ENTRY_T* b = (PMBD_BSORT_ENTRY_T*) n;
+	PMBD_BSORT_ENTRY_T tmp;
+
+	/* the size is fixed, it is only in the signature sort() expects */
+	(void) size;
+	tmp = *a;
+	*a = *b;
+	*b = tmp;
+	return;
+}
+
+/*
+ * get the next sequence of contiguous physical blocks in the sort buffer
+ * @se: the sort buffer
+ * @num: the num of entries in the sort buffer
+ * @i: the index to start from
+ * @first_pbn: the first PBN of the sequence (out)
+ * @last_pbn: the last PBN of the sequence (out)
+ *
+ * return the index of the entry following the sequence
+ */
+unsigned long pmbd_flush_next_seq(PMBD_BSORT_ENTRY_T* se, unsigned long num, unsigned long i,
+					PBN_T* first_pbn, PBN_T* last_pbn)
+{
+	*first_pbn = se[i].pbn;
+	*last_pbn = se[i].pbn;
+
+	for (i = i + 1; i < num && se[i].pbn == (*last_pbn + 1); i ++)
+		*last_pbn = se[i].pbn;
+	return i;
+}
+
+
+/*
+ **************************************************************************
+ * Buffer admission
+ **************************************************************************
+ */
+
+/*
+ * track the sequential write streams of a submitter
+ * @slots:	the streams, the most recently written first
+ * @num:	the num of slots
+ * @sector:	the first sector of the write
+ * @nsectors:	the size of the write (in sectors)
+ *
+ * return the length (in sectors) of the stream the write extends, or of the
+ * new stream it starts (the least recently written one is dropped)
+ */
+uint64_t pmbd_stream_update(PMBD_STREAM_T* slots, unsigned num, uint64_t sector, uint64_t nsectors)
+{
+	PMBD_STREAM_T cur;
+	unsigned i;
+
+	for (i = 0; i < num && slots[i].next != sector; i ++)
+		;
+
+	if (i < num) {
+		cur.run = slots[i].run + nsectors;
+	} else {
+		cur.run = nsectors;
+		i = num - 1;
+	}
+	cur.next = sector + nsectors;
+
+	/* move it to the front */
+	for (; i > 0; i --)
+		slots[i] = slots[i - 1];
+	slots[0] = cur;
+	return cur.run;
+}
+
+/*
+ * the counters of a key: one 4-bit counter in each of PMBD_SKETCH_DEPTH words
+ * picked by independent hashes
+ */
+static inline uint64_t pmbd_sketch_hash(uint64_t key, unsigned d)
+{
+	static const uint64_t seed[PMBD_SKETCH_DEPTH] = {
+		0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+		0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL,
+	};
+	uint64_t h = (key + seed[d]) * 0xff51afd7ed558ccdULL;
+	return h ^ (h >> 29);
+}
+
+#define PMBD_SKETCH_WORD(S, H)		(&(S)->table[(H) & (S)->mask])
+#define PMBD_SKETCH_SHIFT(H)		((unsigned) ((H) >> 60) << 2)
+
+/*
+ * estimate how many times a key was added (at most PMBD_SKETCH_MAX)
+ */
+unsigned pmbd_sketch_estimate(const PMBD_SKETCH_T* s, uint64_t key)
+{
+	unsigned min = PMBD_SKETCH_MAX;
+	unsigned d;
+
+	for (d = 0; d < PMBD_SKETCH_DEPTH; d ++){
+		uint64_t h = pmbd_sketch_hash(key, d);
+		unsigned c = (unsigned) ((READ_ONCE(*PMBD_SKETCH_WORD(s, h)) >> PMBD_SKETCH_SHIFT(h)) & 0xf);
+		if (c < min)
+			min = c;
+	}
+	return min;
+}
+
+/* halve all the counters (racing with the additions, so with cmpxchg too) */
+void pmbd_sketch_age(PMBD_SKETCH_T* s)
+{
+	uint64_t i, old;
+
+	for (i = 0; i <= s->mask; i ++){
+		do {
+			old = READ_ONCE(s->table[i]);
+		} while (cmpxchg64(&s->table[i], old, (old >> 1) & 0x7777777777777777ULL) != old);
+	}
+	return;
+}
+
+/*
+ * add a key and return its new estimate
+ *
+ * Only the counters at the minimum are incremented (conservative update),
+ * which keeps the estimates of the keys sharing a counter apart. After
+ * s->sample additions all the counters are halved, so the writes of the
+ * past fade away.
+ *
+ * There is no lock: a counter is bumped with cmpxchg only while it is still
+ * at the minimum, and only the addition that reaches s->sample ages the
+ * sketch. A racing addition may see a stale minimum, which only makes the
+ * estimate as loose as the one of a plain count-min update.
+ */
+unsigned pmbd_sketch_add(PMBD_SKETCH_T* s, uint64_t key)
+{
+	unsigned min = pmbd_sketch_estimate(s, key);
+	unsigned d;
+
+	if (min < PMBD_SKETCH_MAX) {
+		for (d = 0; d < PMBD_SKETCH_DEPTH; d ++){
+			uint64_t h = pmbd_sketch_hash(key, d);
+			uint64_t* w = PMBD_SKETCH_WORD(s, h);
+			unsigned shift = PMBD_SKETCH_SHIFT(h);
+			uint64_t old;
+
+			do {
+				old = READ_ONCE(*w);
+				if (((old >> shift) & 0xf) != min)
+					break;
+			} while (cmpxchg64(w, old, old + (1ULL << shift)) != old);
+		}
+		min ++;
+	}
+
+	if (atomic64_inc_return(&s->adds) == s->sample){
+		pmbd_sketch_age(s);
+		atomic64_sub(s->sample, &s->adds);
+	}
+	return min;
+}
+
+
+/*
+ **************************************************************************
+ * Emulation arithmetic
+ **************************************************************************
+ */
+
+uint64_t pmbd_div64_round(uint64_t dividend, uint64_t divisor)
+{
+	if (divisor > 0) {
+		uint32_t quot1 = dividend / divisor;
+		uint32_t mod = dividend % divisor;
+		uint32_t mult = mod * 2;
+		uint32_t quot2 = mult / divisor;
+		uint64_t result = quot1 + quot2;
+		return result;
+	} else { // FIXME: how to handle this?
+		printk(KERN_WARNING "pmbd: WARNING - %s(%d) divisor is zero\n", __FUNCTION__, __LINE__);
+		return 0;
+	}
+}
+
+uint64_t pmbd_cycle_to_ns(uint64_t cycle, unsigned int khz)
+{
+	return cycle * 1000000 / khz;
+}
+
+/*
+ * emulate the transfer time for a given request size at a given bandwidth
+ * @num_sectors: num of sectors to read/write
+ * @bw: the bandwidth (MB/sec)
+ */
+uint64_t pmbd_trans_time(unsigned int num_sectors, uint64_t bw)
+{
+	uint64_t ns = 0;
+	if (bw) {
+		uint64_t tmp = (uint64_t) num_sectors * CORE_SECTOR_SIZE;
+		uint64_t tt = 1000000000UL >> CORE_MB_SHIFT;
+		ns += pmbd_div64_round((tmp * tt), bw);
+	}
+	return ns;
+}
+
+/*
+ * get the bandwidth share of an emulation context
+ * @bw: the device bandwidth (MB/sec, 0 for unlimited)
+ * @demand: the demand of the context in the last interval
+ * @total: the total demand of all the contexts
+ * @nr_active: the num of contexts with a demand
+ *
+ * The bandwidth is split proportionally to the demand. An idle context is
+ * given the share it would get if it joined the active ones.
+ */
+uint64_t pmbd_bw_share(uint64_t bw, uint64_t demand, uint64_t total, uint64_t nr_active)
+{
+	uint64_t share = 0;
+
+	if (!bw)
+		return 0;
+
+	if (demand && total)
+		share = div64_u64(bw * demand, total);
+	else
+		share = div64_u64(bw, nr_active + 1);
+
+	return share ? share : 1;
+}
+
+/*
+ * access the banked timing model
+ * @m: the model
+ * @now: the time the access is issued
+ * @addr: the first byte accessed (offset in PM)
+ * @bytes: the size of the access
+ * @is_write: write (1) or read (0)
+ * return value: the time the access completes (a write completes once all
+ * its rows are in the write queue)
+ *
+ * The access is split by rows. Rows on different banks are served in
+ * parallel, rows on the same bank one after the other, taking t_hit if the
+ * row is open in the row buffer and t_miss otherwise. A full write queue
+ * stalls a write until its oldest entry is drained, and reads wait for the
+ * queued writes of their banks, so random small writes end up much slower
+ * than sequential ones.
+ */
+uint64_t pmbd_bank_access(PMBD_BANK_MODEL_T* m, uint64_t now, uint64_t addr, uint64_t bytes, unsigned is_write)
+{
+	uint64_t first = addr >> m->row_shift;
+	uint64_t last = (addr + (bytes ? bytes : 1) - 1) >> m->row_shift;
+	uint64_t done = now;
+	uint64_t c;
+
+	for (c = first; c <= last; c ++){
+		uint64_t row = div64_u64(c, m->num_banks);
+		PMBD_BANK_T* bank = &m->banks[c - row * m->num_banks];
+		uint64_t accept = now;
+		uint64_t start;
+		uint64_t t;
+
+		/* wait for a free entry in the write queue */
+		if (is_write && m->wq_depth && m->wq[m->wq_head] > accept)
+			accept = m->wq[m->wq_head];
+
+		/* wait for the bank */
+		start = bank->busy_until > accept ? bank->busy_until : accept;
+		t = (bank->row_valid && bank->open_row == row) ? m->t_hit[is_write] : m->t_miss[is_write];
+		bank->busy_until = start + t;
+		bank->open_row = row;
+		bank->row_valid = 1;
+
+		if (is_write && m->wq_depth) {
+			/* queued, drained in the background */
+			m->wq[m->wq_head] = bank->busy_until;
+			m->wq_head = (m->wq_head + 1) % m->wq_depth;
+			if (accept > done)
+				done = accept;
+		} else if (bank->busy_until > done) {
+			done = bank->busy_until;
+		}
+	}
+	return done;
+}
+
+/* THE END */
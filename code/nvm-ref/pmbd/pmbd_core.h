@@ -0,0 +1,168 @@
+/*
+ * Intel Persistent Memory Block Driver
+ * Copyright (c) <2011-2013>, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Intel Persistent Memory Block Driver (v0.9)
+ *
+ * pmbd_core.h
+ *
+ * The core library of PMBD: checksum engines, write verification, buffer line
+ * masks, flush planning, buffer admission and emulation arithmetic. It does not depend on the
+ * block layer or on any device state, so it builds both into the kernel
+ * module and in userspace against pmbd_shim.h (see pmbd_core_test.c and
+ * "make test").
+ */
+
+#ifndef PMBD_CORE_H
+#define PMBD_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/crc32.h>
+#else
+#include "pmbd_shim.h"
+#endif
+
+/*
+ * the vector registers used by inline assembly: the kernel never uses them
+ * outside kernel_fpu_begin()/kernel_fpu_end(), so only userspace lists them
+ */
+#ifdef __KERNEL__
+#define PMBD_SIMD_CLOBBERS		"memory"
+#else
+#define PMBD_SIMD_CLOBBERS		"memory", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7"
+#endif
+
+/*
+ * type definitions
+ */
+typedef uint64_t			PMBD_CHECKSUM_T;/* wide enough for any checksum engine (see csalg) */
+typedef sector_t			BBN_T;		/* BBN_T */
+typedef sector_t			PBN_T;		/* BBN_T */
+
+typedef struct pmbd_bsort_entry {			/* pmbd buffer block info for sorting */
+	BBN_T				bbn;		/* buffer block number (in buffer)*/
+	PBN_T				pbn;		/* physical block number (in PMBD)*/
+} PMBD_BSORT_ENTRY_T;
+
+/*
+ * checksum engines
+ */
+#define PMBD_CSALG_CRC32		0 /* CRC32 (lib/crc32.c, default) */
+#define PMBD_CSALG_CRC32C		1 /* CRC32C with the SSE4.2 crc32 instruction */
+#define PMBD_CSALG_XXH64		2 /* xxhash64 */
+
+#define PMBD_CRC32C_LANE		(1360)	/* bytes per lane (3 lanes + 16 bytes = 4KB) */
+
+extern void pmbd_crc32c_init(void);
+extern uint32_t pmbd_crc32c(const void* data, size_t len);
+extern uint64_t pmbd_xxh64(const void* data, size_t len, uint64_t seed);
+extern PMBD_CHECKSUM_T pmbd_checksum_calc(unsigned alg, const void* data, size_t len);
+
+/*
+ * write verification: compare engines and page sampling
+ */
+#define PMBD_VERIFY_MEMCMP		0 /* memcmp() */
+#define PMBD_VERIFY_SSE41		1 /* SSE4.1 non-temporal loads, 64 bytes per step */
+#define PMBD_VERIFY_AVX2		2 /* AVX2 non-temporal loads, 128 bytes per step */
+
+extern int pmbd_mem_equal(unsigned engine, const void* a, const void* b, size_t len);
+extern int pmbd_sample_page(uint64_t* state, unsigned n, unsigned rnd);
+
+/*
+ * buffer block line masks (one bit per 1/64 block)
+ */
+#define PMBD_LINE_MASK_BITS		(64)
+
+extern uint64_t pmbd_line_mask(size_t line_size, size_t off, size_t size);
+extern uint64_t pmbd_line_mask_full(size_t line_size, size_t off, size_t size);
+extern int pmbd_next_run(uint64_t mask, unsigned* first, unsigned* last);
+
+/*
+ * buffer flush planning
+ */
+extern int pmbd_bsort_compare(const void* m, const void* n);
+extern void pmbd_bsort_swap(void* m, void* n, int size);
+extern unsigned long pmbd_flush_next_seq(PMBD_BSORT_ENTRY_T* se, unsigned long num, unsigned long i,
+						PBN_T* first_pbn, PBN_T* last_pbn);
+
+/*
+ * buffer admission: sequential stream detection and a count-min sketch of
+ * the block writes (PMBD_SKETCH_DEPTH 4-bit counters per key, 16 counters
+ * per word). The caller allocates the sketch table (a power of 2 words). The
+ * updates are lock-free (cmpxchg on the counter words), so the CPUs can add
+ * keys concurrently.
+ */
+typedef struct pmbd_stream {
+	uint64_t			next;		/* the sector expected next */
+	uint64_t			run;		/* sectors written in a row */
+} PMBD_STREAM_T;
+
+#define PMBD_SKETCH_DEPTH		(4)
+#define PMBD_SKETCH_MAX			(15)
+
+typedef struct pmbd_sketch {
+	uint64_t*			table;		/* the counters */
+	uint64_t			mask;		/* num of words - 1 */
+	atomic64_t			adds;		/* additions since the last aging */
+	uint64_t			sample;		/* halve the counters after so many additions */
+} PMBD_SKETCH_T;
+
+extern uint64_t pmbd_stream_update(PMBD_STREAM_T* slots, unsigned num, uint64_t sector, uint64_t nsectors);
+extern unsigned pmbd_sketch_estimate(const PMBD_SKETCH_T* s, uint64_t key);
+extern unsigned pmbd_sketch_add(PMBD_SKETCH_T* s, uint64_t key);
+extern void pmbd_sketch_age(PMBD_SKETCH_T* s);
+
+/*
+ * emulation arithmetic
+ */
+extern uint64_t pmbd_div64_round(uint64_t dividend, uint64_t divisor);
+extern uint64_t pmbd_cycle_to_ns(uint64_t cycle, unsigned int khz);
+extern uint64_t pmbd_trans_time(unsigned int num_sectors, uint64_t bw);
+extern uint64_t pmbd_bw_share(uint64_t bw, uint64_t demand, uint64_t total, uint64_t nr_active);
+
+/*
+ * banked PM timing model
+ *
+ * The PM space is interleaved row by row over the banks. Each bank has a row
+ * buffer (the last row accessed) and is busy until its last access is done.
+ * Writes are acknowledged once accepted by a bounded write queue and drained
+ * to the banks in the background. All times are in the same unit (cycles in
+ * the driver), the caller serializes the accesses.
+ */
+typedef struct pmbd_bank {
+	uint64_t			busy_until;	/* the bank is busy until */
+	uint64_t			open_row;	/* the row in the row buffer */
+	unsigned			row_valid;	/* the row buffer holds a row */
+} PMBD_BANK_T;
+
+typedef struct pmbd_bank_model {
+	PMBD_BANK_T*			banks;		/* the banks */
+	unsigned			num_banks;	/* the num of banks */
+	unsigned			row_shift;	/* the row size (log2 of bytes) */
+	uint64_t			t_hit[2];	/* row buffer hit time (READ/WRITE) */
+	uint64_t			t_miss[2];	/* row buffer miss time (READ/WRITE) */
+	uint64_t*			wq;		/* the write queue (drain times of the queued writes) */
+	unsigned			wq_depth;	/* the num of entries (0 - writes wait for the bank) */
+	unsigned			wq_head;	/* the oldest entry */
+} PMBD_BANK_MODEL_T;
+
+extern uint64_t pmbd_bank_access(PMBD_BANK_MODEL_T* m, uint64_t now, uint64_t addr, uint64_t bytes, unsigned is_write);
+
+#endif
+/* THEN END */
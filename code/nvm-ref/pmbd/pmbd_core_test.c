@@ -0,0 +1,416 @@
+/*
+ * Intel Persistent Memory Block Driver
+ * Copyright (c) <2011-2013>, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Intel Persistent Memory Block Driver (v0.9)
+ *
+ * pmbd_core_test.c
+ *
+ * Userspace unit tests for the core library (pmbd_core.c).
+ *
+ * Usage:
+ *	make test	- run the tests
+ *	make bench	- run the tests and the checksum benchmark
+ */
+
+#include <time.h>
+#include "pmbd_core.h"
+
+static int failed = 0;
+static int passed = 0;
+
+#define CHECK(COND) do { \
+	if (COND) { \
+		passed ++; \
+	} else { \
+		failed ++; \
+		fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #COND); \
+	} \
+} while (0)
+
+static const char* check_string = "123456789";
+
+/*
+ * checksum engines
+ */
+
+/* bytewise reference for the interleaved crc32c */
+static uint32_t crc32c_ref(const unsigned char* p, size_t len)
+{
+	uint32_t crc = ~0U;
+	int i;
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i ++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+	}
+	return ~crc;
+}
+
+static void test_checksum(void)
+{
+	unsigned char buf[8192];
+	size_t sizes[] = {0, 1, 7, 64, 512, 3 * PMBD_CRC32C_LANE - 1, 3 * PMBD_CRC32C_LANE, 4096, 8192};
+	size_t i;
+
+	for (i = 0; i < sizeof(buf); i ++)
+		buf[i] = (unsigned char) (i * 131 + 7);
+
+	/* crc32 */
+	CHECK((crc32_le(~0U, (const unsigned char*) check_string, 9) ^ ~0U) == 0xcbf43926);
+	CHECK(pmbd_checksum_calc(PMBD_CSALG_CRC32, buf, 4096) == crc32_le(0, buf, 4096));
+
+	/* crc32c */
+	if (!__builtin_cpu_supports("sse4.2")) {
+		printf("skip: crc32c (no sse4.2)\n");
+	} else {
+		pmbd_crc32c_init();
+		CHECK(pmbd_crc32c(check_string, 9) == 0xe3069283);
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i ++)
+			CHECK(pmbd_crc32c(buf, sizes[i]) == crc32c_ref(buf, sizes[i]));
+		CHECK(pmbd_checksum_calc(PMBD_CSALG_CRC32C, buf, 4096) == crc32c_ref(buf, 4096));
+	}
+
+	/* xxh64 */
+	CHECK(pmbd_xxh64("", 0, 0) == 0xef46db3751d8e999ULL);
+	CHECK(pmbd_xxh64("a", 1, 0) == 0xd24ec4f1a98c6e5bULL);
+	CHECK(pmbd_checksum_calc(PMBD_CSALG_XXH64, buf, 4096) == pmbd_xxh64(buf, 4096, 0));
+	CHECK(pmbd_xxh64(buf, 4096, 0) != pmbd_xxh64(buf, 4096, 1));
+	return;
+}
+
+/*
+ * write verification
+ */
+static void test_verify(void)
+{
+	static unsigned char a[8192 + 64] __attribute__((aligned(64)));
+	static unsigned char b[8192 + 64] __attribute__((aligned(64)));
+	size_t diffs[] = {0, 15, 63, 64, 127, 128, 4095, 8191};
+	unsigned engines[] = {PMBD_VERIFY_MEMCMP, PMBD_VERIFY_SSE41, PMBD_VERIFY_AVX2};
+	uint64_t state = 0;
+	unsigned e, i, hits;
+
+	for (i = 0; i < sizeof(a); i ++)
+		a[i] = b[i] = (unsigned char) (i * 37 + 1);
+
+	for (e = 0; e < 3; e ++){
+		unsigned engine = engines[e];
+		if ((engine == PMBD_VERIFY_SSE41 && !__builtin_cpu_supports("sse4.1"))
+		||  (engine == PMBD_VERIFY_AVX2 && !__builtin_cpu_supports("avx2"))) {
+			printf("skip: verify engine %u (not supported)\n", engine);
+			continue;
+		}
+
+		CHECK(pmbd_mem_equal(engine, a, b, 8192) == 1);
+		CHECK(pmbd_mem_equal(engine, a, b, 100) == 1);		/* SIMD and a tail */
+		CHECK(pmbd_mem_equal(engine, a + 8, b + 8, 4096) == 1);	/* unaligned */
+
+		for (i = 0; i < sizeof(diffs) / sizeof(diffs[0]); i ++){
+			b[diffs[i]] ^= 0x80;
+			CHECK(pmbd_mem_equal(engine, a, b, 8192) == 0);
+			b[diffs[i]] ^= 0x80;
+		}
+		b[8192 + 8] ^= 1;
+		CHECK(pmbd_mem_equal(engine, a + 16, b + 16, 8192) == 0);
+		b[8192 + 8] ^= 1;
+	}
+
+	/* sampling: all pages, every 4th page, 1 in 4 at random */
+	CHECK(pmbd_sample_page(&state, 1, 0) == 1 && pmbd_sample_page(&state, 0, 1) == 1);
+	for (i = 0, hits = 0; i < 16; i ++)
+		hits += pmbd_sample_page(&state, 4, 0);
+	CHECK(hits == 4);
+	state = 0;
+	for (i = 0, hits = 0; i < 40000; i ++)
+		hits += pmbd_sample_page(&state, 4, 1);
+	CHECK(hits > 9000 && hits < 11000);
+	return;
+}
+
+/*
+ * buffer line masks
+ */
+static void test_line_mask(void)
+{
+	unsigned first = 0;
+	unsigned last = 0;
+	uint64_t mask = 0;
+
+	/* 4KB blocks, 64B lines */
+	CHECK(pmbd_line_mask(64, 0, 64) == 0x1ULL);
+	CHECK(pmbd_line_mask(64, 0, 65) == 0x3ULL);
+	CHECK(pmbd_line_mask(64, 63, 2) == 0x3ULL);
+	CHECK(pmbd_line_mask(64, 512, 512) == (0xffULL << 8));
+	CHECK(pmbd_line_mask(64, 4032, 64) == (1ULL << 63));
+	CHECK(pmbd_line_mask(64, 0, 4096) == ~0ULL);
+	CHECK(pmbd_line_mask(64, 64, 4032) == ~1ULL);
+
+	/* only the lines covered completely */
+	CHECK(pmbd_line_mask_full(64, 0, 65) == 0x1ULL);
+	CHECK(pmbd_line_mask_full(64, 63, 2) == 0);
+	CHECK(pmbd_line_mask_full(1024, 512, 2048) == 0x2ULL);
+	CHECK(pmbd_line_mask_full(64, 0, 4096) == ~0ULL);
+
+	/* runs */
+	mask = 0x1ULL | (0x7ULL << 4) | (1ULL << 63);
+	CHECK(pmbd_next_run(mask, &first, &last) == 1 && first == 0 && last == 0);
+	first = last + 1;
+	CHECK(pmbd_next_run(mask, &first, &last) == 1 && first == 4 && last == 6);
+	first = last + 1;
+	CHECK(pmbd_next_run(mask, &first, &last) == 1 && first == 63 && last == 63);
+	first = last + 1;
+	CHECK(pmbd_next_run(mask, &first, &last) == 0);
+
+	first = 0;
+	CHECK(pmbd_next_run(~0ULL, &first, &last) == 1 && first == 0 && last == 63);
+	first = 0;
+	CHECK(pmbd_next_run(0, &first, &last) == 0);
+	return;
+}
+
+/*
+ * flush planning
+ */
+static int cmp_entries(const void* m, const void* n)
+{
+	return pmbd_bsort_compare(m, n);
+}
+
+static void test_flush_plan(void)
+{
+	PMBD_BSORT_ENTRY_T se[8];
+	PBN_T pbns[8] = {9, 3, 4, 20, 5, 10, 1, 21};
+	PBN_T first = 0;
+	PBN_T last = 0;
+	unsigned long i = 0;
+	int n;
+
+	for (n = 0; n < 8; n ++){
+		se[n].bbn = n;
+		se[n].pbn = pbns[n];
+	}
+
+	pmbd_bsort_swap(&se[0], &se[1], sizeof(se[0]));
+	CHECK(se[0].pbn == 3 && se[0].bbn == 1 && se[1].pbn == 9 && se[1].bbn == 0);
+
+	qsort(se, 8, sizeof(se[0]), cmp_entries);
+	for (n = 1; n < 8; n ++)
+		CHECK(se[n - 1].pbn < se[n].pbn);
+
+	/* 1 | 3-5 | 9-10 | 20-21 */
+	i = pmbd_flush_next_seq(se, 8, i, &first, &last);
+	CHECK(i == 1 && first == 1 && last == 1);
+	i = pmbd_flush_next_seq(se, 8, i, &first, &last);
+	CHECK(i == 4 && first == 3 && last == 5);
+	i = pmbd_flush_next_seq(se, 8, i, &first, &last);
+	CHECK(i == 6 && first == 9 && last == 10);
+	i = pmbd_flush_next_seq(se, 8, i, &first, &last);
+	CHECK(i == 8 && first == 20 && last == 21);
+	return;
+}
+
+/*
+ * emulation arithmetic
+ */
+static void test_emulation(void)
+{
+	/* rounding */
+	CHECK(pmbd_div64_round(10, 4) == 3);
+	CHECK(pmbd_div64_round(9, 4) == 2);
+	CHECK(pmbd_div64_round(10, 0) == 0);
+
+	/* 2GHz */
+	CHECK(pmbd_cycle_to_ns(2000, 2000000) == 1000);
+
+	/* 4KB at 1024MB/s: 4096 * (10^9 >> 20) / 1024 */
+	CHECK(pmbd_trans_time(8, 1024) == 3812);
+	CHECK(pmbd_trans_time(8, 0) == 0);
+
+	/* bandwidth shares */
+	CHECK(pmbd_bw_share(0, 10, 20, 2) == 0);
+	CHECK(pmbd_bw_share(1000, 10, 40, 2) == 250);
+	CHECK(pmbd_bw_share(1000, 0, 40, 3) == 250);
+	CHECK(pmbd_bw_share(1000, 0, 0, 0) == 1000);
+	CHECK(pmbd_bw_share(1000, 1, 1000000, 2) == 1);
+	return;
+}
+
+/*
+ * buffer admission
+ */
+static void test_admission(void)
+{
+	PMBD_STREAM_T slots[2];
+	uint64_t table[64];
+	PMBD_SKETCH_T sk;
+	uint64_t key;
+	unsigned hot;
+
+	/* two interleaved streams are both tracked */
+	memset(slots, 0, sizeof(slots));
+	CHECK(pmbd_stream_update(slots, 2, 1000, 8) == 8);
+	CHECK(pmbd_stream_update(slots, 2, 5000, 8) == 8);
+	CHECK(pmbd_stream_update(slots, 2, 1008, 8) == 16);
+	CHECK(pmbd_stream_update(slots, 2, 5008, 16) == 24);
+	CHECK(pmbd_stream_update(slots, 2, 1016, 8) == 24);
+
+	/* a third one drops the least recently written (5000) */
+	CHECK(pmbd_stream_update(slots, 2, 9000, 8) == 8);
+	CHECK(pmbd_stream_update(slots, 2, 5024, 8) == 8);
+	CHECK(pmbd_stream_update(slots, 2, 9008, 8) == 16);
+
+	/* the sketch counts, saturates and ages */
+	memset(table, 0, sizeof(table));
+	memset(&sk, 0, sizeof(sk));
+	sk.table = table;
+	sk.mask = 63;
+	sk.sample = 1000000;
+	CHECK(pmbd_sketch_estimate(&sk, 42) == 0);
+	CHECK(pmbd_sketch_add(&sk, 42) == 1);
+	CHECK(pmbd_sketch_add(&sk, 42) == 2);
+	CHECK(pmbd_sketch_estimate(&sk, 42) == 2);
+	for (hot = 0; hot < 20; hot ++)
+		pmbd_sketch_add(&sk, 7);
+	CHECK(pmbd_sketch_estimate(&sk, 7) == PMBD_SKETCH_MAX);
+	pmbd_sketch_age(&sk);
+	CHECK(pmbd_sketch_estimate(&sk, 7) == PMBD_SKETCH_MAX / 2);
+	CHECK(pmbd_sketch_estimate(&sk, 42) == 1);
+
+	/* one-off keys do not look rewritten (1024 counters, 200 keys) */
+	hot = 0;
+	for (key = 1000; key < 1200; key ++)
+		if (pmbd_sketch_add(&sk, key) >= 2)
+			hot ++;
+	CHECK(hot < 10);
+
+	/* aging kicks in after sample additions */
+	sk.sample = 4;
+	atomic64_set(&sk.adds, 0);
+	pmbd_sketch_add(&sk, 42);
+	pmbd_sketch_add(&sk, 42);
+	pmbd_sketch_add(&sk, 42);
+	CHECK(atomic64_read(&sk.adds) == 3);
+	pmbd_sketch_add(&sk, 42);
+	CHECK(atomic64_read(&sk.adds) == 0);
+	return;
+}
+
+/*
+ * banked timing model
+ */
+static void test_bank_model(void)
+{
+	PMBD_BANK_T banks[4];
+	uint64_t wq[2];
+	PMBD_BANK_MODEL_T m;
+
+	memset(&m, 0, sizeof(m));
+	memset(banks, 0, sizeof(banks));
+	memset(wq, 0, sizeof(wq));
+	m.banks = banks;
+	m.num_banks = 4;
+	m.row_shift = 10;	/* 1KB rows */
+	m.t_hit[0] = 20;
+	m.t_hit[1] = 40;
+	m.t_miss[0] = 100;
+	m.t_miss[1] = 400;
+
+	/* row buffer miss, then hit */
+	CHECK(pmbd_bank_access(&m, 0, 0, 512, 0) == 100);
+	CHECK(pmbd_bank_access(&m, 100, 512, 512, 0) == 120);
+
+	/* 4 rows on 4 banks in parallel */
+	CHECK(pmbd_bank_access(&m, 1000, 4096, 4096, 0) == 1100);
+
+	/* 2 rows on the same bank (0 and 4) one after the other */
+	CHECK(pmbd_bank_access(&m, 2000, 8192, 1024, 0) == 2100);
+	CHECK(pmbd_bank_access(&m, 2000, 12288, 1024, 0) == 2200);
+
+	/* no write queue: a write waits for the bank */
+	CHECK(pmbd_bank_access(&m, 3000, 0, 1024, 1) == 3400);
+
+	/* a write queue of 2: the third write to a busy bank stalls */
+	m.wq = wq;
+	m.wq_depth = 2;
+	CHECK(pmbd_bank_access(&m, 4000, 4096, 1024, 1) == 4000);	/* drained at 4400 */
+	CHECK(pmbd_bank_access(&m, 4000, 8192, 1024, 1) == 4000);	/* drained at 4800 */
+	CHECK(pmbd_bank_access(&m, 4000, 12288, 1024, 1) == 4400);	/* drained at 5200 */
+
+	/* a read waits for the queued writes of its bank (row 3 is open) */
+	CHECK(pmbd_bank_access(&m, 4400, 12288, 512, 0) == 5220);
+	return;
+}
+
+/*
+ * checksum benchmark
+ */
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_checksum(void)
+{
+	const char* names[] = {"CRC32", "CRC32C", "XXH64"};
+	size_t size = 4096;
+	size_t total = 256UL << 20;
+	unsigned char* buf = malloc(size);
+	volatile PMBD_CHECKSUM_T sink = 0;
+	unsigned alg;
+	size_t i;
+
+	if (!buf)
+		return;
+	for (i = 0; i < size; i ++)
+		buf[i] = (unsigned char) i;
+
+	for (alg = PMBD_CSALG_CRC32; alg <= PMBD_CSALG_XXH64; alg ++){
+		double start, end;
+		if (alg == PMBD_CSALG_CRC32C && !__builtin_cpu_supports("sse4.2"))
+			continue;
+		start = now_sec();
+		for (i = 0; i < total; i += size)
+			sink ^= pmbd_checksum_calc(alg, buf, size);
+		end = now_sec();
+		printf("bench: %-6s %8.1f MB/s\n", names[alg], (total >> 20) / (end - start));
+	}
+	(void) sink;
+	free(buf);
+	return;
+}
+
+int main(int argc, char** argv)
+{
+	test_checksum();
+	test_verify();
+	test_line_mask();
+	test_flush_plan();
+	test_admission();
+	test_emulation();
+	test_bank_model();
+
+	printf("pmbd_core_test: %d passed, %d failed\n", passed, failed);
+
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+		bench_checksum();
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,7389 @@
+/*
+ * Intel Persistent Memory Block Driver
+ * Copyright (c) <2011-2013>, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* 
+ * Intel Persistent Memory Block Driver (v0.9)
+ *
+ * Parts derived with changes from drivers/block/brd.c, lib/crc32.c, and
+ * arch/x86/lib/mmx_32.c
+ *
+ * Intel Corporation <linux-pmbd@intel.com>
+ * 03/24/2011
+ */
+
+
+/*
+ *******************************************************************************
+ * Persistent Memory Block Device Driver
+ *
+ * USAGE:
+ *  % sudo modprobe pmbd mode="pmbd<#>;hmo<#>;hms<#>;[OPTION1];[OPTION2];..>"
+ *
+ * GENERAL OPTIONS:
+ *  - pmbd<#,..>:    a sequence of integer numbers setting PMBD device sizes (in
+ *                   units of GBs). For example, mode="pmbd4,1" means creating a
+ *                   4GB and a 1GB PMBD device (/dev/pma and /dev/pmb).
+ *
+ *  - HM|VM:         choose two types of PMBD devices
+ *                   - VM:  vmalloc() based 
+ *                   - HM:  HIGH_MEM based (default)
+ *                   - In /boot/grub/grub.conf, add "mem=<n>G memmap=<m>G$<n>G" 
+ *                    to reserve the high m GBs for PM, starting from offset n 
+ *                    GBs in physical memory
+ *
+ *  - hmo<#>:        if HM is set, setting the starting physical mem address 
+ *                   (in units of GBs).
+ *
+ *  - hms<#>:        if HM is set, setting the remapping memory size (in GBs)
+ *
+ *  - pmap<Y|N>      set private mapping (Y) or not (N default). using 
+ *                   pmap_atomic_range() to dynamically map/unmap the 
+ *                   to-be-accessed PM pages for protection purpose. 
+ *                   This option must work with HM enabled. In the Linux boot 
+ *                   option, "mem" option must be removed.
+ *
+ *  - hugemap<Y|N>   fail to load (Y) unless the HM space is mapped with
+ *                   2MB/1GB pages, or only report the page sizes (N default)
+ *
+ *  - nts<Y|N>       set non-temporal store/sfence (Y) or not (N default). 
+ *
+ *  - wb<Y|N>:       use write barrier (Y) or not (N default)
+ *
+ *  - fua<Y|N>       use WRITE_FUA (Y default) or not (N) (only effective for
+ *                   Linux 3.2.1)
+ *
+ * SIMULATION OPTIONS:
+ *
+ *  - simmode<#,#..> set the simulation mode for each PMBD device
+ *                   - 0 for simulating the whole device 
+ *                   - 1 for simulating the PM space only
+ *                   Note that simulating the PM space may cause some system 
+ *                   warning of soft lockup. To disable it, add nonsoftlockup 
+ *                   in the boot options.
+ *
+ *  - rdlat<#,#..>:  a sequence of integer numbers setting emulated read 
+ *                   latencies (in units of nanoseconds) for reading each 
+ *                   sector. Each number is corresponding to a device. Default
+ *                   value is 0. 
+ *
+ *  - wrlat<#,#..>:  set emulated write access latencies (see rdlat)
+ *
+ *  - rdbw<#,#..>:   a sequence of integer numbers setting emulated read 
+ *                   bandwidth (in units of MB/sec) for reading each sector. 
+ *                   Each number corresponds to a device. Default value is 0;
+ *
+ *  - wrbw<#,#..>:   set emulated write bandwidth (see rdbw)
+ *
+ *  - rdsx<#,#..>:   set the slowdown ratio (x) for reads as compared to DRAM
+ *
+ *  - wrsx<#,#..>:   set the slowdown ratio (x) for writes as compared to DRAM
+ *
+ *  - rdpause<#,#..>: set the injected delay (cycles per page) for read (not
+ *                   for emulation, just inject latencies for each read per page)
+ *
+ *  - wrpause<#,#..>: set the injected delay (cycles per page) for write (not for 
+ *                   emulation, just inject latencies for each read per page).
+ *
+ *  - banks<#,#..>:  use the banked timing model with # banks (default: 0, the
+ *                   flat model). PM is interleaved over the banks by rows of
+ *                   1KB, rdlat/wrlat are the row buffer miss latencies
+ *
+ *  - rowhit<#,#..>: the row buffer hit latency (ns) of the banked model
+ *                   (default: 20)
+ *
+ *  - wqsize<#,#..>: the write queue entries of the banked model (default: 32,
+ *                   0 means writes wait for the banks)
+ *
+ *  - defer<Y|N>:    complete the requests from a high-resolution timer at
+ *                   their emulated finish time, rather than busy waiting
+ *                   (default: N, simmode0 and blk-mq only)
+ *
+ *  - adj<#>:        offset the overhead with estimated system overhead. Default 
+ *                   is 4us, however, this could vary system by system.
+ *
+ * WRITE PROTECTION:
+ *
+ *  - wrprot<Y|N>:   provide write protection on PM space by setting page
+ *                   read-only (default: N). This option is incompatible with pmap.
+ *
+ *  - wpmode<#,#,..> write protection mode: use the PTE change (0 default),
+ *                   switch CR0/WP bit (1), or write through a per-CPU private
+ *                   writable window (2). With HM mapped by 2MB/1GB pages, 0
+ *                   is turned into 2, so the large pages stay intact
+ *
+ *  - wrverify<Y|N>: read out the data for verification after writing into PM
+ *                   space. A mismatch fails the request with an I/O error
+ *                   and is counted (num_verify_errors in pmbdstat)
+ *
+ *  - vfysample<#>:  verify only 1 of every # pages written (default: 1, all
+ *                   pages)
+ *
+ *  - vfyrand<Y|N>:  pick the pages to verify at random, with a 1 in # chance,
+ *                   rather than every #th page (default: N)
+ *
+ *  - clflush<Y|N>:  flush CPU cache or not (default: N) 
+ *                   (with clwb or clflushopt if the CPU supports them)
+ *
+ *  - wbinvd<#>:     without nts and clflush (WB), the write barrier writes
+ *                   back only the ranges written since the last barrier, or
+ *                   the entire CPU cache (wbinvd) if more than # MBs were
+ *                   written (default: 16, 0 means always wbinvd)
+ *
+ *  - checksum<Y|N>: use checksum to provide further protection from data
+ *                   corruption (default: N). The checksums are stored in
+ *                   PM, in an area carved from the top of the reserved
+ *                   space (allocated only if enabled)
+ *
+ *  - csalg<CRC32|CRC32C|XXH64>: the checksum algorithm (default: CRC32).
+ *                   CRC32C uses the SSE4.2 crc32 instruction and falls back
+ *                   to CRC32 if the CPU does not support it
+ *
+ *  - cslazy<Y|N>:   verify the checksum of a page on its first read since
+ *                   loading only, later reads of the page skip it until it
+ *                   is written again (default: Y)
+ *
+ *  - lock<Y|N>:     lock the on-access PM page to serialize accesses (default: Y)
+ *
+ *  - bufsize<#,#,#.#...>  -- the buffer size in MBs (for speeding up write
+ *                   protection) 0 means no buffer, minimum size is 16 MBs
+ *
+ *  - bufnum<#>      the number of buffers for a pmbd device (16 buffers, at
+ *                   least 1 if using buffering, 0 will disable buffer mode,
+ *                   at most 4 per CPU)
+ *
+ *  - bufstride<#>   the number of contiguous blocks(4KB) mapped into one
+ *                   buffer (the bucket size for round-robin mapping) (1024 in default)
+ *
+ *  - batch<#,#>     the batch size (num of pages) for flushing PMBD buffer (1
+ *                   means no batching)
+ *
+ *  - admit<Y|N>     admit only the small or rewritten writes into the buffer;
+ *                   sequential streams and cold writes go directly to PM with
+ *                   non-temporal stores (default: N)
+ *
+ *  - admitseq<#>    with admitY, a sequential write stream of # KBs from a
+ *                   CPU bypasses the buffer (default: 512)
+ *
+ *  - admitsmall<#>  with admitY, writes up to # KBs are always admitted
+ *                   (default: 16)
+ *
+ * MISC OPTIONS:
+ *
+ *  - subupdate<Y|N> only update changed cachelines of a page (check
+ *                   PMBD_CACHELINE_SIZE, default: N)
+ *
+ *  - mgb<Y|N>:      setting mergeable or not (default: Y)
+ *
+ *  - cache<WB|WC|UM|UC>:
+ *  		     WB -- write back (both read/write cache used)
+ *  		     WC -- write combined (write through but cachable)
+ *  		     UM -- uncachable but write back 
+ *  		     UC -- write through and uncachable
+ *
+ *  - timestat<Y|N> enable the detailed timing statistics (/proc/pmbd/pmbdstat) or
+ *                  not (default: N). This will cause significant performance loss. 
+ *
+ *  - trace<Y|N>:    log each request (time, sector, size, flags) into per-CPU
+ *                   rings exported by /dev/pmbd_trace (default: N). See
+ *                   pmbd_replay.c to capture and replay the trace.
+ *
+ * EXAMPLE:
+ *  mode="pmbd2,1;rdlat100,2000;wrlat500,4000;rdbw100,100;wrbw100,100;HM;hmo4;hms3;
+ *  mgbY;flushY;cacheWB;wrprotY;wrverifyY;checksumY;lockY;rammode0,1;bufsize16,0;
+ *  subupdateY;"
+ *
+ *  Explanation: Create two PMBD devices, /dev/pma (2GB) and /dev/pmb (1GB).
+ *  Insert 100ns and 500ns for reading and writing a sector to /dev/pma,
+ *  respectively.  Insert 2000ns and 4000ns for reading and writing a sector
+ *  to /dev/pmb.  Make the read/write bandwidth for both devices 100MB/sec.
+ *  No system overhead adjustment is applied.  We use 3GB high memory for the
+ *  PMBD devices, starting from 4GB physical memory address. Make it
+ *  mergeable, use writeback and flush CPU cache for the PM space, use write
+ *  protection for PM space by setting PM space read-only, verify each
+ *  write by reading out written data, use checksum to protect PM space, use
+ *  spinlock to protect from corruption caused by concurrent accesses, the
+ *  first device is applied without write protection, the second device is
+ *  applied with write protection, and use sub-page updates.
+ *
+ * SYSFS:
+ *  The options above are the settings at load. The emulation and buffer
+ *  settings of a device can be changed afterwards in /sys/block/<dev>/pmbd/
+ *  (see "Per-device configuration").
+ *
+ * NOTE:
+ *  - We can create no more than 26 devices, 4 partitions each. 
+ *
+ * FIXME: 
+ *  (1) We use an unoccupied major device num (261) temporarily
+ *******************************************************************************
+ */
+
+#include <linux/init.h>
+#include <linux/version.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/major.h>
+#include <linux/blkdev.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+#include <linux/blk-mq.h>
+#endif
+#include <linux/bio.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0)
+#include <linux/uaccess.h>
+#else
+#include <asm/uaccess.h>
+#endif
+#include <linux/time.h>
+#include <asm/timer.h>
+#include <linux/cpufreq.h>
+#include <linux/crc32.h>
+#include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/sort.h>
+#include <linux/rbtree.h>
+#include <linux/bit_spinlock.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/timex.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/highmem.h>
+#include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <asm/tlbflush.h>
+#include <asm/cacheflush.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+#include <asm/fpu/api.h>
+#else
+#include <asm/i387.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+#include <asm/set_memory.h>
+#endif
+
+#include <asm/asm.h>
+#include "pmbd.h"
+#include "pmbd_trace.h"
+
+
+/* device configs  */
+static int max_part = 4;					/* maximum num of partitions */
+static int part_shift = 0;					/* partition shift */
+static LIST_HEAD(pmbd_devices);					/* device list */
+static DEFINE_MUTEX(pmbd_devices_mutex);				/* device mutex */
+
+/* /proc file system entry */
+static struct proc_dir_entry* proc_pmbd = NULL;
+static struct proc_dir_entry* proc_pmbdstat = NULL;
+static struct proc_dir_entry* proc_pmbdcfg = NULL;
+
+/* debugfs entry (/sys/kernel/debug/pmbd) */
+static struct dentry* pmbd_debugfs_root = NULL;
+
+/* pmbd device default configuration */
+static unsigned g_pmbd_type 		= PMBD_CONFIG_HIGHMEM;	/* vmalloc(PMBD_CONFIG_VMALLOC) or reserve highmem (PMBD_CONFIG_HIGHMEM default) */
+static unsigned g_pmbd_pmap		= FALSE;		/* use pmap_atomic() to map/unmap space on demand  */
+static unsigned g_pmbd_nts		= FALSE;		/* use non-temporal store (movntq) */
+static unsigned g_pmbd_wb		= FALSE;		/* use write barrier */
+static unsigned g_pmbd_fua		= TRUE;			/* use fua support (Linux 3.2.1) */
+static unsigned g_pmbd_mergeable 	= TRUE;			/* mergeable or not  */
+static unsigned g_pmbd_cpu_cache_clflush= FALSE;	 	/* flush CPU cache or not*/
+static unsigned g_pmbd_flush_insn	= PMBD_FLUSH_CLFLUSH;	/* cache line flush instruction (detected at load time) */
+static unsigned long long g_pmbd_wbinvd_threshold = 16;		/* MBs written since the last barrier to flush the entire CPU cache */
+static unsigned g_pmbd_wr_protect	= FALSE;		/* flip PTE R/W bits for write protection */
+static unsigned g_pmbd_wr_verify	= FALSE;		/* read out written data for verification */
+static unsigned g_pmbd_verify_sample	= 1;			/* verify 1 of every N pages */
+static unsigned g_pmbd_verify_rand	= FALSE;		/* pick the verified pages at random */
+static unsigned g_pmbd_verify_engine	= PMBD_VERIFY_MEMCMP;	/* compare engine (detected at load time) */
+static unsigned g_pmbd_checksum		= FALSE;		/* do checksum on PM data */
+static unsigned g_pmbd_csalg		= PMBD_CSALG_CRC32;	/* checksum algorithm */
+static unsigned g_pmbd_cslazy		= TRUE;			/* verify each page once since loading */
+static unsigned g_pmbd_lock		= TRUE;			/* do spinlock on accessing a PM page */
+static unsigned g_pmbd_subpage_update	= FALSE;		/* do subpage update (only write changed content) */
+static unsigned g_pmbd_timestat		= FALSE;		/* do a detailed timestamp breakdown statistics */
+static unsigned g_pmbd_ntl		= FALSE;		/* use non-temporal load (movntdqa)*/
+static unsigned g_pmbd_defer		= FALSE;		/* complete requests from hrtimers at the emulated finish time */
+static unsigned g_pmbd_trace		= FALSE;		/* log the requests to /dev/pmbd_trace */
+static unsigned long g_pmbd_cpu_cache_flag = PMBD_PAGE_CACHE_WB;	/* CPU cache flag (default - write back) */
+
+/* high memory configs */
+static unsigned long 	g_highmem_size = 0; 			/* size of the reserved physical mem space (bytes) */
+static phys_addr_t 	g_highmem_phys_addr = 0;		/* beginning of the reserved phy mem space (bytes)*/
+static void* 		g_highmem_virt_addr = NULL;		/* beginning of the reserve HIGH_MEM space */
+static void* 		g_highmem_curr_addr = NULL;		/* beginning of the available HIGH_MEM space for alloc*/ 
+static void* 		g_highmem_top_addr = NULL;		/* end of the available HIGH_MEM space (checksum areas are below) */
+static unsigned long	g_highmem_map_size = 0;			/* the smallest page size of the HIGH_MEM mapping (bytes) */
+static unsigned long	g_highmem_map_large = 0;		/* the num of 2MB/1GB pages of the HIGH_MEM mapping */
+static unsigned		g_highmem_hugemap = FALSE;		/* require 2MB/1GB pages for the HIGH_MEM mapping */
+
+/* module parameters */
+static unsigned g_pmbd_nr = 0;					/* num of PMBD devices */
+static unsigned long long g_pmbd_size[PMBD_MAX_NUM_DEVICES];	/* PMBD device sizes in units of GBs */
+static unsigned long long g_pmbd_rdlat[PMBD_MAX_NUM_DEVICES]; 	/* access latency for read (nanosecs) */
+static unsigned long long g_pmbd_wrlat[PMBD_MAX_NUM_DEVICES]; 	/* access latency for write nanosecs) */
+static unsigned long long g_pmbd_rdbw[PMBD_MAX_NUM_DEVICES]; 	/* bandwidth for read (MB/sec) */
+static unsigned long long g_pmbd_wrbw[PMBD_MAX_NUM_DEVICES]; 	/* bandwidth for write (MB/sec)*/
+static unsigned long long g_pmbd_rdsx[PMBD_MAX_NUM_DEVICES]; 	/* read slowdown (x) */
+static unsigned long long g_pmbd_wrsx[PMBD_MAX_NUM_DEVICES]; 	/* write slowdown (x)*/
+static unsigned long long g_pmbd_rdpause[PMBD_MAX_NUM_DEVICES];	/* read pause (cycles per page) */
+static unsigned long long g_pmbd_wrpause[PMBD_MAX_NUM_DEVICES];	/* write pause (cycles per page)*/
+static unsigned long long g_pmbd_simmode[PMBD_MAX_NUM_DEVICES];	/* simulating PM space (1) or the whole device (0 default) */
+static unsigned long long g_pmbd_adjust_ns = 0;			/* nanosec of adjustment to offset system overhead */
+static unsigned long long g_pmbd_rammode[PMBD_MAX_NUM_DEVICES];	/* do write optimization or not */
+static unsigned long long g_pmbd_bufsize[PMBD_MAX_NUM_DEVICES];	/* the buffer size (in MBs) */
+static unsigned long long g_pmbd_buffer_batch_size[PMBD_MAX_NUM_DEVICES]; /* the batch size (num of pages) for flushing PMBD buffer */
+static unsigned long long g_pmbd_banks[PMBD_MAX_NUM_DEVICES];	/* num of banks of the banked timing model (0 - flat model) */
+static unsigned long long g_pmbd_rowhit[PMBD_MAX_NUM_DEVICES];	/* row buffer hit latency (nanosecs) */
+static unsigned long long g_pmbd_wqsize[PMBD_MAX_NUM_DEVICES];	/* write queue entries (0 - writes wait for the banks) */
+static unsigned long long g_pmbd_wpmode[PMBD_MAX_NUM_DEVICES];	/* write protection mode: PTE change (0 default) and CR0 Switch (1)*/
+
+static unsigned long long g_pmbd_num_buffers = 0;		/* number of individual buffers */
+static unsigned long long g_pmbd_buffer_stride = 1024;		/* number of contiguous PBNs belonging to the same buffer */
+static unsigned g_pmbd_admit		= FALSE;		/* bypass the buffer for streaming and cold writes */
+static unsigned long long g_pmbd_admit_seq = PMBD_ADMIT_SEQ_DEFAULT;	/* KBs of a sequential stream to bypass the buffer */
+static unsigned long long g_pmbd_admit_small = PMBD_ADMIT_SMALL_DEFAULT;/* KBs of a write always admitted */
+
+/* definition of functions */
+static inline uint64_t cycle_to_ns(uint64_t cycle);
+static inline void sync_slowdown_cycles(uint64_t cycles);
+static uint64_t emul_start(PMBD_DEVICE_T* pmbd, int num_sectors, int rw);
+static uint64_t emul_end(PMBD_DEVICE_T* pmbd, PMBD_EMUL_CTX_T* ctx, sector_t sector, int num_sectors, int rw, uint64_t start);
+static void emul_cks_read(PMBD_DEVICE_T* pmbd, PMBD_EMUL_CTX_T* ctx, size_t bytes);
+
+/*
+ * *************************************************************************
+ * parse module parameters functions
+ * *************************************************************************
+ */
+static char *mode = ""; 
+module_param(mode, charp, 444);
+MODULE_PARM_DESC(mode, USAGE_INFO);
+
+/* print pmbd configuration info */
+static void pmbd_print_conf(void)
+{
+	int i;
+#ifndef CONFIG_X86
+	printk(KERN_INFO "pmbd: running on a non-x86 platform, check ioremap()...\n");
+#endif
+	printk(KERN_INFO "pmbd: cacheline_size=%d\n", PMBD_CACHELINE_SIZE);
+	printk(KERN_INFO "pmbd: PMBD_SECTOR_SIZE=%lu, PMBD_PAGE_SIZE=%lu\n", PMBD_SECTOR_SIZE, PMBD_PAGE_SIZE);
+	printk(KERN_INFO "pmbd: g_pmbd_type = %s\n", PMBD_USE_VMALLOC()? "VMALLOC" : "HIGH_MEM");
+	printk(KERN_INFO "pmbd: g_pmbd_mergeable = %s\n", PMBD_IS_MERGEABLE()? "YES" : "NO");
+	printk(KERN_INFO "pmbd: g_pmbd_cpu_cache_clflush = %s\n", PMBD_USE_CLFLUSH()? "YES" : "NO");
+	printk(KERN_INFO "pmbd: g_pmbd_flush_insn = %s\n", PMBD_FLUSH_INSN_NAME());
+	printk(KERN_INFO "pmbd: g_pmbd_wbinvd_threshold = %llu MB (dirty log %s)\n", g_pmbd_wbinvd_threshold, PMBD_USE_DIRTY_LOG()? "YES" : "NO");
+	printk(KERN_INFO "pmbd: g_pmbd_cpu_cache_flag = %s\n", PMBD_CPU_CACHE_FLAG());
+	printk(KERN_INFO "pmbd: g_pmbd_wr_protect = %s\n", PMBD_USE_WRITE_PROTECTION()? "YES" : "NO");
+	printk(KERN_INFO "pmbd: g_pmbd_wr_verify = %s (1 of %u pages%s, %s)\n", PMBD_USE_WRITE_VERIFICATION()? "YES" : "NO",
+			g_pmbd_verify_sample, g_pmbd_verify_rand ? " at random" : "", PMBD_VERIFY_ENGINE_NAME());
+	printk(KERN_INFO "pmbd: g_pmbd_checksum = %s\n", PMBD_USE_CHECKSUM()? "YES" : "NO");
+	printk(KERN_INFO "pmbd: g_pmbd_csalg = %s\n", PMBD_CSALG_NAME());
+	printk(KERN_INFO "pmbd: g_pmbd_cslazy = %s\n", PMBD_USE_CSLAZY()? "YES" : "NO");
+	printk(KERN_INFO "pmbd: g_pmbd_lock = %s\n", PMBD_USE_LOCK()? "YES" : "NO");
+	printk(KERN_INFO "pmbd: g_pmbd_subpage_update = %s\n", PMBD_USE_SUBPAGE_UPDATE()? "YES" : "NO");
+	printk(KERN_INFO "pmbd: g_pmbd_adjust_ns = %llu ns\n", g_pmbd_adjust_ns);
+	printk(KERN_INFO "pmbd: g_pmbd_num_buffers = %llu\n", g_pmbd_num_buffers);
+	printk(KERN_INFO "pmbd: g_pmbd_buffer_stride = %llu blocks\n", g_pmbd_buffer_stride);
+	printk(KERN_INFO "pmbd: g_pmbd_admit = %s (stream %llu KB, small %llu KB)\n", PMBD_USE_ADMIT()? "YES" : "NO",
+			g_pmbd_admit_seq, g_pmbd_admit_small);
+	printk(KERN_INFO "pmbd: g_pmbd_timestat = %u \n", g_pmbd_timestat);
+	printk(KERN_INFO "pmbd: g_pmbd_defer = %s\n", PMBD_USE_DEFER()? "YES" : "NO");
+	printk(KERN_INFO "pmbd: g_pmbd_trace = %s\n", PMBD_USE_TRACE()? "YES" : "NO");
+	printk(KERN_INFO "pmbd: HIGHMEM offset [%llu] size [%lu] Private Mapping (%s) (%s) (%s) Write Barrier(%s) FUA(%s)\n", 
+			g_highmem_phys_addr, g_highmem_size, (PMBD_USE_PMAP()? "Enabled" : "Disabled"), 
+			(PMBD_USE_NTS()? "Non-Temporal Store":"Temporal Store"),	
+			(PMBD_USE_NTL()? "Non-Temporal Load":"Temporal Load"),	
+			(PMBD_USE_WB()? "Enabled": "Disabled"),
+			(PMBD_USE_FUA()? "Enabled":"Disabled"));
+
+	/* for each pmbd device */
+	for (i = 0; i < g_pmbd_nr; i ++) {
+		printk(KERN_INFO "pmbd: /dev/pm%c (%d)[%llu GB] read[%llu ns %llu MB/sec (%llux) (pause %llu cyc/pg)] write[%llu ns %llu MB/sec (%llux) (pause %llu cyc/pg)] [%s] [Buf: %llu MBs, batch %llu pages] [%s] [%s]\n", 
+			'a'+i, i, g_pmbd_size[i], g_pmbd_rdlat[i], g_pmbd_rdbw[i], g_pmbd_rdsx[i], g_pmbd_rdpause[i], g_pmbd_wrlat[i], g_pmbd_wrbw[i], g_pmbd_wrsx[i], g_pmbd_wrpause[i],\
+			(g_pmbd_rammode[i] ? "RAM" : "PMBD"), g_pmbd_bufsize[i], g_pmbd_buffer_batch_size[i], \
+			(g_pmbd_simmode[i] ? "Simulating PM only" : "Simulating the whole device"), \
+			(PMBD_USE_PMAP() ? "PMAP" : (g_pmbd_wpmode[i] == 2 ? "WP-WINDOW" : (g_pmbd_wpmode[i] ? "WP-CR0/WP" : "WP-PTE"))));
+
+		if (g_pmbd_banks[i] > 0)
+			printk(KERN_INFO "pmbd: /dev/pm%c banked timing model [%llu banks, row %u bytes, row hit %llu ns, write queue %llu]\n",
+				'a'+i, g_pmbd_banks[i], 1U << PMBD_BANK_ROW_SHIFT, g_pmbd_rowhit[i], g_pmbd_wqsize[i]);
+
+		if (g_pmbd_simmode[i] > 0){
+			printk(KERN_INFO "pmbd: ********************************* WARNING **************************************\n");
+			printk(KERN_INFO "pmbd: Using simmode%llu to simulate a slowed-down PM space may cause system soft lockup.\n", g_pmbd_simmode[i]);
+			printk(KERN_INFO "pmbd: To disable the warning message, please add \"nosoftlockup\" in the boot option. \n");
+			printk(KERN_INFO "pmbd: ********************************************************************************\n");
+		}
+	}
+
+	printk(KERN_INFO "pmbd: ****************************** WARNING ***********************************\n");
+	printk(KERN_INFO "pmbd: 1. Checksum mismatch can be detected but not handled \n");
+	printk(KERN_INFO "pmbd: 2. PMAP is incompatible with \"wrprotY\"\n");
+	printk(KERN_INFO "pmbd: **************************************************************************\n");
+
+	return;
+}
+
+/*
+ * Parse a string with config for multiple devices (e.g. mode="pmbd4,1,3;")
+ * @mode: input option string
+ * @tag:  the tag being looked for (e.g. pmbd)
+ * @data: output in an array
+ */
+static int _pmbd_parse_multi(char* mode, char* tag, unsigned long long data[])
+{
+	int nr = 0;
+	if (strlen(mode)) {
+	       	char* head = mode;
+        	char* tail = mode;
+		char* end  = mode + strlen(mode);
+       		char tmp[128];
+	
+        	if ((head = strstr(mode, tag))) {
+	        	head = head + strlen(tag);
+		        tail = head;
+			while(head < end){
+	                	int len = 0;
+
+				/* locate the position of the first non-number char */
+				for(tail = head; IS_DIGIT(*tail) && tail < end; tail++) {};
+
+				/* pick up the numbers */
+	                	len = tail - head;
+				if(len > 0) {
+					nr ++;
+					if (nr > PMBD_MAX_NUM_DEVICES) {
+						printk(KERN_ERR "pmbd: %s(%d) - too many (%d) device config for %s\n", 
+							__FUNCTION__, __LINE__, nr, tag);
+						return -1;
+					}
+		        	        strncpy(tmp, head, len); tmp[len] = '\0';
+        		        	data[nr - 1] = simple_strtoull(tmp, NULL, 0);
+				} 
+
+				/* check the next sequence of numbers */
+				for(; !IS_DIGIT(*tail) && tail < end; tail++) {
+					/* if we meet the first alpha char or space, clause ends */
+					if(IS_ALPHA(*tail) || IS_SPACE(*tail))
+						goto done;
+				};
+
+				/* move head to the next sequence of numbers */
+				head = tail;
+			}
+		}
+	}
+done:
+	return nr;
+}
+
+/*
+ * Parse a string with config for all devices (e.g. mode="adj1000")
+ * @mode: input option string
+ * @tag:  the tag being looked for (e.g. pmbd)
+ * @data: output 
+ */
+static int _pmbd_parse_single(char* mode, char* tag, unsigned long long* data)
+{
+	if (strlen(mode)) {
+	       	char* head = mode;
+        	char* tail = mode;
+       		char tmp[128];
+
+		if (strstr(mode, tag)) {
+			head = strstr(mode, tag) + strlen(tag);
+			for(tail=head; IS_DIGIT(*tail); tail++) {};
+			if(tail == head) {
+				return -1;
+			} else {
+				int len = tail - head;
+				strncpy(tmp, head, len); tmp[len] = '\0';
+				*data = simple_strtoull(tmp, NULL, 0);
+			}
+		} 
+	}
+	return 0;
+}
+
+static void load_default_conf(void)
+{
+	int i = 0;
+	for (i = 0; i < PMBD_MAX_NUM_DEVICES; i ++) {
+		g_pmbd_buffer_batch_size[i] = PMBD_BUFFER_BATCH_SIZE_DEFAULT;
+		g_pmbd_rowhit[i] = PMBD_BANK_ROWHIT_DEFAULT;
+		g_pmbd_wqsize[i] = PMBD_BANK_WQSIZE_DEFAULT;
+	}
+}
+
+/* parse the module parameters (mode) */
+static void pmbd_parse_conf(void)
+{
+	int i = 0;
+	static unsigned enforce_cache_wc = FALSE;
+
+	load_default_conf();
+
+	if (strlen(mode)) {
+		unsigned long long data = 0;
+
+		/* check pmbd size/usable */
+		if (strstr(mode, "pmbd")) {
+			if( (g_pmbd_nr = _pmbd_parse_multi(mode, "pmbd", g_pmbd_size)) <= 0)
+				goto fail;
+		} else {
+			printk(KERN_ERR "pmbd: no pmbd size set\n");
+			goto fail;
+		}
+		
+		/* rdlat/wrlat (emulated read/write latency) in nanosec */
+		if (strstr(mode, "rdlat"))
+			if (_pmbd_parse_multi(mode, "rdlat", g_pmbd_rdlat) < 0)
+				goto fail;
+		if (strstr(mode, "wrlat")) 
+			if (_pmbd_parse_multi(mode, "wrlat", g_pmbd_wrlat) < 0)
+				goto fail;
+
+		/* rdbw/wrbw (emulated read/write bandwidth) in MB/sec*/
+		if (strstr(mode, "rdbw"))
+			if (_pmbd_parse_multi(mode, "rdbw", g_pmbd_rdbw) < 0)
+				goto fail;
+		if (strstr(mode, "wrbw")) 
+			if (_pmbd_parse_multi(mode, "wrbw", g_pmbd_wrbw) < 0)
+				goto fail;
+
+		/* rdsx/wrsx (emulated read/write slowdown X) */
+		if (strstr(mode, "rdsx"))
+			if (_pmbd_parse_multi(mode, "rdsx", g_pmbd_rdsx) < 0)
+				goto fail;
+		if (strstr(mode, "wrsx")) 
+			if (_pmbd_parse_multi(mode, "wrsx", g_pmbd_wrsx) < 0)
+				goto fail;
+
+		/* rdsx/wrsx (emulated read/write slowdown X) */
+		if (strstr(mode, "rdpause"))
+			if (_pmbd_parse_multi(mode, "rdpause", g_pmbd_rdpause) < 0)
+				goto fail;
+		if (strstr(mode, "wrpause")) 
+			if (_pmbd_parse_multi(mode, "wrpause", g_pmbd_wrpause) < 0)
+				goto fail;
+
+		/* banked timing model */
+		if (strstr(mode, "banks"))
+			if (_pmbd_parse_multi(mode, "banks", g_pmbd_banks) < 0)
+				goto fail;
+		if (strstr(mode, "rowhit"))
+			if (_pmbd_parse_multi(mode, "rowhit", g_pmbd_rowhit) < 0)
+				goto fail;
+		if (strstr(mode, "wqsize"))
+			if (_pmbd_parse_multi(mode, "wqsize", g_pmbd_wqsize) < 0)
+				goto fail;
+
+		/* do write optimization */
+		if (strstr(mode, "rammode")){
+			printk(KERN_ERR "pmbd: rammode removed\n");
+			goto fail;
+			if (_pmbd_parse_multi(mode, "rammode", g_pmbd_rammode) < 0)
+				goto fail;
+		}
+
+		if (strstr(mode, "bufsize")){
+			if (_pmbd_parse_multi(mode, "bufsize", g_pmbd_bufsize) < 0)
+				goto fail;
+			for (i = 0; i < PMBD_MAX_NUM_DEVICES; i ++) {
+				if (g_pmbd_bufsize[i] > 0 && g_pmbd_bufsize[i] < PMBD_BUFFER_MIN_BUFSIZE){
+					printk(KERN_ERR "pmbd: bufsize cannot be smaller than %d MBs. Setting 0 to disable PMBD buffer.\n", PMBD_BUFFER_MIN_BUFSIZE);
+					goto fail;
+				}
+			}
+		}
+
+		/* numbuf and bufstride*/
+		if (strstr(mode, "bufnum")) { 
+			if(_pmbd_parse_single(mode, "bufnum", &data) < 0) {
+				printk(KERN_ERR "pmbd: incorrect bufnum (must be at least 1)\n");
+				goto fail;
+			} else if (data > PMBD_BUFFER_MAX_NUM) {
+				printk(KERN_ERR "pmbd: bufnum cannot be larger than %u\n", PMBD_BUFFER_MAX_NUM);
+				goto fail;
+			} else {
+				g_pmbd_num_buffers = data;
+			}
+		}
+		if (strstr(mode, "bufstride")) { 
+			if(_pmbd_parse_single(mode, "bufstride", &data) < 0) {
+				printk(KERN_ERR "pmbd: incorrect bufstride (must be at least 1)\n");
+				goto fail;
+			} else {
+				g_pmbd_buffer_stride = data;
+			}
+		}
+
+		/* buffer admission */
+		if (strstr(mode, "admitseq")) { 
+			if(_pmbd_parse_single(mode, "admitseq", &data) < 0 || data == 0) {
+				printk(KERN_ERR "pmbd: incorrect admitseq (must be at least 1)\n");
+				goto fail;
+			} else {
+				g_pmbd_admit_seq = data;
+			}
+		}
+		if (strstr(mode, "admitsmall")) { 
+			if(_pmbd_parse_single(mode, "admitsmall", &data) < 0) {
+				printk(KERN_ERR "pmbd: incorrect admitsmall\n");
+				goto fail;
+			} else {
+				g_pmbd_admit_small = data;
+			}
+		}
+
+		/* write back the entire CPU cache at a barrier if more MBs were written */
+		if (strstr(mode, "wbinvd")) { 
+			if(_pmbd_parse_single(mode, "wbinvd", &data) < 0) {
+				printk(KERN_ERR "pmbd: incorrect wbinvd\n");
+				goto fail;
+			} else {
+				g_pmbd_wbinvd_threshold = data;
+			}
+		}
+
+		/* check the nanoseconds of overhead to compensate */
+		if (strstr(mode, "adj")) { 
+			if(_pmbd_parse_single(mode, "adj", &data) < 0) {
+				printk(KERN_ERR "pmbd: incorrect adj\n");
+				goto fail;
+			} else {
+				g_pmbd_adjust_ns = data;
+			}
+		}
+
+		/* check PMBD device type */
+		if ((strstr(mode, "VM"))) {
+			g_pmbd_type = PMBD_CONFIG_VMALLOC;
+		} else if ((strstr(mode, "HM"))) {
+			g_pmbd_type = PMBD_CONFIG_HIGHMEM;
+		}
+
+		/* use pmap*/
+		if ((strstr(mode, "pmapY"))) {
+			g_pmbd_pmap = TRUE;
+		} else if ((strstr(mode, "pmapN"))) {
+			g_pmbd_pmap = FALSE;
+		} 
+		if ((strstr(mode, "PMAP"))){
+			printk("WARNING: !!! pmbd: PMAP is not supported any more (use pmapY) !!!\n");
+			goto fail;
+		}
+
+		/* require a huge page mapping of the HM space */
+		if ((strstr(mode, "hugemapY"))) {
+			g_highmem_hugemap = TRUE;
+		} else if ((strstr(mode, "hugemapN"))) {
+			g_highmem_hugemap = FALSE;
+		}
+
+		/* use nts*/
+		if ((strstr(mode, "ntsY"))) {
+			g_pmbd_nts = TRUE;
+		} else if ((strstr(mode, "ntsN"))) {
+			g_pmbd_nts = FALSE;
+		}
+		if ((strstr(mode, "NTS"))){
+			printk("WARNING: !!! pmbd: NTS is not supported any more (use ntsY) !!!\n");
+			goto fail;
+		}
+
+		/* use ntl*/
+		if ((strstr(mode, "ntlY"))) {
+			g_pmbd_ntl = TRUE;
+			enforce_cache_wc = TRUE;
+		} else if ((strstr(mode, "ntlN"))) {
+			g_pmbd_ntl = FALSE;
+		}
+
+		/* completion deferral */
+		if ((strstr(mode, "deferY"))) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+			g_pmbd_defer = TRUE;
+#else
+			printk(KERN_WARNING "pmbd: WARNING - defer is only supported with blk-mq (4.13 or later)\n");
+#endif
+		} else if ((strstr(mode, "deferN"))) {
+			g_pmbd_defer = FALSE;
+		}
+
+		/* buffer admission */
+		if ((strstr(mode, "admitY"))) {
+			g_pmbd_admit = TRUE;
+		} else if ((strstr(mode, "admitN"))) {
+			g_pmbd_admit = FALSE;
+		}
+
+		/* request trace */
+		if ((strstr(mode, "traceY"))) {
+			g_pmbd_trace = TRUE;
+		} else if ((strstr(mode, "traceN"))) {
+			g_pmbd_trace = FALSE;
+		}
+
+		/* timestat */
+		if ((strstr(mode, "timestatY"))) {
+			g_pmbd_timestat = TRUE;
+		} else if ((strstr(mode, "timestatN"))) {
+			g_pmbd_timestat = FALSE;
+		}
+
+
+		/* write barrier */
+		if ((strstr(mode, "wbY"))) {
+			g_pmbd_wb = TRUE;
+		} else if ((strstr(mode, "wbN"))) {
+			g_pmbd_wb = FALSE;
+		}
+
+		/* write barrier */
+		if ((strstr(mode, "fuaY"))) {
+			g_pmbd_fua = TRUE;
+		} else if ((strstr(mode, "fuaN"))) {
+			g_pmbd_fua = FALSE;
+		}
+
+
+		/* check if HIGH_MEM PMBD is configured */
+		if (PMBD_USE_HIGHMEM()) { 
+			if (strstr(mode, "hmo") && strstr(mode, "hms")) {
+				/* parse reserved HIGH_MEM offset */
+				if(_pmbd_parse_single(mode, "hmo", &data) < 0){
+					printk(KERN_ERR "pmbd: incorrect hmo\n");
+					g_highmem_phys_addr = 0;
+					goto fail;
+				} else {
+					g_highmem_phys_addr = data * 1024 * 1024 * 1024;
+				}
+
+				/* parse reserved HIGH_MEM size */
+				if(_pmbd_parse_single(mode, "hms", &data) < 0 || data == 0){
+					printk(KERN_ERR "pmbd: incorrect hms\n");
+					g_highmem_size = 0;
+					goto fail;
+				} else {
+					g_highmem_size = data * 1024 * 1024 * 1024;
+				} 
+			} else {
+				printk(KERN_ERR "pmbd: hmo or hms not set ***\n");
+				goto fail;
+			}
+
+
+		} 
+
+
+		/* check if mergeable */
+		if((strstr(mode,"mgbY")))
+			g_pmbd_mergeable = TRUE;
+		else if((strstr(mode,"mgbN")))
+			g_pmbd_mergeable = FALSE;
+
+		/* CPU cache flushing  */
+		if((strstr(mode,"clflushY")))
+			g_pmbd_cpu_cache_clflush = TRUE;
+		else if((strstr(mode,"clflushN")))
+			g_pmbd_cpu_cache_clflush = FALSE;
+
+		/* CPU cache setting */
+		if((strstr(mode,"cacheWB")))		/* cache write back */
+			g_pmbd_cpu_cache_flag = PMBD_PAGE_CACHE_WB;
+		else if((strstr(mode,"cacheWC")))	/* cache write combined (through) */
+			g_pmbd_cpu_cache_flag = PMBD_PAGE_CACHE_WC;
+		else if((strstr(mode,"cacheUM")))	/* cache cachable but write back */
+			g_pmbd_cpu_cache_flag = PMBD_PAGE_CACHE_UC_MINUS;
+		else if((strstr(mode,"cacheUC")))	/* cache uncablable */
+			g_pmbd_cpu_cache_flag = PMBD_PAGE_CACHE_UC;
+
+
+		/* write protectable  */
+		if((strstr(mode,"wrprotY")))
+			g_pmbd_wr_protect = TRUE;
+		else if((strstr(mode,"wrprotN")))
+			g_pmbd_wr_protect = FALSE;
+
+		/* write protectable  */
+		if((strstr(mode,"wrverifyY")))
+			g_pmbd_wr_verify = TRUE;
+		else if((strstr(mode,"wrverifyN")))
+			g_pmbd_wr_verify = FALSE;
+
+		/* write verification sampling */
+		if (strstr(mode, "vfysample")) { 
+			if(_pmbd_parse_single(mode, "vfysample", &data) < 0) {
+				printk(KERN_ERR "pmbd: incorrect vfysample\n");
+				goto fail;
+			} else {
+				g_pmbd_verify_sample = data ? data : 1;
+			}
+		}
+		if((strstr(mode,"vfyrandY")))
+			g_pmbd_verify_rand = TRUE;
+		else if((strstr(mode,"vfyrandN")))
+			g_pmbd_verify_rand = FALSE;
+
+		/* checksum  */
+		if((strstr(mode,"checksumY")))
+			g_pmbd_checksum = TRUE;
+		else if((strstr(mode,"checksumN")))
+			g_pmbd_checksum = FALSE;
+
+		/* checksum algorithm (note "csalgCRC32" is a prefix of "csalgCRC32C") */
+		if((strstr(mode,"csalgCRC32C")))
+			g_pmbd_csalg = PMBD_CSALG_CRC32C;
+		else if((strstr(mode,"csalgXXH64")))
+			g_pmbd_csalg = PMBD_CSALG_XXH64;
+		else if((strstr(mode,"csalgCRC32")))
+			g_pmbd_csalg = PMBD_CSALG_CRC32;
+
+		/* lazy checksum verification */
+		if((strstr(mode,"cslazyY")))
+			g_pmbd_cslazy = TRUE;
+		else if((strstr(mode,"cslazyN")))
+			g_pmbd_cslazy = FALSE;
+
+		/* checksum  */
+		if((strstr(mode,"lockY")))
+			g_pmbd_lock = TRUE;
+		else if((strstr(mode,"lockN")))
+			g_pmbd_lock = FALSE;
+
+		/* write protectable  */
+		if((strstr(mode,"subupdateY")))
+			g_pmbd_subpage_update = TRUE;
+		else if((strstr(mode,"subupdateN")))
+			g_pmbd_subpage_update = FALSE;
+
+
+		/* batch */
+		if (strstr(mode, "batch")){
+			if (_pmbd_parse_multi(mode, "batch", g_pmbd_buffer_batch_size) < 0)
+				goto fail;
+			/* check if any batch size is set too small */
+			for (i = 0; i < PMBD_MAX_NUM_DEVICES; i ++) {
+				if (g_pmbd_buffer_batch_size[i] < 1){
+					printk(KERN_ERR "pmbd: buffer batch size cannot be smaller than 1 page (default: 1024 pages)\n");
+					goto fail;
+				}
+			}
+		}
+
+		/* simmode */
+		if (strstr(mode, "simmode")){
+			if (_pmbd_parse_multi(mode, "simmode", g_pmbd_simmode) < 0)
+				goto fail;
+		}
+
+		/* wpmode */
+		if (strstr(mode, "wpmode")){
+			if (_pmbd_parse_multi(mode, "wpmode", g_pmbd_wpmode) < 0)
+				goto fail;
+			for (i = 0; i < PMBD_MAX_NUM_DEVICES; i ++) {
+				if (g_pmbd_wpmode[i] > 2) {
+					printk(KERN_ERR "pmbd: wpmode must be 0, 1, or 2\n");
+					goto fail;
+				}
+#if PMBD_PTE_PROTECT
+				/* CR0.WP is pinned on this kernel */
+				if (g_pmbd_wpmode[i] == 1) {
+					printk(KERN_WARNING "pmbd: WARNING - wpmode1 is not supported on this kernel - use wpmode2\n");
+					g_pmbd_wpmode[i] = 2;
+				}
+#endif
+			}
+		}
+
+	} else {
+		goto fail;
+	}
+
+	/* apply some enforced configuration */
+	if (enforce_cache_wc)	/* if ntl is used, we must use WC */
+		g_pmbd_cpu_cache_flag = PMBD_PAGE_CACHE_WC;
+
+	if (PMBD_USE_CSALG(PMBD_CSALG_CRC32C) && !PMBD_CPU_HAS_SSE42()){
+		printk(KERN_WARNING "pmbd: no SSE4.2 support - use CRC32 for checksum\n");
+		g_pmbd_csalg = PMBD_CSALG_CRC32;
+	}
+
+	/* the fastest compare engine for write verification */
+	if (PMBD_CPU_HAS_AVX2())
+		g_pmbd_verify_engine = PMBD_VERIFY_AVX2;
+	else if (PMBD_CPU_HAS_SSE41())
+		g_pmbd_verify_engine = PMBD_VERIFY_SSE41;
+	else
+		g_pmbd_verify_engine = PMBD_VERIFY_MEMCMP;
+
+	/* the best cache line flush instruction of the CPU */
+	if (PMBD_CPU_HAS_CLWB())
+		g_pmbd_flush_insn = PMBD_FLUSH_CLWB;
+	else if (PMBD_CPU_HAS_CLFLUSHOPT())
+		g_pmbd_flush_insn = PMBD_FLUSH_CLFLUSHOPT;
+	else
+		g_pmbd_flush_insn = PMBD_FLUSH_CLFLUSH;
+
+	/* Done, print input options */
+	pmbd_print_conf();
+	return;
+
+fail:
+	printk(KERN_ERR "pmbd: wrong mode config! Check modinfo\n\n");
+	g_pmbd_nr = 0;
+	return;
+}
+
+/*
+ * *****************************************************************
+ * simple emulation API functions
+ * pmbd_rdwr_pause - pause read/write for a specified cycles/page
+ * pmbd_rdwr_slowdown - slowdown read/write proportionally to DRAM 
+ * *****************************************************************/
+
+/* handle rdpause and wrpause options*/
+static void pmbd_rdwr_pause(PMBD_DEVICE_T* pmbd, size_t bytes, unsigned rw)
+{
+	uint64_t cycles = 0;
+	uint64_t time_p1, time_p2;
+
+	/* sanity check */
+	if (pmbd->rdpause == 0 && pmbd->wrpause == 0)
+		return;
+
+	/* start */
+	TIMESTAT_POINT(time_p1);
+
+	/* calculate the cycles to pause */
+	if (rw == READ && pmbd->rdpause){
+		cycles = MAX_OF((BYTE_TO_PAGE(bytes) * pmbd->rdpause), pmbd->rdpause);
+	} else if (rw == WRITE && pmbd->wrpause){
+		cycles = MAX_OF((BYTE_TO_PAGE(bytes) * pmbd->wrpause), pmbd->wrpause);
+	}
+
+	/* slow down now */
+	if (cycles)
+		sync_slowdown_cycles(cycles);
+	
+	TIMESTAT_POINT(time_p2);
+
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_pause[rw], time_p2 - time_p1);
+	}
+
+	return;
+}
+
+
+/* handle rdsx and wrsx options */
+static void pmbd_rdwr_slowdown(PMBD_DEVICE_T* pmbd, int rw, uint64_t start, uint64_t end)
+{
+	uint64_t cycles = 0;
+	uint64_t time_p1, time_p2;
+
+	/* sanity check */
+	if ( !((rw == READ && pmbd->rdsx > 1) || (rw == WRITE && pmbd->wrsx > 1)))
+		return;
+
+	if (end < start){
+		printk(KERN_WARNING "pmbd: %s(%d) end (%llu) is earlier than start (%llu)\n", \
+			__FUNCTION__, __LINE__, (unsigned long long) start, (unsigned long long)end);
+		return;
+	}
+
+	/* start */
+	TIMESTAT_POINT(time_p1);
+
+	/*FIXME: should we allow to do async slowdown? */
+	cycles = (end-start)*((rw == READ) ? (pmbd->rdsx - 1) : (pmbd->wrsx -1));
+
+	/*FIXME: should we minus a slack here (80-100cycles)? */
+	if (cycles)
+		sync_slowdown_cycles(cycles);
+
+	TIMESTAT_POINT(time_p2);
+
+	/* updating statistics */
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_slowdown[rw], time_p2 - time_p1);
+	}
+
+	return;
+}
+
+
+/* 
+ * set page's cache flags
+ * @vaddr: start virtual address
+ * @num_pages: the range size
+ */
+static void set_pages_cache_flags(unsigned long vaddr, int num_pages)
+{
+	switch (g_pmbd_cpu_cache_flag) {
+		case PMBD_PAGE_CACHE_WB:
+			printk(KERN_INFO "pmbd: set PM pages cache flags (WB)\n");
+			set_memory_wb(vaddr, num_pages);
+			break;
+		case PMBD_PAGE_CACHE_WC:
+			printk(KERN_INFO "pmbd: set PM pages cache flags (WC)\n");
+			set_memory_wc(vaddr, num_pages);
+			break;
+		case PMBD_PAGE_CACHE_UC:
+			printk(KERN_INFO "pmbd: set PM pages cache flags (UC)\n");
+			set_memory_uc(vaddr, num_pages);
+			break;
+		case PMBD_PAGE_CACHE_UC_MINUS:
+			printk(KERN_INFO "pmbd: set PM pages cache flags (UM)\n");
+			set_memory_uc(vaddr, num_pages);
+			break;
+		default:
+			set_memory_wb(vaddr, num_pages);
+			printk(KERN_WARNING "pmbd: PM page attribute is not set - use WB\n");
+			break;
+	}
+	return;
+}
+
+
+/* 
+ * *************************************************************************
+ * PMAP - Private mapping interface APIs
+ * *************************************************************************
+ *
+ * The private mapping is for providing write protection -- only when we need
+ * to access the PM page, we map it into the kernel virtual memory space, once
+ * we finish using it, we unmap it, so the spatial and temporal window left for
+ * bug attack is really small.
+ *
+ * Notes: pmap works similar to kmap_atomic*. It does the following:
+ * (1) pmap_create(): allocate a pool of PMAP_POOL_PAGES pages with vmalloc for
+ * each CPU, these pte mapping is saved to a backup place, and then be cleared
+ * to prevent accidental accesses. A CPU only uses the pages in its own pool,
+ * so no lock is needed (interrupts are disabled by the caller). 
+ * (2) pmap_atomic_range(): take the next N free pages from the current CPU's
+ * pool and load the pfns of N PM pages into their pte entries, so a whole
+ * request (up to PMAP_POOL_PAGES pages) is mapped in one step. pmap_atomic_pfn()
+ * does the same for a single pfn.
+ * (3) punmap_atomic_range(): the pte entries are cleared, but the TLB entries
+ * are NOT flushed. Pool pages are handed out in a round-robin manner, and a
+ * page is not reused before the pool wraps around, at which time the whole
+ * pool is invalidated with a batch of local invlpg. So we pay one TLB flush
+ * per PMAP_POOL_PAGES mapped pages, rather than two per page. The price is
+ * that a stale TLB entry may keep an unmapped page accessible from its
+ * private pmap address on this CPU until the pool wraps around.
+ * (4) pmap_destroy(): the saved pte mapping of the pool pages are restored, and
+ * vfree() is called to release the pages allocated through vmalloc().
+ *
+ */
+
+#define PMAP_POOL_PAGES	(64)					/* pages per CPU pool (256KB) */
+#define PMAP_MAX_POOLS	(128)					/* max num of CPU pools */
+static unsigned int 	pmap_nr_pages = 0;			/* the total number of available pages for private mapping */
+static unsigned int 	pmap_nr_pools = 0;			/* the number of CPU pools */
+static void* 		pmap_va_start = NULL;			/* the first PMAP virtual address */
+static pte_t**  	pmap_ptep = NULL;			/* the array of PTE entries */
+static unsigned long*	pmap_pfn = NULL;			/* the array of page frame numbers for restoring */
+static pgprot_t* 	pmap_prot = NULL;			/* the array of page protection fields */
+static unsigned int 	pmap_next[PMAP_MAX_POOLS];		/* the next free page in each CPU pool */
+#define PMAP_VA(IDX)	(pmap_va_start + (IDX) * PAGE_SIZE)
+#define PMAP_IDX(VA)	(((unsigned long)(VA) - (unsigned long)pmap_va_start) >> PAGE_SHIFT)
+#define PMAP_POOL_IDX(CPU, I)	((CPU) * PMAP_POOL_PAGES + (I))
+
+static inline void pmap_flush_tlb_single(unsigned long addr)
+{
+	asm volatile("invlpg (%0)" ::"r" (addr) : "memory");
+}
+
+/* 
+ * flush the TLB entries of a kernel range on all CPUs (must be called with
+ * interrupts enabled). flush_tlb_all() is not exported to modules any more,
+ * so we invalidate the range page by page with invlpg on each CPU. 
+ */
+#if PMBD_PTE_PROTECT
+static void __pmbd_flush_tlb_range(void* info)
+{
+	unsigned long* range = (unsigned long*) info;
+	unsigned long addr;
+
+	for (addr = range[0]; addr < range[1]; addr += PAGE_SIZE)
+		pmap_flush_tlb_single(addr);
+	return;
+}
+
+static void pmbd_flush_tlb_range(unsigned long start, unsigned long end)
+{
+	unsigned long range[2] = {start & PAGE_MASK, end};
+	on_each_cpu(__pmbd_flush_tlb_range, range, 1);
+	return;
+}
+#else
+static inline void pmbd_flush_tlb_range(unsigned long start, unsigned long end)
+{
+	flush_tlb_all();
+	return;
+}
+#endif
+
+/* load a pfn into a pmap entry (the entry must have been invalidated) */
+static inline void* set_pmap_pfn(unsigned long pfn, unsigned int idx)
+{
+	void* va 	= PMAP_VA(idx);
+	pte_t* ptep 	= pmap_ptep[idx];
+	pte_t new_pte 	= pfn_pte(pfn, pmap_prot[idx]);
+
+	/* update the pte entry */
+	set_pte_atomic(ptep, new_pte);
+	return va;
+}
+
+/* load a pfn into a pmap entry and flush its TLB entry */
+static inline void* update_pmap_pfn(unsigned long pfn, unsigned int idx)
+{
+	void* va = set_pmap_pfn(pfn, idx);
+
+	/* flush one single tlb */
+	pmap_flush_tlb_single((unsigned long) va);
+	return va;
+}
+
+/* clear a pmap entry (the TLB entry is flushed when the pool wraps around) */
+static inline void clear_pmap_pfn(unsigned idx)
+{
+	if (idx < pmap_nr_pages){
+
+		void* va = PMAP_VA(idx);
+		pte_t* ptep = pmap_ptep[idx];
+
+		/* clear the mapping */
+		pte_clear(NULL, (unsigned long) va, ptep);
+
+	} else {
+		panic("%s(%d) illegal pmap idx\n", __FUNCTION__, __LINE__);
+	}
+}
+
+/* get num free entries from the current CPU's pool, return the first index */
+static inline unsigned int pmap_alloc_entries(unsigned int num)
+{
+	unsigned int cpu = CUR_CPU_ID();
+	unsigned int i;
+
+	if (cpu >= pmap_nr_pools || num > PMAP_POOL_PAGES)
+		panic("%s(%d) illegal pmap request (cpu %u, %u pages)\n", __FUNCTION__, __LINE__, cpu, num);
+
+	/* wrap around: invalidate the whole pool in one batch */
+	if (pmap_next[cpu] + num > PMAP_POOL_PAGES){
+		for (i = 0; i < PMAP_POOL_PAGES; i ++)
+			pmap_flush_tlb_single((unsigned long) PMAP_VA(PMAP_POOL_IDX(cpu, i)));
+		pmap_next[cpu] = 0;
+	}
+
+	i = pmap_next[cpu];
+	pmap_next[cpu] += num;
+	return PMAP_POOL_IDX(cpu, i);
+}
+
+static int pmap_atomic_init(void)
+{
+	unsigned int i;
+
+	/* checking */
+	if (pmap_va_start)
+		panic("%s(%d) something is wrong\n", __FUNCTION__, __LINE__);
+
+	/* one pool for each possible CPU */
+	pmap_nr_pools = MIN_OF(nr_cpu_ids, PMAP_MAX_POOLS);
+	pmap_nr_pages = pmap_nr_pools * PMAP_POOL_PAGES;
+
+	/* allocate the pte backup arrays */
+	pmap_ptep = vmalloc(sizeof(pte_t*) * pmap_nr_pages);
+	pmap_pfn  = vmalloc(sizeof(unsigned long) * pmap_nr_pages);
+	pmap_prot = vmalloc(sizeof(pgprot_t) * pmap_nr_pages);
+	if (!pmap_ptep || !pmap_pfn || !pmap_prot){
+		printk(KERN_ERR "pmbd:%s(%d) pmap arrays cannot be allocated\n", __FUNCTION__, __LINE__);
+		goto fail;
+	}
+
+	/* allocate an array of dummy pages as pmap virtual addresses */
+	pmap_va_start = vmalloc(PAGE_SIZE * pmap_nr_pages);
+	if (!pmap_va_start){
+		printk(KERN_ERR "pmbd:%s(%d) pmap_va_start cannot be initialized\n", __FUNCTION__, __LINE__);
+		goto fail;
+	}
+
+	/* set pages' cache flags, this flag would be saved into pmap_prot
+	 * and will be applied together with the dynamically mapped page too (01/12/2012)*/
+	set_pages_cache_flags((unsigned long)pmap_va_start, pmap_nr_pages);
+
+	/* save the dummy pages' ptep, pfn, and prot info */	
+	printk(KERN_INFO "pmbd: saving dummy pmap entries (%u pools, %u pages)\n", pmap_nr_pools, pmap_nr_pages);
+	for (i = 0; i < pmap_nr_pages; i ++){
+		pte_t old_pte;
+		unsigned int level;
+		void* va = PMAP_VA(i);
+
+		/* get the ptep */
+		pte_t* ptep = lookup_address((unsigned long)(va), &level);
+
+		/* sanity check */
+		if (!ptep)
+			panic("%s(%d) mapping not found\n", __FUNCTION__, __LINE__);
+
+		old_pte = *ptep;
+		if (!pte_val(old_pte))
+			panic("%s(%d) invalid pte value\n", __FUNCTION__, __LINE__);
+
+		if (level != PG_LEVEL_4K)
+			panic("%s(%d) not PG_LEVEL_4K \n", __FUNCTION__, __LINE__);
+
+		/* save dummy entries */
+		pmap_ptep[i] = ptep;
+		pmap_pfn[i] = pte_pfn(old_pte);
+		pmap_prot[i] = pte_pgprot(old_pte);
+	}
+
+	/* clear the pte to make it illegal to access */
+	for (i = 0; i < pmap_nr_pages; i ++)
+		clear_pmap_pfn(i);
+	pmbd_flush_tlb_range((unsigned long) pmap_va_start, (unsigned long) PMAP_VA(pmap_nr_pages));
+
+	for (i = 0; i < pmap_nr_pools; i ++)
+		pmap_next[i] = 0;
+
+	return 0;
+
+fail:
+	if (pmap_ptep) vfree(pmap_ptep);
+	if (pmap_pfn) vfree(pmap_pfn);
+	if (pmap_prot) vfree(pmap_prot);
+	pmap_ptep = NULL;
+	pmap_pfn = NULL;
+	pmap_prot = NULL;
+	pmap_nr_pages = 0;
+	pmap_nr_pools = 0;
+	return -ENOMEM;
+}
+
+static void pmap_atomic_done(void)
+{
+	int i;
+	
+	/* restore the dummy pages' pte */
+	printk(KERN_INFO "pmbd: restoring dummy pmap entries\n");
+	for (i = 0; i < pmap_nr_pages; i ++){
+		/* restore the old pfn */
+		update_pmap_pfn(pmap_pfn[i], i);
+	}
+	pmbd_flush_tlb_range((unsigned long) pmap_va_start, (unsigned long) PMAP_VA(pmap_nr_pages));
+
+	/* free the dummy pages*/
+	if (pmap_va_start)
+		vfree(pmap_va_start);
+	else
+		panic("%s(%d): freeing dummy pages failed\n", __FUNCTION__, __LINE__);
+
+	vfree(pmap_ptep);
+	vfree(pmap_pfn);
+	vfree(pmap_prot);
+
+	pmap_va_start = NULL;
+	pmap_ptep = NULL;
+	pmap_pfn = NULL;
+	pmap_prot = NULL;
+	pmap_nr_pages = 0;
+	pmap_nr_pools = 0;
+	return;
+}
+
+/*
+ * map a range of PM pages into contiguous pmap entries of the current CPU
+ * @pmbd_va: the PM virtual address of the first page (dummy address if pmap)
+ * @num: the number of pages (at most PMAP_POOL_PAGES)
+ * return value: the private virtual address of the first page
+ */
+static void* pmap_atomic_range(PMBD_DEVICE_T* pmbd, void* pmbd_va, unsigned int num, unsigned rw)
+{
+	void* va = NULL;
+	unsigned int i, idx;
+	uint64_t time_p1 = 0;
+	uint64_t time_p2 = 0;
+
+	TIMESTAMP(time_p1);
+
+	/* disable page fault temporarily */
+	pagefault_disable();
+
+	/* load the pfns into the entries */
+	idx = pmap_alloc_entries(num);
+	for (i = 0; i < num; i ++)
+		set_pmap_pfn(pmbd_va_to_pfn(pmbd, pmbd_va + i * PAGE_SIZE), idx + i);
+	va = PMAP_VA(idx);
+
+	TIMESTAMP(time_p2);
+
+	/* update time statistics */
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_pmap[rw], time_p2 - time_p1);
+	}
+
+	return va;
+}
+
+static void punmap_atomic_range(void* va, unsigned int num, PMBD_DEVICE_T* pmbd, unsigned rw)
+{
+	unsigned int i;
+	unsigned int idx = PMAP_IDX(va);
+	uint64_t time_p1 = 0;
+	uint64_t time_p2 = 0;
+
+	TIMESTAMP(time_p1);
+
+	/* clear the mapping (TLB entries are flushed lazily) */
+	for (i = 0; i < num; i ++)
+		clear_pmap_pfn(idx + i);
+
+	/* re-enable the page fault */
+	pagefault_enable();
+
+	TIMESTAMP(time_p2);
+
+	/* update time statistics */
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_punmap[rw], time_p2 - time_p1);
+	}
+
+	return;
+}
+
+static void* pmap_atomic_pfn(unsigned long pfn, PMBD_DEVICE_T* pmbd, unsigned rw)
+{
+	void* va = NULL;
+	uint64_t time_p1 = 0;
+	uint64_t time_p2 = 0;
+
+	TIMESTAMP(time_p1);
+
+	/* disable page fault temporarily */
+	pagefault_disable();
+
+	/* change the mapping to the specified pfn*/
+	va = set_pmap_pfn(pfn, pmap_alloc_entries(1));
+
+	TIMESTAMP(time_p2);
+
+	/* update time statistics */
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_pmap[rw], time_p2 - time_p1);
+	}
+
+	return va;
+}
+
+static void punmap_atomic(void* va, PMBD_DEVICE_T* pmbd, unsigned rw)
+{
+	punmap_atomic_range(va, 1, pmbd, rw);
+	return;
+}
+
+/* create the dummy pmap space */
+static int pmap_create(void)
+{
+	return pmap_atomic_init();
+}
+
+/* destroy the dummy pmap space */
+static void pmap_destroy(void)
+{
+	if (pmap_va_start)
+		pmap_atomic_done();
+	return;
+}
+
+/*
+ * *************************************************************************
+ * Non-temporal memcpy 
+ * *************************************************************************
+ * Non-temporal memcpy does the following:
+ * (1) use movntq to copy into PM space
+ * (2) use sfence to flush the data to memory controller
+ * 
+ * Compared to regular temporal memcpy, it provides several benefits here:
+ * (1) writes to PM bypass the CPU cache, which avoids polluting CPU cache
+ * (2) reads from PM still benefit from the CPU cache
+ * (3) sfence used for each write guarantees data will be flushed out of buffer
+ */
+
+static void nts_memcpy_64bytes_v2(void* to, void* from, size_t size)
+{
+	int i;
+	unsigned bs = 64;	/* write unit size 8 bytes */
+
+	if (size < bs)
+		panic("%s(%d) size (%zu) is smaller than %u\n", __FUNCTION__, __LINE__, size, bs);
+
+	if (((unsigned long) from & 64UL) || ((unsigned long)to & 64UL))
+		panic("%s(%d) not aligned\n", __FUNCTION__, __LINE__);
+
+	/* start */
+	kernel_fpu_begin();
+	
+	/* do the non-temporal mov */	
+	for (i = 0; i < size; i += bs){
+		__asm__ __volatile__ (
+		"movdqa (%0), %%xmm0\n"
+		"movdqa 16(%0), %%xmm1\n"
+		"movdqa 32(%0), %%xmm2\n"
+		"movdqa 48(%0), %%xmm3\n"
+		"movntdq %%xmm0, (%1)\n"
+		"movntdq %%xmm1, 16(%1)\n"
+		"movntdq %%xmm2, 32(%1)\n"
+		"movntdq %%xmm3, 48(%1)\n"
+		:
+		: "r" (from), "r" (to)
+		: "memory");
+
+		to += bs;
+		from += bs;
+	}
+
+	/* NOTE: no sfence here, the data is pushed out by one fence at the
+	 * end of the request (see pmbd_write_fence()) */
+
+	/* end */
+	kernel_fpu_end();
+
+	/*NOTE: we assume it would be multiple units of 64 bytes*/
+	if (i != size)
+		panic("%s:%s:%d size (%zu) is in multiple units of 64 bytes\n", __FILE__, __FUNCTION__, __LINE__, size);
+
+	return;
+}
+
+/* non-temporal store */
+static void nts_memcpy(void* to, void* from, size_t size)
+{
+	if (size < 64){
+		panic("no support for nt load smaller than 64 bytes yet\n");
+	} else {
+		nts_memcpy_64bytes_v2(to, from, size);
+	}
+}
+
+
+static void ntl_memcpy_64bytes(void* to, void* from, size_t size)
+{
+	int i;
+	unsigned bs = 64;	/* write unit size 16 bytes */
+
+	if (size < bs)
+		panic("%s(%d) size (%zu) is smaller than %u\n", __FUNCTION__, __LINE__, size, bs);
+
+	if (((unsigned long) from & 64UL) || ((unsigned long)to & 64UL))
+		panic("%s(%d) not aligned\n", __FUNCTION__, __LINE__);
+
+	/* start */
+	kernel_fpu_begin();
+	
+	/* do the non-temporal mov */	
+	for (i = 0; i < size; i += bs){
+		__asm__ __volatile__ (
+		"movntdqa (%0), %%xmm0\n"
+		"movntdqa 16(%0), %%xmm1\n"
+		"movntdqa 32(%0), %%xmm2\n"
+		"movntdqa 48(%0), %%xmm3\n"
+		"movdqa %%xmm0, (%1)\n"
+		"movdqa %%xmm1, 16(%1)\n"
+		"movdqa %%xmm2, 32(%1)\n"
+		"movdqa %%xmm3, 48(%1)\n"
+		:
+		: "r" (from), "r" (to)
+		: "memory");
+
+		to += bs;
+		from += bs;
+	}
+
+	/* end */
+	kernel_fpu_end();
+
+	/*NOTE: we assume it would be multiple units of 64 bytes (at least 512 bytes)*/
+	if (i != size)
+		panic("%s:%s:%d size (%zu) is in multiple units of 64 bytes\n", __FILE__, __FUNCTION__, __LINE__, size);
+
+	return;
+}
+
+/* non-temporal load */
+static void ntl_memcpy(void* to, void* from, size_t size)
+{
+	if (size < 64){
+		panic("no support for nt load smaller than 128 bytes yet\n");
+	} else {
+		ntl_memcpy_64bytes(to, from, size);
+	}
+}
+
+
+/*
+ * *************************************************************************
+ * COPY TO/FROM PM
+ * *************************************************************************
+ * 
+ * NOTE: copying into PM needs particular care, we use different solution here:
+ * (1) pmap: we only map/unmap PM pages when we need to access, which provides
+ *     us the most protection, for both reads and writes
+ * (2) non-pmap: we always map every page into the kernel space, however, we
+ *     put different protection for writes only. In both cases, PM pages are
+ *     initialized as read-only 
+ *     - PTE manipulation: before each write, the page writable bit is enabled, and
+ *       disabled right after the write operation is done.
+ *     - CR0/WP switch: before each write, the WP bit in the CR0 register turned
+ *       off, and turned back on right after the write operation is done. Once
+ *       CR0/WP bit is turned off, the CPU would not check the writable bit in the
+ *       TLB in local CPU. So it is a tricky way to hack and walk around this
+ *       problem. 
+ *     - write window: the shared kernel mapping of PM is never made writable.
+ *       Writes go through the current CPU's pmap pool, which is loaded with a
+ *       writable alias of the target PM pages. The pool entries are recycled
+ *       lazily with local TLB flushes only (see PMAP), so there is no
+ *       set_memory_* and no TLB shootdown IPI. 
+ *
+ */
+
+#define PMBD_PMAP_DUMMY_BASE_VA	(4096)
+#define PMBD_PMAP_VA_TO_PA(VA)	(g_highmem_phys_addr + (VA) - PMBD_PMAP_DUMMY_BASE_VA)
+#define PMBD_HIGHMEM_VA_TO_PA(VA) (g_highmem_phys_addr + ((VA) - g_highmem_virt_addr))
+
+/* get the page frame number of a PM virtual address (dummy address if pmap) */
+static inline unsigned long pmbd_va_to_pfn(PMBD_DEVICE_T* pmbd, void* va)
+{
+	if (PMBD_USE_PMAP())
+		return (unsigned long) (PMBD_PMAP_VA_TO_PA(va) >> PAGE_SHIFT);
+	else if (PMBD_DEV_USE_HIGHMEM(pmbd))
+		return (unsigned long) (PMBD_HIGHMEM_VA_TO_PA(va) >> PAGE_SHIFT);
+	else
+		return vmalloc_to_pfn(va);
+}
+/*
+ * copying from/to a contiguous PM space using pmap (or the write window)
+ * @ram_va: the RAM virtual address
+ * @pmbd_dummy_va: the PM virtual address (a dummy one if pmap is used)
+ * @rw: 0 - read, 1 - write
+ */
+
+#define MEMCPY_TO_PMBD(dst, src, bytes, nt) { if (PMBD_USE_NTS() || (nt)) \
+						nts_memcpy((dst), (src), (bytes)); \
+					else \
+						memcpy((dst), (src), (bytes));}
+
+#define MEMCPY_FROM_PMBD(dst, src, bytes) { if (PMBD_USE_NTL()) \
+						ntl_memcpy((dst), (src), (bytes)); \
+					else \
+						memcpy((dst), (src), (bytes));}
+
+/* 
+ * checksums are computed along with the copy, one checksum unit at a time, so
+ * the source (or destination) RAM chunk is still in the CPU cache and PM is
+ * not read again; subpage update writes one cacheline per iteration, so it
+ * still checksums the written range afterwards (see pmbd_checksum_on_write)
+ */
+#define PMBD_USE_FUSED_CHECKSUM(RW)	(PMBD_USE_CHECKSUM() && ((RW) == READ || !PMBD_USE_SUBPAGE_UPDATE()))
+
+static inline size_t _memcpy_pmbd_pmap(PMBD_DEVICE_T* pmbd, void* ram_va, void* pmbd_dummy_va, size_t bytes, unsigned rw, unsigned do_fua, unsigned do_nts, unsigned do_cks)
+{
+	unsigned long flags = 0;
+	size_t cks_read = 0;	/* PM read for the checksums of partial units */
+	PMBD_CHECKSUM_T cks[PMAP_POOL_PAGES];	/* the checksums of the window (PMAP_POOL_PAGES <= 64) */
+
+	/* disable interrupt (PMAP entry is shared) */	
+	DISABLE_SAVE_IRQ(flags);
+	
+	/* map a window of up to PMAP_POOL_PAGES pages at a time */
+	while(bytes){
+		unsigned off = (unsigned long) pmbd_dummy_va & (~PAGE_MASK);	/* offset in the first page */
+		unsigned num = MIN_OF(PMAP_POOL_PAGES, (PAGE_ALIGN(off + bytes) >> PAGE_SHIFT)); /* num of pages */
+		size_t left = MIN_OF(((size_t) num << PAGE_SHIFT) - off, bytes); /* the size to copy in the window */
+
+		/* map it */
+		void * map = pmap_atomic_range(pmbd, pmbd_dummy_va - off, num, rw);
+		void * pmbd_va = map + off;
+		unsigned long first = PMBD_USE_CHECKSUM() ? VADDR_TO_CHECKSUM_IDX(pmbd, pmbd_dummy_va - off) : 0;
+		uint64_t mask = 0;	/* the pages checksummed in the window */
+
+		/* do the real work */
+		bytes -= left;
+		while(left){
+			uint64_t time_p1 = 0;
+			uint64_t time_p2 = 0;
+			unsigned size = MIN_OF((PAGE_SIZE - ((unsigned long) pmbd_va & (~PAGE_MASK))), left); /* the size to copy */
+
+			/* do memcopy */
+			TIMESTAMP(time_p1);
+			if (rw == READ) { 
+				MEMCPY_FROM_PMBD(ram_va, pmbd_va, size);
+			} else { 
+				if (PMBD_USE_SUBPAGE_UPDATE()) {
+					/* if we do subpage write, write a cacheline each time */
+					/* FIXME: we probably need to check the alignment here */
+					size = MIN_OF(size, PMBD_CACHELINE_SIZE);
+					if (memcmp(pmbd_va, ram_va, size)){
+						MEMCPY_TO_PMBD(pmbd_va, ram_va, size, do_nts);
+					}
+				} else {
+					MEMCPY_TO_PMBD(pmbd_va, ram_va, size, do_nts);
+				}
+			}
+			TIMESTAMP(time_p2);
+
+			/* emulating slowdown*/
+			if(PMBD_DEV_USE_SLOWDOWN(pmbd))
+				pmbd_rdwr_slowdown((pmbd), rw, time_p1, time_p2);
+
+			/* for write check if we need to do clflush or do FUA*/
+			if (rw == WRITE){ 
+				if (PMBD_USE_CLFLUSH() || (do_fua && PMBD_CPU_CACHE_USE_WB() && !PMBD_USE_NTS()))
+					pmbd_clflush_range(pmbd, pmbd_va, (size));
+				else if (pmbd->dirty_log && !do_nts)
+					pmbd_dirty_log_add(pmbd, pmbd_dummy_va, (size));
+			}
+
+			/* update time statistics */
+			if(PMBD_USE_TIMESTAT()){
+				PMBD_STAT_ADD(pmbd, cycles_memcpy[rw], time_p2 - time_p1);
+				PMBD_STAT_HIST(pmbd, PMBD_HIST_MEMCPY, rw, time_p2 - time_p1);
+			}
+
+			/* checksum the page while it is mapped */
+			if (do_cks && PMBD_USE_FUSED_CHECKSUM(rw)) {
+				unsigned j = VADDR_TO_CHECKSUM_IDX(pmbd, pmbd_dummy_va) - first;
+				if (pmbd_checksum_on_copy(pmbd, pmbd_dummy_va, pmbd_va, ram_va, size, rw, &cks[j], &cks_read))
+					mask |= (1ULL << j);
+			}
+
+			/* prepare the next iteration */
+			ram_va  += size;
+			left 	-= size;
+			pmbd_va += size;
+			pmbd_dummy_va += size;
+		}
+
+		/* unmap it */
+		punmap_atomic_range(map, num, pmbd, rw);
+
+		/* store or verify the checksums of the window */
+		if (mask)
+			pmbd_checksum_commit(pmbd, first, cks, mask, num, rw, do_fua);
+	}
+	
+	/* re-enable interrupt */	
+	ENABLE_RESTORE_IRQ(flags);
+
+	return cks_read;
+}
+
+static inline size_t memcpy_from_pmbd_pmap(PMBD_DEVICE_T* pmbd, void* dst, void* src, size_t bytes)
+{
+	return _memcpy_pmbd_pmap(pmbd, dst, src, bytes, READ, FALSE, FALSE, TRUE);
+}
+
+static inline size_t memcpy_to_pmbd_pmap(PMBD_DEVICE_T* pmbd, void* dst, void* src, size_t bytes, unsigned do_fua, unsigned do_nts, unsigned do_cks)
+{
+	return _memcpy_pmbd_pmap(pmbd, src, dst, bytes, WRITE, do_fua, do_nts, do_cks);
+}
+
+
+/*
+ * memcpy from/to PM without using pmap
+ */
+
+#define DISABLE_CR0_WP(CR0,FLAGS)	{\
+						if (PMBD_USE_WRITE_PROTECTION()){\
+							DISABLE_SAVE_IRQ((FLAGS));\
+							(CR0) = read_cr0();\
+							write_cr0((CR0) & ~X86_CR0_WP);\
+						}\
+					}
+#define ENABLE_CR0_WP(CR0,FLAGS)	{\
+						if (PMBD_USE_WRITE_PROTECTION()){\
+							write_cr0((CR0));\
+							ENABLE_RESTORE_IRQ((FLAGS));\
+						}\
+					}
+
+static inline size_t memcpy_from_pmbd_nopmap(PMBD_DEVICE_T* pmbd, void* dst, void* src, size_t bytes)
+{
+	uint64_t time_p1 = 0;
+	uint64_t time_p2 = 0;
+	size_t cks_read = 0;
+
+	/* start memcpy */
+	TIMESTAMP(time_p1);
+#if 0
+	if (PMBD_DEV_USE_VMALLOC((pmbd))) 
+		memcpy((dst), (src), (bytes)); 
+	else if (PMBD_DEV_USE_HIGHMEM((pmbd))) 
+		memcpy_fromio((dst), (src), (bytes));
+#endif
+	if (PMBD_USE_FUSED_CHECKSUM(READ)) {
+		/* copy one checksum unit at a time and verify it from dst */
+		PMBD_CHECKSUM_T checksum = 0;
+		size_t left = bytes;
+		while (left) {
+			size_t off = (src - pmbd->mem_space) % pmbd->checksum_unit_size;
+			size_t size = MIN_OF(left, pmbd->checksum_unit_size - off);
+
+			MEMCPY_FROM_PMBD(dst, src, size);
+			if (pmbd_checksum_on_copy(pmbd, src, src, dst, size, READ, &checksum, &cks_read))
+				pmbd_checksum_commit(pmbd, VADDR_TO_CHECKSUM_IDX(pmbd, src), &checksum, 1, 1, READ, FALSE);
+
+			dst 	+= size;
+			src 	+= size;
+			left 	-= size;
+		}
+	} else {
+		MEMCPY_FROM_PMBD(dst, src, bytes);
+	}
+
+	TIMESTAMP(time_p2);
+
+	/* emulating slowdown*/
+	if(PMBD_DEV_USE_SLOWDOWN(pmbd))
+		pmbd_rdwr_slowdown((pmbd), READ, time_p1, time_p2);
+
+	/* update time statistics */
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_memcpy[READ], time_p2 - time_p1);
+		PMBD_STAT_HIST(pmbd, PMBD_HIST_MEMCPY, READ, time_p2 - time_p1);
+	}
+
+	return cks_read;
+}
+
+static size_t memcpy_to_pmbd_nopmap(PMBD_DEVICE_T* pmbd, void* dst, void* src, size_t bytes, unsigned do_fua, unsigned do_nts, unsigned do_cks)
+{
+	size_t cks_read = 0;
+
+	unsigned long cr0 = 0;
+	unsigned long flags = 0;
+	size_t left = bytes;
+	PMBD_CHECKSUM_T checksum = 0;
+
+
+	/* get a bkup copy of the CR0 (to allow writable)*/
+	if (PMBD_DEV_USE_WPMODE_CR0(pmbd))
+		DISABLE_CR0_WP(cr0, flags);
+
+	/* do the real work */
+	while(left){
+		size_t size = left; // the size to copy 
+		uint64_t time_p1 = 0;
+		uint64_t time_p2 = 0;
+
+		/* with checksum, copy one checksum unit at a time */
+		if (do_cks && PMBD_USE_FUSED_CHECKSUM(WRITE))
+			size = MIN_OF(left, pmbd->checksum_unit_size - ((dst - pmbd->mem_space) % pmbd->checksum_unit_size));
+
+		TIMESTAMP(time_p1);
+		/* do memcopy */
+		if (PMBD_USE_SUBPAGE_UPDATE()) {
+			/* if we do subpage write, write a cacheline each time */
+			size = MIN_OF(size, PMBD_CACHELINE_SIZE);
+
+			if (memcmp(dst, src, size)){
+				MEMCPY_TO_PMBD(dst, src, size, do_nts);
+			}
+		} else {
+			MEMCPY_TO_PMBD(dst, src, size, do_nts);
+		}
+		TIMESTAMP(time_p2);
+
+		/* emulating slowdown*/
+		if(PMBD_DEV_USE_SLOWDOWN(pmbd))
+			pmbd_rdwr_slowdown((pmbd), WRITE, time_p1, time_p2);
+
+		/* if write, check if we need to do clflush or we do FUA */
+		if (PMBD_USE_CLFLUSH() || (do_fua && PMBD_CPU_CACHE_USE_WB() && !PMBD_USE_NTS()))
+			pmbd_clflush_range(pmbd, dst, (size));
+		else if (pmbd->dirty_log && !do_nts)
+			pmbd_dirty_log_add(pmbd, dst, (size));
+
+		/* update time statistics */
+		if(PMBD_USE_TIMESTAT()){
+			PMBD_STAT_ADD(pmbd, cycles_memcpy[WRITE], time_p2 - time_p1);
+			PMBD_STAT_HIST(pmbd, PMBD_HIST_MEMCPY, WRITE, time_p2 - time_p1);
+		}
+
+		/* generate the checksum from the (cache hot) source */
+		if (do_cks && PMBD_USE_FUSED_CHECKSUM(WRITE) && pmbd_checksum_on_copy(pmbd, dst, dst, src, size, WRITE, &checksum, &cks_read))
+			pmbd_checksum_commit(pmbd, VADDR_TO_CHECKSUM_IDX(pmbd, dst), &checksum, 1, 1, WRITE, do_fua);
+
+		/* prepare the next iteration */
+		dst  	+= size;
+		src 	+= size;
+		left 	-= size;
+	}
+	
+	/* restore the CR0 */
+	if (PMBD_DEV_USE_WPMODE_CR0(pmbd))
+		ENABLE_CR0_WP(cr0, flags);
+
+	return cks_read;
+}
+
+/*
+ * fence the writes to PM 
+ *
+ * The copy functions do not fence each chunk they write. Non-temporal
+ * stores, WC/UC-Minus writes and clflushes are made durable by one fence
+ * issued here when the whole request has been copied. 
+ */
+static inline void pmbd_write_fence(PMBD_DEVICE_T* pmbd, unsigned do_fua)
+{
+	if (PMBD_USE_CLFLUSH() || (do_fua && PMBD_CPU_CACHE_USE_WB() && !PMBD_USE_NTS()))
+		pmbd_flush_fence();
+	else if (PMBD_USE_NTS() || PMBD_CPU_CACHE_USE_WC() || PMBD_CPU_CACHE_USE_UM())
+		sfence();
+	return;
+}
+
+/*
+ * memcpy from/to PM without emulation and fence (the caller does them)
+ * @do_nts: use non-temporal stores (the writes bypassing the buffer, admitY)
+ * @do_cks: compute the checksums along with the copy (FALSE if the caller
+ * checksums the written units itself, see _pmbd_buffer_flush_range())
+ * return value: the bytes read from PM to checksum partial units, which the
+ * caller charges to the emulation (see emul_cks_read()), since the copy may
+ * run with interrupts disabled
+ */
+static inline size_t _memcpy_to_pmbd(PMBD_DEVICE_T* pmbd, void* dst, void* src, size_t bytes, unsigned do_fua, unsigned do_nts, unsigned do_cks)
+{
+	/* the old checksums must stay valid until the new ones are committed */
+	if (PMBD_USE_CHECKSUM())
+		pmbd_checksum_begin_write(pmbd, dst, bytes, do_fua);
+
+	if (PMBD_USE_PMAP() || PMBD_DEV_USE_WRITE_WINDOW(pmbd))
+		return memcpy_to_pmbd_pmap(pmbd, dst, src, bytes, do_fua, do_nts, do_cks);
+	else
+		return memcpy_to_pmbd_nopmap(pmbd, dst, src, bytes, do_fua, do_nts, do_cks);
+}
+
+static inline size_t _memcpy_from_pmbd(PMBD_DEVICE_T* pmbd, void* dst, void* src, size_t bytes)
+{
+	if (PMBD_USE_PMAP())
+		return memcpy_from_pmbd_pmap(pmbd, dst, src, bytes);
+	else
+		return memcpy_from_pmbd_nopmap(pmbd, dst, src, bytes);
+}
+
+static int memcpy_to_pmbd(PMBD_DEVICE_T* pmbd, void* dst, void* src, size_t bytes, unsigned do_fua, unsigned do_cks)
+{
+	uint64_t start = 0; 
+	uint64_t end = 0; 
+	size_t cks_read = 0;
+
+	/* start simulation timing */
+	if (PMBD_DEV_SIM_PMBD((pmbd)))
+		start = emul_start((pmbd), BYTE_TO_SECTOR((bytes)), WRITE);
+
+	/* do memcpy now */
+	cks_read = _memcpy_to_pmbd(pmbd, dst, src, bytes, do_fua, FALSE, do_cks);
+	pmbd_write_fence(pmbd, do_fua);
+
+	/* stop simulation timing */
+	if (PMBD_DEV_SIM_PMBD((pmbd))) {
+		end = emul_end((pmbd), PMBD_EMUL_CTX(pmbd), BYTE_TO_SECTOR(dst - pmbd->mem_space), BYTE_TO_SECTOR((bytes)), WRITE, start); 
+		emul_cks_read(pmbd, PMBD_EMUL_CTX(pmbd), cks_read);
+	}
+
+	/* pause write for a while*/
+	pmbd_rdwr_pause(pmbd, bytes, WRITE);
+
+	return 0;
+}
+
+
+
+static int memcpy_from_pmbd(PMBD_DEVICE_T* pmbd, void* dst, void* src, size_t bytes)
+{
+	uint64_t start = 0; 
+	uint64_t end = 0; 
+	size_t cks_read = 0;
+
+	/* start simulation timing */
+	if (PMBD_DEV_SIM_PMBD((pmbd)))
+		start = emul_start((pmbd), BYTE_TO_SECTOR((bytes)), READ);
+
+	/* do memcpy here */
+	cks_read = _memcpy_from_pmbd(pmbd, dst, src, bytes);
+
+	/* stop simulation timing */
+	if (PMBD_DEV_SIM_PMBD((pmbd))) {
+		end = emul_end((pmbd), PMBD_EMUL_CTX(pmbd), BYTE_TO_SECTOR(src - pmbd->mem_space), BYTE_TO_SECTOR((bytes)), READ, start); 
+		emul_cks_read(pmbd, PMBD_EMUL_CTX(pmbd), cks_read);
+	}
+
+	/* pause read for a while */
+	pmbd_rdwr_pause(pmbd, bytes, READ);
+
+	return 0;
+}
+
+
+
+/*
+ * *************************************************************************
+ * PMBD device buffer management
+ * *************************************************************************
+ *
+ * Since write protection involves high performance overhead (due to TLB
+ * shootdown and other system locking, linked list scan overhead related with
+ * set_memory_* functions), we cannot change page table attributes for each
+ * incoming write to PM space. In order to battle this issue, we added a
+ * buffer to temporarily hold the incoming writes into a DRAM buffer, and
+ * launch a syncer daemon to periodically flush dirty pages from the buffer to
+ * the PM storage.  This brings two benefits: first, more contiguous pages can
+ * be clustered together, and we only need to do one page attribute change for
+ * a cluster; second, high overhead is hidden in the background, since the
+ * writes become asynchronous now. 
+ * 
+ */
+
+
+/* the bbi entries are sorted with pmbd_bsort_compare/swap() (pmbd_core.c) */
+
+
+/*
+ * get the aligned in-block offsets for a given request
+ * @pmbd: the pmbd device
+ * @sector: the starting offset (in sectors) of the incoming request
+ * @bytes: the size of the incoming request
+ * 
+ * return: the in-block offset of the starting sector in the request
+ * 
+ * Since the block size (4096 bytes) is larger than the sector size (512 bytes),
+ * if the incoming request is not completely aligned in units of blocks, then
+ * we need to pull the whole block from PM space into the buffer, and apply
+ * changes to partial blocks. This function is needed to calculate the offset
+ * for the beginning and ending sectors. 
+ *
+ * For example: assuming sector size is 1024, buffer block size is 4096, sector
+ * is 5, size is 1024, then the returned start offset is 1 (the second sector
+ * in the buffer block), and the returned end offset is 2 (the third sector in
+ * the buffer block)
+ *
+ * offset_s -----v     v--- offset_e
+ *      ----------------------------------
+ *      |        |*****|        |        |
+ *      ----------------------------------
+ *
+ */
+
+static sector_t pmbd_buffer_aligned_request_start(PMBD_DEVICE_T* pmbd, sector_t sector, size_t bytes)
+{
+	sector_t sector_s  	= sector;
+	PBN_T pbn_s 		= SECTOR_TO_PBN(pmbd, sector_s);
+	sector_t block_s 	= PBN_TO_SECTOR(pmbd, pbn_s);	/* the block's starting offset (in sector) */
+	sector_t offset_s 	= 0;
+	if (sector_s >= block_s) /* if not aligned */
+		offset_s = sector_s - block_s;
+	return offset_s;
+}
+
+static sector_t pmbd_buffer_aligned_request_end(PMBD_DEVICE_T* pmbd, sector_t sector, size_t bytes)
+{
+	sector_t sector_e  	= sector + BYTE_TO_SECTOR(bytes) - 1;
+	PBN_T pbn_e 		= SECTOR_TO_PBN(pmbd, sector_e);
+	sector_t block_e 	= PBN_TO_SECTOR(pmbd, pbn_e);	/* the block's starting offset (in sector) */
+	sector_t offset_e 	= PBN_TO_SECTOR(pmbd, 1) - 1;
+	
+	if (sector_e >= block_e) /* if not aligned */
+		offset_e = (sector_e - block_e);
+	return offset_e;
+}
+
+
+/*
+ * lock/unlock the block locks of a range of blocks [pbn_s, pbn_e]
+ *
+ * The blocks may share lock bits, so the distinct bits of the range are
+ * taken once each and in ascending bit order (see PMBD_PBI_T notes). The bits
+ * of a range are consecutive modulo the table size, so a range wrapping
+ * around the end of the table takes the low part first. Preemption is
+ * disabled once for the whole range, rather than once per bit.
+ */
+static inline void _pmbd_block_lock_bits(PMBD_DEVICE_T* pmbd, PBN_T bit_s, PBN_T bit_e)
+{
+	PBN_T bit;
+	for (bit = bit_s; bit <= bit_e; bit ++) {
+		while (test_and_set_bit_lock(bit % BITS_PER_LONG, PMBD_BLOCK_LOCK_WORD(pmbd, bit)))
+			cpu_relax();
+	}
+}
+
+static inline void _pmbd_block_unlock_bits(PMBD_DEVICE_T* pmbd, PBN_T bit_s, PBN_T bit_e)
+{
+	PBN_T bit;
+	for (bit = bit_s; bit <= bit_e; bit ++)
+		clear_bit_unlock(bit % BITS_PER_LONG, PMBD_BLOCK_LOCK_WORD(pmbd, bit));
+}
+
+static void pmbd_block_lock_range(PMBD_DEVICE_T* pmbd, PBN_T pbn_s, PBN_T pbn_e)
+{
+	PBN_T bit_s = PMBD_BLOCK_LOCK_BIT(pmbd, pbn_s);
+	PBN_T bit_e = PMBD_BLOCK_LOCK_BIT(pmbd, pbn_e);
+
+	preempt_disable();
+	if (pbn_e - pbn_s + 1 >= PMBD_BLOCK_LOCK_NUM(pmbd)) {
+		_pmbd_block_lock_bits(pmbd, 0, pmbd->pbi_lock_mask);
+	} else if (bit_s <= bit_e) {
+		_pmbd_block_lock_bits(pmbd, bit_s, bit_e);
+	} else {
+		_pmbd_block_lock_bits(pmbd, 0, bit_e);
+		_pmbd_block_lock_bits(pmbd, bit_s, pmbd->pbi_lock_mask);
+	}
+}
+
+static void pmbd_block_unlock_range(PMBD_DEVICE_T* pmbd, PBN_T pbn_s, PBN_T pbn_e)
+{
+	PBN_T bit_s = PMBD_BLOCK_LOCK_BIT(pmbd, pbn_s);
+	PBN_T bit_e = PMBD_BLOCK_LOCK_BIT(pmbd, pbn_e);
+
+	if (pbn_e - pbn_s + 1 >= PMBD_BLOCK_LOCK_NUM(pmbd)) {
+		_pmbd_block_unlock_bits(pmbd, 0, pmbd->pbi_lock_mask);
+	} else if (bit_s <= bit_e) {
+		_pmbd_block_unlock_bits(pmbd, bit_s, bit_e);
+	} else {
+		_pmbd_block_unlock_bits(pmbd, 0, bit_e);
+		_pmbd_block_unlock_bits(pmbd, bit_s, pmbd->pbi_lock_mask);
+	}
+	preempt_enable();
+}
+
+
+/*
+ * PBN->BBN hash functions
+ *
+ * NOTE: The caller must hold the block lock of the pbn, which guarantees
+ * that nobody else can link or unlink the same pbn. The bucket lock only
+ * protects the chain against concurrent updates of other pbns.
+ */
+static void _pmbd_buffer_hash_insert(PMBD_BUFFER_T* buffer, PBN_T pbn, BBN_T bbn)
+{
+	unsigned long h = PMBD_BUFFER_HASH(buffer, pbn);
+	PMBD_BBI_T* bbi = PMBD_BUFFER_BBI(buffer, bbn);
+
+	PMBD_BUFFER_HASH_LOCK(buffer, h);
+	bbi->hnext = buffer->hash_heads[h];
+	buffer->hash_heads[h] = bbn;
+	PMBD_BUFFER_HASH_UNLOCK(buffer, h);
+}
+
+static void _pmbd_buffer_hash_remove(PMBD_BUFFER_T* buffer, PBN_T pbn, BBN_T bbn)
+{
+	unsigned long h = PMBD_BUFFER_HASH(buffer, pbn);
+	BBN_T* link = NULL;
+
+	PMBD_BUFFER_HASH_LOCK(buffer, h);
+	for (link = &buffer->hash_heads[h]; *link != PMBD_BUFFER_BBN_NONE; 
+					link = &PMBD_BUFFER_BBI(buffer, *link)->hnext) {
+		if (*link == bbn) {
+			*link = PMBD_BUFFER_BBI(buffer, bbn)->hnext;
+			break;
+		}
+	}
+	PMBD_BUFFER_BBI(buffer, bbn)->hnext = PMBD_BUFFER_BBN_NONE;
+	PMBD_BUFFER_HASH_UNLOCK(buffer, h);
+}
+
+/*
+ * check and see if a physical block (pbn) is buffered
+ * @pmbd: 	pmbd device
+ * @pbn: 	buffer block number
+ * 
+ * NOTE: The caller must hold the block lock of the pbn
+ */ 
+static PMBD_BBI_T* _pmbd_buffer_lookup(PMBD_BUFFER_T* buffer, PBN_T pbn)
+{
+	unsigned long h = PMBD_BUFFER_HASH(buffer, pbn);
+	BBN_T bbn = PMBD_BUFFER_BBN_NONE;
+
+	PMBD_BUFFER_HASH_LOCK(buffer, h);
+	for (bbn = buffer->hash_heads[h]; bbn != PMBD_BUFFER_BBN_NONE; 
+					bbn = PMBD_BUFFER_BBI(buffer, bbn)->hnext) {
+		if (PMBD_BUFFER_BBI(buffer, bbn)->pbn == pbn)
+			break;
+	}
+	PMBD_BUFFER_HASH_UNLOCK(buffer, h);
+
+	return (bbn == PMBD_BUFFER_BBN_NONE) ? NULL : PMBD_BUFFER_BBI(buffer, bbn);
+}
+
+/*
+ * get the dirty line mask of a write to a buffer block
+ * @pmbd:	pmbd device
+ * @off:	in-block offset of the write (in bytes)
+ * @size:	size of the write (in bytes)
+ *
+ * Each buffer block is tracked with PMBD_BUFFER_BLOCK_LINES lines (one
+ * cacheline each for 4KB blocks), and a write dirties every line it touches. 
+ */
+static inline uint64_t pmbd_buffer_line_mask(PMBD_DEVICE_T* pmbd, size_t off, size_t size)
+{
+	return pmbd_line_mask(PMBD_BUFFER_LINE_SIZE(pmbd), off, size);
+}
+
+/*
+ * fill the lines of a buffer block that are not valid from PM
+ * @buffer:	the buffer
+ * @bbi:	the buffer block info
+ *
+ * A partially written block is buffered without reading the rest of the
+ * block from PM (see copy_to_pmbd_buffered()), so the missing lines are
+ * only read in here when somebody reads them from the buffer. Only dirty
+ * lines are flushed back, so the flusher never needs them. 
+ *
+ * NOTE: The caller must hold the block lock.
+ */
+static void pmbd_buffer_fill_block(PMBD_BUFFER_T* buffer, PMBD_BBI_T* bbi)
+{
+	PMBD_DEVICE_T* pmbd = buffer->pmbd;
+	void* blk = PMBD_BUFFER_BLOCK(buffer, PMBD_BUFFER_BBI_INDEX(buffer, bbi));
+	void* pm = PMBD_BLOCK_VADDR(pmbd, bbi->pbn);
+	size_t line_size = PMBD_BUFFER_LINE_SIZE(pmbd);
+	uint64_t missing = ~bbi->valid_mask;
+	unsigned first = 0;
+	unsigned last = 0;
+
+	while (pmbd_next_run(missing, &first, &last)) {
+		memcpy_from_pmbd(pmbd, blk + first * line_size, pm + first * line_size, (last - first + 1) * line_size);
+		first = last + 1;
+	}
+	bbi->valid_mask = ~0ULL;
+	return;
+}
+
+/*
+ * Alloc/flush buffer functions
+ */
+
+/* 
+ * flushing a range of contiguous physical blocks from buffer to PM space
+ * @pmbd: pmbd device
+ * @pbn_s: the first physical block number to flush (start)
+ * @pbn_e: the last physical block number to flush (end)
+ *
+ * This function only flushes blocks from buffer to PM and unlink(free) the
+ * corresponding buffer blocks and physical PM blocks, and it does not update
+ * the buffer control info (num_dirty, pos_dirty).  This is because after
+ * sorting, the processing order of buffer blocks (BBNs) may be different from
+ * the spatial order of the buffer blocks, which makes it impossible to move
+ * pos_dirty forward exactly one after one. In other words, pos_dirty only
+ * points to the end of the dirty range, and we may flush a dirty block in the
+ * middle of the range, rather than from the end first. 
+ *
+ * NOTE: The caller must hold the flush_lock; only one thread is allowed to do
+ * this sync; we also assume all the physical blocks in the specified range are
+ * buffered.
+ *
+ */
+
+static unsigned long _pmbd_buffer_flush_range(PMBD_BUFFER_T* buffer, PBN_T pbn_s, PBN_T pbn_e)
+{
+	PBN_T pbn = 0;
+	unsigned long num_cleaned = 0;
+	PMBD_DEVICE_T* pmbd = buffer->pmbd;
+	void* dst = PMBD_BLOCK_VADDR(pmbd, pbn_s);
+	size_t bytes = PBN_TO_BYTE(pmbd, (pbn_e - pbn_s + 1));
+	
+	/* NOTE: we are protected by the flush_lock here, no-one else here */
+
+	/* set the pages readwriteable */
+	/* if we use CR0/WP to temporarily switch the writable permission, 
+ 	 * we don't have to change the PTE attributes directly */
+	if (PMBD_DEV_USE_WPMODE_PTE(pmbd))
+		pmbd_set_pages_rw(pmbd, dst, bytes, TRUE);
+	
+	/* 
+	 * lock the blocks (in lock bit order)
+	 * NOTE: This would not cause a deadlock, because the writers never
+	 * wait for the flush_lock while holding a block lock (see
+	 * copy_to_pmbd_buffered())
+	 */
+	pmbd_block_lock_range(pmbd, pbn_s, pbn_e);
+
+	/* for each physical block, flush it from buffer to the PM space */
+	for (pbn = pbn_s; pbn <= pbn_e; pbn ++){
+		BBN_T bbn 	= 0;
+		void* to 	= PMBD_BLOCK_VADDR(pmbd, pbn);
+		void* from	= NULL;		/* wait to get it in locked region */
+		PMBD_BBI_T* bbi	= NULL;		/* wait to get it in locked region */
+
+		/* get related buffer block info */
+		if ((bbi = _pmbd_buffer_lookup(buffer, pbn))) {
+			bbn	= PMBD_BUFFER_BBI_INDEX(buffer, bbi);
+			from  	= PMBD_BUFFER_BLOCK(buffer, bbn);
+		} else {
+			panic("pmbd: %s(%d) something wrong here \n", __FUNCTION__, __LINE__);
+		}
+		
+		/* sync data from buffer into PM first */
+		if (PMBD_BUFFER_BBI_IS_DIRTY(buffer, bbn)) {
+			/* flush the dirty lines to PM (one copy per run of lines) 
+			 * NOTE: lines not valid in the buffer are never dirty, so
+			 * PM keeps their data and no merge is needed here */	
+			size_t line_size = PMBD_BUFFER_LINE_SIZE(pmbd);
+			unsigned first = 0;
+			unsigned last = 0;
+
+			while (pmbd_next_run(bbi->line_mask, &first, &last)) {
+				size_t off = first * line_size;
+				size_t len = (last - first + 1) * line_size;
+
+				memcpy_to_pmbd(pmbd, to + off, from + off, len, FALSE, FALSE);
+
+				/* verify that the write operation succeeded; the
+				 * block leaves the buffer, so write it once more if
+				 * not (the mismatch is counted) */
+				if(PMBD_USE_WRITE_VERIFICATION() && pmbd_verify_wr_pages(pmbd, to + off, from + off, len) < 0) {
+					memcpy_to_pmbd(pmbd, to + off, from + off, len, FALSE, FALSE);
+					pmbd_verify_wr_pages(pmbd, to + off, from + off, len);
+				}
+
+				first = last + 1;
+			}
+
+			/* checksum the block once, after all its runs are written */
+			if (PMBD_USE_FUSED_CHECKSUM(WRITE))
+				pmbd_checksum_on_flush(pmbd, bbi, to, from);
+
+			/* mark it as clean */
+			bbi->line_mask = 0;
+			PMBD_BUFFER_SET_BBI_CLEAN(buffer, bbn);
+		}
+	}
+
+	/* make the checksums durable (the data was fenced by the copies) */
+	if (PMBD_USE_FUSED_CHECKSUM(WRITE))
+		pmbd_write_fence(pmbd, FALSE);
+
+	/* set the pages back to read-only */
+	if (PMBD_DEV_USE_WPMODE_PTE(pmbd))
+		pmbd_set_pages_ro(pmbd, dst, bytes, TRUE);
+	
+
+	/* finish the remaining work */	
+	for (pbn = pbn_s; pbn <= pbn_e; pbn ++){
+		BBN_T bbn	= PMBD_BUFFER_BBI_INDEX(buffer, _pmbd_buffer_lookup(buffer, pbn));
+
+		/* unlink the block from the buffer */
+		_pmbd_buffer_hash_remove(buffer, pbn, bbn);
+		PMBD_BUFFER_SET_BBI_UNBUFFERED(buffer, bbn);
+
+		num_cleaned ++;
+	}
+
+	/* unlock the blocks */
+	pmbd_block_unlock_range(pmbd, pbn_s, pbn_e);
+
+	/* generate checksum (if not done along with the copy) */
+	if (PMBD_USE_CHECKSUM() && !PMBD_USE_FUSED_CHECKSUM(WRITE))
+		pmbd_checksum_on_write(pmbd, dst, bytes, FALSE);
+	
+	return num_cleaned;
+}
+
+
+/*
+ * core function of flushing the pmbd buffer
+ * @pmbd: pmbd device
+ *
+ * NOTE: this function performs the flushing in the following steps
+ * (1) get the flush lock (to allow only one to do flushing)
+ * (2) check if someone else has already done the flushing work while waiting
+ * for the lock 
+ * (3) copy the buffer block info from pos_dirty onwards to a temporary array,
+ * stopping at the first block that is reserved by an allocator but not
+ * published yet (see pmbd_buffer_alloc_block())
+ *
+ * (4) sort the temporary array of buffer blocks in the order of their PBNs.
+ * This is because we need to organize sequences of contiguous physical blocks,
+ * so that we can use only one set_memory_* function for a sequence of memory
+ * pages, rather than once for each page. So the larger the sequence is, the
+ * more efficient it would be.
+ * (5) scan the sorted list, and form sequences of contiguous physical blocks,
+ * and call __pmbd_buffer_flush_range() to synchronize the sequences one by one
+ *
+ * (6) move pos_dirty forward, then return the cleaned blocks to the
+ * allocators by decrementing num_dirty
+ * (7) release the flush_lock
+ *
+ * The flusher is the only consumer of the dirty ring, so pos_dirty is only
+ * touched under the flush_lock, and allocators never wait for it.
+ *
+ * NOTE: The caller must not hold flush_lock or any block lock (the flusher
+ * takes the lock bits of whole runs, which may be shared with the caller's).
+ *
+ */
+static unsigned long pmbd_buffer_flush(PMBD_BUFFER_T* buffer, unsigned long num_to_clean)
+{
+	BBN_T i = 0;
+	BBN_T bbn_s = 0;
+	PBN_T first_pbn = 0;
+	PBN_T last_pbn = 0;
+	unsigned long num_dirty = 0;
+	unsigned long num_cleaned = 0;
+	unsigned long num_scanned = 0; 
+	PMBD_DEVICE_T* pmbd = buffer->pmbd;
+	PMBD_BSORT_ENTRY_T* bbi_sort_buffer = buffer->bbi_sort_buffer;
+
+	/* lock the flush_lock to ensure no-one else can do flush in parallel */
+	spin_lock(&buffer->flush_lock);
+
+	/* check if num_to_clean is too large */
+	num_dirty = PMBD_BUFFER_NUM_DIRTY(buffer);
+	if (num_to_clean > num_dirty)
+		num_to_clean = num_dirty;
+
+	/* check if the buffer is empty (someone else may have done the flushing job) */
+	if (num_to_clean == 0)
+		goto done;
+
+	/* scan the buffer range and put it into the sort buffer */ 
+	bbn_s = buffer->pos_dirty; 				/* the first bbn */
+	for (i = bbn_s; num_scanned < num_to_clean; i = PMBD_BUFFER_NEXT_POS(buffer, i)) {
+		PMBD_BBI_T* bbi = PMBD_BUFFER_BBI(buffer, i);
+		PMBD_BSORT_ENTRY_T* se = bbi_sort_buffer + num_scanned;
+
+		/* 
+		 * A clean block in the dirty range has been reserved by an
+		 * allocator, which has not published it yet. We cannot skip
+		 * it (pos_dirty only moves forward contiguously), so we stop
+		 * here and leave it to the next round.
+		 */
+		if(PMBD_BUFFER_BBI_IS_CLEAN(buffer, i))
+			break;
+
+		/* pairs with smp_wmb() in pmbd_buffer_alloc_block() */
+		smp_rmb();
+
+		/* add it to the buffer for sorting */
+		se->pbn = bbi->pbn;
+		se->bbn = i;
+		num_scanned ++;
+	}
+
+	/* if no valid dirty block to be cleaned*/
+	if (num_scanned == 0)
+		goto done;
+
+	/* 
+	 * sort the buffer to get sequences of contiguous blocks 
+	 */
+	if (PMBD_DEV_USE_WPMODE_PTE(pmbd))
+		sort(bbi_sort_buffer, num_scanned, sizeof(PMBD_BSORT_ENTRY_T), pmbd_bsort_compare, pmbd_bsort_swap);
+
+	/* scan the sorted list to organize and flush the sequences of contiguous PBNs */
+	for (i = 0; i < num_scanned; ) {
+		i = pmbd_flush_next_seq(bbi_sort_buffer, num_scanned, i, &first_pbn, &last_pbn);
+		num_cleaned += _pmbd_buffer_flush_range(buffer, first_pbn, last_pbn);
+	}
+
+	/* update the buffer control info */
+	buffer->pos_dirty = PMBD_BUFFER_NEXT_N_POS(buffer, bbn_s, num_cleaned);	/* move pos_dirty forward */
+
+	/* the cleaned blocks must look clean before allocators can reuse them */
+	smp_mb();
+	atomic_sub(num_cleaned, &buffer->num_dirty);	/* decrement the counter*/
+
+done:
+	spin_unlock(&buffer->flush_lock);
+	return num_cleaned;
+}
+
+/*
+ * entry function of flushing buffer
+ * This function is called by both allocator and syncer
+ * @pmbd: pmbd device
+ * @num_to_clean: how many blocks to clean 
+ * @i_am_syncer: indicate which caller is (TRUE for syncer and FALSE for allocator)
+ */
+static unsigned long pmbd_buffer_check_and_flush(PMBD_BUFFER_T* buffer, unsigned long num_to_clean, unsigned caller)
+{
+	unsigned long num_cleaned = 0;
+
+	/* 
+	 * Since there may exist more than one thread (e.g. alloc/flush or
+	 * alloc/alloc) trying to flush the buffer, we need to first check if
+	 * someone else has already done the job while waiting for the lock. If
+	 * true, we don't have to proceed and flush it again. This improves the
+	 * responsiveness of applications 
+	 */
+	if (caller == CALLER_DESTROYER){
+		/* if destroyer calls this function, just flush everything */
+		goto do_it;
+
+	} else if (caller == CALLER_SYNCER) {
+		/* if syncer calls this function and the buffer is empty, do nothing */
+		if (PMBD_BUFFER_IS_EMPTY(buffer))
+			goto done;
+
+	} else if (caller == CALLER_ALLOCATOR){
+	
+		/* if reader/writer calls this function, some blocks are freed, then 
+		 * we just do nothing */
+		if (!PMBD_BUFFER_IS_FULL(buffer))
+			goto done;
+
+	} else {
+		panic("ERR: %s(%d) unknown caller id\n", __FUNCTION__, __LINE__);
+	}
+
+	/* otherwise, we do flushing */
+do_it:
+	num_cleaned = pmbd_buffer_flush(buffer, num_to_clean);
+
+done:
+	return num_cleaned;
+}
+
+/* 
+ * Core function of allocating a buffer block
+ * 
+ * The dirty blocks form a ring between pos_dirty (consumed by the flusher)
+ * and pos_clean (produced by allocators), and allocation is lock-free:
+ *
+ * (1) reserve a free block by incrementing num_dirty, unless it already
+ * equals num_blocks (pmbd_buffer_reserve_block()). If the buffer is full,
+ * the caller drops its block lock, synchronously flushes a batch and retries,
+ * since someone may use up the freed blocks before us.
+ * (2) claim the next slot of the ring with one atomic fetch-and-add on
+ * pos_clean (a monotonically increasing ticket). Because the flusher returns
+ * blocks by decrementing num_dirty only after pos_dirty has moved past them,
+ * a reserved ticket always maps to a slot that is free.
+ * (3) link the slot to the pbn, then publish it by marking it dirty. The
+ * flusher never goes beyond a reserved but unpublished slot.
+ *
+ * Since we already hold the block lock, nobody else can read/write or access
+ * the same block before we really write data into the buffer block.
+ *
+ * NOTE: The caller must hold the block lock and a reservation.
+ *
+ */
+static inline int pmbd_buffer_reserve_block(PMBD_BUFFER_T* buffer)
+{
+	return atomic_add_unless(&buffer->num_dirty, 1, (int) buffer->num_blocks);
+}
+
+static PMBD_BBI_T* pmbd_buffer_alloc_block(PMBD_BUFFER_T* buffer, PBN_T pbn)
+{
+	BBN_T pos		= 0;
+	PMBD_BBI_T* bbi		= NULL;
+
+	/* claim the next slot in the ring */
+	pos = (BBN_T) ((atomic64_inc_return(&buffer->pos_clean) - 1) % buffer->num_blocks);
+
+	/* now link them up (no-one else can see it) */
+	bbi = PMBD_BUFFER_BBI(buffer, pos);
+	bbi->pbn = pbn;
+	_pmbd_buffer_hash_insert(buffer, pbn, pos);
+
+	/* NOTE: we mark it "dirty" here to publish it to the flusher, but
+	 * actually the data has not been really written into the PMBD buffer
+	 * block yet. This is safe, because we are protected by the block lock  */
+	smp_wmb();
+	PMBD_BUFFER_SET_BBI_DIRTY(buffer, pos); 
+
+	return bbi;
+}
+
+
+/*
+ * syncer daemon worker function
+ */
+
+static inline uint64_t pmbd_device_is_idle(PMBD_DEVICE_T* pmbd)
+{
+	unsigned last_jiffies, now_jiffies;
+	uint64_t interval = 0;
+
+	now_jiffies = jiffies;
+	PMBD_DEV_GET_ACCESS_TIME(pmbd, last_jiffies);
+	interval = jiffies_to_usecs(now_jiffies - last_jiffies);
+	
+	if (PMBD_DEV_IS_IDLE(pmbd, interval)) {
+		return interval;
+	} else {
+		return 0;
+	}
+}
+
+static int pmbd_syncer_worker(void* data)
+{
+	PMBD_BUFFER_T* buffer = (PMBD_BUFFER_T*) data;
+
+	set_user_nice(current, 0);
+
+	do {
+		unsigned do_flush  = 0;
+//		unsigned long loop = 0;
+		uint64_t idle_usec = 0;
+
+		/* we start flushing, if 
+		 * (1) the num of dirty blocks hits the high watermark, or
+		 * (2) the device has been idle for a while */
+		if (PMBD_BUFFER_ABOVE_HW(buffer)) {
+			//printk("High watermark is hit\n";
+			do_flush = 1;
+		}
+//		if (pmbd_device_is_idle(buffer->pmbd) && !PMBD_BUFFER_IS_EMPTY(buffer)) {
+		if ((idle_usec = pmbd_device_is_idle(buffer->pmbd)) && PMBD_BUFFER_ABOVE_LW(buffer)) {
+			//printk("Device is idle for %llu uSeconds\n", idle_usec);
+			do_flush = 1;
+		}
+		if (do_flush){
+			unsigned long num_dirty = 0;
+			unsigned long num_cleaned = 0;
+repeat:
+			num_dirty = PMBD_BUFFER_NUM_DIRTY(buffer);
+
+			/* start flushing 
+			 * 
+			 * NOTE: we only allocate a batch (e.g. 1024) of blocks each time. The
+			 * purpose is to let the applications wait for free blocks, so that they can
+			 * get a few free blocks and proceed, rather than waiting for the whole
+			 * buffer gets flushed. Otherwise, the bandwidth would be lower and the
+			 * applications cannot run smoothly. 
+			 */
+			num_cleaned = pmbd_buffer_check_and_flush(buffer, buffer->batch_size, CALLER_SYNCER);
+			//printk("Syncer(%u) activated (%lu) - Before (%lu) Cleaned (%lu) After (%lu)\n", 
+			//		buffer->buffer_id, loop++, num_dirty, num_cleaned, PMBD_BUFFER_NUM_DIRTY(buffer));
+			
+			/* continue to flush until we hit the low watermark (or
+			 * the head of the ring is not published yet) */
+			if (num_cleaned && PMBD_BUFFER_ABOVE_LW(buffer)) {
+//			if (PMBD_BUFFER_NUM_DIRTY(buffer) > 0) {
+				goto repeat;
+			}
+		}
+
+		/* go to sleep */
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_timeout(1);
+		set_current_state(TASK_RUNNING);
+
+	} while(!kthread_should_stop());
+	return 0;
+}
+
+static struct task_struct* pmbd_buffer_syncer_init(PMBD_BUFFER_T* buffer)
+{
+	struct task_struct* tsk = NULL;
+	tsk = kthread_run(pmbd_syncer_worker, (void*) buffer, "nsyncer");
+	if (!tsk) {
+		printk(KERN_ERR "pmbd: initializing buffer syncer failed\n");
+		return NULL;
+	}
+
+	buffer->syncer = tsk;
+	printk("pmbd: buffer syncer launched\n");
+	return tsk;
+}
+
+static int pmbd_buffer_syncer_stop(PMBD_BUFFER_T* buffer)
+{
+	if (buffer->syncer){
+		kthread_stop(buffer->syncer);
+		buffer->syncer = NULL;
+		printk(KERN_INFO "pmbd: buffer syncer stopped\n");
+	}
+	return 0;
+}
+
+/*
+ * buffer admission (admitY)
+ *
+ * The buffer pays off for the small writes and for the blocks rewritten
+ * before being flushed. A streaming write only passes through it, costs an
+ * extra copy and pushes the hot blocks out. So the writes extending a
+ * sequential stream of the submitting CPU to admitseq<#> KBs, and the large
+ * writes to the blocks not written recently, go directly to PM with
+ * non-temporal stores (the same way as the FUA writes, see
+ * pmbd_batch_start()). The write frequencies are kept in a count-min
+ * sketch of 4-bit counters (see pmbd_core.c), aged every 10 writes per
+ * buffer block.
+ *
+ * return TRUE if the write is to be buffered
+ */
+static int pmbd_buffer_admit(PMBD_DEVICE_T* pmbd, sector_t sector, size_t bytes)
+{
+	PMBD_ADMIT_STREAMS_T* streams;
+	PBN_T pbn_s = SECTOR_TO_PBN(pmbd, sector);
+	PBN_T pbn_e = BYTE_TO_PBN(pmbd, (SECTOR_TO_BYTE(sector) + bytes - 1));
+	PBN_T pbn;
+	uint64_t run;
+	unsigned freq = 0;
+
+	/* sequential streams go directly to PM */
+	streams = get_cpu_ptr(pmbd->admit_streams);
+	run = pmbd_stream_update(streams->slot, PMBD_ADMIT_STREAMS, sector, BYTE_TO_SECTOR(bytes));
+	put_cpu_ptr(pmbd->admit_streams);
+	if (SECTOR_TO_BYTE(run) >= KB_TO_BYTES(g_pmbd_admit_seq)){
+		PMBD_STAT_INC(pmbd, num_bypass_seq);
+		return FALSE;
+	}
+
+	/* count the writes of each block (the sketch is lock-free) */
+	for (pbn = pbn_s; pbn <= pbn_e; pbn ++)
+		freq = MAX_OF(freq, pmbd_sketch_add(&pmbd->admit_sketch, pbn));
+
+	if (bytes <= KB_TO_BYTES(g_pmbd_admit_small)){
+		PMBD_STAT_INC(pmbd, num_admit_small);
+		return TRUE;
+	}
+	if (freq >= PMBD_ADMIT_FREQ){
+		PMBD_STAT_INC(pmbd, num_admit_freq);
+		return TRUE;
+	}
+	PMBD_STAT_INC(pmbd, num_bypass_cold);
+	return FALSE;
+}
+
+/*
+ * read and write to PMBD with buffer 
+ */ 
+static void copy_to_pmbd_buffered(PMBD_DEVICE_T* pmbd, void *src, sector_t sector, size_t bytes)
+{
+	PBN_T pbn   = 0;
+	void*  from = src;
+
+	/*
+	 * get the start and end in-block offset
+	 * 
+	 * NOTE: Since the buffer block (4096 bytes) can be larger than the
+	 * sector(512 bytes), if incoming request is not completely aligned to
+	 * buffer blocks, we need to read the full block from PM into the
+	 * buffer block and apply writes to partial of the buffer block. Here,
+	 * offset_s and offset_e are the start and end in-block offsets (in
+	 * units of sectors) for the first and the last sector in the request,
+	 * they may or may not appear in the same buffer block, depending on the
+	 * request size.
+	 */
+	PBN_T pbn_s = SECTOR_TO_PBN(pmbd, sector);
+	PBN_T pbn_e = BYTE_TO_PBN(pmbd, (SECTOR_TO_BYTE(sector) + bytes - 1));
+	sector_t offset_s = pmbd_buffer_aligned_request_start(pmbd, sector, bytes);
+	sector_t offset_e = pmbd_buffer_aligned_request_end(pmbd, sector, bytes);
+
+	/* for each physical block */
+	for (pbn = pbn_s; pbn <= pbn_e; pbn ++){
+		void* to 	= NULL;
+		BBN_T bbn	= 0;
+		PMBD_BBI_T* bbi = NULL;
+		uint64_t mask	= 0;
+		sector_t sect_s	= (pbn == pbn_s) ? offset_s : 0; /* sub-block access */
+		sector_t sect_e	= (pbn == pbn_e) ? offset_e : (PBN_TO_SECTOR(pmbd, 1) - 1);/* sub-block access */
+		size_t size 	= SECTOR_TO_BYTE(sect_e - sect_s + 1);	/* get the real size */
+		PMBD_BUFFER_T* buffer = PBN_TO_PMBD_BUFFER(pmbd, pbn);
+
+		/* lock the physical block first */
+		PMBD_BLOCK_LOCK(pmbd, pbn);
+
+		/* check if the physical block is buffered */
+		bbi = _pmbd_buffer_lookup(buffer, pbn);
+
+		/* a miss needs a free buffer block; if the buffer is full, we must flush it
+		 * synchronously. 
+		 *
+		 * NOTE: this on-demand flushing can improve performance a lot, since
+		 * the allocator has not to wait for waking up syncer to do this, which
+		 * is much faster. Another merit is that it makes the application run
+		 * more smoothly (it is abrupt if completely relying on syncer). Also
+		 * note that we only flush a batch (e.g. 1024) of blocks, rather than
+		 * all the buffer blocks, this is because we only need a few blocks to
+		 * satisfy the application's own need, and this reduces the time that 
+		 * the application spends on allocation. The block lock is dropped
+		 * while flushing (the flusher may need the same lock bit), so the
+		 * block is looked up again afterwards. */
+		while (!bbi && !pmbd_buffer_reserve_block(buffer)) {
+			PMBD_BLOCK_UNLOCK(pmbd, pbn);
+			pmbd_buffer_check_and_flush(buffer, buffer->batch_size, CALLER_ALLOCATOR);
+			PMBD_BLOCK_LOCK(pmbd, pbn);
+			bbi = _pmbd_buffer_lookup(buffer, pbn);
+		}
+
+		if (bbi){
+			/* if the block is already buffered */
+			bbn = PMBD_BUFFER_BBI_INDEX(buffer, bbi);
+			to = PMBD_BUFFER_BLOCK(buffer, bbn) + SECTOR_TO_BYTE(sect_s);
+			PMBD_STAT_INC(pmbd, num_buffer_wr_hits);
+		} else {
+			/* if not buffered, allocate one free buffer block */
+			PMBD_STAT_INC(pmbd, num_buffer_wr_misses);
+			bbi = pmbd_buffer_alloc_block(buffer, pbn);
+			bbn = PMBD_BUFFER_BBI_INDEX(buffer, bbi);
+
+			/* if not aligned to a full block, we do not read the rest
+			 * of the block from PM here; the block only holds the
+			 * written lines, and the others are filled on demand
+			 * (see pmbd_buffer_fill_block()) */
+			to = PMBD_BUFFER_BLOCK(buffer, bbn) + SECTOR_TO_BYTE(sect_s);
+			bbi->line_mask = 0;
+			bbi->valid_mask = 0;
+		}
+		
+		/* writing it into buffer, and mark the touched lines dirty */
+		memcpy(to, from, size);
+		mask = pmbd_buffer_line_mask(pmbd, SECTOR_TO_BYTE(sect_s), size);
+		bbi->line_mask |= mask;
+		bbi->valid_mask |= mask;
+		PMBD_BUFFER_SET_BBI_DIRTY(buffer, bbn);
+
+		/* unlock the block */
+		PMBD_BLOCK_UNLOCK(pmbd, pbn);
+
+		from += size;
+	}
+
+	return;
+}
+
+static void copy_from_pmbd_buffered(PMBD_DEVICE_T* pmbd, void *dst, sector_t sector, size_t bytes)
+{
+	PBN_T pbn = 0;
+	void*  to = dst;
+
+	/* get the start and end in-block offset */
+	PBN_T pbn_s 	= SECTOR_TO_PBN(pmbd, sector);
+	PBN_T pbn_e 	= BYTE_TO_PBN(pmbd, SECTOR_TO_BYTE(sector) + bytes - 1);
+	sector_t offset_s = pmbd_buffer_aligned_request_start(pmbd, sector, bytes);
+	sector_t offset_e = pmbd_buffer_aligned_request_end(pmbd, sector, bytes);
+
+	for (pbn = pbn_s; pbn <= pbn_e; pbn ++){
+		/* Scan the incoming request and check each block, for each block, we
+		 * check if it is in the buffer. If true, we read it from the buffer,
+		 * otherwise, we read from the PM space. */
+
+		void* from 	= NULL;
+		PMBD_BBI_T* bbi = NULL;
+		sector_t sect_s	= (pbn == pbn_s) ? offset_s : 0;				
+		sector_t sect_e	= (pbn == pbn_e) ? offset_e : (PBN_TO_SECTOR(pmbd, 1) - 1);/* sub-block access */
+		size_t size 	= SECTOR_TO_BYTE(sect_e - sect_s + 1);	/* get the real size */
+		PMBD_BUFFER_T* buffer = PBN_TO_PMBD_BUFFER(pmbd, pbn);
+
+		/* lock the physical block first */
+		PMBD_BLOCK_LOCK(pmbd, pbn);
+
+		/* check if the block is in the buffer */
+		bbi = _pmbd_buffer_lookup(buffer, pbn);
+
+		/* start reading data */
+		if (bbi) { 
+			/* if buffered, read it from the buffer (fill the missing lines first) */
+			uint64_t mask = pmbd_buffer_line_mask(pmbd, SECTOR_TO_BYTE(sect_s), size);
+			if ((bbi->valid_mask & mask) != mask)
+				pmbd_buffer_fill_block(buffer, bbi);
+
+			from = PMBD_BUFFER_BLOCK(buffer, PMBD_BUFFER_BBI_INDEX(buffer, bbi)) + SECTOR_TO_BYTE(sect_s);
+
+			/* read it out */
+			memcpy(to, from, size);
+
+		} else {
+			/* if not buffered, read it from PM space (checksum is verified along with the copy) */
+			from = PMBD_BLOCK_VADDR(pmbd, pbn) + SECTOR_TO_BYTE(sect_s);
+			memcpy_from_pmbd(pmbd, to, from, size);
+		}
+
+		/* unlock the block */
+		PMBD_BLOCK_UNLOCK(pmbd, pbn);
+
+		to += size;
+	}
+
+	return;
+}
+
+/*
+ * refresh the buffered copies of the blocks written through to PM
+ * @pmbd:	pmbd device
+ * @src:	the data just written to PM
+ * @sector:	the start sector
+ * @bytes:	the request size
+ *
+ * A FUA write on a buffered device goes directly to PM (see copy_to_pmbd()).
+ * If some of its blocks are also in the buffer, the buffered copies are dirty
+ * and would be flushed later, so we apply the same data to them and clear the
+ * dirty bits of the lines the write covers; a block with no dirty line left
+ * is clean and the flusher skips it. Blocks not buffered are left alone, so
+ * no buffer block is allocated and no data is copied twice. 
+ *
+ * NOTE: The caller must hold the block locks of the whole range. 
+ */
+static void pmbd_buffer_refresh_blocks(PMBD_DEVICE_T* pmbd, void *src, sector_t sector, size_t bytes)
+{
+	PBN_T pbn = 0;
+	void* from = src;
+
+	PBN_T pbn_s 	= SECTOR_TO_PBN(pmbd, sector);
+	PBN_T pbn_e 	= BYTE_TO_PBN(pmbd, SECTOR_TO_BYTE(sector) + bytes - 1);
+	sector_t offset_s = pmbd_buffer_aligned_request_start(pmbd, sector, bytes);
+	sector_t offset_e = pmbd_buffer_aligned_request_end(pmbd, sector, bytes);
+
+	for (pbn = pbn_s; pbn <= pbn_e; pbn ++){
+		PMBD_BBI_T* bbi = NULL;
+		sector_t sect_s	= (pbn == pbn_s) ? offset_s : 0;				
+		sector_t sect_e	= (pbn == pbn_e) ? offset_e : (PBN_TO_SECTOR(pmbd, 1) - 1);/* sub-block access */
+		size_t size 	= SECTOR_TO_BYTE(sect_e - sect_s + 1);	/* get the real size */
+		PMBD_BUFFER_T* buffer = PBN_TO_PMBD_BUFFER(pmbd, pbn);
+
+		if ((bbi = _pmbd_buffer_lookup(buffer, pbn))) {
+			void* to = PMBD_BUFFER_BLOCK(buffer, PMBD_BUFFER_BBI_INDEX(buffer, bbi)) + SECTOR_TO_BYTE(sect_s);
+			memcpy(to, from, size);
+			bbi->valid_mask |= pmbd_buffer_line_mask(pmbd, SECTOR_TO_BYTE(sect_s), size);
+
+			/* the lines overwritten are durable now, a line only
+			 * partially written keeps the rest of its dirty data */
+			bbi->line_mask &= ~pmbd_line_mask_full(PMBD_BUFFER_LINE_SIZE(pmbd), SECTOR_TO_BYTE(sect_s), size);
+			if (bbi->line_mask == 0)
+				PMBD_BUFFER_SET_BBI_CLEAN(buffer, PMBD_BUFFER_BBI_INDEX(buffer, bbi));
+		}
+
+		from += size;
+	}
+
+	return;
+}
+
+/*
+ * buffer related space alloc/free functions
+ */
+/* the num of block lock bits, sized by the buffers (see pmbd_buffer_create()) */
+static PBN_T pmbd_pbi_lock_num(PMBD_DEVICE_T* pmbd)
+{
+	unsigned long long bufsize = MAX_OF(g_pmbd_bufsize[pmbd->pmbd_id], PMBD_BUFFER_MIN_BUFSIZE);
+	uint64_t num = (MB_TO_BYTES(bufsize) / pmbd->pb_size) * pmbd->num_buffers * PMBD_BLOCK_LOCKS_PER_BBN;
+
+	/* no more than one bit per block */
+	num = MIN_OF(num, PMBD_TOTAL_PB_NUM(pmbd));
+	num = MAX_OF(num, BITS_PER_LONG);
+	return roundup_pow_of_two(num);
+}
+
+static int pmbd_pbi_space_alloc(PMBD_DEVICE_T* pmbd)
+{
+	int err = 0;
+	PBN_T num = pmbd_pbi_lock_num(pmbd);
+	size_t bytes = BITS_TO_LONGS(num) * sizeof(unsigned long);
+
+	/* allocate the block lock bits (all unlocked) */
+	pmbd->pbi_locks = vmalloc(bytes);
+	if (pmbd->pbi_locks) {
+		memset(pmbd->pbi_locks, 0, bytes);
+		pmbd->pbi_lock_mask = num - 1;
+		printk(KERN_INFO "pmbd(%d): pbi space is initialized (%llu lock bits, %lu KB)\n", 
+				pmbd->pmbd_id, (unsigned long long) num, (unsigned long) (bytes >> KB_SHIFT));
+	} else {
+		err = -ENOMEM;
+	}
+
+	return err;
+}
+
+static int pmbd_pbi_space_free(PMBD_DEVICE_T* pmbd)
+{
+	if (pmbd->pbi_locks){
+		vfree(pmbd->pbi_locks);
+		pmbd->pbi_locks = NULL;
+		printk(KERN_INFO "pmbd(%d): pbi space is freed\n", pmbd->pmbd_id);
+	}
+	return 0;
+}
+
+static PMBD_BUFFER_T* pmbd_buffer_create(PMBD_DEVICE_T* pmbd)
+{
+	int i;
+	PMBD_BUFFER_T* buffer = kzalloc (sizeof(PMBD_BUFFER_T), GFP_KERNEL);
+	if (!buffer){
+		goto fail;
+	}
+
+	/* link to the pmbd device */	
+	buffer->pmbd = pmbd;
+
+	/* set size */
+	if (g_pmbd_bufsize[pmbd->pmbd_id] > PMBD_BUFFER_MIN_BUFSIZE) {
+		buffer->num_blocks = MB_TO_BYTES(g_pmbd_bufsize[pmbd->pmbd_id]) / pmbd->pb_size;
+	} else {
+		if (PMBD_DEV_USE_BUFFER(pmbd)) {
+			printk(KERN_INFO "pmbd(%d): WARNING - too small buffer size (%llu MBs). Buffer set to %d MBs\n", 
+				pmbd->pmbd_id, g_pmbd_bufsize[pmbd->pmbd_id], PMBD_BUFFER_MIN_BUFSIZE);
+		}
+		buffer->num_blocks = MB_TO_BYTES(PMBD_BUFFER_MIN_BUFSIZE) / pmbd->pb_size;
+	}
+	
+	/* buffer space */
+	buffer->buffer_space = vmalloc(buffer->num_blocks * pmbd->pb_size);
+	if (!buffer->buffer_space)
+		goto fail;
+
+	/* BBI array */
+	buffer->bbi_space = vmalloc(buffer->num_blocks * sizeof(PMBD_BBI_T));
+	if (!buffer->bbi_space)
+		goto fail;
+	memset(buffer->bbi_space, 0, buffer->num_blocks * sizeof(PMBD_BBI_T));
+
+	/* temporary array of bbi for sorting */
+	buffer->bbi_sort_buffer = vmalloc(buffer->num_blocks * sizeof(PMBD_BSORT_ENTRY_T));
+	if (!buffer->bbi_sort_buffer)
+		goto fail;
+
+	/* PBN->BBN hash (at least one bucket per buffer block) */
+	buffer->hash_bits = ilog2(roundup_pow_of_two(buffer->num_blocks));
+	buffer->hash_heads = vmalloc(PMBD_BUFFER_HASH_NUM(buffer) * sizeof(BBN_T));
+	if (!buffer->hash_heads)
+		goto fail;
+	for (i = 0; i < PMBD_BUFFER_HASH_NUM(buffer); i ++)
+		buffer->hash_heads[i] = PMBD_BUFFER_BBN_NONE;
+
+	buffer->hash_locks = kzalloc(BITS_TO_LONGS(PMBD_BUFFER_HASH_NUM(buffer)) * sizeof(unsigned long), GFP_KERNEL);
+	if (!buffer->hash_locks)
+		goto fail;
+
+	/* initialize the locks*/
+	spin_lock_init(&buffer->flush_lock);
+
+	/* initialize the BBI array */
+	for (i = 0; i < buffer->num_blocks; i ++){
+		PMBD_BUFFER_SET_BBI_CLEAN(buffer, i);
+		PMBD_BUFFER_SET_BBI_UNBUFFERED(buffer, i);
+		PMBD_BUFFER_BBI(buffer, i)->line_mask = 0;
+		PMBD_BUFFER_BBI(buffer, i)->valid_mask = 0;
+		PMBD_BUFFER_BBI(buffer, i)->hnext = PMBD_BUFFER_BBN_NONE;
+	}
+	
+	/* initialize the buffer control info */
+	atomic_set(&buffer->num_dirty, 0);
+	buffer->pos_dirty = 0;
+	atomic64_set(&buffer->pos_clean, 0);
+	buffer->batch_size = g_pmbd_buffer_batch_size[pmbd->pmbd_id];
+
+	/* launch the syncer daemon */
+	pmbd_buffer_syncer_init(buffer);
+	if (!buffer->syncer) 
+		goto fail;
+
+	printk(KERN_INFO "pmbd: pmbd device buffer (%u) allocated (%lu blocks - block size %u bytes)\n", 
+			buffer->buffer_id, buffer->num_blocks, pmbd->pb_size);
+	return buffer;
+
+fail:
+	if (buffer && buffer->hash_locks)
+		kfree(buffer->hash_locks);
+	if (buffer && buffer->hash_heads)
+		vfree(buffer->hash_heads);
+	if (buffer && buffer->bbi_sort_buffer)
+		vfree(buffer->bbi_sort_buffer);
+	if (buffer && buffer->bbi_space)
+		vfree(buffer->bbi_space);
+	if (buffer && buffer->buffer_space)
+		vfree(buffer->buffer_space);
+	if (buffer)
+		kfree(buffer);
+	printk(KERN_ERR "%s(%d) vzalloc failed\n", __FUNCTION__, __LINE__);
+	return NULL;
+}
+
+static int pmbd_buffer_destroy(PMBD_BUFFER_T* buffer)
+{
+	unsigned id = buffer->buffer_id;
+
+	/* stop syncer first */
+	pmbd_buffer_syncer_stop(buffer);
+	
+	/* flush the buffer to the PM space */
+	pmbd_buffer_check_and_flush(buffer, buffer->num_blocks, CALLER_DESTROYER);
+	
+	/* FIXME: wait for the on-going operations to finish first? */
+	if (buffer && buffer->hash_locks)
+		kfree(buffer->hash_locks);
+	if (buffer && buffer->hash_heads)
+		vfree(buffer->hash_heads);
+	if (buffer && buffer->bbi_sort_buffer)
+		vfree(buffer->bbi_sort_buffer);
+	if (buffer && buffer->bbi_space)
+		vfree(buffer->bbi_space);
+	if (buffer && buffer->buffer_space)
+		vfree(buffer->buffer_space);
+	if (buffer)
+		kfree(buffer);
+	printk(KERN_INFO "pmbd: pmbd device buffer (%u) space freed\n", id);
+	return 0;
+}
+
+static int pmbd_buffers_create(PMBD_DEVICE_T* pmbd)
+{
+	int i;
+	for (i = 0; i < pmbd->num_buffers; i ++){
+		pmbd->buffers[i] = pmbd_buffer_create(pmbd);
+		if (pmbd->buffers[i] == NULL)
+			return -ENOMEM;
+		(pmbd->buffers[i])->buffer_id = i;
+	}
+	return 0;
+}
+
+static int pmbd_buffers_destroy(PMBD_DEVICE_T* pmbd)
+{
+	int i;
+	for (i = 0; i < pmbd->num_buffers; i ++){
+		if(pmbd->buffers[i]){
+			pmbd_buffer_destroy(pmbd->buffers[i]);
+			pmbd->buffers[i] = NULL;
+		}
+	}
+	return 0;
+}
+
+static int pmbd_buffer_space_alloc(PMBD_DEVICE_T* pmbd)
+{
+	int err = 0;
+	
+	if (pmbd->num_buffers <= 0)
+		return 0;
+
+	/* allocate buffers array */
+	pmbd->buffers = kzalloc (sizeof(PMBD_BUFFER_T*) * pmbd->num_buffers, GFP_KERNEL);
+	if (pmbd->buffers == NULL){
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	/* allocate each buffer */
+	err = pmbd_buffers_create(pmbd);
+	printk(KERN_INFO "pmbd: pmbd buffer space allocated.\n");
+fail:
+	return err;
+}
+
+static int pmbd_buffer_space_free(PMBD_DEVICE_T* pmbd)
+{
+	if (pmbd->num_buffers <=0)
+		return 0;
+
+	pmbd_buffers_destroy(pmbd);
+	kfree(pmbd->buffers);
+	pmbd->buffers = NULL;
+	printk(KERN_INFO "pmbd: pmbd buffer space freed.\n");
+
+	return 0;
+}
+
+/* the stream slots and the frequency sketch of buffer admission (see pmbd_buffer_admit()) */
+static int pmbd_admit_alloc(PMBD_DEVICE_T* pmbd)
+{
+	uint64_t num_blocks = 0;
+	uint64_t words = 0;
+	unsigned i;
+
+	pmbd->admit_streams = NULL;
+	if (!PMBD_USE_ADMIT() || !PMBD_DEV_USE_BUFFER(pmbd))
+		return 0;
+
+	for (i = 0; i < pmbd->num_buffers; i ++)
+		num_blocks += pmbd->buffers[i]->num_blocks;
+	words = PMBD_ADMIT_SKETCH_WORDS(num_blocks);
+
+	pmbd->admit_sketch.table = vmalloc(words * sizeof(uint64_t));
+	if (pmbd->admit_sketch.table == NULL){
+		printk(KERN_ERR "pmbd:%s(%d) cannot allocate the admission sketch (%llu words)\n", 
+				__FUNCTION__, __LINE__, words);
+		return -ENOMEM;
+	}
+	memset(pmbd->admit_sketch.table, 0, words * sizeof(uint64_t));
+	pmbd->admit_sketch.mask = words - 1;
+	atomic64_set(&pmbd->admit_sketch.adds, 0);
+	pmbd->admit_sketch.sample = PMBD_ADMIT_SKETCH_SAMPLE(num_blocks);
+
+	/* zeroed, so no stream is tracked at first */
+	pmbd->admit_streams = alloc_percpu(PMBD_ADMIT_STREAMS_T);
+	if (pmbd->admit_streams == NULL){
+		printk(KERN_ERR "pmbd:%s(%d) cannot allocate the admission streams\n", __FUNCTION__, __LINE__);
+		vfree(pmbd->admit_sketch.table);
+		pmbd->admit_sketch.table = NULL;
+		return -ENOMEM;
+	}
+
+	printk(KERN_INFO "pmbd: buffer admission enabled (%llu KB sketch)\n", BYTES_TO_KB(words * sizeof(uint64_t)));
+	return 0;
+}
+
+static void pmbd_admit_free(PMBD_DEVICE_T* pmbd)
+{
+	if (pmbd->admit_streams){
+		free_percpu(pmbd->admit_streams);
+		pmbd->admit_streams = NULL;
+	}
+	if (pmbd->admit_sketch.table){
+		vfree(pmbd->admit_sketch.table);
+		pmbd->admit_sketch.table = NULL;
+	}
+	return;
+}
+
+
+/*
+ * *************************************************************************
+ * High memory based PMBD functions
+ * *************************************************************************
+ *
+ * NOTE:
+ * (1) memcpy_fromio() and memcpy_intoio() are used for reading/writing PM,
+ *     but it is unnecessary on x86 architectures.
+ * (2) Currently we only allocate the reserved space to multiple PMBDs once.  
+ *     No dynamic allocate/deallocate of the space is needed so far. 
+ * (3) The devices are allocated from the bottom of the reserved space, and
+ *     their checksum areas (if checksum is enabled) from the top, so the
+ *     data of a device stays at the same place whether checksum is enabled
+ *     or not.
+ */
+
+
+/* the size of a page at a page table level (0 if not supported) */
+static inline unsigned long pmbd_page_level_size(unsigned int level)
+{
+	if (level == PG_LEVEL_4K)
+		return PAGE_SIZE;
+	else if (level == PG_LEVEL_2M)
+		return PMD_SIZE;
+#ifdef CONFIG_X86_64
+	else if (level == PG_LEVEL_1G)
+		return PUD_SIZE;
+#endif
+	return 0;
+}
+
+/*
+ * count the pages of each size the HM space is mapped with
+ *
+ * ioremap uses 2MB/1GB pages where the physical space is aligned to them,
+ * unless the kernel is built without CONFIG_HAVE_ARCH_HUGE_VMAP or booted
+ * with "nohugeiomap" (the 1GB pages also need CPU support). Since hmo and
+ * hms are in GBs, the whole space is aligned.
+ *
+ * @num_large: the num of 2MB/1GB pages
+ * return the smallest page size (0 if some page is not mapped)
+ */
+static unsigned long pmbd_highmem_map_granularity(unsigned long* num_large)
+{
+	unsigned long va = (unsigned long) g_highmem_virt_addr;
+	unsigned long end = va + g_highmem_size;
+	unsigned long num_4k = 0, num_2m = 0, num_1g = 0;
+
+	while (va < end) {
+		unsigned int level;
+		unsigned long size;
+		pte_t* ptep = lookup_address(va, &level);
+
+		if (!ptep || !(size = pmbd_page_level_size(level))){
+			printk(KERN_ERR "pmbd:%s(%d) high memory page %lx is not mapped\n", __FUNCTION__, __LINE__, va);
+			return 0;
+		}
+
+		if (size == PAGE_SIZE)
+			num_4k ++;
+		else if (size == PMD_SIZE)
+			num_2m ++;
+		else
+			num_1g ++;
+		va = (va & ~(size - 1)) + size;
+	}
+
+	printk(KERN_INFO "pmbd: high memory space mapped with %lu 1GB pages, %lu 2MB pages and %lu 4KB pages\n", 
+			num_1g, num_2m, num_4k);
+	*num_large = num_2m + num_1g;
+	if (num_4k)
+		return PAGE_SIZE;
+	else if (num_2m)
+		return PMD_SIZE;
+	else
+		return PUD_SIZE;
+}
+
+static void* pmbd_highmem_map(void)
+{
+	/* 
+	 * NOTE: we can also use ioremap_* functions to directly set memory
+	 * page attributes when do remapping, but to make it consistent with
+	 * using vmalloc(), we do ioremap_cache() and call set_memory_* later. 
+	 */
+
+	if (PMBD_USE_PMAP()){
+		/* NOTE: If we use pmap(), we don't need to map the reserved
+		 * physical memory into the kernel space. Instead we use
+		 * pmap_atomic() to make and unmap the to-be-accessed pages on
+		 * demand. Since such mapping is private to the processor,
+		 * there is no need to change PTE, and TLB shootdown either. 
+		 *
+		 * Also note that We use PMBD_PMAP_DUMMY_BASE_VA to make the rest
+		 * of code happy with a valid virtual address. The real
+		 * physical address is calculated as follows:
+		 * g_highmem_phys_addr + (vaddr) - PMBD_PMAP_DUMMY_BASE_VA 
+		 *
+		 * (updated 10/25/2011) 
+		 */
+
+		g_highmem_virt_addr = (void*) PMBD_PMAP_DUMMY_BASE_VA;
+		g_highmem_curr_addr = g_highmem_virt_addr;
+		g_highmem_top_addr = g_highmem_virt_addr + g_highmem_size;
+		g_highmem_map_size = PAGE_SIZE;
+		printk(KERN_INFO "pmbd: PMAP enabled - setting g_highmem_virt_addr to a dummy address (%d)\n", PMBD_PMAP_DUMMY_BASE_VA);
+		return g_highmem_virt_addr;
+
+	} else if ((g_highmem_virt_addr = ioremap_prot(g_highmem_phys_addr, g_highmem_size, PMBD_CACHE_PROT(g_pmbd_cpu_cache_flag)))) {
+
+		g_highmem_curr_addr = g_highmem_virt_addr;
+		g_highmem_top_addr = g_highmem_virt_addr + g_highmem_size;
+		printk(KERN_INFO "pmbd: high memory space remapped (offset: %llu MB, size=%lu MB, cache flag=%s)\n",
+			BYTES_TO_MB(g_highmem_phys_addr), BYTES_TO_MB(g_highmem_size), PMBD_CPU_CACHE_FLAG());
+
+		/* report the page sizes (4KB pages are refused with hugemapY) */
+		g_highmem_map_size = pmbd_highmem_map_granularity(&g_highmem_map_large);
+		if (!g_highmem_map_size){
+			printk(KERN_ERR "pmbd: %s(%d) - cannot walk the high memory mapping\n", __FUNCTION__, __LINE__);
+			iounmap(g_highmem_virt_addr);
+			g_highmem_virt_addr = NULL;
+			return NULL;
+		}
+		if (g_highmem_hugemap && g_highmem_map_size <= PAGE_SIZE){
+			printk(KERN_ERR "pmbd: %s(%d) - high memory space is not mapped with 2MB/1GB pages (hugemapY)\n",
+				__FUNCTION__, __LINE__);
+			iounmap(g_highmem_virt_addr);
+			g_highmem_virt_addr = NULL;
+			return NULL;
+		}
+		printk(KERN_INFO "pmbd: high memory mapping granularity is %lu KB\n", BYTES_TO_KB(g_highmem_map_size));
+		return g_highmem_virt_addr;
+
+	} else {
+
+		printk(KERN_ERR "pmbd: %s(%d) - failed remapping high memory space (offset: %llu MB size=%lu MB)\n",
+			__FUNCTION__, __LINE__, BYTES_TO_MB(g_highmem_phys_addr), BYTES_TO_MB(g_highmem_size));
+		return NULL;
+	}
+}
+
+static void pmbd_highmem_unmap(void)
+{
+	/* de-remap the high memory from kernel address space */
+	/* NOTE: if we use pmap(), the g_highmem_virt_addr is fake */
+	if (!PMBD_USE_PMAP()){ 
+		if(g_highmem_virt_addr){
+			iounmap(g_highmem_virt_addr);
+			g_highmem_virt_addr = NULL;
+			printk(KERN_INFO "pmbd: unmapping high mem space (offset: %llu MB, size=%lu MB)is unmapped\n",
+				BYTES_TO_MB(g_highmem_phys_addr), BYTES_TO_MB(g_highmem_size));
+		}
+	}
+	return;
+}
+
+static void* hmalloc(uint64_t bytes)
+{
+	void* rtn = NULL;
+	
+	/* check if there is still available reserve high memory space */
+	if (bytes <= PMBD_HIGHMEM_AVAILABLE_SPACE) {
+		rtn = g_highmem_curr_addr;
+		g_highmem_curr_addr += bytes;
+	} else {
+		printk(KERN_ERR "pmbd: %s(%d) - no available space (< %llu bytes) in reserved high memory\n", 
+			__FUNCTION__, __LINE__, bytes);
+	}
+	return rtn;
+}
+
+/* allocate from the top of the reserved space (for checksum areas) */
+static void* hmalloc_top(uint64_t bytes)
+{
+	void* rtn = NULL;
+
+	if (bytes <= PMBD_HIGHMEM_AVAILABLE_SPACE) {
+		g_highmem_top_addr -= bytes;
+		rtn = g_highmem_top_addr;
+	} else {
+		printk(KERN_ERR "pmbd: %s(%d) - no available space (< %llu bytes) in reserved high memory\n", 
+			__FUNCTION__, __LINE__, bytes);
+	}
+	return rtn;
+}
+
+static int hfree(void* addr)
+{	
+	/* FIXME: no support for dynamic alloc/dealloc in HIGH_MEM space */
+	return 0;
+}
+
+
+/*
+ * *************************************************************************
+ * Device Emulation
+ * *************************************************************************
+ *
+ * Our emulation is based on a simple model - access time and transfer time.
+ *
+ *     emulated time = access time + (request size / bandwidth)
+ *     inserted delay = emulated time - observed time
+ *
+ * (1) Access time is applied to each request. We check each request's real
+ * access time and pad it with an extra delay to meet the designated latency.
+ * This is a best-effort solution, which means we just guarantee that no
+ * request can be completed with a response time less than the specified
+ * latency, but the real access latencies could be higher. In addition, if the
+ * total number of threads is larger than the number of available processors,
+ * the simulated latencies could be higher, due to CPU saturation. 
+ *
+ * (2) Transfer time is calculated based on batches
+ *     - A batch is a sequence of consecutive requests with a short interval in
+ *     between; requests in a batch can be overlapped with each other (parallel
+ *     jobs); there is a limit for the total amount of data and the duration of
+ *     a batch 
+ *     - For each batch, we calculate its target emulated transfer time as
+ *     "emul_trans_time = num_sectors/emul_bandwidth" and calculate a delay as
+ *     "delay = emul_trans_time - real_trans_time"
+ *     - The calculated delay is applied to each batch at the end
+ *     - A lock is used to slow down all threads, because bandwidth is a
+ *     system-wide specification. In this way, we serialize the threads
+ *     accessing the device, which simulates that the device is busy on a task.
+ *
+ * (3) Two types of delays implemented 
+ *     - Sync delay:  if delay is less than 10ms, we keep polling the TSC
+ *     counter, which is basically "busy waiting", like spin-lock. This allows
+ *     to reach precision of one hundred of cycles
+ *     - Async delay: if delay is more than 10ms, we call msleep() to sleep for
+ *     a while, which relinquish CPU control, which results in a low precision.
+ *     The left-over delay is done with sync delay in nanosecs.  Async delay
+ *     cannot be used while holding a lock.
+ *
+ */ 
+
+
+static inline unsigned int get_cpu_freq(void)
+{
+#if 0
+	unsigned int khz = cpufreq_quick_get(0);  /* FIXME: use cpufreq_get() ??? */
+	if (!khz) 
+		khz = cpu_khz;
+	printk("khz=%u, cpu_khz=%u\n", khz, cpu_khz);
+#endif
+	return cpu_khz;
+}
+
+static inline uint64_t cycle_to_ns(uint64_t cycle)
+{
+	unsigned int khz = get_cpu_freq();
+	return pmbd_cycle_to_ns(cycle, khz);
+}
+
+static inline uint64_t ns_to_cycle(uint64_t ns)
+{
+	unsigned int khz = get_cpu_freq();
+	return div64_u64(ns * khz, 1000000);
+}
+
+/* the transfer time is emulated with pmbd_trans_time() (pmbd_core.c) */
+
+static uint64_t cal_access_time(unsigned int num_sectors, unsigned rw, PMBD_DEVICE_T* pmbd)
+{
+	uint64_t ns = (rw == READ) ? pmbd->rdlat : pmbd->wrlat; /* access time */
+	return ns;
+}
+
+static inline void sync_slowdown(uint64_t ns)
+{
+	uint64_t start, now;
+	unsigned int khz = get_cpu_freq();
+	if (ns) {
+		/* 
+		 * We keep reading TSC counter to check if the delay has
+		 * been passed and this prevents CPU from being scaled down,
+		 * which provides a stable estimation of the elapsed time.
+		 */
+		TIMESTAMP(start);
+		while(1) {
+			TIMESTAMP(now);
+			if (pmbd_cycle_to_ns((now-start), khz) > ns)
+				break;
+		}
+	}
+	return;
+}
+
+static inline void sync_slowdown_cycles(uint64_t cycles)
+{
+
+	uint64_t start, now;
+	if (cycles){
+		/* 
+		 * We keep reading TSC counter to check if the delay has
+		 * been passed and this prevents CPU from being scaled down,
+		 * which provides a stable estimation of the elapsed time.
+		 */
+		TIMESTAMP(start);
+		while(1) {
+			TIMESTAMP(now);
+			if ((now - start) >= cycles)
+				break;
+		}
+	}
+	return;
+}
+
+static inline void async_slowdown(uint64_t ns)
+{
+	uint64_t ms = ns / 1000000;
+	uint64_t left = ns - (ms * 1000000);
+	/* do ms delay with sleep */
+	msleep(ms);		
+
+	/* make up the sub-ms delay */
+	sync_slowdown(left);	
+}
+
+#if 0
+static inline void slowdown_us(unsigned long long us)
+{
+	set_current_state(TASK_INTERRUPTIBLE);
+	schedule_timeout(us * HZ / 1000000);
+}
+#endif
+
+static void pmbd_slowdown(uint64_t ns, unsigned in_lock)
+{
+	/* 
+	 * NOTE: if the delay is less than 10ms, we use sync_slowdown to keep
+	 * polling the CPU cycle counter and busy waiting for the delay elapse;
+	 * otherwise, we use msleep() to relinquish the CPU control. 
+	 */
+	if (ns > MAX_SYNC_SLOWDOWN && !in_lock)
+		async_slowdown(ns);
+	else if (ns > 0) 
+		sync_slowdown(ns);
+
+	return;
+}
+
+/*
+ * Emulating the transfer time for a batch of requests for specific bandwidth
+ * 
+ * We group a bunch of consecutive requests as a "batch". In one batch, the
+ * interval between two consecutive requests should be small, and the total
+ * amount of accessed data should be a good size (not too small, not too
+ * large), the duration is reasonable (not too long). For each batch, we
+ * estimate the emulated transfer time and compare it with the real transfer
+ * time (the start and end time of the batch), if the real transfer time is
+ * less than the emulated time, we apply an extra delay to the end of batch for
+ * making up the difference. In this way we can make the bandwidth emulation
+ * closer to real situation. 
+ *
+ * Note that, since requests from multiple threads could be processed in
+ * parallel, the bandwidth must be shared by ALL the threads accessing the PMBD
+ * device. Each emulation context (one per CPU/hardware context) keeps its own
+ * batch and emulates the transfer time with its share of the bandwidth, so
+ * CPUs do not serialize on a device-wide lock. The shares are reconciled
+ * periodically (see pmbd_emul_reconcile()). 
+ *
+ * @num_sectors: the num of sectors of the request
+ * @rw: read or write
+ * @pmbd: the involved pmbd device
+ *
+ */
+
+/*
+ * reconcile the bandwidth shares of the emulation contexts
+ *
+ * Every PMBD_EMUL_RECONCILE_INTERVAL, one thread (whoever gets the trylock)
+ * splits the device bandwidth among the contexts proportionally to their
+ * demand in the last interval. An idle context is given the share it would
+ * get if it joined the active ones, so that a new burst is not starved before
+ * the next reconciliation.
+ */
+static void pmbd_emul_reconcile(PMBD_DEVICE_T* pmbd, uint64_t now_cycle)
+{
+	unsigned i;
+	int rw;
+
+	if (now_cycle < pmbd->emul_reconcile_cycle || 
+	    cycle_to_ns(now_cycle - pmbd->emul_reconcile_cycle) < PMBD_EMUL_RECONCILE_INTERVAL)
+		return;
+
+	if (!spin_trylock(&pmbd->emul_reconcile_lock))
+		return;
+
+	/* check again (someone else may have just done it) */
+	if (cycle_to_ns(now_cycle - pmbd->emul_reconcile_cycle) < PMBD_EMUL_RECONCILE_INTERVAL)
+		goto done;
+
+	for (rw = READ; rw <= WRITE; rw ++){
+		uint64_t bw = (rw == READ) ? pmbd->rdbw : pmbd->wrbw;
+		uint64_t total = 0;
+		uint64_t nr_active = 0;
+
+		/* collect the demand of the last interval */
+		for (i = 0; i < pmbd->num_emul_ctx; i ++){
+			uint64_t demand = atomic64_read(&pmbd->emul_ctx[i].demand[rw]);
+			total += demand;
+			if (demand)
+				nr_active ++;
+		}
+
+		/* split the bandwidth */
+		for (i = 0; i < pmbd->num_emul_ctx; i ++){
+			PMBD_EMUL_CTX_T* ctx = &pmbd->emul_ctx[i];
+			uint64_t demand = atomic64_xchg(&ctx->demand[rw], 0);
+
+			ctx->bw_share[rw] = pmbd_bw_share(bw, demand, total, nr_active);
+		}
+	}
+
+	pmbd->emul_reconcile_cycle = now_cycle;
+done:
+	spin_unlock(&pmbd->emul_reconcile_lock);
+	return;
+}
+
+static void pmbd_emul_transfer_time(int num_sectors, int rw, PMBD_DEVICE_T* pmbd, PMBD_EMUL_CTX_T* ctx)
+{
+	uint64_t interval_ns 	= 0;
+	uint64_t duration_ns 	= 0; 
+	unsigned new_batch 	= FALSE;
+	unsigned end_batch 	= FALSE;
+	uint64_t now_cycle 	= 0;
+
+	spin_lock(&ctx->batch_lock);
+
+	/* account the demand of this context */
+	atomic64_add(num_sectors, &ctx->demand[rw]);
+
+	/* get a timestamp for now */
+	TIMESTAMP(now_cycle);
+
+	/* if this is the first timestamp */
+	if (ctx->batch_start_cycle[rw] == 0) {
+		ctx->batch_start_cycle[rw] = now_cycle;
+		ctx->batch_end_cycle[rw] = now_cycle;
+		goto done;
+	}
+
+	/* calculate the interval from the last request */
+	if (now_cycle >= ctx->batch_end_cycle[rw]){
+		interval_ns = cycle_to_ns(now_cycle - ctx->batch_end_cycle[rw]); 
+	} else {
+		panic(KERN_ERR "%s(%d): timestamp in the past found.\n", __FUNCTION__, __LINE__);
+	}
+
+	/* check the interval length (cannot be too distant) */
+	if (interval_ns >= PMBD_BATCH_MAX_INTERVAL) {
+		/* interval is too big, break it to two batches */
+		new_batch = TRUE;
+		end_batch = TRUE;
+	} else {
+		/* still in the same batch, good */
+		ctx->batch_sectors[rw] += num_sectors;
+		ctx->batch_end_cycle[rw] = now_cycle;
+	}
+
+	/* check current batch duration (cannot be too long) */
+	duration_ns = cycle_to_ns(ctx->batch_end_cycle[rw] - ctx->batch_start_cycle[rw]);
+	if (duration_ns >= PMBD_BATCH_MAX_DURATION) 
+		end_batch = TRUE;
+
+	/* check current batch data amount (cannot be too large) */
+	if (ctx->batch_sectors[rw] >= PMBD_BATCH_MAX_SECTORS)
+		end_batch = TRUE;
+
+	/* if the batch ends, check and apply slow-down */
+	if (end_batch) {
+		/* batch size must be large enough, if not, just skip it */
+		if (ctx->batch_sectors[rw] > PMBD_BATCH_MIN_SECTORS) {
+			uint64_t real_ns = cycle_to_ns(ctx->batch_end_cycle[rw] - ctx->batch_start_cycle[rw]);
+			uint64_t emul_ns = pmbd_trans_time(ctx->batch_sectors[rw], ctx->bw_share[rw]);
+
+			if (emul_ns > real_ns)
+				pmbd_slowdown((emul_ns - real_ns), TRUE);
+		}
+
+		ctx->batch_sectors[rw] = 0;
+		ctx->batch_start_cycle[rw] = now_cycle;
+		ctx->batch_end_cycle[rw] = now_cycle;
+	}
+
+	/* if a new batch begins, add the first request */
+	if (new_batch) {
+		ctx->batch_sectors[rw] = num_sectors;
+		ctx->batch_start_cycle[rw] = now_cycle;
+		ctx->batch_end_cycle[rw] = now_cycle;
+	}
+
+done:
+	spin_unlock(&ctx->batch_lock);
+
+	/* reconcile the bandwidth shares if it is time */
+	pmbd_emul_reconcile(pmbd, now_cycle);
+	return;
+}
+
+static int pmbd_emul_ctx_alloc(PMBD_DEVICE_T* pmbd)
+{
+	unsigned i;
+
+	pmbd->num_emul_ctx = nr_cpu_ids;
+	pmbd->emul_ctx = kzalloc(sizeof(PMBD_EMUL_CTX_T) * pmbd->num_emul_ctx, GFP_KERNEL);
+	if (!pmbd->emul_ctx){
+		printk(KERN_ERR "pmbd:%s(%d) emulation contexts cannot be allocated\n", __FUNCTION__, __LINE__);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < pmbd->num_emul_ctx; i ++){
+		PMBD_EMUL_CTX_T* ctx = &pmbd->emul_ctx[i];
+		spin_lock_init(&ctx->batch_lock);
+		atomic64_set(&ctx->demand[READ], 0);
+		atomic64_set(&ctx->demand[WRITE], 0);
+
+		/* every context starts with the full bandwidth */
+		ctx->bw_share[READ] = pmbd->rdbw;
+		ctx->bw_share[WRITE] = pmbd->wrbw;
+	}
+	spin_lock_init(&pmbd->emul_reconcile_lock);
+	pmbd->emul_reconcile_cycle = 0;
+
+	/* banked timing model (the times are in cycles) */
+	spin_lock_init(&pmbd->bank_lock);
+	if (PMBD_DEV_USE_BANKS(pmbd)){
+		PMBD_BANK_MODEL_T* m = &pmbd->bank_model;
+
+		m->banks = kzalloc(sizeof(PMBD_BANK_T) * pmbd->banks, GFP_KERNEL);
+		if (pmbd->wqsize)
+			m->wq = kzalloc(sizeof(uint64_t) * pmbd->wqsize, GFP_KERNEL);
+		if (!m->banks || (pmbd->wqsize && !m->wq)){
+			printk(KERN_ERR "pmbd:%s(%d) bank model cannot be allocated\n", __FUNCTION__, __LINE__);
+			pmbd_emul_ctx_free(pmbd);
+			return -ENOMEM;
+		}
+		m->num_banks 		= pmbd->banks;
+		m->row_shift 		= PMBD_BANK_ROW_SHIFT;
+		m->t_hit[READ] 		= ns_to_cycle(pmbd->rowhit);
+		m->t_hit[WRITE] 	= ns_to_cycle(pmbd->rowhit);
+		m->t_miss[READ] 	= ns_to_cycle(pmbd->rdlat);
+		m->t_miss[WRITE] 	= ns_to_cycle(pmbd->wrlat);
+		m->wq_depth 		= pmbd->wqsize;
+		m->wq_head 		= 0;
+	}
+	return 0;
+}
+
+static void pmbd_emul_ctx_free(PMBD_DEVICE_T* pmbd)
+{
+	if (pmbd->emul_ctx){
+		kfree(pmbd->emul_ctx);
+		pmbd->emul_ctx = NULL;
+	}
+	if (pmbd->bank_model.banks){
+		kfree(pmbd->bank_model.banks);
+		pmbd->bank_model.banks = NULL;
+	}
+	if (pmbd->bank_model.wq){
+		kfree(pmbd->bank_model.wq);
+		pmbd->bank_model.wq = NULL;
+	}
+	pmbd->num_emul_ctx = 0;
+	return;
+}
+
+/*
+ * Emulating access time for a request
+ *
+ * Different from emulating bandwidths, we emulate access time for each
+ * individual access. Right after we simulate the transfer time, we examine
+ * the real access time (including transfer time), if the real time is smaller
+ * than the specified access time, we slow down the request by applying a delay
+ * to make up the difference.  Note that we do not use any lock to coordinate
+ * multiple threads for a system-wide "slowdown", but apply this delay on each
+ * request individually and separately. 
+ *
+ * Also note that since we basically use "busy-waiting", when the total number
+ * of threads exceeds or be close to the total number of processors, the
+ * simulated access time observed at application level could be longer than the
+ * specified access time due to high CPU usage. But for each request, after
+ * directly examining the duration of being in the make_request() function, the
+ * simulated access time is still very precise. 
+ *
+ */ 
+static void pmbd_emul_access_time(uint64_t start, uint64_t end, int num_sectors, int rw, PMBD_DEVICE_T* pmbd)
+{
+	/* 
+	 * Access time can be overlapped with each other, so there is no need
+	 * to use a lock to serialize it.
+	 * FIXME: should we apply this on each batch or each request?
+	 */
+	uint64_t real_ns = cycle_to_ns(end - start);
+	uint64_t emul_ns = cal_access_time(num_sectors, rw, pmbd);
+
+	if (emul_ns > real_ns)
+		pmbd_slowdown((emul_ns - real_ns), FALSE);
+		
+	return;
+}
+
+/*
+ * Emulating access time with the banked timing model
+ *
+ * Rather than a flat latency per request, the request is mapped to the banks
+ * by address (see pmbd_bank_access() in pmbd_core.c): it is delayed by the
+ * busy banks it touches, row buffer misses cost rdlat/wrlat and hits rowhit,
+ * and writes stall only when the write queue is full. The model keeps the
+ * state of the whole device, so it is updated under bank_lock, and the delay
+ * is applied outside the lock.
+ */
+static void pmbd_emul_bank_time(uint64_t start, uint64_t end, sector_t sector, int num_sectors, int rw, PMBD_DEVICE_T* pmbd)
+{
+	uint64_t done;
+
+	spin_lock(&pmbd->bank_lock);
+	done = pmbd_bank_access(&pmbd->bank_model, start, SECTOR_TO_BYTE(sector), SECTOR_TO_BYTE(num_sectors), rw == WRITE);
+	spin_unlock(&pmbd->bank_lock);
+
+	if (done > end)
+		pmbd_slowdown(cycle_to_ns(done - end), FALSE);
+
+	return;
+}
+
+/* 
+ * set the starting hook for PM emulation 
+ *
+ * @pmbd: pmbd device
+ * @num_sectors: sectors being accessed
+ * @rw: READ/WRITE
+ * return value: the start cycle
+ */
+static uint64_t emul_start(PMBD_DEVICE_T* pmbd, int num_sectors, int rw)
+{
+	uint64_t start = 0;
+	if (PMBD_DEV_USE_EMULATION(pmbd) && num_sectors > 0) {
+		/* start timer here */
+		TIMESTAMP(start);	
+	}
+	return start;
+}
+
+/* 
+ * set the stopping hook for PM emulation 
+ *
+ * @pmbd: pmbd device
+ * @ctx: the emulation context charged (the one of the hardware context)
+ * @sector: the first sector being accessed
+ * @num_sectors: sectors being accessed
+ * @rw: READ/WRITE
+ * @start: the starting cycle
+ * return value: the end cycle
+ */
+static uint64_t emul_end(PMBD_DEVICE_T* pmbd, PMBD_EMUL_CTX_T* ctx, sector_t sector, int num_sectors, int rw, uint64_t start)
+{
+	uint64_t end = 0;
+	uint64_t end2 = 0;
+	/*
+	 * NOTE: emulation can be done in two ways - (1) directly specify the
+	 * read/write latencies and bandwidths (2) only specify a relative
+	 * slowdown ratio (X), compared to DRAM.
+	 *
+	 * Also note that if rdsx/wrsx is set, we will ignore
+	 * rdlat/wrlat/rdbw/wrbw. 
+	 */
+	if (PMBD_DEV_USE_EMULATION(pmbd) && num_sectors > 0) {
+		/* 
+		 * NOTE: we first attempt to meet the target bandwidth and then
+		 * latency. This means the actual bandwidth should be close
+		 * to the emulated bandwidth, and then we guarantee that the
+		 * latency would not be SMALLER than the target latency. 
+		 */
+
+		/* emulate the bandwidth first */	
+		if (pmbd->rdbw > 0 && pmbd->wrbw > 0) {
+			/* emulate transfer time (bandwidth) */
+			pmbd_emul_transfer_time(num_sectors, rw, pmbd, ctx);
+		}
+
+		/* emulate the latency now */
+		TIMESTAMP(end);
+		if (PMBD_DEV_USE_BANKS(pmbd)) {
+			/* the banked timing model replaces the flat latency */
+			pmbd_emul_bank_time(start, end, sector, num_sectors, rw, pmbd);
+		} else if (pmbd->rdlat > 0 || pmbd->wrlat > 0) {
+			/* emulate access time (latency) */
+			pmbd_emul_access_time(start, end, num_sectors, rw, pmbd);
+		}
+	}
+	/* get the ending timestamp */
+	TIMESTAMP(end2);
+
+	return end2;
+}
+
+/*
+ * charge the PM reads done to checksum partial units along with a copy (see
+ * pmbd_checksum_on_copy()) to the context of the copy
+ *
+ * @pmbd: pmbd device
+ * @ctx: the emulation context charged
+ * @bytes: the bytes read
+ *
+ * They are not part of the transfer the copy is emulated with, and they
+ * overlap its access time, so only the read bandwidth is charged. 
+ */
+static void emul_cks_read(PMBD_DEVICE_T* pmbd, PMBD_EMUL_CTX_T* ctx, size_t bytes)
+{
+	if (PMBD_DEV_USE_EMULATION(pmbd) && bytes > 0 && pmbd->rdbw > 0 && pmbd->wrbw > 0)
+		pmbd_emul_transfer_time(BYTE_TO_SECTOR(bytes), READ, pmbd, ctx);
+	return;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+/*
+ * get the emulated finish time of a request (defer mode)
+ *
+ * @pmbd: pmbd device
+ * @ctx: the emulation context charged (the one of the hardware context)
+ * @sector: the first sector being accessed
+ * @num_sectors: sectors being accessed
+ * @rw: READ/WRITE
+ * @start: the starting cycle
+ * return value: the finish time (cycles)
+ *
+ * Rather than slowing the CPU down until the emulated time has passed (see
+ * emul_end()), the delays are turned into a deadline at which the request is
+ * completed by a timer. The transfers of an emulation context are queued
+ * one after another on a virtual clock (defer_until), so the bandwidth holds
+ * for any queue depth, and the access time is at least the latency (or the
+ * one given by the banked model).
+ */
+static uint64_t emul_deadline(PMBD_DEVICE_T* pmbd, PMBD_EMUL_CTX_T* ctx, sector_t sector, int num_sectors, int rw, uint64_t start)
+{
+	uint64_t now = 0;
+	uint64_t deadline = 0;
+
+	TIMESTAMP(now);
+	deadline = now;
+	if (!PMBD_DEV_USE_EMULATION(pmbd) || num_sectors <= 0 || start == 0)
+		return deadline;
+
+	/* the bandwidth first */
+	if (pmbd->rdbw > 0 && pmbd->wrbw > 0) {
+		spin_lock(&ctx->batch_lock);
+		atomic64_add(num_sectors, &ctx->demand[rw]);
+		if (ctx->defer_until[rw] < start)
+			ctx->defer_until[rw] = start;
+		ctx->defer_until[rw] += ns_to_cycle(pmbd_trans_time(num_sectors, ctx->bw_share[rw]));
+		deadline = MAX_OF(deadline, ctx->defer_until[rw]);
+		spin_unlock(&ctx->batch_lock);
+
+		/* reconcile the bandwidth shares if it is time */
+		pmbd_emul_reconcile(pmbd, now);
+	}
+
+	/* then the latency */
+	if (PMBD_DEV_USE_BANKS(pmbd)) {
+		uint64_t done;
+
+		spin_lock(&pmbd->bank_lock);
+		done = pmbd_bank_access(&pmbd->bank_model, start, SECTOR_TO_BYTE(sector), SECTOR_TO_BYTE(num_sectors), rw == WRITE);
+		spin_unlock(&pmbd->bank_lock);
+		deadline = MAX_OF(deadline, done);
+	} else if (pmbd->rdlat > 0 || pmbd->wrlat > 0) {
+		deadline = MAX_OF(deadline, start + ns_to_cycle(cal_access_time(num_sectors, rw, pmbd)));
+	}
+	return deadline;
+}
+#endif
+
+/*
+ * *************************************************************************
+ * PM space protection functions 
+ * - clflush
+ * - write protection
+ * - write verification
+ * - checksum
+ * *************************************************************************
+ */
+
+/* 
+ * flush designated cache lines in CPU cache 
+ */
+
+/*
+ * write back the cache lines of a range (no fence, see pmbd_flush_fence())
+ *
+ * The instruction is selected at load time (g_pmbd_flush_insn): clwb keeps
+ * the line in the cache, clflushopt invalidates it but, unlike clflush, is
+ * not ordered with the other flushes, so the lines are flushed in parallel.
+ * The loops are unrolled by 4 lines.
+ */
+#define PMBD_FLUSH_LOOP(INSN, P, END) {	\
+	for (; (P) + 4 * PMBD_CACHELINE_SIZE <= (END); (P) += 4 * PMBD_CACHELINE_SIZE) { \
+		INSN((P)); \
+		INSN((P) + PMBD_CACHELINE_SIZE); \
+		INSN((P) + 2 * PMBD_CACHELINE_SIZE); \
+		INSN((P) + 3 * PMBD_CACHELINE_SIZE); \
+	} \
+	for (; (P) < (END); (P) += PMBD_CACHELINE_SIZE) \
+		INSN((P)); \
+}
+
+static inline void pmbd_writeback_range(void* dst, size_t bytes)
+{
+	void* p = (void*) ((unsigned long) dst & ~((unsigned long) PMBD_CACHELINE_SIZE - 1));
+	void* end = dst + bytes;
+
+	switch (g_pmbd_flush_insn) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+	case PMBD_FLUSH_CLWB:
+		PMBD_FLUSH_LOOP(clwb, p, end);
+		break;
+	case PMBD_FLUSH_CLFLUSHOPT:
+		PMBD_FLUSH_LOOP(clflushopt, p, end);
+		break;
+#endif
+	default:
+		PMBD_FLUSH_LOOP(clflush, p, end);
+		break;
+	}
+	return;
+}
+
+/* make the flushed lines durable: clwb/clflushopt are ordered by sfence */
+static inline void pmbd_flush_fence(void)
+{
+	if (g_pmbd_flush_insn == PMBD_FLUSH_CLFLUSH)
+		mfence();
+	else
+		sfence();
+	return;
+}
+
+static inline void pmbd_clflush_all(PMBD_DEVICE_T* pmbd)
+{
+	uint64_t time_p1 = 0;
+	uint64_t time_p2 = 0;
+
+	TIMESTAMP(time_p1);
+	if (PMBD_CPU_HAS_CLFLUSH()){
+#ifdef CONFIG_X86
+		wbinvd_on_all_cpus();
+#else
+		printk(KERN_WARNING "pmbd: WARNING - %s(%d) flush_cache_all() not implemented\n", __FUNCTION__, __LINE__);
+#endif
+	}
+	TIMESTAMP(time_p2);
+
+	/* emulating slowdown */
+	if(PMBD_DEV_USE_SLOWDOWN(pmbd))
+		pmbd_rdwr_slowdown((pmbd), WRITE, time_p1, time_p2);
+
+	/* update time statistics */
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_clflushall[WRITE], time_p2 - time_p1);
+	}
+	return;
+}
+
+static inline void pmbd_clflush_range(PMBD_DEVICE_T* pmbd, void* dst, size_t bytes)
+{
+	uint64_t time_p1 = 0;
+	uint64_t time_p2 = 0;
+
+	TIMESTAMP(time_p1);
+	if (PMBD_CPU_HAS_CLFLUSH()){
+		/* NOTE: the flushes are ordered with the writes to the same line,
+		 * the closing fence is done by pmbd_write_fence() */
+		pmbd_writeback_range(dst, bytes);
+	}
+	TIMESTAMP(time_p2);
+
+	/* emulating slowdown */
+	if(PMBD_DEV_USE_SLOWDOWN(pmbd))
+		pmbd_rdwr_slowdown((pmbd), WRITE, time_p1, time_p2);
+
+	/* update time statistics */
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_clflush[WRITE], time_p2 - time_p1);
+		PMBD_STAT_HIST(pmbd, PMBD_HIST_CLFLUSH, WRITE, time_p2 - time_p1);
+	}
+	return;
+}
+
+/*
+ * dirty-extent log
+ *
+ * Without nts and clflush (WB), the data written to PM stays in the CPU cache
+ * until the write barrier. Instead of dropping the entire cache of all CPUs
+ * with wbinvd, each CPU logs the ranges it writes (coalescing contiguous
+ * ones), and the barrier queues a work item on each CPU to write back the
+ * lines of its own ranges (see pmbd_writeback_range()), so the flush runs in
+ * parallel with interrupts enabled. If more than wbinvd<#> MBs were written
+ * or a log was full, wbinvd is still used. 
+ *
+ * NOTE: not used with pmap, since the ranges are not mapped at the barrier
+ */
+static int pmbd_dirty_log_alloc(PMBD_DEVICE_T* pmbd)
+{
+	int cpu;
+
+	pmbd->dirty_log = NULL;
+	if (!PMBD_USE_DIRTY_LOG())
+		return 0;
+
+	/* a set holds the threshold in pages */
+	pmbd->dirty_log_extents = MAX_OF(PMBD_DIRTY_LOG_MIN_EXTENTS, 
+					MB_TO_BYTES(g_pmbd_wbinvd_threshold) / PAGE_SIZE);
+
+	pmbd->dirty_log = alloc_percpu(PMBD_DIRTY_LOG_T);
+	if (!pmbd->dirty_log){
+		printk(KERN_ERR "pmbd:%s(%d) cannot allocate dirty log\n", __FUNCTION__, __LINE__);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu){
+		PMBD_DIRTY_LOG_T* log = per_cpu_ptr(pmbd->dirty_log, cpu);
+		PMBD_EXTENT_T* extent = vmalloc(2 * pmbd->dirty_log_extents * sizeof(PMBD_EXTENT_T));
+
+		if (!extent){
+			printk(KERN_ERR "pmbd:%s(%d) cannot allocate dirty log extents\n", __FUNCTION__, __LINE__);
+			pmbd_dirty_log_free(pmbd);
+			return -ENOMEM;
+		}
+		spin_lock_init(&log->lock);
+		INIT_WORK(&log->work, pmbd_dirty_log_work);
+		log->pmbd = pmbd;
+		log->set[0].extent = extent;
+		log->set[1].extent = extent + pmbd->dirty_log_extents;
+	}
+	return 0;
+}
+
+static void pmbd_dirty_log_free(PMBD_DEVICE_T* pmbd)
+{
+	int cpu;
+
+	if (pmbd->dirty_log){
+		for_each_possible_cpu(cpu){
+			PMBD_DIRTY_LOG_T* log = per_cpu_ptr(pmbd->dirty_log, cpu);
+			if (log->set[0].extent)
+				vfree(log->set[0].extent);
+		}
+		free_percpu(pmbd->dirty_log);
+		pmbd->dirty_log = NULL;
+	}
+	return;
+}
+
+static inline void pmbd_dirty_log_add(PMBD_DEVICE_T* pmbd, void* addr, size_t bytes)
+{
+	PMBD_DIRTY_LOG_T* log = get_cpu_ptr(pmbd->dirty_log);
+	PMBD_DIRTY_SET_T* set;
+
+	spin_lock(&log->lock);
+	set = &log->set[log->cur];
+	set->bytes += bytes;
+	if (set->num && set->extent[set->num - 1].addr + set->extent[set->num - 1].bytes == addr){
+		/* contiguous with the last one */
+		set->extent[set->num - 1].bytes += bytes;
+	} else if (set->num < pmbd->dirty_log_extents){
+		set->extent[set->num].addr = addr;
+		set->extent[set->num].bytes = bytes;
+		set->num ++;
+	} else {
+		set->overflow = TRUE;
+	}
+	spin_unlock(&log->lock);
+	put_cpu_ptr(pmbd->dirty_log);
+	return;
+}
+
+/* flush and empty a detached set */
+static void pmbd_dirty_set_flush(PMBD_DIRTY_SET_T* set)
+{
+	unsigned i;
+
+	for (i = 0; i < set->num; i ++)
+		pmbd_writeback_range(set->extent[i].addr, set->extent[i].bytes);
+
+	if (set->num)
+		pmbd_flush_fence();
+
+	set->num = 0;
+	set->bytes = 0;
+	set->overflow = FALSE;
+	return;
+}
+
+/* flush the set detached from a CPU's log (queued on that CPU) */
+static void pmbd_dirty_log_work(struct work_struct* work)
+{
+	PMBD_DIRTY_LOG_T* log = container_of(work, PMBD_DIRTY_LOG_T, work);
+
+	pmbd_dirty_set_flush(&log->set[log->cur ^ 1]);
+	return;
+}
+
+/* called by the write barrier (serialized by wr_barrier_lock) */
+static void pmbd_dirty_log_flush(PMBD_DEVICE_T* pmbd)
+{
+	uint64_t time_p1 = 0;
+	uint64_t time_p2 = 0;
+	uint64_t bytes = 0;
+	unsigned overflow = FALSE;
+	int cpu;
+
+	TIMESTAMP(time_p1);
+
+	/* switch the sets, the writes from now on are flushed by the next barrier */
+	for_each_possible_cpu(cpu){
+		PMBD_DIRTY_LOG_T* log = per_cpu_ptr(pmbd->dirty_log, cpu);
+
+		spin_lock(&log->lock);
+		log->cur ^= 1;
+		spin_unlock(&log->lock);
+
+		bytes += log->set[log->cur ^ 1].bytes;
+		overflow |= log->set[log->cur ^ 1].overflow;
+	}
+
+	if (overflow || bytes > MB_TO_BYTES(g_pmbd_wbinvd_threshold)){
+		/* cheaper to drop the entire cache */
+		pmbd_clflush_all(pmbd);
+		for_each_possible_cpu(cpu){
+			PMBD_DIRTY_LOG_T* log = per_cpu_ptr(pmbd->dirty_log, cpu);
+			PMBD_DIRTY_SET_T* set = &log->set[log->cur ^ 1];
+			set->num = 0;
+			set->bytes = 0;
+			set->overflow = FALSE;
+		}
+		return;
+	}
+
+	if (bytes){
+		/* 
+		 * spread the flush on the CPUs that wrote; a write back reaches
+		 * PM from any CPU, so the log of a CPU gone offline is flushed
+		 * on another one
+		 */
+		for_each_possible_cpu(cpu){
+			PMBD_DIRTY_LOG_T* log = per_cpu_ptr(pmbd->dirty_log, cpu);
+			if (!log->set[log->cur ^ 1].num)
+				continue;
+			if (cpu_online(cpu))
+				schedule_work_on(cpu, &log->work);
+			else
+				schedule_work(&log->work);
+		}
+		for_each_possible_cpu(cpu)
+			flush_work(&per_cpu_ptr(pmbd->dirty_log, cpu)->work);
+	}
+	TIMESTAMP(time_p2);
+
+	/* emulating slowdown */
+	if(PMBD_DEV_USE_SLOWDOWN(pmbd))
+		pmbd_rdwr_slowdown((pmbd), WRITE, time_p1, time_p2);
+
+	/* update time statistics */
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_clflushall[WRITE], time_p2 - time_p1);
+	}
+	return;
+}
+
+
+/* 
+ * Write-protection 
+ *
+ * Being used as storage, PMBD needs to provide certain protection on accidental
+ * change caused by wild pointers. So we initialize all the PM pages as
+ * read-only; before we perform write operations into PM space, we set the
+ * pages writable, after done, we set it back to read-only. This would
+ * introduce extra overhead. However, this is a realistic solution to tackle
+ * wild pointer problem.
+ *
+ */
+
+#if PMBD_PTE_PROTECT
+/*
+ * change the RW bit of the kernel PTEs of a PM range
+ * @vaddr - the starting virtual address (page aligned)
+ * @num_pages - the range size
+ * @writable - set (TRUE) or clear (FALSE) the RW bit
+ *
+ * A range mapped with 2MB/1GB pages (e.g. a huge ioremap) is changed in units
+ * of 2MB/1GB, so the large pages are never split. The TLB entries are flushed
+ * on all CPUs before we return.
+ */
+static void pmbd_change_pages_rw(unsigned long vaddr, int num_pages, unsigned writable)
+{
+	unsigned long va = vaddr;
+	unsigned long end = vaddr + ((unsigned long) num_pages << PAGE_SHIFT);
+
+	while (va < end) {
+		unsigned int level;
+		unsigned long size;
+		pte_t* ptep = lookup_address(va, &level);
+
+		if (!ptep)
+			panic("%s(%d) PM page %lx is not mapped\n", __FUNCTION__, __LINE__, va);
+
+		if (!(size = pmbd_page_level_size(level)))
+			panic("%s(%d) unsupported page level %u\n", __FUNCTION__, __LINE__, level);
+
+		if (writable)
+			set_pte_atomic(ptep, pte_set_flags(*ptep, _PAGE_RW));
+		else
+			set_pte_atomic(ptep, pte_clear_flags(*ptep, _PAGE_RW));
+
+		va = (va & ~(size - 1)) + size;
+	}
+
+	pmbd_flush_tlb_range(vaddr, end);
+	return;
+}
+#define PMBD_SET_MEMORY_RO(VADDR, NUM)	pmbd_change_pages_rw((VADDR), (NUM), FALSE)
+#define PMBD_SET_MEMORY_RW(VADDR, NUM)	pmbd_change_pages_rw((VADDR), (NUM), TRUE)
+#else
+#define PMBD_SET_MEMORY_RO(VADDR, NUM)	set_memory_ro((VADDR), (NUM))
+#define PMBD_SET_MEMORY_RW(VADDR, NUM)	set_memory_rw((VADDR), (NUM))
+#endif
+
+/*
+ * set PM pages to read-only
+ * @addr -  the starting virtual address (PM space)
+ * @bytes - the range in bytes
+ * @on_access - this change command from request or during creating/destroying
+ */
+
+static inline void pmbd_set_pages_ro(PMBD_DEVICE_T* pmbd, void* addr, uint64_t bytes, unsigned on_access)
+{
+	if (PMBD_USE_WRITE_PROTECTION()) {
+		/* FIXME: type conversion happens here */
+		/* FIXME: add range and bytes check here?? - not so necessary */
+		uint64_t time_p1 = 0;
+		uint64_t time_p2 = 0;
+		unsigned long offset = (unsigned long) addr;
+		unsigned long vaddr = PAGE_TO_VADDR(VADDR_TO_PAGE(offset));
+		int num_pages = VADDR_TO_PAGE(offset + bytes - 1) - VADDR_TO_PAGE(offset) + 1;
+
+		if(!(VADDR_IN_PMBD_SPACE(pmbd, addr) && VADDR_IN_PMBD_SPACE(pmbd, addr + bytes-1)))
+			printk(KERN_WARNING "pmbd: WARNING - %s(%d): PM space range exceeded (%lu : %d pages)\n", 
+					__FUNCTION__, __LINE__, vaddr, num_pages);
+
+		TIMESTAMP(time_p1);
+		PMBD_SET_MEMORY_RO(vaddr, num_pages);
+		TIMESTAMP(time_p2);
+
+		/* update time statistics */
+//		if(PMBD_USE_TIMESTAT() && on_access){
+		if(PMBD_USE_TIMESTAT()){
+			PMBD_STAT_ADD(pmbd, cycles_setpages_ro[WRITE], time_p2 - time_p1);
+		}
+	}
+	return;
+}
+
+static inline void pmbd_set_pages_rw(PMBD_DEVICE_T* pmbd, void* addr, uint64_t bytes, unsigned on_access)
+{
+	if (PMBD_USE_WRITE_PROTECTION()) {
+		uint64_t time_p1 = 0;
+		uint64_t time_p2 = 0;
+		unsigned long offset = (unsigned long) addr;
+		unsigned long vaddr = PAGE_TO_VADDR(VADDR_TO_PAGE(offset));
+		int num_pages = VADDR_TO_PAGE(offset + bytes - 1) - VADDR_TO_PAGE(offset) + 1;
+
+		if(!(VADDR_IN_PMBD_SPACE(pmbd, addr) && VADDR_IN_PMBD_SPACE(pmbd, addr + bytes-1)))
+			printk(KERN_WARNING "pmbd: WARNING - %s(%d): PM space range exceeded (%lu : %d pages)\n", __FUNCTION__, __LINE__, vaddr, num_pages);
+
+		TIMESTAMP(time_p1);
+		PMBD_SET_MEMORY_RW(vaddr, num_pages);
+		TIMESTAMP(time_p2);
+
+		/* update time statistics */
+//		if(PMBD_USE_TIMESTAT() && on_access){
+		if(PMBD_USE_TIMESTAT()){
+			PMBD_STAT_ADD(pmbd, cycles_setpages_rw[WRITE], time_p2 - time_p1);
+		}
+	}
+	return;
+}
+
+
+/*
+ * Write verification (EXPERIMENTAL)
+ *
+ * Note: Even we do write protection by setting PM space read-only, there is
+ * still a short vulnerable window when we write pages into PM space - between
+ * the time when the pages are set RW and the time when the pages are set back
+ * to RO. So we need to verify that no data has been changed during this window
+ * by reading out the written data and comparing with the source data. 
+ *
+ * The comparison uses the fastest engine of the CPU (see pmbd_mem_equal())
+ * and can be sampled (vfysample/vfyrand) by PM page, so that it is cheap
+ * enough to be left on. A mismatch fails the request with -EIO and is
+ * counted in num_verify_errors.
+ */
+
+static DEFINE_PER_CPU(uint64_t, pmbd_verify_state);	/* sampling state */
+
+
+static inline int pmbd_verify_wr_pages_pmap(PMBD_DEVICE_T* pmbd, void* pmbd_dummy_va, void* ram_va, size_t bytes)
+{
+
+	unsigned long flags = 0;
+
+	/*NOTE: we assume src is starting from 0 */
+	uint64_t pa = (uint64_t) PMBD_PMAP_VA_TO_PA(pmbd_dummy_va);
+
+	/* disable interrupt (FIXME: do we need to do this?)*/	
+	DISABLE_SAVE_IRQ(flags);
+
+	/* do the real work */
+	while(bytes){
+		uint64_t pfn = (pa >> PAGE_SHIFT);	// page frame number
+		unsigned off = pa & (~PAGE_MASK);	// offset in one page
+		unsigned size = MIN_OF((PAGE_SIZE - off), bytes); // the size to copy 
+
+		/* map it */
+		void * map = pmap_atomic_pfn(pfn, pmbd, WRITE);
+		void * pmbd_va = map + off;
+
+		/* compare it */
+		if (!pmbd_mem_equal(g_pmbd_verify_engine, pmbd_va, ram_va, size)){
+			punmap_atomic(map, pmbd, WRITE);
+			goto bad;
+		}
+
+		/* unmap it */
+		punmap_atomic(map, pmbd, WRITE);
+
+		/* prepare the next iteration */
+		ram_va  += size;
+		bytes 	-= size;
+		pa 	+= size;
+	}
+	
+	/* re-enable interrupt */
+	ENABLE_RESTORE_IRQ(flags);
+	return 0;
+
+bad:
+	ENABLE_RESTORE_IRQ(flags);
+	return -1;
+}
+
+
+static inline int pmbd_verify_wr_pages_nopmap(PMBD_DEVICE_T* pmbd, void* pmbd_va, void* ram_va, size_t bytes)
+{
+	if (!pmbd_mem_equal(g_pmbd_verify_engine, pmbd_va, ram_va, bytes)) 
+		return -1;
+	else
+		return 0;
+}
+
+static inline int pmbd_verify_wr_pages(PMBD_DEVICE_T* pmbd, void* pmbd_va, void* ram_va, size_t bytes)
+{
+	int rtn = 0;
+	uint64_t* state;
+	uint64_t time_p1, time_p2;
+
+	TIMESTAT_POINT(time_p1);
+
+	/* the SIMD engines use the vector registers */
+	if (g_pmbd_verify_engine != PMBD_VERIFY_MEMCMP)
+		kernel_fpu_begin();
+	state = &get_cpu_var(pmbd_verify_state);
+
+	/* check it, one PM page (the sampling unit) at a time */
+	while (bytes) {
+		size_t off = (pmbd_va - pmbd->mem_space) & (~PAGE_MASK);
+		size_t size = MIN_OF((PAGE_SIZE - off), bytes);
+
+		if (pmbd_sample_page(state, g_pmbd_verify_sample, g_pmbd_verify_rand)) {
+			if (PMBD_USE_PMAP())
+				rtn = pmbd_verify_wr_pages_pmap(pmbd, pmbd_va, ram_va, size);
+			else
+				rtn = pmbd_verify_wr_pages_nopmap(pmbd, pmbd_va, ram_va, size);
+			if (rtn < 0)
+				break;
+		}
+
+		pmbd_va += size;
+		ram_va 	+= size;
+		bytes 	-= size;
+	}
+
+	put_cpu_var(pmbd_verify_state);
+	if (g_pmbd_verify_engine != PMBD_VERIFY_MEMCMP)
+		kernel_fpu_end();
+
+	/* found mismatch */
+	if (rtn < 0){
+		PMBD_STAT_INC(pmbd, num_verify_errors);
+		if (printk_ratelimit())
+			printk(KERN_ERR "pmbd(%d): *** writing into PM failed (mismatch at byte %llu) ***\n", 
+				pmbd->pmbd_id, (unsigned long long) (pmbd_va - pmbd->mem_space));
+		return -EIO;
+	}
+
+	TIMESTAT_POINT(time_p2);
+
+	/* timestamp */
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_wrverify[WRITE], time_p2 - time_p1);
+	}
+
+	return 0;
+}
+
+/*
+ * Checksum (EXPERIMENTAL)
+ *
+ * Note: With write-protection and write verification, we can largely reduce
+ * the risk of PM data corruption caused by wild in-kernel pointers, however,
+ * it is still possible that some data gets corrupted (e.g. PM pages are
+ * maliciously changed to writable). Thus, we need to provide another layer of
+ * protection by checksuming the PM pages. When writing a page, we compute a
+ * checksum and write it into memory; When reading a page, we compute its
+ * checksum and compare it with the stored checksum. If a mismatch is found,
+ * it indicates that either PM data or the checksum has been corrupted. 
+ *
+ * The checksum is computed along with the copy to/from PM, one checksum unit
+ * at a time (see pmbd_checksum_on_copy): a fully copied unit is checksummed
+ * from its RAM copy while it is still in the CPU cache, so PM is not read
+ * again; a partially copied unit is checksummed directly on the PM page
+ * (through the pmap window if pmap is used, and charged to the emulation as
+ * a PM read). A buffer block flushed as several runs of dirty lines is
+ * checksummed once after its last run (see pmbd_checksum_on_flush), rather
+ * than once per run. No bounce buffer is needed, and
+ * concurrent checksumming of different pages is safe. The algorithm is
+ * selected by the csalg option:
+ * - CRC32: the generic lib/crc32.c implementation (default)
+ * - CRC32C: the SSE4.2 crc32 instruction. A single crc32q has a latency of 3
+ *   cycles but a throughput of 1 per cycle, so we run three independent CRC
+ *   streams over three lanes of the page and merge them at the end with a
+ *   precomputed table that shifts a CRC over one lane of zeros.
+ * - XXH64: xxhash64, a non-cryptographic hash that runs at memory speed
+ *
+ * The checksums are stored in PM, in a checksum area allocated along with
+ * the device only if checksum is enabled (from the top of the reserved space
+ * for HIGH_MEM devices, see hmalloc_top). The area is a header page followed
+ * by one 8-byte entry per unit. The header records the algorithm, the unit
+ * size and the number of units; if it matches at loading, the entries are
+ * kept, otherwise they are cleared and the header is rewritten (see
+ * pmbd_checksum_space_format). 
+ *
+ * Crash consistency: an entry is written with a single aligned 8-byte store,
+ * so it is never torn. When the data of a write is durable at its fence
+ * (clflush, nts, FUA, or a non-WB cache mode, see PMBD_CHECKSUM_ORDERED), a
+ * write goes in three steps: 
+ * (1) before the data is copied, the entries of its units are marked
+ * PMBD_CHECKSUM_PENDING, keeping the old checksum, and made durable
+ * (pmbd_checksum_begin_write);
+ * (2) the data is copied, flushed and fenced;
+ * (3) the new checksums are stored without the mark (pmbd_checksum_commit). 
+ * After a crash, a unit thus holds a matching data/checksum pair, or a
+ * pending entry. A pending unit that matches the old checksum is verified
+ * (the write did not reach PM); otherwise, the write was cut short (the unit
+ * may hold the new data, or a torn mix of both), and the unit is counted in
+ * num_checksum_pending rather than as a mismatch, until it is rewritten. 
+ * Without such a fence (WB with neither clflush nor nts), the data reaches PM
+ * by cache evictions in any order until the write barrier, so no ordering
+ * holds: a crash may leave mismatches in the units written since the last
+ * barrier. An entry of 0 means that the unit has never been written with
+ * checksum enabled, and it is not verified. 
+ *
+ * Lazy verification (cslazyY): a unit verified on read or written since
+ * loading has its bit set in checksum_verified (in RAM), and later reads of
+ * it skip the checksum, so the hot pages are checksummed once. With cslazyN,
+ * every read is verified. 
+ *
+ * NOTE: with pmap, the checksums of the pages copied through a pmap window
+ * are computed in the window, and stored or verified once the window is
+ * unmapped (see pmbd_checksum_commit), since the pmap pool of a CPU cannot
+ * be nested. 
+ *
+ * FIXME:
+ * (1) the checksum area is not write-protected; a wild write into it would
+ * show up as a checksum mismatch too.
+ * (2) writes done while checksum is disabled do not update the stored
+ * checksums, and the header does not tell, so such PM data reports mismatches
+ * when loaded with checksum enabled again, until the pages are rewritten.
+ *
+ */ 
+
+/* map a few pages of the checksum area (the dummy address if pmap is used) */
+static inline void* pmbd_checksum_area_map(PMBD_DEVICE_T* pmbd, void* va, unsigned num, unsigned rw, unsigned long* flags)
+{
+	if (!PMBD_USE_PMAP())
+		return va;
+
+	/* disable interrupt (PMAP entry is shared) */
+	DISABLE_SAVE_IRQ(*flags);
+	return pmap_atomic_range(pmbd, va, num, rw);
+}
+
+static inline void pmbd_checksum_area_unmap(PMBD_DEVICE_T* pmbd, void* map, unsigned num, unsigned rw, unsigned long* flags)
+{
+	if (!PMBD_USE_PMAP())
+		return;
+
+	punmap_atomic_range(map, num, pmbd, rw);
+	ENABLE_RESTORE_IRQ(*flags);
+	return;
+}
+
+/* reuse the stored checksums if the header matches, otherwise clear them */
+static void pmbd_checksum_space_format(PMBD_DEVICE_T* pmbd)
+{
+	PMBD_CHECKSUM_HEADER_T hdr;
+	PMBD_CHECKSUM_HEADER_T old;
+	void* end = pmbd->checksum_area + PMBD_CHECKSUM_SPACE_BYTES(pmbd);
+	unsigned long flags = 0;
+	void* map = NULL;
+	void* va = NULL;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic 	= PMBD_CHECKSUM_MAGIC;
+	hdr.version 	= PMBD_CHECKSUM_VERSION;
+	hdr.csalg 	= g_pmbd_csalg;
+	hdr.unit_size 	= pmbd->checksum_unit_size;
+	hdr.num_units 	= PMBD_CHECKSUM_TOTAL_NUM(pmbd);
+
+	map = pmbd_checksum_area_map(pmbd, pmbd->checksum_area, 1, READ, &flags);
+	memcpy(&old, map, sizeof(old));
+	pmbd_checksum_area_unmap(pmbd, map, 1, READ, &flags);
+
+	if (!memcmp(&old, &hdr, sizeof(hdr))){
+		printk(KERN_INFO "pmbd(%d): stored checksums are found (%llu units)\n", pmbd->pmbd_id, hdr.num_units);
+		return;
+	}
+
+	/* clear the entries first, and then write the header */
+	for (va = (void*) pmbd->checksum_space; va < end; va += PAGE_SIZE){
+		map = pmbd_checksum_area_map(pmbd, va, 1, WRITE, &flags);
+		memset(map, 0, PAGE_SIZE);
+		pmbd_clflush_range(pmbd, map, PAGE_SIZE);
+		pmbd_checksum_area_unmap(pmbd, map, 1, WRITE, &flags);
+		cond_resched();
+	}
+	pmbd_flush_fence();
+
+	map = pmbd_checksum_area_map(pmbd, pmbd->checksum_area, 1, WRITE, &flags);
+	memcpy(map, &hdr, sizeof(hdr));
+	pmbd_clflush_range(pmbd, map, sizeof(hdr));
+	pmbd_checksum_area_unmap(pmbd, map, 1, WRITE, &flags);
+	pmbd_flush_fence();
+
+	printk(KERN_INFO "pmbd(%d): checksum space is formatted (%llu units)\n", pmbd->pmbd_id, hdr.num_units);
+	return;
+}
+
+static int pmbd_checksum_space_alloc(PMBD_DEVICE_T* pmbd)
+{
+	uint64_t bytes = 0;
+	size_t vbytes = 0;
+
+	pmbd->checksum_area = NULL;
+	pmbd->checksum_space = NULL;
+	pmbd->checksum_verified = NULL;
+
+	/* nothing to allocate */
+	if (!PMBD_USE_CHECKSUM())
+		return 0;
+
+	/* allocate the verified bits (none verified) */
+	vbytes = BITS_TO_LONGS(PMBD_CHECKSUM_TOTAL_NUM(pmbd)) * sizeof(unsigned long);
+	pmbd->checksum_verified = vmalloc(vbytes);
+	if (!pmbd->checksum_verified)
+		return -ENOMEM;
+	memset(pmbd->checksum_verified, 0, vbytes);
+
+	/* allocate checksum space in PM */
+	bytes = PMBD_CHECKSUM_SPACE_BYTES(pmbd);
+	if (PMBD_DEV_USE_VMALLOC(pmbd))
+		pmbd->checksum_area = vmalloc(bytes);
+	else if (PMBD_DEV_USE_HIGHMEM(pmbd))
+		pmbd->checksum_area = hmalloc_top(bytes);
+	if (!pmbd->checksum_area){
+		printk(KERN_ERR "pmbd: %s(%d): checksum space allocation failed\n", __FUNCTION__, __LINE__);
+		vfree(pmbd->checksum_verified);
+		pmbd->checksum_verified = NULL;
+		return -ENOMEM;
+	}
+	pmbd->checksum_space = (PMBD_CHECKSUM_T*) (pmbd->checksum_area + PAGE_SIZE);
+
+	pmbd_checksum_space_format(pmbd);
+	printk(KERN_INFO "pmbd(%d): checksum space is allocated (%llu KB in PM)\n", pmbd->pmbd_id, bytes >> KB_SHIFT);
+
+	return 0;
+}
+
+static int pmbd_checksum_space_free(PMBD_DEVICE_T* pmbd)
+{
+	if (pmbd->checksum_verified) {
+		vfree(pmbd->checksum_verified);
+		pmbd->checksum_verified = NULL;
+	}
+	if (pmbd->checksum_area) {
+		if (PMBD_DEV_USE_VMALLOC(pmbd))
+			vfree(pmbd->checksum_area);
+		else if (PMBD_DEV_USE_HIGHMEM(pmbd))
+			hfree(pmbd->checksum_area);
+		pmbd->checksum_area = NULL;
+		pmbd->checksum_space = NULL;
+		printk(KERN_INFO "pmbd(%d): checksum space is freed\n", pmbd->pmbd_id);
+	}
+	return 0;
+}
+
+
+/* initialize the checksum engine (called once at module loading) */
+static void pmbd_checksum_init(void)
+{
+	if (PMBD_USE_CSALG(PMBD_CSALG_CRC32C))
+		pmbd_crc32c_init();
+	return;
+}
+
+static inline PMBD_CHECKSUM_T pmbd_checksum_func(void* data, size_t size)
+{
+	return pmbd_checksum_calc(g_pmbd_csalg, data, size);
+}
+
+/*
+ * calculate the checksum for a chunksum unit
+ * @pmbd: the pmbd device
+ * @data: the virtual address of the target data (must be aligned to the
+ * checksum unit boundaries)
+ */ 
+
+
+static inline PMBD_CHECKSUM_T pmbd_cal_checksum(PMBD_DEVICE_T* pmbd, void* data)
+{
+	size_t size = pmbd->checksum_unit_size;
+	PMBD_CHECKSUM_T chk = 0;
+	uint64_t start = 0;
+
+	if (pmbd->checksum_unit_size != PAGE_SIZE){
+		panic("ERR: %s(%d) checksum unit size (%u) must be %lu\n", __FUNCTION__, __LINE__, pmbd->checksum_unit_size, PAGE_SIZE);
+		return 0;
+	}
+
+	/* start simulation timing (we are reading a PM page) */
+	if (PMBD_DEV_SIM_PMBD((pmbd)))
+		start = emul_start((pmbd), BYTE_TO_SECTOR((size)), READ);
+
+	/* calculate the checksum on the PM page in place */
+	if (PMBD_USE_PMAP()){
+		unsigned long flags = 0;
+		uint64_t pa = (uint64_t) PMBD_PMAP_VA_TO_PA(data);
+		void* map;
+
+		/* disable interrupt (PMAP entry is shared) */
+		DISABLE_SAVE_IRQ(flags);
+		map = pmap_atomic_pfn((pa >> PAGE_SHIFT), pmbd, READ);
+		chk = pmbd_checksum_func(map, size);
+		punmap_atomic(map, pmbd, READ);
+		ENABLE_RESTORE_IRQ(flags);
+	} else {
+		chk = pmbd_checksum_func(data, size);
+	}
+
+	/* stop simulation timing */
+	if (PMBD_DEV_SIM_PMBD((pmbd))) 
+		emul_end((pmbd), PMBD_EMUL_CTX(pmbd), BYTE_TO_SECTOR(data - pmbd->mem_space), BYTE_TO_SECTOR((size)), READ, start); 
+
+	return chk;
+}
+
+/*
+ * store (write) or verify (read) the checksums of the units [first, first + num)
+ * @cks: the checksums computed on the data of the units
+ * @mask: the units to handle (bit j for the unit first + j)
+ * @do_fua: the data of the units is being written with FUA
+ *
+ * NOTE: for writes, the entries are flushed (or logged) like the data, so
+ * the fence the caller issues for the data makes them durable too. If the
+ * units were marked pending, the data is fenced first, so the new checksums
+ * never reach PM before their data.
+ */
+static void pmbd_checksum_commit(PMBD_DEVICE_T* pmbd, unsigned long first, PMBD_CHECKSUM_T* cks, uint64_t mask, unsigned num, unsigned rw, unsigned do_fua)
+{
+	void* va = CHECKSUM_IDX_TO_CKADDR(pmbd, first);
+	size_t bytes = num * sizeof(PMBD_CHECKSUM_T);
+	unsigned off = (unsigned long) va & (~PAGE_MASK);
+	unsigned npages = PAGE_ALIGN(off + bytes) >> PAGE_SHIFT;
+	unsigned long flags = 0;
+	void* map = pmbd_checksum_area_map(pmbd, va - off, npages, rw, &flags);
+	volatile PMBD_CHECKSUM_T* ck = map + off;
+	unsigned j;
+
+	/* the data must be durable before the pending marks are cleared */
+	if (rw == WRITE && PMBD_CHECKSUM_ORDERED(do_fua))
+		pmbd_write_fence(pmbd, do_fua);
+
+	for (j = 0; j < num; j ++){
+		PMBD_CHECKSUM_T stored;
+
+		if (!(mask & (1ULL << j)))
+			continue;
+
+		/* one aligned 8-byte store (never torn), clears the pending mark */
+		if (rw == WRITE){
+			ck[j] = PMBD_CHECKSUM_ENTRY(cks[j]);
+			set_bit(first + j, pmbd->checksum_verified);
+			continue;
+		}
+
+		/* a write cut short by a crash, unless the unit still holds the old data */
+		stored = ck[j];
+		if ((stored & PMBD_CHECKSUM_PENDING) && PMBD_CHECKSUM_ENTRY(stored) != PMBD_CHECKSUM_ENTRY(cks[j])){
+			PMBD_STAT_INC(pmbd, num_checksum_pending);
+			if (printk_ratelimit())
+				printk(KERN_WARNING "pmbd(%d): page %lu was being written at a crash, not verified\n", pmbd->pmbd_id, first + j);
+			set_bit(first + j, pmbd->checksum_verified);
+			continue;
+		}
+
+		/* never written with checksum enabled (0), or a match */
+		stored &= ~PMBD_CHECKSUM_PENDING;
+		if (stored && stored != PMBD_CHECKSUM_ENTRY(cks[j])){
+			PMBD_STAT_INC(pmbd, num_checksum_errors);
+			if (printk_ratelimit())
+				printk(KERN_WARNING "pmbd(%d): checksum mismatch found (page %lu)!\n", pmbd->pmbd_id, first + j);
+		} else {
+			set_bit(first + j, pmbd->checksum_verified);
+		}
+	}
+
+	if (rw == WRITE){
+		if (PMBD_USE_CLFLUSH() || PMBD_USE_NTS() || (do_fua && PMBD_CPU_CACHE_USE_WB()))
+			pmbd_clflush_range(pmbd, (void*) ck, bytes);
+		else if (pmbd->dirty_log)
+			pmbd_dirty_log_add(pmbd, (void*) ck, bytes);
+	}
+
+	pmbd_checksum_area_unmap(pmbd, map, npages, rw, &flags);
+	return;
+}
+
+/*
+ * mark the units of [vaddr, vaddr + bytes) pending before their data is written
+ * @do_fua: the data is being written with FUA
+ *
+ * The marks keep the old checksums, and are made durable before the caller
+ * writes the data, so an interrupted write is told from a corruption (see
+ * Crash consistency above). The units already marked (by an earlier run of
+ * the same write) are skipped, and nothing is done if the data is not
+ * ordered by a fence (PMBD_CHECKSUM_ORDERED).
+ *
+ * NOTE: The caller must hold the locks of the units until they are committed.
+ */
+static void pmbd_checksum_begin_write(PMBD_DEVICE_T* pmbd, void* vaddr, size_t bytes, unsigned do_fua)
+{
+	unsigned long i = VADDR_TO_CHECKSUM_IDX(pmbd, vaddr);
+	unsigned long last = VADDR_TO_CHECKSUM_IDX(pmbd, (vaddr + bytes - 1));
+	unsigned marked = FALSE;
+
+	if (!PMBD_CHECKSUM_ORDERED(do_fua))
+		return;
+
+	/* one page of entries at a time */
+	while (i <= last){
+		void* va = CHECKSUM_IDX_TO_CKADDR(pmbd, i);
+		unsigned off = (unsigned long) va & (~PAGE_MASK);
+		unsigned num = MIN_OF(last - i + 1, (PAGE_SIZE - off) / sizeof(PMBD_CHECKSUM_T));
+		unsigned long flags = 0;
+		void* map = pmbd_checksum_area_map(pmbd, va - off, 1, WRITE, &flags);
+		volatile PMBD_CHECKSUM_T* ck = map + off;
+		unsigned lo = num;	/* the first and last entries marked in the page */
+		unsigned hi = 0;
+		unsigned j;
+
+		for (j = 0; j < num; j ++){
+			if (ck[j] & PMBD_CHECKSUM_PENDING)
+				continue;
+			ck[j] |= PMBD_CHECKSUM_PENDING;
+			lo = MIN_OF(lo, j);
+			hi = j;
+		}
+
+		if (lo < num){
+			if (PMBD_CPU_CACHE_USE_WB())
+				pmbd_clflush_range(pmbd, (void*) &ck[lo], (hi - lo + 1) * sizeof(PMBD_CHECKSUM_T));
+			marked = TRUE;
+		}
+
+		pmbd_checksum_area_unmap(pmbd, map, 1, WRITE, &flags);
+		i += num;
+	}
+
+	/* the marks must be durable before the data */
+	if (marked){
+		if (PMBD_CPU_CACHE_USE_WB())
+			pmbd_flush_fence();
+		else
+			sfence();
+	}
+	return;
+}
+
+static int pmbd_checksum_on_write(PMBD_DEVICE_T* pmbd, void* vaddr, size_t bytes, unsigned do_fua)
+{
+	unsigned long i;
+	unsigned long ck_id_s = VADDR_TO_CHECKSUM_IDX(pmbd, vaddr);
+	unsigned long ck_id_e = VADDR_TO_CHECKSUM_IDX(pmbd, (vaddr + bytes - 1));
+
+	uint64_t time_p1, time_p2;
+
+	TIMESTAT_POINT(time_p1);
+
+	for (i = ck_id_s; i <= ck_id_e; i ++){
+		void* data = CHECKSUM_IDX_TO_VADDR(pmbd, i);
+
+		PMBD_CHECKSUM_T checksum = pmbd_cal_checksum(pmbd, data);
+		pmbd_checksum_commit(pmbd, i, &checksum, 1, 1, WRITE, do_fua);
+	}
+
+	/* the data has been fenced already, fence the checksums */
+	pmbd_write_fence(pmbd, do_fua);
+
+	TIMESTAT_POINT(time_p2);
+
+	/* timestamp */
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_checksum[WRITE], time_p2 - time_p1);
+	}
+	return 0;
+}
+
+/*
+ * compute the checksum of the unit covering a chunk that has just been copied
+ * to/from PM, to be stored or verified by pmbd_checksum_commit
+ * @pmbd_va: the PM address of the chunk (the dummy address if pmap is used)
+ * @map_va: the accessible virtual address of the chunk in PM
+ * @ram_va: the RAM copy of the chunk
+ * @bytes: the chunk size (must not cross the checksum unit boundary)
+ * @checksum: the computed checksum
+ * @cks_read: the bytes read from PM for the checksum are added here
+ * return value: 0 if a read skips the unit (verified since loading), 1 otherwise
+ *
+ * NOTE: if the chunk covers the whole unit, we checksum the RAM copy, which
+ * was just read or written and is still in the CPU cache; otherwise, we
+ * have to read the whole unit from PM through @map_va. That read is added to
+ * @cks_read rather than emulated here: the copy may run with interrupts
+ * disabled (pmap, write window), so the caller charges it to the context of
+ * the request once the copy is done (see emul_cks_read()).
+ */
+static inline int pmbd_checksum_on_copy(PMBD_DEVICE_T* pmbd, void* pmbd_va, void* map_va, void* ram_va, size_t bytes, unsigned rw, PMBD_CHECKSUM_T* checksum, size_t* cks_read)
+{
+	unsigned long i = VADDR_TO_CHECKSUM_IDX(pmbd, pmbd_va);
+	size_t off = (pmbd_va - pmbd->mem_space) % pmbd->checksum_unit_size;
+	uint64_t time_p1, time_p2;
+
+	if (off + bytes > pmbd->checksum_unit_size)
+		panic("%s(%d) chunk crosses the checksum unit boundary\n", __FUNCTION__, __LINE__);
+
+	if (rw == READ && PMBD_USE_CSLAZY() && test_bit(i, pmbd->checksum_verified)){
+		PMBD_STAT_INC(pmbd, num_checksum_lazy);
+		return 0;
+	}
+
+	TIMESTAT_POINT(time_p1);
+
+	if (bytes == pmbd->checksum_unit_size) {
+		*checksum = pmbd_checksum_func(ram_va, bytes);
+	} else {
+		/* the whole unit is read from PM (charged by the caller) */
+		*checksum = pmbd_checksum_func(map_va - off, pmbd->checksum_unit_size);
+		*cks_read += pmbd->checksum_unit_size;
+	}
+
+	TIMESTAT_POINT(time_p2);
+
+	/* timestamp */
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_checksum[rw], time_p2 - time_p1);
+	}
+	return 1;
+}
+
+/*
+ * checksum a buffer block that has just been flushed to PM
+ * @bbi: the buffer block info
+ * @pmbd_va: the PM block
+ * @buf_va: the buffer block
+ *
+ * A block is flushed with one copy per run of dirty lines, so rather than
+ * checksumming the unit along with each run (a full PM page read for each
+ * partial run), the runs are copied without checksum and the unit is
+ * checksummed here once. If the buffer holds all the lines, the (cache hot)
+ * buffer copy is used; otherwise the PM page is read once, charged to the
+ * emulation by pmbd_cal_checksum().
+ *
+ * NOTE: The caller must hold the block lock and fence the entry.
+ */
+static void pmbd_checksum_on_flush(PMBD_DEVICE_T* pmbd, PMBD_BBI_T* bbi, void* pmbd_va, void* buf_va)
+{
+	PMBD_CHECKSUM_T checksum = 0;
+	uint64_t time_p1, time_p2;
+
+	TIMESTAT_POINT(time_p1);
+
+	if (bbi->valid_mask == pmbd_buffer_line_mask(pmbd, 0, pmbd->pb_size))
+		checksum = pmbd_checksum_func(buf_va, pmbd->checksum_unit_size);
+	else
+		checksum = pmbd_cal_checksum(pmbd, pmbd_va);
+	pmbd_checksum_commit(pmbd, VADDR_TO_CHECKSUM_IDX(pmbd, pmbd_va), &checksum, 1, 1, WRITE, FALSE);
+
+	TIMESTAT_POINT(time_p2);
+
+	/* timestamp */
+	if(PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_checksum[WRITE], time_p2 - time_p1);
+	}
+	return;
+}
+
+/*
+ * locks
+ *
+ * Note:  We should prevent multiple threads from concurrently accessing the same
+ * chunk of data. For example, if two writes access the same page, the PM page
+ * could be corrupted with a merged content of two. When read/writing PM data,
+ * we lock the range of related pages and unlock it after done.  
+ *
+ * For unbuffered devices, a request grabs the whole range of blocks with one
+ * range lock operation (see PMBD_RANGE_LOCK_T), so a 128KB request costs one
+ * tree lookup rather than 32 spinlock round trips. For buffered devices, the
+ * unbuffered path is only used by FUA writes, which must be serialized with the
+ * syncer working block by block and refresh the buffered copies of the blocks,
+ * so we still take the block locks there (in lock bit order).
+ */
+
+static inline void pmbd_range_lock_init(PMBD_RANGE_LOCK_T* rl)
+{
+	spin_lock_init(&rl->lock);
+	rl->root = RB_ROOT;
+	rl->waiters = 0;
+	init_waitqueue_head(&rl->wait);
+}
+
+/*
+ * find a held range overlapping with [start, end]
+ * NOTE: The caller must hold rl->lock
+ */
+static PMBD_RANGE_LOCK_NODE_T* _pmbd_range_lock_conflict(PMBD_RANGE_LOCK_T* rl, PBN_T start, PBN_T end)
+{
+	struct rb_node* n = rl->root.rb_node;
+	PMBD_RANGE_LOCK_NODE_T* cand = NULL;
+
+	/* find the held range with the largest start <= end */
+	while (n) {
+		PMBD_RANGE_LOCK_NODE_T* rn = rb_entry(n, PMBD_RANGE_LOCK_NODE_T, node);
+		if (rn->start <= end) {
+			cand = rn;
+			n = n->rb_right;
+		} else {
+			n = n->rb_left;
+		}
+	}
+
+	/* held ranges are disjoint, so if cand does not overlap, nobody does */
+	if (cand && cand->end >= start)
+		return cand;
+	return NULL;
+}
+
+/*
+ * insert a range into the tree of held ranges
+ * NOTE: The caller must hold rl->lock and make sure no conflict exists
+ */
+static void _pmbd_range_lock_insert(PMBD_RANGE_LOCK_T* rl, PMBD_RANGE_LOCK_NODE_T* rn)
+{
+	struct rb_node** p = &rl->root.rb_node;
+	struct rb_node* parent = NULL;
+
+	while (*p) {
+		PMBD_RANGE_LOCK_NODE_T* cur = rb_entry(*p, PMBD_RANGE_LOCK_NODE_T, node);
+		parent = *p;
+		if (rn->start < cur->start)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&rn->node, parent, p);
+	rb_insert_color(&rn->node, &rl->root);
+}
+
+/*
+ * NOTE: The waiter is queued before rl->lock is released, and the releaser
+ * checks the waiters under rl->lock, so no wakeup is lost.
+ */
+static void pmbd_range_lock(PMBD_RANGE_LOCK_T* rl, PMBD_RANGE_LOCK_NODE_T* rn, PBN_T start, PBN_T end)
+{
+	DEFINE_WAIT(wait);
+	unsigned waiting = FALSE;
+
+	rn->start = start;
+	rn->end = end;
+
+	for (;;) {
+		spin_lock(&rl->lock);
+		if (waiting) {
+			rl->waiters --;
+			waiting = FALSE;
+		}
+		if (!_pmbd_range_lock_conflict(rl, start, end)) {
+			_pmbd_range_lock_insert(rl, rn);
+			spin_unlock(&rl->lock);
+			finish_wait(&rl->wait, &wait);
+			return;
+		}
+
+		/* someone is working on an overlapping range, sleep until it is released */
+		prepare_to_wait(&rl->wait, &wait, TASK_UNINTERRUPTIBLE);
+		rl->waiters ++;
+		waiting = TRUE;
+		spin_unlock(&rl->lock);
+		schedule();
+	}
+}
+
+static void pmbd_range_unlock(PMBD_RANGE_LOCK_T* rl, PMBD_RANGE_LOCK_NODE_T* rn)
+{
+	unsigned wake;
+
+	spin_lock(&rl->lock);
+	rb_erase(&rn->node, &rl->root);
+	wake = (rl->waiters > 0);
+	spin_unlock(&rl->lock);
+
+	/* the waiters recheck their ranges (they may conflict with other holders) */
+	if (wake)
+		wake_up_all(&rl->wait);
+}
+
+static int pmbd_lock_on_access(PMBD_DEVICE_T* pmbd, PMBD_RANGE_LOCK_NODE_T* rn, sector_t sector, size_t bytes)
+{
+	if (PMBD_USE_LOCK()) {
+		PBN_T pbn_s = SECTOR_TO_PBN(pmbd, sector);
+		PBN_T pbn_e = BYTE_TO_PBN(pmbd, (SECTOR_TO_BYTE(sector) + bytes - 1));
+
+		if (!PMBD_DEV_USE_BUFFER(pmbd)) {
+			pmbd_range_lock(&pmbd->range_lock, rn, pbn_s, pbn_e);
+			return 0;
+		}
+
+		pmbd_block_lock_range(pmbd, pbn_s, pbn_e);
+	}
+	return 0;
+}
+
+static int pmbd_unlock_on_access(PMBD_DEVICE_T* pmbd, PMBD_RANGE_LOCK_NODE_T* rn, sector_t sector, size_t bytes)
+{
+	if (PMBD_USE_LOCK()){
+		PBN_T pbn_s = SECTOR_TO_PBN(pmbd, sector);
+		PBN_T pbn_e = BYTE_TO_PBN(pmbd, (SECTOR_TO_BYTE(sector) + bytes - 1));
+
+		if (!PMBD_DEV_USE_BUFFER(pmbd)) {
+			pmbd_range_unlock(&pmbd->range_lock, rn);
+			return 0;
+		}
+
+		pmbd_block_unlock_range(pmbd, pbn_s, pbn_e);
+	}
+	return 0;
+}
+
+/*
+ **************************************************************************
+ * Unbuffered Read/write functions
+ **************************************************************************
+ */
+
+/*
+ * An unbuffered request is processed as one batch: the PM range of the whole
+ * request (a bio or a blk-mq request is always contiguous in PM) is locked,
+ * made writable, emulated and fenced once, and each segment is then only
+ * copied by pmbd_batch_segment(). This saves the per-segment overhead for
+ * large requests, e.g. 32 page attribute changes for a 128KB write.
+ *
+ * Buffered devices also use it for FUA writes, which bypass the buffer (see
+ * copy_to_pmbd()), and for the writes not admitted into the buffer (see
+ * pmbd_buffer_admit()).
+ */
+static void pmbd_batch_start(PMBD_DEVICE_T* pmbd, PMBD_EMUL_CTX_T* ctx, PMBD_BATCH_T* batch, sector_t sector, size_t bytes, int rw, unsigned do_fua, unsigned do_nts)
+{
+	batch->ctx 	= ctx;
+	batch->sector 	= sector;
+	batch->bytes 	= bytes;
+	batch->pos 	= pmbd->mem_space + sector * pmbd->sector_size;
+	batch->rw 	= rw;
+	batch->do_fua 	= do_fua;
+	batch->do_nts 	= do_nts;
+	batch->start 	= 0;
+	batch->cks_read	= 0;
+	batch->err 	= 0;
+
+	/* lock the pages */
+	pmbd_lock_on_access(pmbd, &batch->rn, sector, bytes);
+
+	/* set the pages writable */
+	/* if we use CR0/WP to temporarily switch the writable permission, 
+ 	 * we don't have to change the PTE attributes directly */
+	if (rw == WRITE && PMBD_DEV_USE_WPMODE_PTE(pmbd))
+		pmbd_set_pages_rw(pmbd, batch->pos, bytes, TRUE);
+
+	/* start simulation timing */
+	if (PMBD_DEV_SIM_PMBD(pmbd))
+		batch->start = emul_start(pmbd, BYTE_TO_SECTOR(bytes), rw);
+
+	return;
+}
+
+static void pmbd_batch_segment(PMBD_DEVICE_T* pmbd, PMBD_BATCH_T* batch, void* mem, size_t len)
+{
+	void* pos = batch->pos;
+
+	if (batch->rw == READ) {
+		/* read it out (checksum is verified along with the copy) */
+		batch->cks_read += _memcpy_from_pmbd(pmbd, mem, pos, len);
+	} else {
+		/* do memcpy */
+		batch->cks_read += _memcpy_to_pmbd(pmbd, pos, mem, len, batch->do_fua, batch->do_nts, TRUE);
+
+		/* verify that the write operation succeeded (fails the request if not) */
+		if(PMBD_USE_WRITE_VERIFICATION() && pmbd_verify_wr_pages(pmbd, pos, mem, len) < 0)
+			batch->err = -EIO;
+
+		/* keep the buffered copies (if any) the same as PM */
+		if (PMBD_DEV_USE_BUFFER(pmbd))
+			pmbd_buffer_refresh_blocks(pmbd, mem, BYTE_TO_SECTOR(pos - pmbd->mem_space), len);
+	}
+
+	batch->pos += len;
+	return;
+}
+
+static void pmbd_batch_finish(PMBD_DEVICE_T* pmbd, PMBD_BATCH_T* batch)
+{
+	void* dst = pmbd->mem_space + batch->sector * pmbd->sector_size;
+
+	if (batch->rw == WRITE) {
+		/* push the data out */
+		pmbd_write_fence(pmbd, batch->do_fua);
+		if (batch->do_nts)
+			sfence();
+
+		/* set the pages read-only */
+		if (PMBD_DEV_USE_WPMODE_PTE(pmbd)) 
+			pmbd_set_pages_ro(pmbd, dst, batch->bytes, TRUE);
+
+		/* generate check sum (if not done along with the copy) */
+		if (PMBD_USE_CHECKSUM() && !PMBD_USE_FUSED_CHECKSUM(WRITE))
+			pmbd_checksum_on_write(pmbd, dst, batch->bytes, batch->do_fua);
+	}
+
+	/* stop simulation timing */
+	if (PMBD_DEV_SIM_PMBD(pmbd)) {
+		emul_end(pmbd, batch->ctx, batch->sector, BYTE_TO_SECTOR(batch->bytes), batch->rw, batch->start); 
+		emul_cks_read(pmbd, batch->ctx, batch->cks_read);
+	}
+
+	/* pause for a while */
+	pmbd_rdwr_pause(pmbd, batch->bytes, batch->rw);
+
+	/* unlock the pages */
+	pmbd_unlock_on_access(pmbd, &batch->rn, batch->sector, batch->bytes);
+
+	return;
+}
+
+static int copy_to_pmbd_unbuffered(PMBD_DEVICE_T* pmbd, void *src, sector_t sector, size_t bytes, unsigned do_fua)
+{
+	PMBD_BATCH_T batch;
+
+	pmbd_batch_start(pmbd, PMBD_EMUL_CTX(pmbd), &batch, sector, bytes, WRITE, do_fua, FALSE);
+	pmbd_batch_segment(pmbd, &batch, src, bytes);
+	pmbd_batch_finish(pmbd, &batch);
+	return batch.err;
+}
+
+
+static void copy_from_pmbd_unbuffered(PMBD_DEVICE_T* pmbd, void *dst, sector_t sector, size_t bytes)
+{
+	PMBD_BATCH_T batch;
+
+	pmbd_batch_start(pmbd, PMBD_EMUL_CTX(pmbd), &batch, sector, bytes, READ, FALSE, FALSE);
+	pmbd_batch_segment(pmbd, &batch, dst, bytes);
+	pmbd_batch_finish(pmbd, &batch);
+	return;
+}
+
+
+/*
+ * *************************************************************************
+ * Read/write functions 
+ * *************************************************************************
+ */ 
+
+static int copy_to_pmbd(PMBD_DEVICE_T* pmbd, void *dst, sector_t sector, size_t bytes, unsigned do_fua)
+{
+	int err = 0;
+
+	/* NOTE: 
+	 * When we use a FUA, if the buffer is enabled, we bypass the buffer
+	 * and write directly into the PM space. The buffered copies of the
+	 * blocks (if any) are refreshed under the block locks, so the data is
+	 * written only once and no buffer block is allocated for it.
+	 */
+	if (PMBD_DEV_USE_BUFFER(pmbd) && !do_fua)
+		copy_to_pmbd_buffered(pmbd, dst, sector, bytes);
+	else
+		err = copy_to_pmbd_unbuffered(pmbd, dst, sector, bytes, do_fua);
+	return err;
+}
+
+static void copy_from_pmbd(PMBD_DEVICE_T* pmbd, void *dst, sector_t sector, size_t bytes)
+{
+	if (PMBD_DEV_USE_BUFFER(pmbd))
+		copy_from_pmbd_buffered(pmbd, dst, sector, bytes);
+	else
+		copy_from_pmbd_unbuffered(pmbd, dst, sector, bytes);
+	return;
+}
+
+static int pmbd_seg_read_write(PMBD_DEVICE_T* pmbd, struct page *page, unsigned int len, 
+					unsigned int off, int rw, sector_t sector, unsigned do_fua)
+{
+	void *mem;
+	int err = 0;
+
+	mem = PMBD_KMAP(page);
+	if (rw == READ) {
+		copy_from_pmbd(pmbd, mem + off, sector, len);
+		flush_dcache_page(page);
+	} else {
+		flush_dcache_page(page);
+		err = copy_to_pmbd(pmbd, mem + off, sector, len, do_fua);
+	}
+	PMBD_KUNMAP(mem);
+
+	return err;
+}
+
+static int pmbd_do_bvec(PMBD_DEVICE_T* pmbd, struct page *page,
+			unsigned int len, unsigned int off, int rw, sector_t sector, unsigned do_fua)
+{
+	return pmbd_seg_read_write(pmbd, page, len, off, rw, sector, do_fua);
+}
+
+/* 
+ * requests that can be processed as one batch: all unbuffered requests, and
+ * FUA writes and writes not admitted with buffer (which go directly to PM) 
+ */
+#define PMBD_DEV_USE_BATCH(PMBD, RW, FUA)	(!PMBD_DEV_USE_BUFFER(PMBD) || ((RW) == WRITE && (FUA)))
+
+static int pmbd_batch_bvec(PMBD_DEVICE_T* pmbd, PMBD_BATCH_T* batch, struct page *page,
+			unsigned int len, unsigned int off)
+{
+	void *mem;
+
+	mem = PMBD_KMAP(page);
+	if (batch->rw == READ) {
+		pmbd_batch_segment(pmbd, batch, mem + off, len);
+		flush_dcache_page(page);
+	} else {
+		flush_dcache_page(page);
+		pmbd_batch_segment(pmbd, batch, mem + off, len);
+	}
+	PMBD_KUNMAP(mem);
+
+	return batch->err;
+}
+
+/*
+ * Handling write barrier 
+ * @pmbd: the pmbd device
+ *
+ * When the application sends fsync(), a bio labeled with WRITE_BARRIER would be 
+ * received by pmbd_make_request(). The barrier must make sure that all the
+ * writes received before it have reached PM, but it should not stop the
+ * writes arriving after it.
+ *
+ * Writes on the fly are tracked by epoch: each write enters the current
+ * epoch by incrementing a per-CPU counter of the epoch's parity (see
+ * pmbd_wr_enter()), so writers never touch a shared cache line or lock. The
+ * barrier flips the epoch and sleeps on wr_drain_wait until the counters of
+ * the old parity sum up to zero (a write leaving the old epoch wakes it up, see
+ * pmbd_wr_exit()); new writes are counted in the new parity and proceed
+ * unblocked. Then if we use buffer, we flush the whole entire DRAM buffer
+ * with clflush enabled. If we do not use the buffer, we flush the CPU cache to
+ * let all the data securely be written into PM (only the ranges written since
+ * the last barrier, if they are logged, see pmbd_dirty_log_flush()). Barriers
+ * are serialized by wr_barrier_lock (a mutex, the barrier may sleep), so the
+ * old parity is always drained before being reused. 
+ *
+ */
+
+static int pmbd_wr_epoch_alloc(PMBD_DEVICE_T* pmbd)
+{
+	pmbd->wr_epoch = 0;
+	pmbd->num_flying_wr[0] = alloc_percpu(long);
+	pmbd->num_flying_wr[1] = alloc_percpu(long);
+	if (!pmbd->num_flying_wr[0] || !pmbd->num_flying_wr[1]){
+		printk(KERN_ERR "pmbd:%s(%d) cannot allocate write epoch counters\n", __FUNCTION__, __LINE__);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void pmbd_wr_epoch_free(PMBD_DEVICE_T* pmbd)
+{
+	int i;
+	for (i = 0; i < 2; i ++){
+		if (pmbd->num_flying_wr[i]){
+			free_percpu(pmbd->num_flying_wr[i]);
+			pmbd->num_flying_wr[i] = NULL;
+		}
+	}
+	return;
+}
+
+/* leave the write epoch (may be on a different CPU, only the sum counts) */
+static inline void pmbd_wr_exit(PMBD_DEVICE_T* pmbd, unsigned e)
+{
+	smp_mb();
+	this_cpu_dec(*pmbd->num_flying_wr[e]);
+
+	/* 
+	 * make the counter visible before checking the epoch: if we still see
+	 * our epoch, no barrier has flipped it yet and the barrier's sum will
+	 * see our decrement; otherwise a barrier may be draining our epoch
+	 */
+	smp_mb();
+	if (unlikely((READ_ONCE(pmbd->wr_epoch) & 1) != e))
+		wake_up(&pmbd->wr_drain_wait);
+}
+
+/* enter the current write epoch, return the epoch parity */
+static inline unsigned pmbd_wr_enter(PMBD_DEVICE_T* pmbd)
+{
+	unsigned e;
+	while (1) {
+		e = READ_ONCE(pmbd->wr_epoch) & 1;
+		this_cpu_inc(*pmbd->num_flying_wr[e]);
+
+		/* make the counter visible before checking the epoch again */
+		smp_mb();
+
+		/* if a barrier flipped the epoch in between, retry in the new one */
+		if ((READ_ONCE(pmbd->wr_epoch) & 1) == e)
+			return e;
+
+		/* leave it like a write, the barrier may have seen our count */
+		pmbd_wr_exit(pmbd, e);
+	}
+}
+
+static long pmbd_wr_flying(PMBD_DEVICE_T* pmbd, unsigned e)
+{
+	int cpu;
+	long sum = 0;
+	for_each_possible_cpu(cpu)
+		sum += *per_cpu_ptr(pmbd->num_flying_wr[e], cpu);
+	return sum;
+}
+
+
+static void __x86_mfence_all(void *arg)
+{
+	unsigned long cache = (unsigned long)arg;
+	if (cache && boot_cpu_data.x86 >= 4)
+		mfence();
+}
+
+static void x86_mfence_all(unsigned long cache)
+{
+	BUG_ON(irqs_disabled());
+	on_each_cpu(__x86_mfence_all, (void*) cache, 1);
+}
+
+static inline void pmbd_mfence_all(PMBD_DEVICE_T* pmbd)
+{
+	x86_mfence_all(1);
+}
+
+
+static void __x86_sfence_all(void *arg)
+{
+	unsigned long cache = (unsigned long)arg;
+	if (cache && boot_cpu_data.x86 >= 4)
+		sfence();
+}
+
+static void x86_sfence_all(unsigned long cache)
+{
+	BUG_ON(irqs_disabled());
+	on_each_cpu(__x86_sfence_all, (void*) cache, 1);
+	
+}
+
+static inline void pmbd_sfence_all(PMBD_DEVICE_T* pmbd)
+{
+	x86_sfence_all(1);
+}
+
+static int pmbd_write_barrier(PMBD_DEVICE_T* pmbd)
+{
+	unsigned i;
+
+	unsigned old;
+
+	/* one barrier at a time */
+	mutex_lock(&pmbd->wr_barrier_lock);
+
+	/* start a new epoch, and sleep until the writes of the old one finish */
+	old = pmbd->wr_epoch & 1;
+	WRITE_ONCE(pmbd->wr_epoch, pmbd->wr_epoch + 1);
+	smp_mb();
+	wait_event(pmbd->wr_drain_wait, pmbd_wr_flying(pmbd, old) == 0);
+
+	if (PMBD_DEV_USE_BUFFER(pmbd)){
+		/* if buffer is used, flush the entire buffer */
+		for (i = 0; i < pmbd->num_buffers; i ++){
+			PMBD_BUFFER_T* buffer = pmbd->buffers[i];
+			pmbd_buffer_check_and_flush(buffer, buffer->num_blocks, CALLER_DESTROYER);
+		}
+	} 
+
+	/* 
+	 * considering the following:
+	 * UC (write-through): 		strong ordering, we do nothing
+	 * UC-Minus:			strong ordering (may be overridden by WC), we use sfence, do nothing
+	 * WC (write-combining):	sfence is used after each write request, so we do nothing
+	 * WB (write-back):		non-temporal store : sfence is used, do nothing
+	 * 				clflush/mfence: mfence is used after each write request, do nothing
+	 * 				nothing: write back the logged ranges, or wbinvd to drop the entire cache
+	 */
+	if (PMBD_CPU_CACHE_USE_WB()){
+		if (PMBD_USE_NTS()){
+			/* sfence is used after each write request, so it is safe, we
+ 			* do nothing, just stop accepting any incoming requests */
+		} else if (PMBD_USE_CLFLUSH()) {
+			/* if use clflush/mfence to sync I/O, we do nothing*/
+//			pmbd_mfence_all(pmbd);
+		} else if (pmbd->dirty_log) {
+			/* write back the ranges written since the last barrier */
+			pmbd_dirty_log_flush(pmbd);
+		} else {
+			/* if no sync operations, we have to drop the entire cache */
+			pmbd_clflush_all(pmbd);
+		}
+	} else if (PMBD_CPU_CACHE_USE_WC() || PMBD_CPU_CACHE_USE_UM()) {
+		/* if using WC, sfence should used already, so do nothing */
+	
+	} else if (PMBD_CPU_CACHE_USE_UC()) {
+		/* strong ordering is used, no need to do anything else*/
+	} else {
+		panic("%s(%d): something is wrong\n", __FUNCTION__, __LINE__);
+	}
+
+	mutex_unlock(&pmbd->wr_barrier_lock);
+	return 0;
+}
+
+
+/*
+ * account a finished request on the current CPU
+ * @rw: READ or WRITE
+ * @num_sectors: the size of the request
+ * @is_barrier, @is_fua: the request is a write barrier/FUA write
+ * @p1..p6: the time points of the request (start, barrier done, prepare
+ * done, work done, endio done, finish; all zero if timestat is disabled)
+ */
+static void pmbd_stat_request(PMBD_DEVICE_T* pmbd, int rw, int num_sectors, unsigned is_barrier, unsigned is_fua, 
+				uint64_t p1, uint64_t p2, uint64_t p3, uint64_t p4, uint64_t p5, uint64_t p6)
+{
+	PMBD_STAT_INC(pmbd, num_requests[rw]);
+	PMBD_STAT_ADD(pmbd, num_sectors[rw], num_sectors);
+	if (is_barrier)
+		PMBD_STAT_INC(pmbd, num_write_barrier);
+	if (is_fua)
+		PMBD_STAT_INC(pmbd, num_write_fua);
+
+	/* cycles */
+	if (PMBD_USE_TIMESTAT()){
+		PMBD_STAT_ADD(pmbd, cycles_total[rw], p6 - p1);
+		PMBD_STAT_ADD(pmbd, cycles_wb[rw], p2 - p1);		/* write barrier */
+		PMBD_STAT_ADD(pmbd, cycles_prepare[rw], p3 - p2);
+		PMBD_STAT_ADD(pmbd, cycles_work[rw], p4 - p3);
+		PMBD_STAT_ADD(pmbd, cycles_endio[rw], p5 - p4);
+		PMBD_STAT_ADD(pmbd, cycles_finish[rw], p6 - p5);
+
+		if (is_barrier)
+			PMBD_STAT_HIST(pmbd, PMBD_HIST_BARRIER, rw, p2 - p1);
+		PMBD_STAT_HIST(pmbd, PMBD_HIST_PREPARE, rw, p3 - p2);
+		PMBD_STAT_HIST(pmbd, PMBD_HIST_WORK, rw, p4 - p3);
+		PMBD_STAT_HIST(pmbd, PMBD_HIST_ENDIO, rw, p5 - p4);
+	}
+	return;
+}
+
+/*
+ * legacy bio front end (before 4.13, see pmbd_queue_rq() for blk-mq)
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0)
+#if LINUX_VERSION_CODE == KERNEL_VERSION(3,2,1)
+//	#define BIO_WR_BARRIER(BIO)	(((BIO)->bi_rw & REQ_FLUSH) == REQ_FLUSH)
+//	#define BIO_WR_BARRIER(BIO)	((BIO)->bi_rw & (REQ_FLUSH | REQ_FLUSH_SEQ))
+	#define BIO_WR_BARRIER(BIO)	(((BIO)->bi_rw & WRITE_FLUSH) == WRITE_FLUSH)
+	#define BIO_WR_FUA(BIO)		(((BIO)->bi_rw & WRITE_FUA) == WRITE_FUA)
+	#define BIO_WR_SYNC(BIO)	(((BIO)->bi_rw & WRITE_SYNC) == WRITE_SYNC)
+#elif LINUX_VERSION_CODE == KERNEL_VERSION(2,6,34)
+	#define BIO_WR_BARRIER(BIO)	(((BIO)->bi_rw & WRITE_BARRIER) == WRITE_BARRIER)
+	#define BIO_WR_FUA(BIO)		(0)	/* FUA is only handled on 3.2.1 */
+	#define BIO_WR_SYNC(BIO)	(((BIO)->bi_rw & WRITE_SYNC) == WRITE_SYNC)
+#endif
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(3,2,1)
+#define MKREQ_RTN_TYPE	void
+#elif LINUX_VERSION_CODE == KERNEL_VERSION(2,6,34)
+#define MKREQ_RTN_TYPE	int
+#endif
+
+static MKREQ_RTN_TYPE pmbd_make_request(struct request_queue *q, struct bio *bio)
+{
+	int i 	= 0;
+	int err = -EIO;
+	uint64_t start = 0;
+	uint64_t end   = 0;
+	struct bio_vec *bvec;
+	int rw 	= bio_rw(bio);
+	sector_t sector = bio->bi_sector;
+	sector_t first_sector = sector;		/* sector is advanced by the bvec loop */
+	int num_sectors = bio_sectors(bio);
+	struct block_device *bdev = bio->bi_bdev;
+	PMBD_DEVICE_T *pmbd = bdev->bd_disk->private_data;
+	PMBD_EMUL_CTX_T *ctx = PMBD_EMUL_CTX(pmbd);	/* charged for the whole request */
+	unsigned bio_is_write_fua = FALSE;
+	unsigned bio_is_write_barrier = FALSE;
+	unsigned do_fua = FALSE;
+	unsigned do_bypass = FALSE;
+	unsigned wr_epoch = 0;
+	uint64_t time_p1, time_p2, time_p3, time_p4, time_p5, time_p6;
+	time_p1 = time_p2 = time_p3 = time_p4 = time_p5 = time_p6 = 0;
+
+
+	TIMESTAT_POINT(time_p1);
+//	printk("ACCESS: %u %d %X %d\n", sector, num_sectors, bio->bi_rw, rw);
+	
+	/* update rw */
+	if (rw == READA)
+		rw = READ;
+	if (rw != READ && rw != WRITE)
+		panic("pmbd: %s(%d) found request not read or write either\n", __FUNCTION__, __LINE__);
+
+	/* log the request before it is served (traceY) */
+	pmbd_trace_request(pmbd->pmbd_id, sector, bio->bi_size,
+			(rw == WRITE ? PMBD_TRACE_WRITE : 0) |
+			(BIO_WR_BARRIER(bio) ? PMBD_TRACE_FLUSH : 0) |
+			(BIO_WR_FUA(bio) ? PMBD_TRACE_FUA : 0));
+
+	/* handle write barrier (we don't do for BIO_WR_SYNC(bio) anymore*/
+	if (BIO_WR_BARRIER(bio)){
+		/* 
+		 * Note: Linux kernel 2.6.37 and later use file systems and FUA 
+		 * to ensure data reliability, rather than write barriers. 
+		 * See http://monolight.cc/2011/06/barriers-caches-filesystems
+		 */
+		bio_is_write_barrier = TRUE;
+//		printk(KERN_INFO "pmbd: received barrier request %u %d %lx %d\n", (unsigned int) sector, num_sectors, bio->bi_rw, rw);
+
+		if (PMBD_USE_WB())
+			pmbd_write_barrier(pmbd);
+	}
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(3,2,1)
+	if (BIO_WR_FUA(bio)){
+		bio_is_write_fua = TRUE;
+//		printk(KERN_INFO "pmbd: received FUA request %u %d %lx %d\n", (unsigned int) sector, num_sectors, bio->bi_rw, rw);
+
+		if (PMBD_USE_FUA())
+			do_fua = TRUE;
+	}
+#endif
+
+	TIMESTAT_POINT(time_p2);
+
+	/* enter the current write epoch */
+	if (rw == WRITE)
+		wr_epoch = pmbd_wr_enter(pmbd);
+
+	/* starting emulation */
+	if (PMBD_DEV_SIM_DEV(pmbd))
+		start = emul_start(pmbd, num_sectors, rw);
+
+	/* check if out of range */
+	if (sector + (bio->bi_size >> SECTOR_SHIFT) > get_capacity(bdev->bd_disk)){
+		printk(KERN_WARNING "pmbd: request exceeds the PMBD capacity\n");
+		TIMESTAT_POINT(time_p3);
+		goto out;
+	}
+
+//	printk("DEBUG: ACCESS %lu %d %d\n", sector, num_sectors, rw);
+
+	/*
+	 * NOTE: some applications (e.g. fdisk) call fsync() to request
+	 * flushing dirty data from the buffer cache. In default, fsync() is
+	 * linked to blkdev_fsync() in the def_blk_fops structure, and
+	 * blkdev_fsync() will call blkdev_issue_flush(), which generates an
+	 * empty bio carrying a write barrier down to the block device through
+	 * generic_make_request(), which calls pmbd_make_request() in turn. If
+	 * we don't set err=0 here, this error message would pass upwards back
+	 * to the application. For example, fdisk will fail and reports error
+	 * when trying to write the partition table before it exits. Thus we
+	 * must reset the error code here if the bio is empty. Also note that
+	 * we directly check the bio size, rather than using bio_wr_barrier(),
+	 * to handle other cases.
+	 *
+ 	 */
+	if (num_sectors == 0) { 
+		err = 0;
+		TIMESTAT_POINT(time_p3);
+		goto out;
+	} 
+
+	/* update the access time*/
+	PMBD_DEV_UPDATE_ACCESS_TIME(pmbd);
+
+	TIMESTAT_POINT(time_p3);
+
+	/* 
+	 * Do read/write now. We first perform the operation, then check how
+	 * long it actually takes to finish the operation, then we calculate an
+	 * emulated time for a given slow-down model, if the actual access time
+	 * is less than the emulated time, we just make up the difference to
+	 * emulate a slower device. 
+	 */
+	if (rw == WRITE && !do_fua && PMBD_DEV_USE_ADMIT(pmbd))
+		do_bypass = !pmbd_buffer_admit(pmbd, sector, bio->bi_size);
+
+	if (PMBD_DEV_USE_BATCH(pmbd, rw, do_fua || do_bypass)) {
+		PMBD_BATCH_T batch;
+
+		pmbd_batch_start(pmbd, ctx, &batch, sector, bio->bi_size, rw, do_fua, do_bypass);
+		bio_for_each_segment(bvec, bio, i) {
+			err = pmbd_batch_bvec(pmbd, &batch, bvec->bv_page, 
+						bvec->bv_len, bvec->bv_offset);
+			if (err)
+				break;
+		}
+		pmbd_batch_finish(pmbd, &batch);
+	} else {
+		bio_for_each_segment(bvec, bio, i) {
+			unsigned int len = bvec->bv_len;
+			err = pmbd_do_bvec(pmbd, bvec->bv_page, len, 
+						bvec->bv_offset, rw, sector, do_fua);
+			if (err)
+				break;
+			sector += len >> SECTOR_SHIFT;
+		}
+	}
+
+out:
+	TIMESTAT_POINT(time_p4);
+
+	bio_endio(bio, err);
+
+	TIMESTAT_POINT(time_p5);
+
+	/* ending emulation (simmode0)*/
+	if (PMBD_DEV_SIM_DEV(pmbd))
+		end = emul_end(pmbd, ctx, first_sector, num_sectors, rw, start);
+
+	/* leave the write epoch */
+	if (rw == WRITE)
+		pmbd_wr_exit(pmbd, wr_epoch);
+
+	TIMESTAT_POINT(time_p6);
+
+	/* update statistics data */
+	pmbd_stat_request(pmbd, rw, num_sectors, bio_is_write_barrier, bio_is_write_fua,
+				time_p1, time_p2, time_p3, time_p4, time_p5, time_p6);
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,34)
+	return 0;
+#endif
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+/*
+ * blk-mq front end
+ *
+ * Each hardware context (one per CPU) is bound to the emulation context of
+ * the same index, which keeps its own batch state and bandwidth share (see
+ * pmbd_emul_transfer_time()), so the submitting CPUs do not serialize on the
+ * emulation. The context is kept in hctx->driver_data and passed down to the
+ * emulation of the request (emul_end(), emul_deadline() and the batch), so a
+ * request preempted and moved to another CPU is still charged to one
+ * context. The request handling is the same as pmbd_make_request(). Note
+ * that the emulation and the write barrier may sleep, so the queue is
+ * registered with BLK_MQ_F_BLOCKING.
+ */
+static int pmbd_mq_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int hctx_idx)
+{
+	PMBD_DEVICE_T *pmbd = data;
+	hctx->driver_data = &pmbd->emul_ctx[hctx_idx % pmbd->num_emul_ctx];
+	return 0;
+}
+
+/*
+ * completion deferral (defer mode)
+ *
+ * A request is processed right away, but completed by the hrtimer in its pdu
+ * at the emulated finish time (see emul_deadline()). The CPU is not held
+ * during the emulated delay, so the CPU usage does not depend on the emulated
+ * latency, and the requests in the queue are really served concurrently.
+ */
+static enum hrtimer_restart pmbd_mq_defer_timer_fn(struct hrtimer* timer)
+{
+	PMBD_MQ_CMD_T* cmd = container_of(timer, PMBD_MQ_CMD_T, timer);
+
+	blk_mq_end_request(blk_mq_rq_from_pdu(cmd), cmd->status);
+	return HRTIMER_NORESTART;
+}
+
+static int pmbd_mq_init_request(struct blk_mq_tag_set* set, struct request* rq, 
+				unsigned int hctx_idx, unsigned int numa_node)
+{
+	PMBD_MQ_CMD_T* cmd = blk_mq_rq_to_pdu(rq);
+
+	PMBD_HRTIMER_INIT(&cmd->timer, pmbd_mq_defer_timer_fn);
+	return 0;
+}
+
+/* complete the request at the deadline (cycles), the request must not be touched afterwards */
+static void pmbd_mq_defer_end(struct request* rq, blk_status_t status, uint64_t deadline)
+{
+	PMBD_MQ_CMD_T* cmd = blk_mq_rq_to_pdu(rq);
+	uint64_t now = 0;
+
+	TIMESTAMP(now);
+	if (deadline <= now) {
+		blk_mq_end_request(rq, status);
+		return;
+	}
+
+	cmd->status = status;
+	hrtimer_start(&cmd->timer, ns_to_ktime(cycle_to_ns(deadline - now)), HRTIMER_MODE_REL);
+	return;
+}
+
+static blk_status_t pmbd_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+	int err = 0;
+	uint64_t start = 0;
+	uint64_t end   = 0;
+	struct request *rq = bd->rq;
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	PMBD_DEVICE_T *pmbd = rq->q->queuedata;
+	PMBD_EMUL_CTX_T *ctx = hctx->driver_data;	/* see pmbd_mq_init_hctx() */
+	int rw = rq_data_dir(rq);
+	sector_t sector = blk_rq_pos(rq);
+	sector_t first_sector = sector;		/* sector is advanced by the bvec loop */
+	int num_sectors = blk_rq_sectors(rq);
+	unsigned bio_is_write_fua = FALSE;
+	unsigned bio_is_write_barrier = FALSE;
+	unsigned do_fua = FALSE;
+	unsigned do_bypass = FALSE;
+	unsigned wr_epoch = 0;
+	uint64_t time_p1, time_p2, time_p3, time_p4, time_p5, time_p6;
+	time_p1 = time_p2 = time_p3 = time_p4 = time_p5 = time_p6 = 0;
+
+	TIMESTAT_POINT(time_p1);
+
+	/* log the request before it is served (traceY) */
+	pmbd_trace_request(pmbd->pmbd_id, sector, blk_rq_bytes(rq),
+			(rw == WRITE ? PMBD_TRACE_WRITE : 0) |
+			(req_op(rq) == REQ_OP_FLUSH ? PMBD_TRACE_FLUSH : 0) |
+			((rq->cmd_flags & REQ_FUA) ? PMBD_TRACE_FUA : 0));
+
+	blk_mq_start_request(rq);
+
+	/* handle write barrier */
+	if (req_op(rq) == REQ_OP_FLUSH){
+		bio_is_write_barrier = TRUE;
+		if (PMBD_USE_WB())
+			pmbd_write_barrier(pmbd);
+	}
+
+	TIMESTAT_POINT(time_p2);
+
+	/* handle FUA */
+	if (rq->cmd_flags & REQ_FUA){
+		bio_is_write_fua = TRUE;
+		if (PMBD_USE_FUA())
+			do_fua = TRUE;
+	}
+
+	/* enter the current write epoch */
+	if (rw == WRITE)
+		wr_epoch = pmbd_wr_enter(pmbd);
+
+	/* starting emulation */
+	if (PMBD_DEV_SIM_DEV(pmbd))
+		start = emul_start(pmbd, num_sectors, rw);
+
+	TIMESTAT_POINT(time_p3);
+
+	/* check if out of range */
+	if (sector + num_sectors > get_capacity(pmbd->pmbd_disk)){
+		printk(KERN_WARNING "pmbd: request exceeds the PMBD capacity\n");
+		err = -EIO;
+		goto out;
+	}
+
+	/* nothing to do for an empty flush */
+	if (num_sectors == 0)
+		goto out;
+
+	/* update the access time*/
+	PMBD_DEV_UPDATE_ACCESS_TIME(pmbd);
+
+	/* streaming and cold writes bypass the buffer (admitY) */
+	if (rw == WRITE && !do_fua && PMBD_DEV_USE_ADMIT(pmbd))
+		do_bypass = !pmbd_buffer_admit(pmbd, sector, blk_rq_bytes(rq));
+
+	/* do read/write now */
+	if (PMBD_DEV_USE_BATCH(pmbd, rw, do_fua || do_bypass)) {
+		PMBD_BATCH_T batch;
+
+		pmbd_batch_start(pmbd, ctx, &batch, sector, blk_rq_bytes(rq), rw, do_fua, do_bypass);
+		rq_for_each_segment(bvec, rq, iter) {
+			err = pmbd_batch_bvec(pmbd, &batch, bvec.bv_page, 
+						bvec.bv_len, bvec.bv_offset);
+			if (err)
+				break;
+		}
+		pmbd_batch_finish(pmbd, &batch);
+	} else {
+		rq_for_each_segment(bvec, rq, iter) {
+			unsigned int len = bvec.bv_len;
+			err = pmbd_do_bvec(pmbd, bvec.bv_page, len, 
+						bvec.bv_offset, rw, sector, do_fua);
+			if (err)
+				break;
+			sector += len >> SECTOR_SHIFT;
+		}
+	}
+
+out:
+	TIMESTAT_POINT(time_p4);
+
+	if (PMBD_DEV_USE_DEFER(pmbd)) {
+		/* complete it at the emulated finish time, instead of ending emulation */
+		pmbd_mq_defer_end(rq, err ? BLK_STS_IOERR : BLK_STS_OK, 
+					emul_deadline(pmbd, ctx, first_sector, num_sectors, rw, start));
+	} else {
+		blk_mq_end_request(rq, err ? BLK_STS_IOERR : BLK_STS_OK);
+	}
+
+	TIMESTAT_POINT(time_p5);
+
+	/* ending emulation (simmode0)*/
+	if (PMBD_DEV_SIM_DEV(pmbd) && !PMBD_DEV_USE_DEFER(pmbd))
+		end = emul_end(pmbd, ctx, first_sector, num_sectors, rw, start);
+
+	/* leave the write epoch */
+	if (rw == WRITE)
+		pmbd_wr_exit(pmbd, wr_epoch);
+
+	TIMESTAT_POINT(time_p6);
+
+	/* update statistics data */
+	pmbd_stat_request(pmbd, rw, num_sectors, bio_is_write_barrier, bio_is_write_fua,
+				time_p1, time_p2, time_p3, time_p4, time_p5, time_p6);
+
+	return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops pmbd_mq_ops = {
+	.queue_rq	= pmbd_queue_rq,
+	.init_hctx	= pmbd_mq_init_hctx,
+	.init_request	= pmbd_mq_init_request,
+};
+
+/* allocate the blk-mq tag set and queue (one hardware context per CPU) */
+static struct request_queue* pmbd_mq_alloc_queue(PMBD_DEVICE_T* pmbd)
+{
+	struct request_queue* q;
+#if PMBD_MQ_QUEUE_LIMITS
+	struct queue_limits lim = {
+		.max_hw_sectors	= PMBD_MAX_HW_SECTORS,
+#if PMBD_MQ_QUEUE_FEATURES
+		/* FUA is ignored without a write cache, as blk_queue_write_cache() did */
+		.features	= PMBD_USE_WB() ? 
+					(BLK_FEAT_WRITE_CACHE | (PMBD_USE_FUA() ? BLK_FEAT_FUA : 0)) : 0,
+#endif
+	};
+#endif
+
+	pmbd->tag_set.ops		= &pmbd_mq_ops;
+	pmbd->tag_set.nr_hw_queues	= pmbd->num_emul_ctx;
+	pmbd->tag_set.queue_depth	= PMBD_MQ_QUEUE_DEPTH;
+	pmbd->tag_set.cmd_size		= sizeof(PMBD_MQ_CMD_T);
+	pmbd->tag_set.numa_node		= NUMA_NO_NODE;
+	pmbd->tag_set.flags		= PMBD_MQ_FLAGS;
+	pmbd->tag_set.driver_data	= pmbd;
+
+	if (blk_mq_alloc_tag_set(&pmbd->tag_set))
+		return NULL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+	/* the disk is allocated together with the queue */
+#if PMBD_MQ_QUEUE_LIMITS
+	pmbd->pmbd_disk = blk_mq_alloc_disk(&pmbd->tag_set, &lim, pmbd);
+#else
+	pmbd->pmbd_disk = blk_mq_alloc_disk(&pmbd->tag_set, pmbd);
+#endif
+	if (IS_ERR(pmbd->pmbd_disk)){
+		pmbd->pmbd_disk = NULL;
+		blk_mq_free_tag_set(&pmbd->tag_set);
+		return NULL;
+	}
+	q = pmbd->pmbd_disk->queue;
+#else
+	q = blk_mq_init_queue(&pmbd->tag_set);
+	if (IS_ERR(q)){
+		blk_mq_free_tag_set(&pmbd->tag_set);
+		return NULL;
+	}
+#endif
+	q->queuedata = pmbd;
+
+#if !PMBD_MQ_QUEUE_LIMITS
+	blk_queue_max_hw_sectors(q, PMBD_MAX_HW_SECTORS);
+#endif
+#if !PMBD_MQ_QUEUE_FEATURES
+	/* flush and FUA capability */
+	blk_queue_write_cache(q, PMBD_USE_WB(), PMBD_USE_FUA());
+#endif
+	return q;
+}
+#endif
+
+/*
+ **************************************************************************
+ * Per-device configuration (sysfs)
+ **************************************************************************
+ *
+ * The mode= string sets up the devices at load. Afterwards, the settings
+ * of a device can be read and changed in /sys/block/<dev>/pmbd/:
+ *
+ *  - emulation: rdlat, wrlat, rdbw, wrbw, rdsx, wrsx, rdpause, wrpause,
+ *    simmode and rowhit can be changed. banks and wqsize are read-only
+ *    (the model is sized at load).
+ *  - buffer: bufsize (MBs), bufnum and bufstride replace the buffers (the
+ *    old ones are flushed and their syncers stopped), batch only changes the
+ *    flush batch size.
+ *  - cache and wpmode are read-only (fixed by the mapping of the PM space).
+ *
+ * A change is made with the queue frozen, so no request sees half of it.
+ * config_lock serializes the changes, and also the readers of the buffers
+ * outside the I/O path (/proc/pmbd).
+ *
+ * NOTE: only with blk-mq (4.13 or later), which provides queue freezing.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+
+#define PMBD_SYSFS_DEV(DEV)		((PMBD_DEVICE_T*) dev_to_disk((DEV))->private_data)
+
+static unsigned int pmbd_config_begin(PMBD_DEVICE_T* pmbd)
+{
+	unsigned int memflags;
+
+	mutex_lock(&pmbd->config_lock);
+	PMBD_FREEZE_QUEUE(pmbd->pmbd_queue, memflags);
+	return memflags;
+}
+
+static void pmbd_config_end(PMBD_DEVICE_T* pmbd, unsigned int memflags)
+{
+	PMBD_UNFREEZE_QUEUE(pmbd->pmbd_queue, memflags);
+	mutex_unlock(&pmbd->config_lock);
+	return;
+}
+
+/* restart the emulation with the new settings (the queue is frozen) */
+static void pmbd_emul_update(PMBD_DEVICE_T* pmbd)
+{
+	unsigned i;
+	int rw;
+
+	for (i = 0; i < pmbd->num_emul_ctx; i ++){
+		PMBD_EMUL_CTX_T* ctx = &pmbd->emul_ctx[i];
+
+		spin_lock(&ctx->batch_lock);
+		for (rw = READ; rw <= WRITE; rw ++){
+			ctx->batch_start_cycle[rw] = 0;
+			ctx->batch_end_cycle[rw] = 0;
+			ctx->batch_sectors[rw] = 0;
+			ctx->defer_until[rw] = 0;
+			atomic64_set(&ctx->demand[rw], 0);
+		}
+		ctx->bw_share[READ] = pmbd->rdbw;
+		ctx->bw_share[WRITE] = pmbd->wrbw;
+		spin_unlock(&ctx->batch_lock);
+	}
+	spin_lock(&pmbd->emul_reconcile_lock);
+	pmbd->emul_reconcile_cycle = 0;
+	spin_unlock(&pmbd->emul_reconcile_lock);
+
+	if (PMBD_DEV_USE_BANKS(pmbd)){
+		PMBD_BANK_MODEL_T* m = &pmbd->bank_model;
+
+		spin_lock(&pmbd->bank_lock);
+		m->t_hit[READ] 		= ns_to_cycle(pmbd->rowhit);
+		m->t_hit[WRITE] 	= ns_to_cycle(pmbd->rowhit);
+		m->t_miss[READ] 	= ns_to_cycle(pmbd->rdlat);
+		m->t_miss[WRITE] 	= ns_to_cycle(pmbd->wrlat);
+		spin_unlock(&pmbd->bank_lock);
+	}
+	return;
+}
+
+/*
+ * replace the buffers of a device (the queue is frozen)
+ *
+ * The old buffers are flushed to PM and freed, and the new ones start
+ * empty. If the new ones cannot be allocated, the old settings are
+ * restored, or the device goes on without buffer.
+ */
+static int pmbd_buffer_resize(PMBD_DEVICE_T* pmbd, unsigned long long bufsize, unsigned num_buffers, unsigned stride)
+{
+	unsigned long long old_bufsize = g_pmbd_bufsize[pmbd->pmbd_id];
+	unsigned old_num_buffers = pmbd->num_buffers;
+	unsigned old_stride = pmbd->buffer_stride;
+	int err = 0;
+	int retry;
+
+	pmbd_admit_free(pmbd);
+	pmbd_buffer_space_free(pmbd);
+	pmbd_pbi_space_free(pmbd);
+
+	for (retry = 0; retry < 2; retry ++){
+		g_pmbd_bufsize[pmbd->pmbd_id] = bufsize;
+		pmbd->num_buffers = num_buffers;
+		pmbd->buffer_stride = stride;
+		pmbd->bufmode = (bufsize > 0 && num_buffers > 0) ? TRUE : FALSE;
+
+		/* the block lock table is sized by the buffers */
+		if ((err = pmbd_pbi_space_alloc(pmbd)) == 0 && (err = pmbd_buffer_space_alloc(pmbd)) == 0 
+				&& (err = pmbd_admit_alloc(pmbd)) == 0){
+			printk(KERN_INFO "pmbd: /dev/%s buffers set to %u x %llu MB (stride %u blocks)\n",
+					pmbd->pmbd_name, pmbd->num_buffers, bufsize, pmbd->buffer_stride);
+			return retry ? -ENOMEM : 0;
+		}
+
+		/* undo the partial allocation */
+		if (pmbd->buffers)
+			pmbd_buffer_space_free(pmbd);
+		pmbd_pbi_space_free(pmbd);
+
+		bufsize = old_bufsize;
+		num_buffers = old_num_buffers;
+		stride = old_stride;
+	}
+
+	printk(KERN_ERR "pmbd:%s(%d) cannot allocate the buffers of /dev/%s, running without buffer\n",
+			__FUNCTION__, __LINE__, pmbd->pmbd_name);
+	g_pmbd_bufsize[pmbd->pmbd_id] = 0;
+	pmbd->num_buffers = 0;
+	pmbd->bufmode = FALSE;
+	pmbd_pbi_space_alloc(pmbd);
+	return err;
+}
+
+/* emulation settings (u64 or unsigned fields of the device, MAX is the limit) */
+#define PMBD_SYSFS_EMUL_ATTR(NAME, MAX)						\
+static ssize_t pmbd_sysfs_##NAME##_show(struct device* dev, struct device_attribute* attr, char* buf)	\
+{										\
+	return sprintf(buf, "%llu\n", (unsigned long long) PMBD_SYSFS_DEV(dev)->NAME);	\
+}										\
+static ssize_t pmbd_sysfs_##NAME##_store(struct device* dev, struct device_attribute* attr,	\
+					const char* buf, size_t count)		\
+{										\
+	PMBD_DEVICE_T* pmbd = PMBD_SYSFS_DEV(dev);				\
+	unsigned long long data;						\
+	unsigned int memflags;							\
+	int err = kstrtoull(buf, 0, &data);					\
+										\
+	if (err)								\
+		return err;							\
+	if (data > (MAX))							\
+		return -EINVAL;							\
+										\
+	memflags = pmbd_config_begin(pmbd);					\
+	pmbd->NAME = data;							\
+	pmbd_emul_update(pmbd);							\
+	pmbd_config_end(pmbd, memflags);					\
+	return count;								\
+}										\
+static DEVICE_ATTR(NAME, S_IRUGO | S_IWUSR, pmbd_sysfs_##NAME##_show, pmbd_sysfs_##NAME##_store)
+
+PMBD_SYSFS_EMUL_ATTR(rdlat, ULLONG_MAX);
+PMBD_SYSFS_EMUL_ATTR(wrlat, ULLONG_MAX);
+PMBD_SYSFS_EMUL_ATTR(rdbw, ULLONG_MAX);
+PMBD_SYSFS_EMUL_ATTR(wrbw, ULLONG_MAX);
+PMBD_SYSFS_EMUL_ATTR(rdsx, UINT_MAX);
+PMBD_SYSFS_EMUL_ATTR(wrsx, UINT_MAX);
+PMBD_SYSFS_EMUL_ATTR(rdpause, ULLONG_MAX);
+PMBD_SYSFS_EMUL_ATTR(wrpause, ULLONG_MAX);
+PMBD_SYSFS_EMUL_ATTR(simmode, 1);
+PMBD_SYSFS_EMUL_ATTR(rowhit, ULLONG_MAX);
+
+/* read-only settings */
+#define PMBD_SYSFS_RO_ATTR(NAME, FMT, VAL)					\
+static ssize_t pmbd_sysfs_##NAME##_show(struct device* dev, struct device_attribute* attr, char* buf)	\
+{										\
+	PMBD_DEVICE_T* pmbd = PMBD_SYSFS_DEV(dev);				\
+	return sprintf(buf, FMT "\n", (VAL));					\
+}										\
+static DEVICE_ATTR(NAME, S_IRUGO, pmbd_sysfs_##NAME##_show, NULL)
+
+PMBD_SYSFS_RO_ATTR(banks, "%u", pmbd->banks);
+PMBD_SYSFS_RO_ATTR(wqsize, "%u", pmbd->wqsize);
+PMBD_SYSFS_RO_ATTR(wpmode, "%u", pmbd->wpmode);
+PMBD_SYSFS_RO_ATTR(cache, "%s", PMBD_CPU_CACHE_FLAG());
+
+/* buffer settings */
+static ssize_t pmbd_sysfs_bufsize_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	PMBD_DEVICE_T* pmbd = PMBD_SYSFS_DEV(dev);
+	return sprintf(buf, "%llu\n", g_pmbd_bufsize[pmbd->pmbd_id]);
+}
+
+static ssize_t pmbd_sysfs_bufsize_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+	PMBD_DEVICE_T* pmbd = PMBD_SYSFS_DEV(dev);
+	unsigned long long data;
+	unsigned int memflags;
+	int err = kstrtoull(buf, 0, &data);
+
+	if (err)
+		return err;
+	if (data > 0 && data < PMBD_BUFFER_MIN_BUFSIZE)
+		return -EINVAL;
+
+	memflags = pmbd_config_begin(pmbd);
+	err = pmbd_buffer_resize(pmbd, data, pmbd->num_buffers, pmbd->buffer_stride);
+	pmbd_config_end(pmbd, memflags);
+	return err ? err : count;
+}
+static DEVICE_ATTR(bufsize, S_IRUGO | S_IWUSR, pmbd_sysfs_bufsize_show, pmbd_sysfs_bufsize_store);
+
+static ssize_t pmbd_sysfs_bufnum_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	return sprintf(buf, "%u\n", PMBD_SYSFS_DEV(dev)->num_buffers);
+}
+
+static ssize_t pmbd_sysfs_bufnum_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+	PMBD_DEVICE_T* pmbd = PMBD_SYSFS_DEV(dev);
+	unsigned int data;
+	unsigned int memflags;
+	int err = kstrtouint(buf, 0, &data);
+
+	if (err)
+		return err;
+	/* checked before freezing the queue, the buffers are kzalloc'ed per count */
+	if (data > PMBD_BUFFER_MAX_NUM)
+		return -EINVAL;
+
+	memflags = pmbd_config_begin(pmbd);
+	err = pmbd_buffer_resize(pmbd, g_pmbd_bufsize[pmbd->pmbd_id], data, pmbd->buffer_stride);
+	pmbd_config_end(pmbd, memflags);
+	return err ? err : count;
+}
+static DEVICE_ATTR(bufnum, S_IRUGO | S_IWUSR, pmbd_sysfs_bufnum_show, pmbd_sysfs_bufnum_store);
+
+static ssize_t pmbd_sysfs_bufstride_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	return sprintf(buf, "%u\n", PMBD_SYSFS_DEV(dev)->buffer_stride);
+}
+
+static ssize_t pmbd_sysfs_bufstride_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+	PMBD_DEVICE_T* pmbd = PMBD_SYSFS_DEV(dev);
+	unsigned int data;
+	unsigned int memflags;
+	int err = kstrtouint(buf, 0, &data);
+
+	if (err)
+		return err;
+	if (data == 0)
+		return -EINVAL;
+
+	memflags = pmbd_config_begin(pmbd);
+	err = pmbd_buffer_resize(pmbd, g_pmbd_bufsize[pmbd->pmbd_id], pmbd->num_buffers, data);
+	pmbd_config_end(pmbd, memflags);
+	return err ? err : count;
+}
+static DEVICE_ATTR(bufstride, S_IRUGO | S_IWUSR, pmbd_sysfs_bufstride_show, pmbd_sysfs_bufstride_store);
+
+/* the batch size is only read by the flusher, so the queue is not frozen */
+static ssize_t pmbd_sysfs_batch_show(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	PMBD_DEVICE_T* pmbd = PMBD_SYSFS_DEV(dev);
+	return sprintf(buf, "%llu\n", g_pmbd_buffer_batch_size[pmbd->pmbd_id]);
+}
+
+static ssize_t pmbd_sysfs_batch_store(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+	PMBD_DEVICE_T* pmbd = PMBD_SYSFS_DEV(dev);
+	unsigned int data;
+	unsigned i;
+	int err = kstrtouint(buf, 0, &data);
+
+	if (err)
+		return err;
+	if (data == 0)
+		return -EINVAL;
+
+	mutex_lock(&pmbd->config_lock);
+	g_pmbd_buffer_batch_size[pmbd->pmbd_id] = data;
+	for (i = 0; i < pmbd->num_buffers; i ++)
+		WRITE_ONCE(pmbd->buffers[i]->batch_size, data);
+	mutex_unlock(&pmbd->config_lock);
+	return count;
+}
+static DEVICE_ATTR(batch, S_IRUGO | S_IWUSR, pmbd_sysfs_batch_show, pmbd_sysfs_batch_store);
+
+static struct attribute* pmbd_sysfs_attrs[] = {
+	&dev_attr_rdlat.attr,
+	&dev_attr_wrlat.attr,
+	&dev_attr_rdbw.attr,
+	&dev_attr_wrbw.attr,
+	&dev_attr_rdsx.attr,
+	&dev_attr_wrsx.attr,
+	&dev_attr_rdpause.attr,
+	&dev_attr_wrpause.attr,
+	&dev_attr_simmode.attr,
+	&dev_attr_rowhit.attr,
+	&dev_attr_banks.attr,
+	&dev_attr_wqsize.attr,
+	&dev_attr_bufsize.attr,
+	&dev_attr_bufnum.attr,
+	&dev_attr_bufstride.attr,
+	&dev_attr_batch.attr,
+	&dev_attr_cache.attr,
+	&dev_attr_wpmode.attr,
+	NULL,
+};
+
+static const struct attribute_group pmbd_sysfs_group = {
+	.name		= "pmbd",
+	.attrs		= pmbd_sysfs_attrs,
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+/* /sys/block/<dev>/pmbd is created and removed along with the disk (see
+ * pmbd_add_disk()), so it is there when the uevent is sent */
+static const struct attribute_group* pmbd_sysfs_groups[] = {
+	&pmbd_sysfs_group,
+	NULL,
+};
+
+static void pmbd_sysfs_create(PMBD_DEVICE_T* pmbd) {return;}
+static void pmbd_sysfs_destroy(PMBD_DEVICE_T* pmbd) {return;}
+#else
+/* create /sys/block/<dev>/pmbd (after add_disk()) */
+static void pmbd_sysfs_create(PMBD_DEVICE_T* pmbd)
+{
+	if (sysfs_create_group(&disk_to_dev(pmbd->pmbd_disk)->kobj, &pmbd_sysfs_group) < 0){
+		printk(KERN_WARNING "pmbd: WARNING - cannot create /sys/block/%s/pmbd\n", pmbd->pmbd_name);
+		return;
+	}
+	pmbd->sysfs_added = TRUE;
+	return;
+}
+
+static void pmbd_sysfs_destroy(PMBD_DEVICE_T* pmbd)
+{
+	if (pmbd->sysfs_added){
+		sysfs_remove_group(&disk_to_dev(pmbd->pmbd_disk)->kobj, &pmbd_sysfs_group);
+		pmbd->sysfs_added = FALSE;
+	}
+	return;
+}
+#endif
+#else
+static void pmbd_sysfs_create(PMBD_DEVICE_T* pmbd) {return;}
+static void pmbd_sysfs_destroy(PMBD_DEVICE_T* pmbd) {return;}
+#endif
+
+
+/*
+ **************************************************************************
+ * Allocating memory space for PMBD device 
+ **************************************************************************
+ */ 
+
+/*
+ * Set the page attributes for the PMBD backstore memory space
+ *  - WB: cache enabled, write back (default)
+ *  - WC: cache disabled, write through, speculative writes combined
+ *  - UC: cache disabled, write through, no write combined
+ *  - UC-Minus: the same as UC 
+ *
+ * REF: 
+ * - http://www.kernel.org/doc/ols/2008/ols2008v2-pages-135-144.pdf
+ * - http://www.mjmwired.net/kernel/Documentation/x86/pat.txt
+ */ 
+
+static int pmbd_set_pages_cache_flags(PMBD_DEVICE_T* pmbd)
+{
+	if (pmbd->mem_space && pmbd->num_sectors) {
+		/* NOTE: we convert it here with no problem on 64-bit system */
+		unsigned long vaddr = (unsigned long) pmbd->mem_space;
+		int num_pages = PMBD_MEM_TOTAL_PAGES(pmbd);
+
+		printk(KERN_INFO "pmbd: setting %s PTE flags (%lx:%d)\n", pmbd->pmbd_name, vaddr, num_pages);
+		set_pages_cache_flags(vaddr, num_pages);
+		printk(KERN_INFO "pmbd: setting %s PTE flags done.\n", pmbd->pmbd_name);
+	}
+	return 0;
+}
+
+static int pmbd_reset_pages_cache_flags(PMBD_DEVICE_T* pmbd)
+{
+	if (pmbd->mem_space){
+		unsigned long vaddr = (unsigned long) pmbd->mem_space;
+		int num_pages = PMBD_MEM_TOTAL_PAGES(pmbd);
+		set_memory_wb(vaddr, num_pages);
+		printk(KERN_INFO "pmbd: %s pages cache flags are reset to WB\n", pmbd->pmbd_name);
+	}
+	return 0;
+}
+
+
+/*
+ * Allocate/free memory backstore space for PMBD devices
+ */
+static int pmbd_mem_space_alloc (PMBD_DEVICE_T* pmbd)
+{
+	int err = 0;
+
+	/* allocate PM memory space */
+	if (PMBD_DEV_USE_VMALLOC(pmbd)){
+		pmbd->mem_space = vmalloc (PMBD_MEM_TOTAL_BYTES(pmbd));
+	} else if (PMBD_DEV_USE_HIGHMEM(pmbd)){
+		pmbd->mem_space = hmalloc (PMBD_MEM_TOTAL_BYTES(pmbd));
+	}
+
+	if (pmbd->mem_space) {
+#if 0
+		/* FIXME: No need to do this. It's slow, system could be locked up */
+		memset(pmbd->mem_space, 0, pmbd->sectors * pmbd->sector_size);
+#endif
+		printk(KERN_INFO "pmbd: /dev/%s is created [%lu : %llu MBs]\n", 
+				pmbd->pmbd_name, (unsigned long) pmbd->mem_space, SECTORS_TO_MB(pmbd->num_sectors));
+	} else {
+		printk(KERN_ERR "pmbd: %s(%d): PMBD space allocation failed\n", __FUNCTION__, __LINE__);
+		err = -ENOMEM;
+	} 
+	return err;
+}
+
+static int pmbd_mem_space_free(PMBD_DEVICE_T* pmbd)
+{
+	/* free it up */
+	if (pmbd->mem_space) {
+		if (PMBD_DEV_USE_VMALLOC(pmbd))
+			vfree(pmbd->mem_space);
+		else if (PMBD_DEV_USE_HIGHMEM(pmbd)) {
+			hfree(pmbd->mem_space);
+		}
+		pmbd->mem_space = NULL;
+	}
+	return 0;
+}
+
+/* pmbd->pmbd_stat */
+static int pmbd_stat_alloc(PMBD_DEVICE_T* pmbd)
+{
+	int err = 0;
+	pmbd->pmbd_stat = (PMBD_STAT_T*)kzalloc(sizeof(PMBD_STAT_T), GFP_KERNEL);
+	if (pmbd->pmbd_stat)
+		pmbd->pmbd_stat->cpu = alloc_percpu(PMBD_STAT_CPU_T);
+
+	if (!pmbd->pmbd_stat || !pmbd->pmbd_stat->cpu){
+		printk(KERN_ERR "pmbd: %s(%d): PMBD space allocation failed\n", __FUNCTION__, __LINE__);
+		if (pmbd->pmbd_stat)
+			kfree(pmbd->pmbd_stat);
+		pmbd->pmbd_stat = NULL;
+		err = -ENOMEM;
+	}
+	return err;
+}
+
+static int pmbd_stat_free(PMBD_DEVICE_T* pmbd)
+{
+	if(pmbd->pmbd_stat) {
+		free_percpu(pmbd->pmbd_stat->cpu);
+		kfree(pmbd->pmbd_stat);
+		pmbd->pmbd_stat = NULL;
+	}
+	return 0;
+}
+
+/* sum up the per-CPU counters of a device */
+static void pmbd_stat_sum(PMBD_DEVICE_T* pmbd, PMBD_STAT_CPU_T* sum)
+{
+	int cpu;
+	unsigned i;
+
+	memset(sum, 0, sizeof(PMBD_STAT_CPU_T));
+	for_each_possible_cpu(cpu) {
+		uint64_t* src = (uint64_t*) per_cpu_ptr(pmbd->pmbd_stat->cpu, cpu);
+		uint64_t* dst = (uint64_t*) sum;
+
+		/* the per-CPU block is an array of uint64_t counters */
+		for (i = 0; i < sizeof(PMBD_STAT_CPU_T) / sizeof(uint64_t); i ++)
+			dst[i] += src[i];
+	}
+	return;
+}
+
+/* 
+ * /proc/pmbd/pmbdstat 
+ * It is a seq_file, so the output is not limited by a fixed size buffer.
+ */
+static const char* pmbd_hist_name[PMBD_HIST_NUM_PHASES] = {"barrier", "prepare", "work", "endio", "memcpy", "clflush"};
+
+static int pmbd_proc_pmbdstat_show(struct seq_file* m, void* v)
+{
+	PMBD_DEVICE_T* pmbd, *next;
+	char rdwr_name[2][16] = {"read\0", "write\0"};
+	PMBD_STAT_CPU_T* st = kzalloc(sizeof(PMBD_STAT_CPU_T), GFP_KERNEL);
+
+	if (!st)
+		return -ENOMEM;
+
+	list_for_each_entry_safe(pmbd, next, &pmbd_devices, pmbd_list) {
+		unsigned i, j;
+		BBN_T num_dirty = 0;
+		BBN_T num_blocks = 0; 
+
+		/* the buffers may be replaced (sysfs) */
+		mutex_lock(&pmbd->config_lock);
+		for (i = 0; i < pmbd->num_buffers; i ++){
+			num_blocks += pmbd->buffers[i]->num_blocks;
+			num_dirty += PMBD_BUFFER_NUM_DIRTY(pmbd->buffers[i]);
+		}
+		mutex_unlock(&pmbd->config_lock);
+
+		/* the counters are read without locking, so they may be slightly off */
+		pmbd_stat_sum(pmbd, st);
+
+		/* print stuff now */
+		seq_printf(m, "num_dirty_blocks[%s] %u\n", pmbd->pmbd_name, (unsigned int) num_dirty);
+		seq_printf(m, "num_clean_blocks[%s] %u\n", pmbd->pmbd_name, (unsigned int) (num_blocks - num_dirty));
+		seq_printf(m, "num_sectors_read[%s] %llu\n",  pmbd->pmbd_name, st->num_sectors[READ]);
+		seq_printf(m, "num_sectors_write[%s] %llu\n", pmbd->pmbd_name, st->num_sectors[WRITE]);
+		seq_printf(m, "num_requests_read[%s] %llu\n", pmbd->pmbd_name, st->num_requests[READ]);
+		seq_printf(m, "num_requests_write[%s] %llu\n",pmbd->pmbd_name, st->num_requests[WRITE]);
+		seq_printf(m, "num_write_barrier[%s] %llu\n", pmbd->pmbd_name, st->num_write_barrier);
+		seq_printf(m, "num_write_fua[%s] %llu\n", pmbd->pmbd_name, st->num_write_fua);
+		seq_printf(m, "num_verify_errors[%s] %llu\n", pmbd->pmbd_name, st->num_verify_errors);
+		seq_printf(m, "num_checksum_errors[%s] %llu\n", pmbd->pmbd_name, st->num_checksum_errors);
+		seq_printf(m, "num_checksum_lazy[%s] %llu\n", pmbd->pmbd_name, st->num_checksum_lazy);
+		seq_printf(m, "num_checksum_pending[%s] %llu\n", pmbd->pmbd_name, st->num_checksum_pending);
+		seq_printf(m, "num_admit_small[%s] %llu\n", pmbd->pmbd_name, st->num_admit_small);
+		seq_printf(m, "num_admit_freq[%s] %llu\n", pmbd->pmbd_name, st->num_admit_freq);
+		seq_printf(m, "num_bypass_seq[%s] %llu\n", pmbd->pmbd_name, st->num_bypass_seq);
+		seq_printf(m, "num_bypass_cold[%s] %llu\n", pmbd->pmbd_name, st->num_bypass_cold);
+		seq_printf(m, "num_buffer_wr_hits[%s] %llu\n", pmbd->pmbd_name, st->num_buffer_wr_hits);
+		seq_printf(m, "num_buffer_wr_misses[%s] %llu\n", pmbd->pmbd_name, st->num_buffer_wr_misses);
+
+		for (j = 0; j <= 1; j ++){
+			seq_printf(m, "cycles_total_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_total[j]);
+			seq_printf(m, "cycles_prepare_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_prepare[j]);
+			seq_printf(m, "cycles_wb_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_wb[j]);
+			seq_printf(m, "cycles_work_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_work[j]);
+			seq_printf(m, "cycles_endio_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_endio[j]);
+			seq_printf(m, "cycles_finish_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_finish[j]);
+			seq_printf(m, "cycles_pmap_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_pmap[j]);
+			seq_printf(m, "cycles_punmap_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_punmap[j]);
+			seq_printf(m, "cycles_memcpy_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_memcpy[j]);
+			seq_printf(m, "cycles_clflush_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_clflush[j]);
+			seq_printf(m, "cycles_clflushall_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_clflushall[j]);
+			seq_printf(m, "cycles_wrverify_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_wrverify[j]);
+			seq_printf(m, "cycles_checksum_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_checksum[j]);
+			seq_printf(m, "cycles_pause_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_pause[j]);
+			seq_printf(m, "cycles_slowdown_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_slowdown[j]);
+			seq_printf(m, "cycles_setpages_ro_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_setpages_ro[j]);
+			seq_printf(m, "cycles_setpages_rw_%s[%s] %llu\n", rdwr_name[j], pmbd->pmbd_name, st->cycles_setpages_rw[j]);
+		}
+	}
+
+	kfree(st);
+	return 0;
+}
+
+/*
+ * /sys/kernel/debug/pmbd/<dev>/latency
+ * One line per non-empty histogram bucket: 
+ *	<phase>_<read|write>[<dev>] <lower bound (ns)> <upper bound (ns)> <count>
+ */
+static int pmbd_debugfs_latency_show(struct seq_file* m, void* v)
+{
+	PMBD_DEVICE_T* pmbd = (PMBD_DEVICE_T*) m->private;
+	char rdwr_name[2][16] = {"read\0", "write\0"};
+	PMBD_STAT_CPU_T* st = kzalloc(sizeof(PMBD_STAT_CPU_T), GFP_KERNEL);
+	unsigned i, j, k;
+
+	if (!st)
+		return -ENOMEM;
+
+	pmbd_stat_sum(pmbd, st);
+	for (i = 0; i < PMBD_HIST_NUM_PHASES; i ++) {
+		for (j = 0; j <= 1; j ++) {
+			for (k = 0; k < PMBD_HIST_NUM_BUCKETS; k ++) {
+				if (!st->hist[i][j][k])
+					continue;
+				seq_printf(m, "%s_%s[%s] %llu %llu %llu\n", pmbd_hist_name[i], rdwr_name[j], pmbd->pmbd_name, 
+					k ? cycle_to_ns(1ULL << k) : 0, cycle_to_ns(1ULL << (k + 1)), st->hist[i][j][k]);
+			}
+		}
+	}
+
+	kfree(st);
+	return 0;
+}
+
+static int pmbd_debugfs_latency_open(struct inode* inode, struct file* file)
+{
+	return single_open(file, pmbd_debugfs_latency_show, inode->i_private);
+}
+
+static const struct file_operations pmbd_debugfs_latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= pmbd_debugfs_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int pmbd_debugfs_create(PMBD_DEVICE_T* pmbd)
+{
+	if (!pmbd_debugfs_root)
+		return 0;
+
+	pmbd->debugfs_dir = debugfs_create_dir(pmbd->pmbd_name, pmbd_debugfs_root);
+	if (IS_ERR_OR_NULL(pmbd->debugfs_dir)) {
+		pmbd->debugfs_dir = NULL;
+		return 0;
+	}
+	debugfs_create_file("latency", S_IRUGO, pmbd->debugfs_dir, pmbd, &pmbd_debugfs_latency_fops);
+	return 0;
+}
+
+static void pmbd_debugfs_destroy(PMBD_DEVICE_T* pmbd)
+{
+	debugfs_remove_recursive(pmbd->debugfs_dir);
+	pmbd->debugfs_dir = NULL;
+	return;
+}
+
+/* /proc/pmbd/pmbdcfg, a seq_file so the per-buffer lines are not bounded */
+static int pmbd_proc_pmbdcfg_show(struct seq_file* m, void* v)
+{
+	PMBD_DEVICE_T* pmbd, *next;
+
+	/* global configurations */
+	seq_printf(m, "MODULE OPTIONS: %s\n", mode);
+	seq_printf(m, "\n");
+
+	seq_printf(m, "max_part %d\n", max_part);
+	seq_printf(m, "part_shift %d\n", part_shift);
+
+	seq_printf(m, "g_pmbd_type %u\n", g_pmbd_type);
+	seq_printf(m, "g_pmbd_mergeable %u\n", g_pmbd_mergeable);
+	seq_printf(m, "g_pmbd_cpu_cache_clflush %u\n", g_pmbd_cpu_cache_clflush);
+	seq_printf(m, "g_pmbd_cpu_cache_flag %lu\n", g_pmbd_cpu_cache_flag);
+	seq_printf(m, "g_pmbd_wr_protect %u\n", g_pmbd_wr_protect);
+	seq_printf(m, "g_pmbd_wr_verify %u\n", g_pmbd_wr_verify);
+	seq_printf(m, "g_pmbd_verify_sample %u\n", g_pmbd_verify_sample);
+	seq_printf(m, "g_pmbd_verify_rand %u\n", g_pmbd_verify_rand);
+	seq_printf(m, "g_pmbd_verify_engine %s\n", PMBD_VERIFY_ENGINE_NAME());
+	seq_printf(m, "g_pmbd_checksum %u\n", g_pmbd_checksum);
+	seq_printf(m, "g_pmbd_csalg %s\n", PMBD_CSALG_NAME());
+	seq_printf(m, "g_pmbd_cslazy %u\n", g_pmbd_cslazy);
+	seq_printf(m, "g_pmbd_lock %u\n", g_pmbd_lock);
+	seq_printf(m, "g_pmbd_subpage_update %u\n", g_pmbd_subpage_update);
+	seq_printf(m, "g_pmbd_pmap %u\n", g_pmbd_pmap);
+	seq_printf(m, "g_pmbd_nts %u\n", g_pmbd_nts);
+	seq_printf(m, "g_pmbd_ntl %u\n", g_pmbd_ntl);
+	seq_printf(m, "g_pmbd_wb %u\n", g_pmbd_wb);
+	seq_printf(m, "g_pmbd_fua %u\n", g_pmbd_fua);
+	seq_printf(m, "g_pmbd_timestat %u\n", g_pmbd_timestat);
+	seq_printf(m, "g_pmbd_defer %u\n", g_pmbd_defer);
+	seq_printf(m, "g_pmbd_trace %u\n", g_pmbd_trace);
+	seq_printf(m, "g_highmem_size %lu\n", g_highmem_size);
+	seq_printf(m, "g_highmem_map_size %lu\n", g_highmem_map_size);
+	seq_printf(m, "g_highmem_map_large %lu\n", g_highmem_map_large);
+	seq_printf(m, "g_highmem_phys_addr %llu\n", (unsigned long long) g_highmem_phys_addr);
+	seq_printf(m, "g_highmem_virt_addr %llu\n", (unsigned long long) g_highmem_virt_addr);
+	seq_printf(m, "g_pmbd_nr %u\n", g_pmbd_nr);
+	seq_printf(m, "g_pmbd_adjust_ns %llu\n", g_pmbd_adjust_ns);
+	seq_printf(m, "g_pmbd_flush_insn %s\n", PMBD_FLUSH_INSN_NAME());
+	seq_printf(m, "g_pmbd_wbinvd_threshold %llu\n", g_pmbd_wbinvd_threshold);
+	seq_printf(m, "g_pmbd_num_buffers %llu\n", g_pmbd_num_buffers);
+	seq_printf(m, "g_pmbd_buffer_stride %llu\n", g_pmbd_buffer_stride);
+	seq_printf(m, "g_pmbd_admit %u\n", g_pmbd_admit);
+	seq_printf(m, "g_pmbd_admit_seq %llu\n", g_pmbd_admit_seq);
+	seq_printf(m, "g_pmbd_admit_small %llu\n", g_pmbd_admit_small);
+	seq_printf(m, "\n");
+
+	/* device specific configurations */
+	list_for_each_entry_safe(pmbd, next, &pmbd_devices, pmbd_list) {
+		int i = 0;
+
+		seq_printf(m, "pmbd_id[%s] %d\n", pmbd->pmbd_name, pmbd->pmbd_id);
+		seq_printf(m, "num_sectors[%s] %llu\n", pmbd->pmbd_name, (unsigned long long) pmbd->num_sectors);
+		seq_printf(m, "sector_size[%s] %u\n", pmbd->pmbd_name, pmbd->sector_size);
+		seq_printf(m, "pmbd_type[%s] %u\n", pmbd->pmbd_name, pmbd->pmbd_type);
+		seq_printf(m, "rammode[%s] %u\n", pmbd->pmbd_name, pmbd->rammode);
+		seq_printf(m, "bufmode[%s] %u\n", pmbd->pmbd_name, pmbd->bufmode);
+		seq_printf(m, "wpmode[%s] %u\n", pmbd->pmbd_name, pmbd->wpmode);
+		seq_printf(m, "num_buffers[%s] %u\n", pmbd->pmbd_name, pmbd->num_buffers);
+		seq_printf(m, "buffer_stride[%s] %u\n", pmbd->pmbd_name, pmbd->buffer_stride);
+		seq_printf(m, "pb_size[%s] %u\n", pmbd->pmbd_name, pmbd->pb_size);
+		seq_printf(m, "checksum_unit_size[%s] %u\n", pmbd->pmbd_name, pmbd->checksum_unit_size);
+		seq_printf(m, "simmode[%s] %u\n", pmbd->pmbd_name, pmbd->simmode);
+		seq_printf(m, "rdlat[%s] %llu\n", pmbd->pmbd_name, (unsigned long long) pmbd->rdlat);
+		seq_printf(m, "wrlat[%s] %llu\n", pmbd->pmbd_name, (unsigned long long) pmbd->wrlat);
+		seq_printf(m, "rdbw[%s] %llu\n", pmbd->pmbd_name, (unsigned long long) pmbd->rdbw);
+		seq_printf(m, "wrbw[%s] %llu\n", pmbd->pmbd_name, (unsigned long long) pmbd->wrbw);
+		seq_printf(m, "rdsx[%s] %u\n", pmbd->pmbd_name, pmbd->rdsx);
+		seq_printf(m, "wrsx[%s] %u\n", pmbd->pmbd_name, pmbd->wrsx);
+		seq_printf(m, "rdpause[%s] %llu\n", pmbd->pmbd_name, (unsigned long long) pmbd->rdpause);
+		seq_printf(m, "wrpause[%s] %llu\n", pmbd->pmbd_name, (unsigned long long) pmbd->wrpause);
+		seq_printf(m, "banks[%s] %u\n", pmbd->pmbd_name, pmbd->banks);
+		seq_printf(m, "rowhit[%s] %llu\n", pmbd->pmbd_name, (unsigned long long) pmbd->rowhit);
+		seq_printf(m, "wqsize[%s] %u\n", pmbd->pmbd_name, pmbd->wqsize);
+
+		mutex_lock(&pmbd->config_lock);
+		for (i = 0; i < pmbd->num_buffers; i ++){
+			PMBD_BUFFER_T* buffer = pmbd->buffers[i];
+			seq_printf(m, "buffer%d[%s]buffer_id %u\n", i, pmbd->pmbd_name, buffer->buffer_id);
+			seq_printf(m, "buffer%d[%s]num_blocks %lu\n", i, pmbd->pmbd_name, (unsigned long) buffer->num_blocks);
+			seq_printf(m, "buffer%d[%s]batch_size %lu\n", i, pmbd->pmbd_name, (unsigned long) buffer->batch_size);
+		}
+		mutex_unlock(&pmbd->config_lock);
+
+	}
+	return 0;
+}
+
+static int pmbd_proc_devstat_show(struct seq_file* m, void* v)
+{
+	seq_printf(m, "N/A\n");
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+#define PMBD_PROC_SEQ_ENTRY(NAME, PARENT, SHOW)		proc_create_single_data((NAME), S_IRUGO, (PARENT), (SHOW), NULL)
+#else
+/* a seq_file entry, the show function is kept in the entry's data */
+static int pmbd_proc_seq_open(struct inode* inode, struct file* file)
+{
+	return single_open(file, (int (*)(struct seq_file*, void*)) PDE(inode)->data, NULL);
+}
+
+static const struct file_operations pmbd_proc_seq_fops = {
+	.owner		= THIS_MODULE,
+	.open		= pmbd_proc_seq_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+#define PMBD_PROC_SEQ_ENTRY(NAME, PARENT, SHOW)		proc_create_data((NAME), S_IRUGO, (PARENT), &pmbd_proc_seq_fops, (void*) (SHOW))
+#endif
+
+static int pmbd_proc_devstat_create(PMBD_DEVICE_T* pmbd)
+{
+	/* create a /proc/pmbd/<dev> entry */
+	pmbd->proc_devstat = PMBD_PROC_SEQ_ENTRY(pmbd->pmbd_name, proc_pmbd, pmbd_proc_devstat_show);
+	if (pmbd->proc_devstat == NULL) {
+		remove_proc_entry(pmbd->pmbd_name, proc_pmbd);
+		printk(KERN_ERR "pmbd: cannot create /proc/pmbd/%s\n", pmbd->pmbd_name);
+		return -ENOMEM;
+	}
+	printk(KERN_INFO "pmbd: /proc/pmbd/%s created\n", pmbd->pmbd_name);
+
+	return 0;
+}
+
+static int pmbd_proc_devstat_destroy(PMBD_DEVICE_T* pmbd)
+{
+	remove_proc_entry(pmbd->pmbd_name, proc_pmbd);
+	printk(KERN_INFO "pmbd: /proc/pmbd/%s removed\n", pmbd->pmbd_name);
+	return 0;
+}
+
+static int pmbd_create (PMBD_DEVICE_T* pmbd, uint64_t sectors)
+{
+	int err = 0;
+
+	pmbd->num_sectors = sectors; 
+	pmbd->sector_size = PMBD_SECTOR_SIZE;	 	/* FIXME: now we use 512, do we need to change it? */
+	pmbd->pmbd_type = g_pmbd_type;
+	pmbd->checksum_unit_size = PAGE_SIZE;
+	pmbd->pb_size = PAGE_SIZE;
+
+	mutex_init(&pmbd->wr_barrier_lock);
+	init_waitqueue_head(&pmbd->wr_drain_wait);
+	pmbd_range_lock_init(&pmbd->range_lock);
+
+	/* allocate write epoch counters */
+	if ((err = pmbd_wr_epoch_alloc(pmbd)) < 0)
+		goto error;
+
+	spin_lock_init(&pmbd->tmp_lock);
+	pmbd->tmp_data = 0;
+	pmbd->tmp_num = 0;
+
+	/* allocate the dirty-extent log */
+	if ((err = pmbd_dirty_log_alloc(pmbd)) < 0)
+		goto error;
+
+	/* allocate statistics info */
+	if ((err = pmbd_stat_alloc(pmbd)) < 0)
+		goto error;
+
+	/* allocate memory space */
+	if ((err = pmbd_mem_space_alloc(pmbd)) < 0)
+		goto error;
+
+	/* allocate block info space (sized by the buffers) */
+	if ((err = pmbd_pbi_space_alloc(pmbd)) < 0)
+		goto error;
+
+	/* allocate buffer space */
+	if ((err = pmbd_buffer_space_alloc(pmbd)) < 0)
+		goto error;
+
+	/* allocate the buffer admission state */
+	if ((err = pmbd_admit_alloc(pmbd)) < 0)
+		goto error;
+
+	/* allocate checksum space */
+	if ((err = pmbd_checksum_space_alloc(pmbd)) < 0)
+		goto error;
+	
+	/* create a /proc/pmbd/<dev> entry*/
+	if ((err = pmbd_proc_devstat_create(pmbd)) < 0)
+		goto error;
+
+	/* create a /sys/kernel/debug/pmbd/<dev> entry (optional) */
+	pmbd_debugfs_create(pmbd);
+
+#if 0
+	/* FIXME: No need to do it. It's slow and could lock up the system*/
+	pmbd_checksum_space_init(pmbd);
+#endif
+
+	/* set up the page attributes related with CPU cache 
+	 * if using vmalloc(), we need to set up the page cache flags (WB,WC,UC,UM);
+	 * if using high memory, we set up the page cache flag with ioremap_prot();
+	 * WARN: In Linux 3.2.1, this function is slow and could cause system hangs. 
+ 	 */
+	
+	if (PMBD_USE_VMALLOC()){
+#if LINUX_VERSION_CODE == KERNEL_VERSION(3,2,1)
+		printk(KERN_ERR "pmbd: WARNING (3.2.1) changing CPU cache setting is slow!\n");
+#endif
+		pmbd_set_pages_cache_flags(pmbd);
+	}
+
+	/* initialize PM pages read-only */
+	if (!PMBD_USE_PMAP() && PMBD_USE_WRITE_PROTECTION())	
+		pmbd_set_pages_ro(pmbd, pmbd->mem_space, PMBD_MEM_TOTAL_BYTES(pmbd), FALSE);
+
+	printk(KERN_INFO "pmbd: %s created\n", pmbd->pmbd_name);
+error:
+	return err;
+}
+
+static int pmbd_destroy (PMBD_DEVICE_T* pmbd)
+{
+	/* flush everything down */
+	// FIXME: this implies flushing CPU cache
+	pmbd_write_barrier(pmbd);
+	
+	/* free /proc entry */
+	pmbd_proc_devstat_destroy(pmbd);
+	pmbd_debugfs_destroy(pmbd);
+
+	/* free buffer space */
+	pmbd_admit_free(pmbd);
+	pmbd_buffer_space_free(pmbd);
+
+	/* set PM pages writable */
+	if (!PMBD_USE_PMAP() && PMBD_USE_WRITE_PROTECTION())
+		pmbd_set_pages_rw(pmbd, pmbd->mem_space, PMBD_MEM_TOTAL_BYTES(pmbd), FALSE);
+
+	/* reset memory attributes to WB */
+	if (PMBD_USE_VMALLOC())
+		pmbd_reset_pages_cache_flags(pmbd);
+		
+	/* free block info space */
+	pmbd_pbi_space_free(pmbd);
+
+	/* free checksum space */
+	pmbd_checksum_space_free(pmbd);
+
+	/* free memory backstore space */
+	pmbd_mem_space_free(pmbd);
+
+	/* free statistics data */
+	pmbd_stat_free(pmbd);
+
+	/* free the dirty-extent log */
+	pmbd_dirty_log_free(pmbd);
+
+	/* free write epoch counters */
+	pmbd_wr_epoch_free(pmbd);
+	
+	printk(KERN_INFO "pmbd: /dev/%s is destroyed (%llu MB)\n", pmbd->pmbd_name, SECTORS_TO_MB(pmbd->num_sectors));
+
+	pmbd->num_sectors = 0;
+	pmbd->sector_size = 0;
+	pmbd->checksum_unit_size = 0;
+	return 0;
+}
+
+static int pmbd_free_pages(PMBD_DEVICE_T* pmbd)
+{
+	return pmbd_destroy(pmbd);
+}
+
+/*
+ **************************************************************************
+ * /proc file system entries
+ **************************************************************************
+ */
+
+static int pmbd_proc_create(void)
+{
+	proc_pmbd= proc_mkdir("pmbd", 0);
+	if(proc_pmbd == NULL){
+		printk(KERN_ERR "pmbd: %s(%d): cannot create /proc/pmbd\n", __FUNCTION__, __LINE__);
+		return -ENOMEM;
+	}
+
+	/* debugfs is optional, the latency histograms are not exported without it */
+	pmbd_debugfs_root = debugfs_create_dir("pmbd", NULL);
+	if (IS_ERR_OR_NULL(pmbd_debugfs_root))
+		pmbd_debugfs_root = NULL;
+
+	proc_pmbdstat = PMBD_PROC_SEQ_ENTRY("pmbdstat", proc_pmbd, pmbd_proc_pmbdstat_show);
+	if (proc_pmbdstat == NULL){
+		remove_proc_entry("pmbdstat", proc_pmbd);
+		printk(KERN_ERR "pmbd: cannot create /proc/pmbd/pmbdstat\n");
+		return -ENOMEM;
+	}
+	printk(KERN_INFO "pmbd: /proc/pmbd/pmbdstat created\n");
+
+	proc_pmbdcfg = PMBD_PROC_SEQ_ENTRY("pmbdcfg", proc_pmbd, pmbd_proc_pmbdcfg_show);
+	if (proc_pmbdcfg == NULL){
+		remove_proc_entry("pmbdcfg", proc_pmbd);
+		printk(KERN_ERR "pmbd: cannot create /proc/pmbd/pmbdcfg\n");
+		return -ENOMEM;
+	}
+	printk(KERN_INFO "pmbd: /proc/pmbd/pmbdcfg created\n");
+
+	return 0;
+}
+
+static int pmbd_proc_destroy(void)
+{
+	remove_proc_entry("pmbdcfg", proc_pmbd);
+	printk(KERN_INFO "pmbd: /proc/pmbd/pmbdcfg is removed\n");
+
+	remove_proc_entry("pmbdstat", proc_pmbd);
+	printk(KERN_INFO "pmbd: /proc/pmbd/pmbdstat is removed\n");
+
+	remove_proc_entry("pmbd", 0);
+	printk(KERN_INFO "pmbd: /proc/pmbd is removed\n");
+
+	debugfs_remove_recursive(pmbd_debugfs_root);
+	pmbd_debugfs_root = NULL;
+	return 0;
+}
+
+/*
+ **************************************************************************
+ * device driver interface hook functions
+ **************************************************************************
+ */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0)
+static int pmbd_mergeable_bvec(struct request_queue *q, 
+                              struct bvec_merge_data *bvm,
+                              struct bio_vec *biovec) {
+	static int flag = 0;
+    
+	if(PMBD_IS_MERGEABLE()) {
+		/* always merge */
+		if (!flag) {
+		    printk(KERN_INFO "pmbd: bio merging enabled\n");
+		    flag = 1;
+		}
+		return biovec->bv_len;
+	} else {
+		/* never merge */
+		if (!flag) {
+			printk(KERN_INFO "pmbd: bio merging disabled\n");
+			flag = 1;
+		}
+		if (!bvm->bi_size) {
+        		return biovec->bv_len;
+		} else {
+			return 0;
+		}
+	}
+}
+#endif
+
+
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,34)
+static int pmbd_ioctl(struct block_device *bdev, fmode_t mode,
+			unsigned int cmd, unsigned long arg)
+{
+	int err = 0;
+	printk(KERN_WARNING "pmbd: WARNING - ioctl not implemented\n");
+
+#if 0
+	PMBD_DEVICE_T* pmbd = bdev->bd_disk->private_data;
+	loff_t size = PMBD_MEM_TOTAL_BYTES(pmbd);
+	switch (cmd){
+		case BLKGETSIZE:
+			printk("pmbd: ioctl: BLKGETSIZE received\n");
+			if ((size >> 9) > ~0UL)
+				return -EFBIG;
+			else 
+				return put_ulong(arg, (size >> 9));
+		case BLKGETSIZE64:
+			printk("pmbd: ioctl: BLKGETSIZE64 received\n");
+			return put_u64(arg, size);
+		case BLKFLSBUF:
+			printk("pmbd(%d): pmbd_ioctl BLKFLSBUF received\n", pmbd->pmbd_id);
+			if (PMBD_USE_WB())
+				pmbd_write_barrier(pmbd);
+			return err;
+		default:
+			return -ENOTTY;
+	}
+#endif
+
+	return err;
+}
+#endif
+
+
+int pmbd_fsync(struct file* file, struct dentry* dentry, int datasync)
+{
+	printk(KERN_WARNING "pmbd: pmbd_fsync not implemented\n");
+
+	return 0;
+}
+
+int pmbd_open(struct block_device* bdev, fmode_t mode)
+{
+	printk(KERN_DEBUG "pmbd: pmbd (/dev/%s) opened\n", bdev->bd_disk->disk_name);
+	return 0;
+}
+
+int pmbd_release (struct gendisk* disk, fmode_t mode)
+{
+	printk(KERN_DEBUG "pmbd: pmbd (/dev/%s) released\n", disk->disk_name);
+	return 0;
+}
+
+static const struct block_device_operations pmbd_fops = {
+	.owner =		THIS_MODULE,
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,34)
+	.locked_ioctl =		pmbd_ioctl,
+#endif
+//	.open =			pmbd_open,
+//	.release = 		pmbd_release,
+};
+
+/*
+ * NOTE: partial of the following code is derived from linux/block/brd.c
+ */
+
+/* release the disk, the queue and the tag set */
+static void pmbd_free_queue(PMBD_DEVICE_T *pmbd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+	put_disk(pmbd->pmbd_disk);
+	blk_mq_free_tag_set(&pmbd->tag_set);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+	blk_cleanup_disk(pmbd->pmbd_disk);
+	blk_mq_free_tag_set(&pmbd->tag_set);
+#else
+	if (pmbd->pmbd_disk)
+		put_disk(pmbd->pmbd_disk);
+	blk_cleanup_queue(pmbd->pmbd_queue);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	blk_mq_free_tag_set(&pmbd->tag_set);
+#endif
+#endif
+	pmbd->pmbd_disk = NULL;
+	pmbd->pmbd_queue = NULL;
+	return;
+}
+
+/* 
+ * add_disk() may fail since 5.15; since 4.20, the sysfs attributes are
+ * added with the disk, before the uevent announces it
+ */
+static int pmbd_add_disk(PMBD_DEVICE_T *pmbd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+	return device_add_disk(NULL, pmbd->pmbd_disk, pmbd_sysfs_groups);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	device_add_disk(NULL, pmbd->pmbd_disk, pmbd_sysfs_groups);
+	return 0;
+#else
+	add_disk(pmbd->pmbd_disk);
+	return 0;
+#endif
+}
+
+
+static PMBD_DEVICE_T *pmbd_alloc(int i)
+{
+	PMBD_DEVICE_T *pmbd;
+	struct gendisk *disk;
+
+	/* no more than 26 devices */
+	if (i >= PMBD_MAX_NUM_DEVICES)
+		return NULL;
+
+	/* alloc and set up pmbd object */
+	pmbd = kzalloc(sizeof(*pmbd), GFP_KERNEL);
+	if (!pmbd) 
+		goto out;
+	pmbd->pmbd_id = i;
+	sprintf(pmbd->pmbd_name, "pm%c", ('a' + i));
+	mutex_init(&pmbd->config_lock);
+	pmbd->rdlat = g_pmbd_rdlat[i];
+	pmbd->wrlat = g_pmbd_wrlat[i];
+	pmbd->rdbw  = g_pmbd_rdbw[i];
+	pmbd->wrbw  = g_pmbd_wrbw[i];
+	pmbd->rdsx  = g_pmbd_rdsx[i];
+	pmbd->wrsx  = g_pmbd_wrsx[i];
+	pmbd->rdpause  = g_pmbd_rdpause[i];
+	pmbd->wrpause  = g_pmbd_wrpause[i];
+	pmbd->simmode  = g_pmbd_simmode[i];
+	pmbd->rammode  = g_pmbd_rammode[i];
+	pmbd->wpmode   = g_pmbd_wpmode[i];
+
+	/* changing the PTEs of a 2MB/1GB page opens the whole large page for a
+	 * write (or splits it before 5.3), so protect it by the write window if
+	 * any part of the space is mapped with large pages */
+	if (PMBD_USE_HIGHMEM() && PMBD_USE_WRITE_PROTECTION() && !PMBD_USE_PMAP() 
+			&& g_highmem_map_large > 0 && pmbd->wpmode == 0){
+		printk(KERN_INFO "pmbd: /dev/%s uses wpmode2 (write window) for the %lu large pages of high memory\n", 
+				pmbd->pmbd_name, g_highmem_map_large);
+		pmbd->wpmode = 2;
+	}
+	pmbd->banks    = g_pmbd_banks[i];
+	pmbd->rowhit   = g_pmbd_rowhit[i];
+	pmbd->wqsize   = g_pmbd_wqsize[i];
+	pmbd->num_buffers  = g_pmbd_num_buffers;
+	pmbd->buffer_stride  = g_pmbd_buffer_stride;
+	pmbd->bufmode  = (g_pmbd_bufsize[i] > 0 && g_pmbd_num_buffers > 0) ? TRUE : FALSE;
+
+	/* emulation contexts (must be ready before the queue) */
+	if (pmbd_emul_ctx_alloc(pmbd) < 0)
+		goto out_free_dev;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	pmbd->pmbd_queue = pmbd_mq_alloc_queue(pmbd);
+	if (!pmbd->pmbd_queue)
+		goto out_free_ctx;
+#else
+	pmbd->pmbd_queue = blk_alloc_queue(GFP_KERNEL);
+	if (!pmbd->pmbd_queue)
+		goto out_free_ctx;
+
+	/* hook functions */
+	blk_queue_make_request(pmbd->pmbd_queue, pmbd_make_request);
+#if LINUX_VERSION_CODE == KERNEL_VERSION(2,6,34)
+	blk_queue_ordered(pmbd->pmbd_queue, QUEUE_ORDERED_TAG, NULL);
+#endif
+#if LINUX_VERSION_CODE == KERNEL_VERSION(3,2,1)
+	/* set flush capability, otherwise, WRITE_FLUSH and WRITE_FUA will be filtered in
+ 	   generic_make_request() */
+	if (PMBD_USE_FUA() && PMBD_USE_WB())
+		blk_queue_flush(pmbd->pmbd_queue, REQ_FLUSH | REQ_FUA);
+	else if (PMBD_USE_WB())
+		blk_queue_flush(pmbd->pmbd_queue, REQ_FLUSH);
+	else if (PMBD_USE_FUA())
+		blk_queue_flush(pmbd->pmbd_queue, REQ_FUA);
+#endif
+	blk_queue_max_hw_sectors(pmbd->pmbd_queue, PMBD_MAX_HW_SECTORS);
+	blk_queue_bounce_limit(pmbd->pmbd_queue, BLK_BOUNCE_ANY);
+    	blk_queue_merge_bvec(pmbd->pmbd_queue, pmbd_mergeable_bvec);
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+	disk = pmbd->pmbd_disk;		/* allocated with the queue */
+	disk->minors		= 1 << part_shift;
+#else
+	disk = pmbd->pmbd_disk = alloc_disk(1 << part_shift);
+	if (!disk)
+		goto out_free_queue;
+#endif
+
+	disk->major		= PMBD_MAJOR;
+	disk->first_minor	= i << part_shift;
+	disk->fops		= &pmbd_fops;
+	disk->private_data	= pmbd;
+	disk->queue		= pmbd->pmbd_queue;
+	strcpy(disk->disk_name, pmbd->pmbd_name);
+	set_capacity(disk, GB_TO_SECTORS(g_pmbd_size[i])); /* num of sectors */
+
+	/* allocate PM space */
+	if (pmbd_create(pmbd, GB_TO_SECTORS(g_pmbd_size[i])) < 0)
+		goto out_free_queue;
+
+	/* done */
+	return pmbd;
+
+out_free_queue:
+	pmbd_free_queue(pmbd);
+out_free_ctx:
+	pmbd_emul_ctx_free(pmbd);
+out_free_dev:
+	kfree(pmbd);
+out:
+	return NULL;
+}
+
+static void pmbd_free(PMBD_DEVICE_T *pmbd)
+{
+	pmbd_free_queue(pmbd);
+	pmbd_free_pages(pmbd);
+	pmbd_emul_ctx_free(pmbd);
+	kfree(pmbd);
+}
+
+static void pmbd_del_one(PMBD_DEVICE_T *pmbd)
+{
+	list_del(&pmbd->pmbd_list);
+	pmbd_sysfs_destroy(pmbd);
+	del_gendisk(pmbd->pmbd_disk);
+	pmbd_free(pmbd);
+}
+
+static int check_kernel_version(void)
+{
+#if LINUX_VERSION_CODE == KERNEL_VERSION(3,2,1)
+	printk(KERN_INFO "pmbd: Linux kernel version 3.2.1 is detected\n");
+	printk(KERN_INFO "pmbd: WARNING (3.2.1) FUA with PT-based protection (with buffer) incurs double-write overhead\n");
+	printk(KERN_INFO "pmbd: WARNING (3.2.1) No support for changing CPU cache flags with vmalloc() based PMBD\n");
+	return 0;
+#elif LINUX_VERSION_CODE == KERNEL_VERSION(2,6,34)
+	printk(KERN_INFO "pmbd: *** Full support for Linux 2.6.34 ***\n");
+	return 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+	printk(KERN_INFO "pmbd: Linux kernel version %d.%d is detected (blk-mq)\n", 
+			LINUX_VERSION_CODE >> 16, (LINUX_VERSION_CODE >> 8) & 0xff);
+	printk(KERN_INFO "pmbd: WARNING wpmode1 (CR0) is not supported - wpmode2 is used instead\n");
+	return 0;
+#else
+	printk(KERN_INFO "pmbd: only support Linux kernel 2.6.34, 3.2.1, and 5.15 or later\n");
+	return -1;
+#endif
+}
+
+static int __init pmbd_init(void)
+{
+	int i, nr;
+	unsigned long range;
+	PMBD_DEVICE_T *pmbd, *next, *added;
+
+	/*check kernel version and print warning*/
+	if (check_kernel_version() < 0)
+		return -EINVAL;
+
+	/* parse input options */
+	pmbd_parse_conf();
+
+	/* initialize the checksum engine */
+	pmbd_checksum_init();
+
+	/* initialize pmap start*/
+	if (pmap_create() < 0)
+		return -ENOMEM;
+
+	/* ioremap high memory space */
+	if (PMBD_USE_HIGHMEM()) {
+		if (pmbd_highmem_map() == NULL) 
+			return -ENOMEM;
+	}
+
+	part_shift = 0;
+	if (max_part > 0)
+		part_shift = fls(max_part);
+
+	if (g_pmbd_nr > 1UL << (MINORBITS - part_shift))
+		return -EINVAL;
+
+	if (g_pmbd_nr) {
+		nr = g_pmbd_nr;
+		range = g_pmbd_nr;
+	} else {
+		printk(KERN_ERR "pmbd: %s(%d) - g_pmbd_nr=%d\n", __FUNCTION__, __LINE__, g_pmbd_nr);
+		return -EINVAL;
+	} 
+
+	pmbd_proc_create();
+
+	if (register_blkdev(PMBD_MAJOR, PMBD_NAME))
+		return -EIO;
+	else
+		printk(KERN_INFO "pmbd: registered device at major %d\n", PMBD_MAJOR);
+
+	for (i = 0; i < nr; i++) {
+		pmbd = pmbd_alloc(i);
+		if (!pmbd)
+			goto out_free;
+		list_add_tail(&pmbd->pmbd_list, &pmbd_devices);
+	}
+
+	/* start the request trace before the partition scan */
+	if (PMBD_USE_TRACE() && pmbd_trace_init() < 0)
+		goto out_free;
+
+	/* point of no return */
+	list_for_each_entry(pmbd, &pmbd_devices, pmbd_list) {
+		if (pmbd_add_disk(pmbd) < 0) {
+			printk(KERN_ERR "pmbd: cannot add /dev/%s\n", pmbd->pmbd_name);
+			goto out_del;
+		}
+		pmbd_sysfs_create(pmbd);
+	}
+
+	printk(KERN_INFO "pmbd: module loaded\n");
+	return 0;
+
+out_del:
+	/* remove the disks added before the failed one */
+	list_for_each_entry_safe(added, next, &pmbd_devices, pmbd_list) {
+		if (added == pmbd)
+			break;
+		pmbd_del_one(added);
+	}
+	pmbd_trace_exit();
+out_free:
+	list_for_each_entry_safe(pmbd, next, &pmbd_devices, pmbd_list) {
+		list_del(&pmbd->pmbd_list);
+		pmbd_free(pmbd);
+	}
+	unregister_blkdev(PMBD_MAJOR, PMBD_NAME);
+
+	return -ENOMEM;
+}
+
+
+static void __exit pmbd_exit(void)
+{
+	unsigned long range;
+	PMBD_DEVICE_T *pmbd, *next;
+
+	range = g_pmbd_nr ? g_pmbd_nr :  1UL << (MINORBITS - part_shift);
+
+	/* deactivate each pmbd instance*/
+	list_for_each_entry_safe(pmbd, next, &pmbd_devices, pmbd_list)
+		pmbd_del_one(pmbd);
+
+	/* stop the request trace */
+	pmbd_trace_exit();
+
+	/* deioremap high memory space */
+	if (PMBD_USE_HIGHMEM()) {
+		pmbd_highmem_unmap(); 
+	}
+
+	/* destroy pmap entries */
+	pmap_destroy();
+
+	unregister_blkdev(PMBD_MAJOR, PMBD_NAME);
+
+	pmbd_proc_destroy();
+
+	printk(KERN_INFO "pmbd: module unloaded\n");
+	return;
+}
+
+/* module setup */
+MODULE_AUTHOR("Intel Corporation <linux-pmbd@intel.com>");
+MODULE_ALIAS("pmbd");
+MODULE_LICENSE("GPL v2");
+MODULE_VERSION("0.9");
+MODULE_ALIAS_BLOCKDEV_MAJOR(PMBD_MAJOR);
+module_init(pmbd_init);
+module_exit(pmbd_exit);
+
+/* THE END */
+
+
@@ -0,0 +1,553 @@
+/*
+ * Intel Persistent Memory Block Driver
+ * Copyright (c) <2011-2013>, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Intel Persistent Memory Block Driver (v0.9)
+ *
+ * pmbd_replay.c
+ *
+ * Capture and replay the request trace of PMBD (traceY) or NVMSIM
+ * (nvm_trace=1). The capture merges the per-CPU rings of the trace device
+ * by time into a trace file; the replay issues the requests of a trace file
+ * to a block device with io_uring (O_DIRECT), either at the original
+ * inter-arrival times or as fast as the queue depth allows (-f).
+ *
+ * Usage:
+ *	pmbd_replay [-t <trace dev>] start		- clear the rings and start logging
+ *	pmbd_replay [-t <trace dev>] stop		- stop logging
+ *	pmbd_replay [-t <trace dev>] dump <file>	- stop logging and save the rings
+ *	pmbd_replay print <file>			- print a trace file
+ *	pmbd_replay [-f] [-q <depth>] [-d <dev id>] replay <blockdev> <file>
+ *
+ * The trace device is /dev/pmbd_trace by default (/dev/nvm_trace for NVMSIM).
+ * Replaying writes to the block device and destroys its content.
+ *
+ * Build: make replay (no kernel headers needed, io_uring needs Linux 5.6+)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include "pmbd_trace.h"
+
+#define TRACE_FILE_MAGIC	"PMBDTRC"
+
+typedef struct trace_file_hdr {
+	char			magic[8];	/* TRACE_FILE_MAGIC */
+	uint32_t		version;	/* PMBD_TRACE_VERSION */
+	uint32_t		rec_size;	/* sizeof(PMBD_TRACE_REC_T) */
+	uint64_t		nr_recs;	/* records that follow, sorted by time */
+} TRACE_FILE_HDR_T;
+
+static const char* trace_dev = "/dev/" PMBD_TRACE_DEV_NAME;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: pmbd_replay [-t <trace dev>] start|stop\n"
+		"       pmbd_replay [-t <trace dev>] dump <trace file>\n"
+		"       pmbd_replay print <trace file>\n"
+		"       pmbd_replay [-f] [-q <depth>] [-d <dev id>] replay <blockdev> <trace file>\n"
+		"\n"
+		"  -t   the trace device (%s default, /dev/nvm_trace for NVMSIM)\n"
+		"  -f   replay as fast as possible, not at the original times\n"
+		"  -q   the io_uring queue depth (64 default, at least 2)\n"
+		"  -d   only replay the requests of device <dev id> (0 - the first device)\n",
+		trace_dev);
+	exit(1);
+}
+
+/*
+ * capture
+ */
+static int trace_ctl(unsigned long cmd)
+{
+	int fd = open(trace_dev, O_RDONLY);
+	if (fd < 0 || ioctl(fd, cmd) < 0) {
+		perror(trace_dev);
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
+
+static int trace_start(void)
+{
+	if (trace_ctl(PMBD_TRACE_IOC_STOP) || trace_ctl(PMBD_TRACE_IOC_RESET))
+		return 1;
+	return trace_ctl(PMBD_TRACE_IOC_START);
+}
+
+static int cmp_rec(const void* m, const void* n)
+{
+	const PMBD_TRACE_REC_T* a = m;
+	const PMBD_TRACE_REC_T* b = n;
+	return a->ts < b->ts ? -1 : (a->ts > b->ts ? 1 : 0);
+}
+
+static int trace_dump(const char* path)
+{
+	PMBD_TRACE_INFO_T info;
+	PMBD_TRACE_REC_T* recs = NULL;
+	TRACE_FILE_HDR_T hdr;
+	uint64_t nr = 0, lost = 0;
+	size_t size;
+	char* map;
+	unsigned i;
+	FILE* out;
+	int fd;
+
+	fd = open(trace_dev, O_RDONLY);
+	if (fd < 0 || ioctl(fd, PMBD_TRACE_IOC_STOP) < 0 || ioctl(fd, PMBD_TRACE_IOC_INFO, &info) < 0) {
+		perror(trace_dev);
+		return 1;
+	}
+	if (info.version != PMBD_TRACE_VERSION || info.rec_size != sizeof(PMBD_TRACE_REC_T)) {
+		fprintf(stderr, "%s: unknown trace version %u\n", trace_dev, info.version);
+		return 1;
+	}
+
+	size = (size_t) info.nr_rings * info.ring_bytes;
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	/* gather the valid part of each ring, the oldest records are overwritten */
+	for (i = 0; i < info.nr_rings; i ++) {
+		PMBD_TRACE_RING_T* ring = (PMBD_TRACE_RING_T*) (map + (size_t) i * info.ring_bytes);
+		uint64_t head = ring->head;
+		uint64_t first = head > info.ring_recs ? head - info.ring_recs : 0;
+		uint64_t j;
+
+		if (head == first)
+			continue;
+		recs = realloc(recs, (nr + head - first) * sizeof(PMBD_TRACE_REC_T));
+		if (recs == NULL) {
+			perror("realloc");
+			return 1;
+		}
+		for (j = first; j < head; j ++)
+			recs[nr ++] = ring->rec[j & (info.ring_recs - 1)];
+		lost += first;
+	}
+	munmap(map, size);
+	close(fd);
+
+	qsort(recs, nr, sizeof(PMBD_TRACE_REC_T), cmp_rec);
+
+	out = fopen(path, "w");
+	if (out == NULL) {
+		perror(path);
+		return 1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC));
+	hdr.version = PMBD_TRACE_VERSION;
+	hdr.rec_size = sizeof(PMBD_TRACE_REC_T);
+	hdr.nr_recs = nr;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 || (nr && fwrite(recs, sizeof(PMBD_TRACE_REC_T), nr, out) != nr)) {
+		perror(path);
+		return 1;
+	}
+	fclose(out);
+	free(recs);
+
+	printf("%s: %llu requests", path, (unsigned long long) nr);
+	if (lost)
+		printf(" (%llu older requests were overwritten)", (unsigned long long) lost);
+	printf("\n");
+	return 0;
+}
+
+static PMBD_TRACE_REC_T* trace_load(const char* path, uint64_t* nr)
+{
+	TRACE_FILE_HDR_T hdr;
+	PMBD_TRACE_REC_T* recs;
+	FILE* in = fopen(path, "r");
+
+	if (in == NULL || fread(&hdr, sizeof(hdr), 1, in) != 1) {
+		perror(path);
+		exit(1);
+	}
+	if (memcmp(hdr.magic, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC)) || hdr.version != PMBD_TRACE_VERSION
+	||  hdr.rec_size != sizeof(PMBD_TRACE_REC_T)) {
+		fprintf(stderr, "%s: not a trace file (version %u)\n", path, PMBD_TRACE_VERSION);
+		exit(1);
+	}
+	recs = malloc((hdr.nr_recs ? hdr.nr_recs : 1) * sizeof(PMBD_TRACE_REC_T));
+	if (recs == NULL || fread(recs, sizeof(PMBD_TRACE_REC_T), hdr.nr_recs, in) != hdr.nr_recs) {
+		fprintf(stderr, "%s: truncated trace file\n", path);
+		exit(1);
+	}
+	fclose(in);
+	*nr = hdr.nr_recs;
+	return recs;
+}
+
+static int trace_print(const char* path)
+{
+	uint64_t i, nr;
+	PMBD_TRACE_REC_T* recs = trace_load(path, &nr);
+
+	printf("# time(ns) cpu dev rw sector bytes flags\n");
+	for (i = 0; i < nr; i ++) {
+		PMBD_TRACE_REC_T* r = &recs[i];
+		printf("%llu %u %u %c %llu %u %s%s\n",
+			(unsigned long long) (r->ts - recs[0].ts), r->cpu, r->dev,
+			(r->flags & PMBD_TRACE_WRITE) ? 'W' : 'R',
+			(unsigned long long) r->sector, r->bytes,
+			(r->flags & PMBD_TRACE_FLUSH) ? "F" : "-",
+			(r->flags & PMBD_TRACE_FUA) ? "U" : "-");
+	}
+	free(recs);
+	return 0;
+}
+
+/*
+ * io_uring (raw system calls, no liburing needed)
+ */
+typedef struct uring {
+	int			fd;
+	unsigned		sq_entries;
+	unsigned		*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned		*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe*	sqes;
+	struct io_uring_cqe*	cqes;
+	unsigned		to_submit;
+} URING_T;
+
+static int uring_init(URING_T* u, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	memset(u, 0, sizeof(*u));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0)
+		return -1;
+
+	sq = mmap(NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	cq = mmap(NULL, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED)
+		return -1;
+
+	u->sq_entries 	= p.sq_entries;
+	u->sq_head 	= (unsigned*) (sq + p.sq_off.head);
+	u->sq_tail 	= (unsigned*) (sq + p.sq_off.tail);
+	u->sq_mask 	= (unsigned*) (sq + p.sq_off.ring_mask);
+	u->sq_array 	= (unsigned*) (sq + p.sq_off.array);
+	u->cq_head 	= (unsigned*) (cq + p.cq_off.head);
+	u->cq_tail 	= (unsigned*) (cq + p.cq_off.tail);
+	u->cq_mask 	= (unsigned*) (cq + p.cq_off.ring_mask);
+	u->cqes 	= (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+	return 0;
+}
+
+/* the caller makes sure the ring has room (no more than sq_entries in flight) */
+static struct io_uring_sqe* uring_get_sqe(URING_T* u)
+{
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe* sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit ++;
+	return sqe;
+}
+
+static int uring_enter(URING_T* u, unsigned wait)
+{
+	int ret;
+	do {
+		ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		perror("io_uring_enter");
+		exit(1);
+	}
+	u->to_submit -= ret;
+	return ret;
+}
+
+/*
+ * replay
+ */
+typedef struct replay {
+	URING_T			ring;
+	unsigned		depth;
+	unsigned		inflight;
+	void**			bufs;		/* one O_DIRECT buffer per slot */
+	uint64_t*		issued;		/* submission time of the slot */
+	unsigned*		free_slots;
+	unsigned		nr_free;
+
+	/* statistics */
+	uint64_t		ops[3];		/* read, write, flush */
+	uint64_t		bytes[2];
+	uint64_t		errors;
+	uint64_t		lat_sum;
+	uint64_t		lat_max;
+	uint64_t		lag_sum;	/* how late the requests were issued (timed replay) */
+	uint64_t		lag_max;
+} REPLAY_T;
+
+static void replay_reap(REPLAY_T* r)
+{
+	URING_T* u = &r->ring;
+	unsigned head = *u->cq_head;
+	uint64_t now = now_ns();
+
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+		unsigned slot = (unsigned) cqe->user_data;
+		uint64_t lat = now - r->issued[slot];
+
+		if (cqe->res < 0 && r->errors ++ == 0)
+			fprintf(stderr, "replay: request failed: %s\n", strerror(-cqe->res));
+		r->lat_sum += lat;
+		if (lat > r->lat_max)
+			r->lat_max = lat;
+		r->free_slots[r->nr_free ++] = slot;
+		r->inflight --;
+		head ++;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return;
+}
+
+static unsigned replay_get_slot(REPLAY_T* r)
+{
+	while (r->nr_free == 0) {
+		uring_enter(&r->ring, 1);
+		replay_reap(r);
+	}
+	r->inflight ++;
+	return r->free_slots[-- r->nr_free];
+}
+
+static void replay_issue(REPLAY_T* r, int fd, PMBD_TRACE_REC_T* rec)
+{
+	struct io_uring_sqe* sqe;
+	unsigned slot;
+	unsigned data_slot = 0;
+
+	/* 
+	 * take the slots first: waiting for one submits the queued SQEs, and
+	 * would split the flush from its data
+	 */
+	if (rec->bytes)
+		data_slot = replay_get_slot(r);
+
+	/* a flush first, then its data (if any), which starts only after the
+	 * flush completes, as with a preflush */
+	if (rec->flags & PMBD_TRACE_FLUSH) {
+		slot = replay_get_slot(r);
+		sqe = uring_get_sqe(&r->ring);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = fd;
+		if (rec->bytes)
+			sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = slot;
+		r->issued[slot] = now_ns();
+		r->ops[2] ++;
+	}
+
+	if (rec->bytes) {
+		int wr = (rec->flags & PMBD_TRACE_WRITE) ? 1 : 0;
+		slot = data_slot;
+		sqe = uring_get_sqe(&r->ring);
+		sqe->opcode = wr ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->off = rec->sector << 9;
+		sqe->addr = (unsigned long) r->bufs[slot];
+		sqe->len = rec->bytes;
+		if (rec->flags & PMBD_TRACE_FUA)
+			sqe->rw_flags = RWF_DSYNC;
+		sqe->user_data = slot;
+		r->issued[slot] = now_ns();
+		r->ops[wr] ++;
+		r->bytes[wr] += rec->bytes;
+	}
+
+	uring_enter(&r->ring, 0);
+	return;
+}
+
+static int trace_replay(const char* bdev, const char* path, unsigned depth, int fast, int dev)
+{
+	REPLAY_T r;
+	uint64_t i, nr, max_bytes = 4096;
+	uint64_t t0, ts0, span, elapsed, total;
+	PMBD_TRACE_REC_T* recs = trace_load(path, &nr);
+	int fd;
+
+	if (nr == 0) {
+		printf("%s: empty trace\n", path);
+		return 0;
+	}
+	for (i = 0; i < nr; i ++)
+		if (recs[i].bytes > max_bytes)
+			max_bytes = recs[i].bytes;
+
+	fd = open(bdev, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		perror(bdev);
+		return 1;
+	}
+
+	memset(&r, 0, sizeof(r));
+	if (uring_init(&r.ring, depth) < 0) {
+		perror("io_uring_setup");
+		return 1;
+	}
+	r.depth 	= depth < r.ring.sq_entries ? depth : r.ring.sq_entries;
+	r.bufs 		= calloc(r.depth, sizeof(void*));
+	r.issued 	= calloc(r.depth, sizeof(uint64_t));
+	r.free_slots 	= calloc(r.depth, sizeof(unsigned));
+	if (!r.bufs || !r.issued || !r.free_slots) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < r.depth; i ++) {
+		if (posix_memalign(&r.bufs[i], 4096, max_bytes)) {
+			perror("posix_memalign");
+			return 1;
+		}
+		memset(r.bufs[i], (int) (0xa5 ^ i), max_bytes);
+		r.free_slots[r.nr_free ++] = i;
+	}
+
+	t0 = now_ns();
+	ts0 = recs[0].ts;
+	span = recs[nr - 1].ts - ts0;
+	for (i = 0; i < nr; i ++) {
+		PMBD_TRACE_REC_T* rec = &recs[i];
+
+		if (dev >= 0 && rec->dev != dev)
+			continue;
+
+		if (!fast) {
+			/* wait for the original arrival time, reaping meanwhile */
+			uint64_t target = t0 + (rec->ts - ts0);
+			uint64_t now = now_ns();
+			replay_reap(&r);
+			if (now < target) {
+				struct timespec ts;
+				ts.tv_sec = target / 1000000000ULL;
+				ts.tv_nsec = target % 1000000000ULL;
+				while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+					;
+				now = now_ns();
+			}
+			if (now > target) {
+				r.lag_sum += now - target;
+				if (now - target > r.lag_max)
+					r.lag_max = now - target;
+			}
+		}
+		replay_issue(&r, fd, rec);
+	}
+
+	while (r.inflight) {
+		uring_enter(&r.ring, 1);
+		replay_reap(&r);
+	}
+	elapsed = now_ns() - t0;
+	close(fd);
+
+	total = r.ops[0] + r.ops[1] + r.ops[2];
+	printf("replayed %llu requests (%llu reads, %llu writes, %llu flushes) in %.3f s (trace: %.3f s)\n",
+		(unsigned long long) total, (unsigned long long) r.ops[0], (unsigned long long) r.ops[1],
+		(unsigned long long) r.ops[2], elapsed / 1e9, span / 1e9);
+	printf("  %.0f IOPS, read %.1f MB/s, write %.1f MB/s\n", total / (elapsed / 1e9),
+		r.bytes[0] / 1048576.0 / (elapsed / 1e9), r.bytes[1] / 1048576.0 / (elapsed / 1e9));
+	if (total)
+		printf("  latency: avg %llu ns, max %llu ns\n",
+			(unsigned long long) (r.lat_sum / total), (unsigned long long) r.lat_max);
+	if (!fast && total)
+		printf("  issue lag: avg %llu ns, max %llu ns\n",
+			(unsigned long long) (r.lag_sum / total), (unsigned long long) r.lag_max);
+	if (r.errors)
+		printf("  %llu requests failed\n", (unsigned long long) r.errors);
+	free(recs);
+	return r.errors ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+	unsigned depth = 64;
+	int fast = 0;
+	int dev = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:fq:d:")) != -1) {
+		switch (opt) {
+		case 't': trace_dev = optarg; break;
+		case 'f': fast = 1; break;
+		case 'q': depth = atoi(optarg); break;
+		case 'd': dev = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	/* a flush with data is linked to its write, so it needs two slots */
+	if (optind >= argc || depth < 2)
+		usage();
+
+	if (!strcmp(argv[optind], "start") && argc - optind == 1)
+		return trace_start();
+	if (!strcmp(argv[optind], "stop") && argc - optind == 1)
+		return trace_ctl(PMBD_TRACE_IOC_STOP);
+	if (!strcmp(argv[optind], "dump") && argc - optind == 2)
+		return trace_dump(argv[optind + 1]);
+	if (!strcmp(argv[optind], "print") && argc - optind == 2)
+		return trace_print(argv[optind + 1]);
+	if (!strcmp(argv[optind], "replay") && argc - optind == 3)
+		return trace_replay(argv[optind + 1], argv[optind + 2], depth, fast, dev);
+	usage();
+	return 1;
+}
+
+/* THE END */
@@ -0,0 +1,76 @@
+/*
+ * Intel Persistent Memory Block Driver
+ * Copyright (c) <2011-2013>, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Intel Persistent Memory Block Driver (v0.9)
+ *
+ * pmbd_shim.h
+ *
+ * The minimal set of kernel definitions used by pmbd_core.c, so that the core
+ * library builds in userspace (see "make test"). Never included by the module.
+ */
+
+#ifndef PMBD_SHIM_H
+#define PMBD_SHIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef uint64_t			sector_t;
+typedef uint32_t			u32;
+typedef uint64_t			u64;
+
+#define KERN_WARNING			""
+#define KERN_INFO			""
+#define printk(...)			fprintf(stderr, __VA_ARGS__)
+#define panic(...)			do { fprintf(stderr, __VA_ARGS__); abort(); } while (0)
+
+/* the atomics used by the sketch (see pmbd_sketch_add) */
+typedef struct {
+	int64_t				counter;
+} atomic64_t;
+
+#define READ_ONCE(x)			__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define cmpxchg64(p, o, n)		__sync_val_compare_and_swap((p), (o), (n))
+#define atomic64_read(v)		__atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic64_set(v, i)		__atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic64_inc_return(v)		__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic64_sub(i, v)		((void) __atomic_sub_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST))
+
+static inline uint64_t div64_u64(uint64_t dividend, uint64_t divisor)
+{
+	return dividend / divisor;
+}
+
+/* bitwise crc32 (little endian), same result as lib/crc32.c */
+static inline u32 crc32_le(u32 crc, const unsigned char* p, size_t len)
+{
+	int i;
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i ++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+	}
+	return crc;
+}
+
+#endif
+/* THEN END */
@@ -0,0 +1,226 @@
+/*
+ * Intel Persistent Memory Block Driver
+ * Copyright (c) <2011-2013>, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Intel Persistent Memory Block Driver (v0.9)
+ *
+ * pmbd_trace.c
+ *
+ * The request trace (option traceY): per-CPU rings of request records in one
+ * vmalloc_user() buffer, exported by the misc device /dev/pmbd_trace (mmap
+ * for the rings, ioctl for start/stop/reset). See pmbd_trace.h for the
+ * layout and pmbd_replay.c for the userspace side.
+ *
+ * Logging takes no lock: a record is written with the interrupts off on the
+ * local ring, and stopping the trace waits for an RCU grace period, so once
+ * PMBD_TRACE_IOC_STOP returns the rings no longer change.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/smp.h>
+#include "pmbd_trace.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+#define PMBD_TRACE_NOW()		ktime_get_ns()
+#else
+#define PMBD_TRACE_NOW()		ktime_to_ns(ktime_get())
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+#define PMBD_TRACE_SYNC()		synchronize_rcu()
+#else
+#define PMBD_TRACE_SYNC()		synchronize_sched()
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+#define PMBD_VMA_CLEAR_MAYWRITE(VMA)	vm_flags_clear((VMA), VM_MAYWRITE)
+#else
+#define PMBD_VMA_CLEAR_MAYWRITE(VMA)	((VMA)->vm_flags &= ~VM_MAYWRITE)
+#endif
+
+int pmbd_trace_on = 0;
+
+static void* pmbd_trace_buf = NULL;
+static unsigned pmbd_trace_nr_rings = 0;
+static unsigned long pmbd_trace_ring_bytes = 0;
+static DEFINE_MUTEX(pmbd_trace_mutex);
+
+#define PMBD_TRACE_RING(CPU)		((PMBD_TRACE_RING_T*) ((char*) pmbd_trace_buf + (CPU) * pmbd_trace_ring_bytes))
+
+void __pmbd_trace_request(unsigned dev, sector_t sector, unsigned bytes, unsigned flags)
+{
+	PMBD_TRACE_RING_T* ring;
+	PMBD_TRACE_REC_T* rec;
+	unsigned long irqflags;
+	__u64 head;
+	int cpu;
+
+	local_irq_save(irqflags);
+
+	/* 
+	 * a stop may have come since the caller checked; the stop waits for the
+	 * irq-off sections (PMBD_TRACE_SYNC()), so no record is written past it
+	 */
+	if (!PMBD_TRACE_ON()){
+		local_irq_restore(irqflags);
+		return;
+	}
+	cpu = smp_processor_id();
+	ring = PMBD_TRACE_RING(cpu);
+	head = ring->head;
+	rec = &ring->rec[head & (PMBD_TRACE_RING_RECS - 1)];
+
+	rec->ts 	= PMBD_TRACE_NOW();
+	rec->sector 	= sector;
+	rec->bytes 	= bytes;
+	rec->flags 	= flags;
+	rec->dev 	= dev;
+	rec->cpu 	= cpu;
+
+	/* a live reader sees the record before the new head */
+	smp_wmb();
+	ring->head = head + 1;
+	local_irq_restore(irqflags);
+	return;
+}
+
+static void pmbd_trace_reset(void)
+{
+	unsigned i;
+	for (i = 0; i < pmbd_trace_nr_rings; i ++)
+		PMBD_TRACE_RING(i)->head = 0;
+	return;
+}
+
+static long pmbd_trace_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
+{
+	PMBD_TRACE_INFO_T info;
+	long ret = 0;
+
+	mutex_lock(&pmbd_trace_mutex);
+	switch (cmd) {
+	case PMBD_TRACE_IOC_INFO:
+		memset(&info, 0, sizeof(info));
+		info.version 	= PMBD_TRACE_VERSION;
+		info.nr_rings 	= pmbd_trace_nr_rings;
+		info.ring_recs 	= PMBD_TRACE_RING_RECS;
+		info.rec_size 	= sizeof(PMBD_TRACE_REC_T);
+		info.ring_bytes = pmbd_trace_ring_bytes;
+		info.enabled 	= pmbd_trace_on;
+		if (copy_to_user((void __user*) arg, &info, sizeof(info)))
+			ret = -EFAULT;
+		break;
+
+	case PMBD_TRACE_IOC_START:
+		pmbd_trace_on = 1;
+		break;
+
+	case PMBD_TRACE_IOC_STOP:
+		pmbd_trace_on = 0;
+		/* wait for the records being written */
+		PMBD_TRACE_SYNC();
+		break;
+
+	case PMBD_TRACE_IOC_RESET:
+		if (pmbd_trace_on)
+			ret = -EBUSY;
+		else
+			pmbd_trace_reset();
+		break;
+
+	default:
+		ret = -ENOTTY;
+	}
+	mutex_unlock(&pmbd_trace_mutex);
+	return ret;
+}
+
+static int pmbd_trace_mmap(struct file* file, struct vm_area_struct* vma)
+{
+	/* the rings are read-only for the users */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	PMBD_VMA_CLEAR_MAYWRITE(vma);
+
+	return remap_vmalloc_range(vma, pmbd_trace_buf, vma->vm_pgoff);
+}
+
+static const struct file_operations pmbd_trace_fops = {
+	.owner 		= THIS_MODULE,
+	.unlocked_ioctl = pmbd_trace_ioctl,
+	.compat_ioctl 	= pmbd_trace_ioctl,
+	.mmap 		= pmbd_trace_mmap,
+};
+
+static struct miscdevice pmbd_trace_dev = {
+	.minor 		= MISC_DYNAMIC_MINOR,
+	.name 		= PMBD_TRACE_DEV_NAME,
+	.fops 		= &pmbd_trace_fops,
+};
+
+/* allocate the rings and register /dev/pmbd_trace, logging starts at once */
+int pmbd_trace_init(void)
+{
+	int ret;
+
+	pmbd_trace_nr_rings = nr_cpu_ids;
+	pmbd_trace_ring_bytes = PAGE_ALIGN(sizeof(PMBD_TRACE_RING_T) + PMBD_TRACE_RING_RECS * sizeof(PMBD_TRACE_REC_T));
+	pmbd_trace_buf = vmalloc_user(pmbd_trace_nr_rings * pmbd_trace_ring_bytes);
+	if (pmbd_trace_buf == NULL) {
+		printk(KERN_ERR "pmbd:%s(%d) cannot allocate the trace rings (%u x %lu bytes)\n",
+			__FUNCTION__, __LINE__, pmbd_trace_nr_rings, pmbd_trace_ring_bytes);
+		return -ENOMEM;
+	}
+
+	ret = misc_register(&pmbd_trace_dev);
+	if (ret < 0) {
+		printk(KERN_ERR "pmbd:%s(%d) cannot register /dev/%s\n", __FUNCTION__, __LINE__, PMBD_TRACE_DEV_NAME);
+		vfree(pmbd_trace_buf);
+		pmbd_trace_buf = NULL;
+		return ret;
+	}
+
+	pmbd_trace_on = 1;
+	printk(KERN_INFO "pmbd: request trace on /dev/%s (%u rings of %u records)\n",
+			PMBD_TRACE_DEV_NAME, pmbd_trace_nr_rings, PMBD_TRACE_RING_RECS);
+	return 0;
+}
+
+void pmbd_trace_exit(void)
+{
+	if (pmbd_trace_buf == NULL)
+		return;
+
+	pmbd_trace_on = 0;
+	PMBD_TRACE_SYNC();
+	misc_deregister(&pmbd_trace_dev);
+	vfree(pmbd_trace_buf);
+	pmbd_trace_buf = NULL;
+	return;
+}
+
+/* THE END */
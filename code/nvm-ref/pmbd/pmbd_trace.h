@@ -0,0 +1,103 @@
+/*
+ * Intel Persistent Memory Block Driver
+ * Copyright (c) <2011-2013>, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Intel Persistent Memory Block Driver (v0.9)
+ *
+ * pmbd_trace.h
+ *
+ * The request trace: each request is logged at its entry into the driver as
+ * one PMBD_TRACE_REC_T in the ring of the submitting CPU. The rings are
+ * exported read-only through the mmap of the trace device (/dev/pmbd_trace),
+ * one after another, each ring_bytes long. This header is shared by the
+ * module and by the userspace tool (pmbd_replay.c), and NVMSIM logs into the
+ * same layout, so one tool captures and replays the traces of both drivers.
+ */
+
+#ifndef PMBD_TRACE_H
+#define PMBD_TRACE_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define PMBD_TRACE_VERSION		1
+#define PMBD_TRACE_DEV_NAME		"pmbd_trace"
+#define PMBD_TRACE_RING_RECS		(1 << 15)	/* records per CPU ring (power of 2, 1MB) */
+
+/* request flags */
+#define PMBD_TRACE_WRITE		(1 << 0)	/* write (read otherwise) */
+#define PMBD_TRACE_FLUSH		(1 << 1)	/* write barrier/cache flush */
+#define PMBD_TRACE_FUA			(1 << 2)	/* forced unit access */
+
+typedef struct pmbd_trace_rec {
+	__u64				ts;		/* entry time (ns, CLOCK_MONOTONIC) */
+	__u64				sector;		/* the first sector */
+	__u32				bytes;		/* request size (0 for a pure flush) */
+	__u16				flags;		/* PMBD_TRACE_WRITE/FLUSH/FUA */
+	__u16				dev;		/* device id (0 - /dev/pma) */
+	__u32				cpu;		/* the submitting CPU */
+	__u32				reserved;
+} PMBD_TRACE_REC_T;					/* 32 bytes */
+
+typedef struct pmbd_trace_ring {
+	__u64				head;		/* records ever written (next at head % ring_recs) */
+	__u64				pad[7];		/* keep the records cacheline aligned */
+	PMBD_TRACE_REC_T		rec[];
+} PMBD_TRACE_RING_T;
+
+typedef struct pmbd_trace_info {
+	__u32				version;	/* PMBD_TRACE_VERSION */
+	__u32				nr_rings;	/* one per possible CPU */
+	__u32				ring_recs;	/* records per ring */
+	__u32				rec_size;	/* sizeof(PMBD_TRACE_REC_T) */
+	__u64				ring_bytes;	/* the distance between rings in the mmap */
+	__u32				enabled;	/* is logging on? */
+	__u32				reserved;
+} PMBD_TRACE_INFO_T;
+
+#define PMBD_TRACE_IOC_MAGIC		'P'
+#define PMBD_TRACE_IOC_INFO		_IOR(PMBD_TRACE_IOC_MAGIC, 1, PMBD_TRACE_INFO_T)
+#define PMBD_TRACE_IOC_START		_IO(PMBD_TRACE_IOC_MAGIC, 2)
+#define PMBD_TRACE_IOC_STOP		_IO(PMBD_TRACE_IOC_MAGIC, 3)
+#define PMBD_TRACE_IOC_RESET		_IO(PMBD_TRACE_IOC_MAGIC, 4)	/* clear the rings (stopped only) */
+
+#ifdef __KERNEL__
+#include <linux/version.h>
+#include <linux/compiler.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+#define PMBD_TRACE_ON()			READ_ONCE(pmbd_trace_on)
+#else
+#define PMBD_TRACE_ON()			ACCESS_ONCE(pmbd_trace_on)
+#endif
+
+extern int pmbd_trace_on;
+extern int pmbd_trace_init(void);
+extern void pmbd_trace_exit(void);
+extern void __pmbd_trace_request(unsigned dev, sector_t sector, unsigned bytes, unsigned flags);
+
+/* cheap enough to sit in the submission path when tracing is off */
+static inline void pmbd_trace_request(unsigned dev, sector_t sector, unsigned bytes, unsigned flags)
+{
+	if (unlikely(PMBD_TRACE_ON()))
+		__pmbd_trace_request(dev, sector, bytes, flags);
+}
+#endif
+
+#endif
+/* THE END */